@@ -0,0 +1,23 @@
+/*
+ * Protothreads: stackless coroutines built on a switch statement, after Adam Dunkels' pt.h.
+ * A thread is a function that loop() calls over and over; each call picks up at the wait it
+ * last stopped at and returns PT_WAITING until the thread runs off its end. Locals do not
+ * survive a wait, so keep state in globals, and do not declare objects with constructors
+ * between PT_BEGIN and a wait.
+ */
+#ifndef PROTOTHREAD_H
+#define PROTOTHREAD_H
+
+struct pt {
+    unsigned int lc; //The line the thread resumes at, 0 to start from the top.
+};
+
+#define PT_WAITING 0
+#define PT_ENDED 3
+
+#define PT_INIT(pt) (pt)->lc = 0
+#define PT_BEGIN(pt) switch ((pt)->lc) { case 0:
+#define PT_WAIT_UNTIL(pt, condition) (pt)->lc = __LINE__; case __LINE__: if (!(condition)) return PT_WAITING
+#define PT_END(pt) } PT_INIT(pt); return PT_ENDED
+
+#endif
@@ -3,223 +3,990 @@
 #include <Crypto.h>
 #include <AES.h>
 #include <SHA256.h>
-#include "IoTSec.h"
+#include <IoTSec.h>
+#include <IoTSecMessages.h>
+#include <SensorCodec.h>
+#include "Protothread.h"
+#include <EEPROM.h>
+
+// BATCHING SETUP #####################################################################################################
+#define SAMPLE_INTERVAL 500                   // Milliseconds between sensor readings
+#define BATCH_SIZE 12                         // Most readings packed into one authenticated frame, fewer if they do not fit
+#define BATCH_DEADLINE 5000                   // Milliseconds the oldest queued reading waits before a short batch is sent
+#define QUEUE_SIZE 12                         // Readings kept in RAM until the server has them, the oldest spilling to EEPROM
+#define SENSORS 10                            // Simulated sensors, at most SENSOR_COUNT
+
+// STORE-AND-FORWARD SETUP ############################################################################################
+#define SPILL_SLOTS 120                       // Readings kept in EEPROM once the RAM queue is full, 1 to 255; a full spill drops its oldest
+#define SPILL_ADDRESS 0                       // Where in EEPROM the spill starts
+#define SPILL_HEADERS 10                      // Copies of the spill's header saved to in turn; BATCH_SIZE * SPILL_HEADERS = SPILL_SLOTS wears them as the slots
+#define SPILL_MAGIC 0x5b                      // Marks an EEPROM the spill has been written to, in this layout
+#define SEQUENCE_LEASE 4096                   // Sequence numbers taken with each EEPROM write of them, skipped after a reset
+
+// HANDSHAKE SETUP ####################################################################################################
+#define HANDSHAKE_STATE 0                     // 0 for the three exchange handshake, 4 for the one round trip one
+
+// WINDOW SETUP #######################################################################################################
+#define WINDOW_SIZE 0                         // Batches sent ahead of their ACK, at most MAX_WINDOW; 0 waits for each ACK, which is quicker for sparse readings
+
+// LINK SETUP #########################################################################################################
+#define LINK_EXCHANGE 5                       // The exchange agreeing a new data rate and transmit power with the server
+
+// EVENT SETUP ########################################################################################################
+#define IRQ_PIN 2                             // nRF24 IRQ pin, must be an external interrupt pin
+
+// MULTI-CLIENT SETUP #################################################################################################
+#define NODE_ID 1                             // This client's node ID, 1 to 255 - ENSURE each client has its own
+#define SERVER_PIPES 1                        // The server's CLIENT_PIPES, clients spread over them by node ID: 1 for a 2 KB server, 5 for a bigger one
+#define RETRY_DELAY 5                         // Auto-retransmit delay in 250 us steps less one; 1500 us leaves room for an ACK payload at 250 kbps
+#define RETRY_SPREAD 8                        // Clients add NODE_ID % RETRY_SPREAD steps, so two whose packets collide do not retry together
+
+// POWER SETUP ########################################################################################################
+#define LOW_POWER 0                           // 1 to power the radio down and sleep between readings, for a client on batteries
+#define SENSOR_PIN 3                          // External interrupt pin a sensor pulls low to be read and reported straight away, -1 for none
+#define WAKE_INTERVAL (LOW_POWER ? BATCH_DEADLINE + SAMPLE_INTERVAL : 0)  // Longest the client is out of reach, told to the server
+
+#if LOW_POWER && defined(__AVR__)
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+extern volatile unsigned long timer0_millis;  // The Arduino core's millis() count, moved on by the time asleep
+#endif
+
+#if BATCH_SIZE > QUEUE_SIZE
+#error "BATCH_SIZE must fit in the queue"
+#endif
+#if SPILL_SLOTS < 1 || SPILL_SLOTS > 255
+#error "SPILL_SLOTS must be 1 to 255"
+#endif
+#if SENSORS > SENSOR_COUNT
+#error "SENSORS must be at most SENSOR_COUNT"
+#endif
+#if RETRY_DELAY + RETRY_SPREAD > 16
+#error "RETRY_DELAY + RETRY_SPREAD - 1 must be at most 15"
+#endif
+#if WINDOW_SIZE > MAX_WINDOW
+#error "WINDOW_SIZE must be at most MAX_WINDOW"
+#endif
 
 // GLOBAL VARIABLES SECTION ############################################################################################
+struct QueuedReading {                        // A reading waiting for the server, in RAM or an EEPROM slot
+    byte packed[READING_LEN];                 // Sensor number in the top 4 bits, 12 bit reading below
+    unsigned int sequence;                    // Counts every reading taken, so the server can tell one it has had
+    unsigned long time;                       // millis() when it was taken
+};
+struct SpillHeader {                          // Where the readings spilled to EEPROM are, one of SPILL_HEADERS copies from SPILL_ADDRESS
+    byte magic;                               // SPILL_MAGIC once written
+    byte slots;                               // The SPILL_SLOTS it was written with
+    byte head;                                // Slot of the oldest spilled reading
+    byte count;                               // Readings spilled when it was saved, see restoreSpill for any since
+    unsigned int next;                        // Sequence number of the next reading to spill when it was saved
+    unsigned int lease;                       // The first sequence number not handed out yet
+    byte stamp;                               // One on from the copy saved before; last, so a save cut short never looks newest
+};
+#ifdef E2END
+static_assert(SPILL_ADDRESS + SPILL_HEADERS * sizeof(SpillHeader) + SPILL_SLOTS * sizeof(QueuedReading) <= E2END + 1,
+              "the spill must fit in the board's EEPROM");
+#endif
+
 RF24 radio(9, 10);                            // CE, CSN - PINOUT FOR SPI and NRF24L01      
-AES128 cipher;                                // object used to encrypt data   
-SHA256 hash256;                               // object used to compute HMAC  
-byte addresses[][6] = {"NODE1", "NODE2"};     // Addresses used to SEND and RECEIVE data - ENSURE they are opposite on the sender/receiver               
-byte receiveBuffer[MAX_PAYLOAD_SIZE + 1];     // Null terminate.
-byte sendBuffer[32];
+IoTSecCipher cipher;                          // object used to encrypt data   
+IoTSecHash hash256;                           // object used to compute HMAC  
+byte addresses[][6] = {"0NODE", "0CLNT"};     // Addresses used to SEND and RECEIVE data, first byte set from NODE_ID - ENSURE they match server.ino's
+byte frame[MAX_FRAME_SIZE];                   // Frame buffer every message is built, encrypted and received in
 int tempVariable; 
 int state;
+int exchange;                                 // The state whose request is waiting for a reply, 3 for a batch sent mid-handshake
 IoTSec iot(&radio, &cipher, &hash256);
 unsigned long handshakeTime; 
+QueuedReading readingQueue[QUEUE_SIZE];       // Bounded queue of readings in RAM, oldest at queueHead, after any spilled to EEPROM
+int queueHead;
+int queueCount;
+SpillHeader spill;                            // The EEPROM spill's header
+byte spillCopy;                               // The copy of the header saved last
+int spillRestored;                            // Spilled readings from before the last reset, their times lost with it
+unsigned int nextSequence;                    // Sequence number of the next reading taken
+int sentCount;                                // Oldest queued readings already in a window frame, kept until it is confirmed
+unsigned int windowEnd[MAX_WINDOW];           // Sequence number after the readings of window frame n, in n % MAX_WINDOW
+unsigned long windowConfirmed;                // The window frame whose readings are let go of next
+unsigned int batchEnd;                        // Sequence number after the readings fillBatch() packed last
+unsigned long lastSample;
+int sensorLevel[SENSORS];                     // Where each simulated sensor's reading has wandered to
+struct pt linkThread;                         // The handshake and data states, see link()
+unsigned long requestSent;                    // micros() when the request waiting for a reply last went out
+int retries;                                  // Times that request has been sent again
+int myRandNum;                                // Random number sent in state 0
+unsigned int linkNumber;                      // Number of the last link proposal, higher each time so the server can tell a replay
+byte nonce1[NONCE_LEN];                       // Nonce sent in state 2 or 4
+int batchCount;                               // Readings in the batch waiting for its ACK
+bool earlyData;                               // Send whatever is queued straight away: it confirms the new keys to the server, or a sensor asked
+bool waitingReply;                            // The link thread waits on the server's reply to its request
+volatile bool sensorEvent;                    // Set from the sensor's interrupt, cleared once its reading is queued
+volatile bool watchdogFired;                  // Set from the watchdog's interrupt, which ends a full sleep
+
+// SRAM BUDGET ########################################################################################################
+// The library's share and the globals above must leave IOTSEC_STACK_RESERVE for the stack.
+#if IOTSEC_SRAM_BUDGET > 0
+#define SKETCH_SRAM (sizeof(radio) + sizeof(Serial) + sizeof(addresses) + sizeof(frame) \
+    + sizeof(tempVariable) + sizeof(state) + sizeof(exchange) + sizeof(handshakeTime) \
+    + sizeof(readingQueue) + sizeof(queueHead) + sizeof(queueCount) + sizeof(spill) + sizeof(spillCopy) + sizeof(spillRestored) \
+    + sizeof(nextSequence) + sizeof(sentCount) + sizeof(windowEnd) + sizeof(windowConfirmed) + sizeof(batchEnd) + sizeof(lastSample) \
+    + sizeof(sensorLevel) + sizeof(linkThread) + sizeof(requestSent) + sizeof(retries) + sizeof(myRandNum) + sizeof(linkNumber) \
+    + sizeof(nonce1) + sizeof(batchCount) + sizeof(earlyData) + sizeof(waitingReply) + sizeof(sensorEvent) + sizeof(watchdogFired))
+static_assert(IOTSEC_NODE_SRAM + SKETCH_SRAM <= IOTSEC_SRAM_BUDGET - IOTSEC_STACK_RESERVE,
+              "the client does not fit the board's SRAM with IOTSEC_STACK_RESERVE left for the stack");
+#endif
 
 // ####################################################################################################################
 void setup() {
+#if IOTSEC_METRICS
+    IoTSec::paintStack();                    // Lets the metrics report how deep the stack has been
+#endif
     // RADIO SETUP
     radio.begin();                           // Starting the radio communication
     radio.setPALevel(RF24_PA_MAX);           // Transmit power
     radio.setDataRate(RF24_250KBPS);         // Transmit data rate
     radio.setChannel(10);                    // Channel = frequency
+    radio.setRetries(RETRY_DELAY + NODE_ID % RETRY_SPREAD, 15);  // Retransmit up to 15 times, at this client's own delay
+    addresses[0][0] += 1 + (NODE_ID - 1) % SERVER_PIPES;  // Pick this client's pipe on the server
+    addresses[1][0] = NODE_ID;               // The server writes to each node's own address
     radio.openWritingPipe(addresses[0]);     // Setting the address SENDING
     radio.openReadingPipe(1, addresses[1]);  // Setting the address RECEIVING
     radio.stopListening();                   // Setting for client
+    iot.setDynamicFrames(true);              // Only put the bytes each packet carries on air
+    iot.setInitiator(true);                  // The client starts the handshake, its sealed frames use the initiator nonces
+    iot.setNodeId(NODE_ID);                  // Sent in front of every frame so the server keeps this client's session
+    iot.setEventDriven(true);                // Queue frames and let the IRQ pin say when the radio is done
+    iot.setWindow(WINDOW_SIZE);              // Keep batches going while earlier ones wait for their ACK
+    iot.setLinkAdaptation(true);             // Start as set up above, then follow the link: less airtime and power when it is good
+    iot.setWakeInterval(WAKE_INTERVAL);      // The server keeps what it has for the client until it next hears from it
+    attachInterrupt(digitalPinToInterrupt(IRQ_PIN), radioISR, FALLING);
+#if SENSOR_PIN >= 0
+    pinMode(SENSOR_PIN, INPUT_PULLUP);
+    attachInterrupt(digitalPinToInterrupt(SENSOR_PIN), sensorISR, FALLING);
+#endif
     Serial.begin(9600);
-    state = 0;
-    //Null terminate.
-    memset(receiveBuffer, 0, MAX_PAYLOAD_SIZE + 1);
+    state = HANDSHAKE_STATE;
+    earlyData = false;
+    waitingReply = false;
+    sensorEvent = false;
     randomSeed(analogRead(A0));
-    
+    queueHead = 0;
+    queueCount = 0;
+    sentCount = 0;
+    windowConfirmed = 0;
+    restoreSpill();                          // Readings that waited in EEPROM through a reset go first
+    for (int i = 0; i < SENSORS; ++i) {
+        sensorLevel[i] = random(0, 1024);
+    }
+    lastSample = millis();
+    PT_INIT(&linkThread);
 }
 
 // ####################################################################################################################
 void loop(){
-    char* newState = new char[MAX_HEADER_SIZE];
-    String msg;
-    
-
-    /***********************[HANDSHAKE] - Server Authentication.*******************/
-    if (state == 0) {
-        handshakeTime = micros();
-        Serial.println("\n# HP BEGIN #");
-        Serial.println("\n- H INIT -");
-        Serial.println("\n- MA INIT -");
-        iot.setHandshakeComplete(false);
+    sampleSensor();                               // Keep sampling whatever the link is waiting on
+    iot.poll();                                   // Move frames between the radio and IoTSec's queues
+    confirmWindow();                              // Let go of readings the window's ACKs have confirmed
+    link(&linkThread);
+    if (!iot.frameAvailable()) {
+        IoTSecLog::drain();                       // Log output only goes out while nothing is waiting to be read
+    }
+#if IOTSEC_METRICS
+    if (Serial.available() > 0 && Serial.read() == 'm') {
+        IoTSec::dumpMetrics();                    // 'm' on the serial monitor prints the counters and timers
+    }
+#endif
+    rest();                                       // With LOW_POWER, sleep until the next reading once the link has nothing to do
+}
 
-        //Send random number to server.
-        int myRandNum = iot.createRandom();
-        msg = ((String)myRandNum) + "-cli";
-        Serial.println("[I] S: " + msg);
-        iot.send(msg, iot.getSecretKey(), iot.getSecretHashKey(), (String)state);
+/*
+ * The handshake and data states as one protothread. Each pass sends the current state's request,
+ * waits for the server's reply without holding up loop(), then acts on it. A request not answered
+ * within IoTSec's retransmission timeout is sent again up to MAX_RETRIES times, the timeout
+ * doubling each time, before the exchange fails.
+ * In the data state it first waits for a batch to be ready; with a window, batches have no reply
+ * to wait for. While a handshake renews keys that still work, ready batches go out between its
+ * exchanges, unless a window would have to carry them over to the new keys. When IoTSec's judgment
+ * of the link wants another data rate or transmit power, the data state agrees it with the server
+ * before its next batch.
+ */
+char link(struct pt* pt){
+    PT_BEGIN(pt);
+    while (true) {
+        PT_WAIT_UNTIL(pt, linkReady());
+        if (state == 3 && iot.frameAvailable()) {
+            serverNotice();
+            continue;
+        }
+        exchange = (state != 3 && !iot.keyExpired() && WINDOW_SIZE == 0 && batchReady()) ? 3 : state;
+        if (exchange == 3 && linkDue()) {
+            exchange = LINK_EXCHANGE;
+        }
+        if (!sendRequest()) {
+            continue;
+        }
+        waitingReply = true;
+        for (retries = 0; ; ++retries) {
+            requestSent = micros();
+            PT_WAIT_UNTIL(pt, iot.frameAvailable() || micros() - requestSent >= iot.getResponseTimeout());
+            if (iot.frameAvailable() || retries == MAX_RETRIES) {
+                break;
+            }
+            LOG_WARN(LOG_RETRY);
+            iot.retransmit();
+        }
+        waitingReply = false;
+        handleResponse();
+    }
+    PT_END(pt);
+}
 
-        //Receive decremented random number and rand number from server.
-        msg = iot.receiveStr(iot.getSecretKey(), iot.getSecretHashKey(), newState, false);
+/*
+ * What opens each exchange, and what to do when its reply does not come or is not the one
+ * expected, by exchange: the three exchange handshake's 0 to 2, a batch (3), the one round
+ * trip hello (4) and a new data rate and transmit power (LINK_EXCHANGE).
+ */
+typedef bool (*ExchangeRequest)(void);
+typedef void (*ExchangeFailure)(void);
+const ExchangeRequest exchangeRequests[] PROGMEM = {sendChallenge, sendResponse, sendNonce, sendBatch, sendHello, sendLink};
+const ExchangeFailure exchangeFailures[] PROGMEM = {challengeFailed, responseFailed, nonceFailed, batchFailed, helloFailed, linkFailed};
 
-        char* randStr = new char[3];
-        memset(randStr, 0, 3);
+/*
+ * What the client does with each reply, by type. Types only the client sends fail the exchange.
+ */
+const MessageHandler clientHandlers[MSG_TYPE_LIMIT] PROGMEM = {
+    unexpected,                                   // MSG_NONE
+    unexpected,                                   // MSG_CHALLENGE
+    onChallengeReply,                             // MSG_CHALLENGE_REPLY
+    unexpected,                                   // MSG_RESPONSE
+    onAuthOk,                                     // MSG_AUTH_OK
+    onNonce,                                      // MSG_NONCE
+    onHello,                                      // MSG_HELLO
+    unexpected,                                   // MSG_BATCH
+    onAck,                                        // MSG_ACK
+    unexpected,                                   // MSG_RESTART
+    unexpected,                                   // MSG_WINDOW_BATCH
+    unexpected,                                   // MSG_WINDOW_ACK
+    onLink                                        // MSG_LINK
+};
 
-        int i = 0;
-        while (i < 3 && msg[i] != '-') {
-            randStr[i] = msg[i];
-            ++i;
-        }
-        int randNum = atoi(randStr);
-
-        if (iot.getIntegrityPassed() && atoi(newState) == 0 && randNum == (myRandNum - 1)) {
-            Serial.println("[I] R: " + msg);
-            Serial.println("\n- S AUTH SUCCESS -");
-            
-            memset(randStr, 0, 3);
-            for (int j = i + 1; j < msg.length(); ++j) {
-                randStr[j - i - 1] = msg[j];
-            }
+/*
+ * Sends the request of the exchange picked by link().
+ * @return false if there is nothing to wait for: the handshake (re)starts instead.
+ */
+bool sendRequest(void){
+    ExchangeRequest request = (ExchangeRequest)pgm_read_ptr(&exchangeRequests[exchange]);
+    return request();
+}
 
-            //Store the server's random number in global memory so that we still remember it in the next loop iteration.
-            tempVariable = atoi(randStr);
-            
-            state = 1;
-            delete[] randStr;
-        }
-        else {
-            Serial.println("\nX S AUTH FAIL X");
-            Serial.println("\nX MA FAIL X");
-            Serial.println("\n# HP END #");
-            delete[] randStr;
-            iot.setHandshakeComplete(false);
+/*
+ * Reads the server's reply to the request sendRequest() sent and picks the next state. A reply
+ * that never came, even after the retries, fails like one that fails its integrity check or
+ * belongs to another exchange.
+ */
+void handleResponse(void){
+    byte type = MSG_NONE;
+    if (iot.frameAvailable()) {
+        type = (byte)iot.peekState();
+    }
+    else {
+        LOG_WARN(LOG_TIMED_OUT);
+    }
+    byte len;
+    byte* payload = readMessage(iot, frame, type, &len);
+
+    if (iot.getIntegrityPassed() && messageState(type) == exchange) {
+        LOG_DEBUG(LOG_RECEIVED_MESSAGE, type, LogBytes(payload, len));
+        MessageHandler handle = (MessageHandler)pgm_read_ptr(&clientHandlers[type]);
+        if (handle(iot, payload, len)) {
+            return;
         }
     }
-    /***********************[HANDSHAKE] - Client Authentication.*******************/
-    else if (state == 1) {
-        //Send the servers decremented random number.
-        msg = ((String)(tempVariable - 1)) + "-serv";
-        Serial.println("[I] S: " + msg);
-        iot.send(msg, iot.getSecretKey(), iot.getSecretHashKey(), (String)state);
+    ExchangeFailure fail = (ExchangeFailure)pgm_read_ptr(&exchangeFailures[exchange]);
+    fail();
+}
 
-        //Receive either a success or failure from server.
-        msg = iot.receiveStr(iot.getSecretKey(), iot.getSecretHashKey(), newState, false);
+/***********************[HANDSHAKE] - Server Authentication.*******************/
+bool sendChallenge(void){
+    handshakeTime = micros();
+    LOG_INFO(LOG_HP_BEGIN);
+    LOG_INFO(LOG_H_INIT);
+    LOG_INFO(LOG_MA_INIT);
 
-        if (iot.getIntegrityPassed() && atoi(newState) != 0 && msg == "suc-auth") {
-            Serial.println("[I] R: " + msg);
-            Serial.println("\n- MA SUCCESS -");
-            state = 2;
-        }
-        else {
-            Serial.println("\nX MA FAIL X");
-            Serial.println("\n# HP END #");
-            state = 0;
-            iot.setHandshakeComplete(false);
+    //Send random number to server.
+    ChallengeMsg challenge;
+    myRandNum = iot.createRandom();
+    challenge.number = myRandNum;
+    sendMessage(iot, frame, encodeChallenge(challenge, iot.beginFrame(frame, MSG_CHALLENGE)));
+    return true;
+}
+
+bool onChallengeReply(IoTSec& iot, byte payload[], byte len){
+    //Receive decremented random number and rand number from server.
+    ChallengeReplyMsg reply;
+    if (!decodeChallengeReply(payload, len, &reply) || (int)reply.number != myRandNum - 1) {
+        return false;
+    }
+    LOG_INFO(LOG_S_AUTH_SUCCESS);
+
+    //Store the server's random number in global memory so that we still remember it in the next loop iteration.
+    tempVariable = reply.challenge;
+    state = 1;
+    return true;
+}
+
+void challengeFailed(void){
+    LOG_WARN(LOG_S_AUTH_FAIL);
+    LOG_WARN(LOG_MA_FAIL);
+    LOG_INFO(LOG_HP_END);
+    abandonHandshake();
+}
+
+/***********************[HANDSHAKE] - One Round Trip.*******************/
+bool sendHello(void){
+    handshakeTime = micros();
+    LOG_INFO(LOG_HP_BEGIN);
+    LOG_INFO(LOG_H_INIT);
+
+    //Send the random number and the nonce together.
+    HelloMsg hello;
+    myRandNum = iot.createRandom();
+    iot.createNonce(nonce1);
+    hello.number = myRandNum;
+    memmove(hello.nonce, nonce1, NONCE_LEN);
+    hello.wake = (iot.getWakeInterval() + 999) / 1000;
+    sendMessage(iot, frame, encodeHello(hello, iot.beginFrame(frame, MSG_HELLO)));
+    return true;
+}
+
+bool onHello(IoTSec& iot, byte payload[], byte len){
+    //Receive the decremented random number and the server's nonce, then make the keys straight away.
+    //The server only knows the client holds the secret key once the first sealed batch checks out.
+    HelloMsg reply;
+    if (!decodeHello(payload, len, &reply) || (int)reply.number != myRandNum - 1) {
+        return false;
+    }
+    LOG_INFO(LOG_S_AUTH_SUCCESS);
+
+    iot.generateKeys(nonce1, reply.nonce);
+    LOG_DEBUG(LOG_MASTER_KEY, LogBytes(iot.getMasterKey(), KEY_DATA_LEN));
+    LOG_DEBUG(LOG_HASH_KEY, LogBytes(iot.getHashKey(), KEY_DATA_LEN));
+
+    iot.setHandshakeComplete(true);
+    state = 3;
+    earlyData = true;
+    resendUnconfirmed();
+
+    LOG_INFO(LOG_KEYS_GEN_SUCCESS);
+    LOG_INFO(LOG_H_SUCCESS);
+    LOG_INFO(LOG_HP_END);
+
+    LOG_INFO(LOG_DP_BEGIN);
+    METRIC_STOP(STAGE_HANDSHAKE, handshakeTime);
+    return true;
+}
+
+void helloFailed(void){
+    LOG_WARN(LOG_S_AUTH_FAIL);
+    LOG_WARN(LOG_H_FAIL);
+    LOG_INFO(LOG_HP_END);
+    abandonHandshake();
+}
+
+/***********************[HANDSHAKE] - Client Authentication.*******************/
+bool sendResponse(void){
+    //Send the servers decremented random number.
+    ResponseMsg response;
+    response.number = tempVariable - 1;
+    sendMessage(iot, frame, encodeResponse(response, iot.beginFrame(frame, MSG_RESPONSE)));
+    return true;
+}
+
+bool onAuthOk(IoTSec& iot, byte payload[], byte len){
+    AuthOkMsg ok;
+    if (!decodeAuthOk(payload, len, &ok)) {
+        return false;
+    }
+    LOG_INFO(LOG_MA_SUCCESS);
+    state = 2;
+    return true;
+}
+
+void responseFailed(void){
+    LOG_WARN(LOG_MA_FAIL);
+    LOG_INFO(LOG_HP_END);
+    abandonHandshake();
+}
+
+/***********************[HANDSHAKE] - Share Nonces.*******************/
+bool sendNonce(void){
+    LOG_INFO(LOG_KEYS_GEN_INIT);
+
+    //Generate and Send the nonce.
+    NonceMsg nonce;
+    iot.createNonce(nonce1);
+    memmove(nonce.nonce, nonce1, NONCE_LEN);
+    nonce.wake = (iot.getWakeInterval() + 999) / 1000;
+    sendMessage(iot, frame, encodeNonce(nonce, iot.beginFrame(frame, MSG_NONCE)));
+    return true;
+}
+
+bool onNonce(IoTSec& iot, byte payload[], byte len){
+    //Retrieve the servers nonce.
+    NonceMsg nonce2;
+    if (!decodeNonce(payload, len, &nonce2)) {
+        return false;
+    }
+
+    //Generate keys;
+    iot.generateKeys(nonce1, nonce2.nonce);
+    LOG_DEBUG(LOG_MASTER_KEY, LogBytes(iot.getMasterKey(), KEY_DATA_LEN));
+    LOG_DEBUG(LOG_HASH_KEY, LogBytes(iot.getHashKey(), KEY_DATA_LEN));
+
+    iot.setHandshakeComplete(true);
+    state = 3;
+    resendUnconfirmed();
+
+    LOG_INFO(LOG_KEYS_GEN_SUCCESS);
+    LOG_INFO(LOG_H_SUCCESS);
+    LOG_INFO(LOG_HP_END);
+
+    LOG_INFO(LOG_DP_BEGIN);
+    METRIC_STOP(STAGE_HANDSHAKE, handshakeTime);
+    return true;
+}
+
+void nonceFailed(void){
+    LOG_WARN(LOG_H_FAIL);
+    LOG_INFO(LOG_HP_END);
+    abandonHandshake();
+}
+
+/***********************[DATA] - Starting The Data Phase.*******************/
+bool sendBatch(void){
+    /***********************[VERIFY KEY EXPIRATION] - Set state to renew key.*******************/
+    if (iot.keyExpired()) {
+        LOG_INFO(LOG_K_EXPIRED);
+        LOG_INFO(LOG_DP_END);
+        state = HANDSHAKE_STATE;
+        iot.setHandshakeComplete(false);
+        return false;
+    }
+    /***********************[WINDOW LOST] - The server stopped acknowledging batches.*******************/
+    if (iot.windowFailed()) {
+        LOG_WARN(LOG_ACK_FAIL);
+        LOG_INFO(LOG_DP_END);
+        state = HANDSHAKE_STATE;
+        iot.setHandshakeComplete(false);
+        return false;
+    }
+    /***********************[RENEW KEYS] - Handshake while the keys still carry data.*******************/
+    if (state == 3 && renewDue()) {
+        LOG_INFO(LOG_K_RENEW);
+        state = HANDSHAKE_STATE;
+        return false;
+    }
+
+    // Send the oldest queued readings in one frame, the server ACKs the whole batch
+    byte* batch = iot.beginFrame(frame, MSG_BATCH);
+    byte batchLen;
+    batchCount = fillBatch(batch, &batchLen);
+    earlyData = false;
+
+    LOG_INFO(LOG_P_SENT);
+    LOG_DEBUG(LOG_SENT_READINGS, batchCount);
+    if (WINDOW_SIZE > 0) {
+        // IoTSec keeps the batch and sends it again until its ACK comes back on the radio's ACK of a later frame.
+        // Its readings stay queued until then, and go again under new keys if the window fails.
+        if (iot.sendWindowed(batch, batchLen, iot.getMasterKey())) {
+            windowEnd[(iot.getWindowBase() + iot.windowInFlight() - 1) % MAX_WINDOW] = batchEnd;
+            sentCount += batchCount;
         }
+        return false;
     }
-    /***********************[HANDSHAKE] - Share Nonces.*******************/
-    else if (state == 2) {
-        Serial.println("\n- KEYS GEN INIT -");
-        byte nonce1[MAX_PAYLOAD_SIZE];
-        byte nonce2[MAX_PAYLOAD_SIZE];
-
-        //Generate and Send the nonce.
-        iot.createNonce(nonce1);
-        Serial.print("[I] S: ");
-        iot.printByteArr(nonce1, MAX_PAYLOAD_SIZE);
-        iot.send(nonce1, iot.getSecretKey(), iot.getSecretHashKey(), (String)state);
-
-        //Retrieve the servers nonce.
-        iot.receive(nonce2, iot.getSecretKey(), iot.getSecretHashKey(), newState, false);
-
-        if (iot.getIntegrityPassed() && atoi(newState) != 0) {
-            Serial.print("[I] R: ");
-            iot.printByteArr(nonce2, MAX_PAYLOAD_SIZE);
-            
-            //Generate keys;
-            iot.generateKeys(nonce1, nonce2);
-            Serial.print("[I] MK: ");
-            iot.printByteArr(iot.getMasterKey(), KEY_DATA_LEN);
-            Serial.print("[I] HK: ");
-            iot.printByteArr(iot.getHashKey(), KEY_DATA_LEN);
-
-            iot.setHandshakeComplete(true);
-            state = 3;
-            
-            Serial.println("\n- KEYS GEN SUCCESS -");
-            Serial.println("\n- H SUCCESS -");
-            Serial.println("\n# HP END #");
-
-            Serial.println("\n# DP BEGIN #");
+    iot.sendSealedInPlace(frame, batchLen, iot.getMasterKey());
+    return true;
+}
+
+bool onAck(IoTSec& iot, byte payload[], byte len){
+    AckMsg ack;
+    if (!decodeAck(payload, len, &ack) || ack.count != batchCount) {
+        return false;
+    }
+    LOG_INFO(LOG_P_RECEIVED);
+    LOG_DEBUG(LOG_RECEIVED_ACK, ack.count);
+    dropBefore(batchEnd);
+    return true;
+}
+
+void batchFailed(void){
+    LOG_WARN(iot.getTimedOut() ? LOG_TIMEOUT : LOG_INT_FAIL);
+    LOG_INFO(LOG_DP_END);
+    state = HANDSHAKE_STATE;
+    iot.setHandshakeComplete(false);
+}
+
+/***********************[LINK] - Agree The Data Rate And Transmit Power.*******************/
+bool sendLink(void){
+    //Under the session keys, but not sealed, so it leaves the session's frame counts and the window alone.
+    //The server takes only numbers higher than the last it agreed to, so a proposal cannot be played again.
+    LinkMsg link;
+    link.number = ++linkNumber;
+    iot.linkProposal(&link.rate, &link.paLevel);
+    sendMessage(iot, frame, encodeLink(link, iot.beginFrame(frame, MSG_LINK)));
+    return true;
+}
+
+bool onLink(IoTSec& iot, byte payload[], byte len){
+    //The server moves once its reply is on air; the client follows now it has heard it.
+    LinkMsg link;
+    if (!decodeLink(payload, len, &link) || link.number != linkNumber - 1) {
+        return false;
+    }
+    iot.setLinkMode(link.rate, link.paLevel);
+    LOG_INFO(LOG_LINK_MODE, link.rate, link.paLevel);
+    return true;
+}
+
+void linkFailed(void){
+    //Keep what was agreed before. If the server did move, the client finds it by falling back.
+    iot.setLinkMode(iot.getLinkRate(), iot.getLinkPaLevel());
+}
+
+/*
+ * A reply of a type the client never expects.
+ */
+bool unexpected(IoTSec& iot, byte payload[], byte len){
+    return false;
+}
+
+// HELPER FUNCTIONS ###########################################################################################################
+/*
+ * Gives up on the handshake in progress. If it was renewing keys that still work the data phase
+ * carries on with them and the handshake is tried again from the start; otherwise it restarts.
+ */
+void abandonHandshake(void){
+    state = iot.keyExpired() ? HANDSHAKE_STATE : 3;
+}
+
+/*
+ * Reads a frame the server sent in the data state without being asked. Only the server giving up
+ * on the session keys means anything (a MSG_RESTART under the secret keys) and restarts the
+ * handshake; anything else, such as a reply that came too late, is dropped.
+ */
+void serverNotice(void){
+    byte len;
+    byte* payload = readMessage(iot, frame, MSG_RESTART, &len);
+
+    if (iot.getIntegrityPassed() && frame[0] == MSG_RESTART) {
+        LOG_DEBUG(LOG_RECEIVED_MESSAGE, frame[0], LogBytes(payload, len));
+        LOG_INFO(LOG_DP_END);
+        state = HANDSHAKE_STATE;
+        iot.setHandshakeComplete(false);
+    }
+}
+
+/*
+ * Takes a simulated sensor reading once every SAMPLE_INTERVAL and queues it, stamped with the
+ * next sequence number and the time. A full RAM queue spills its oldest reading to EEPROM. Each
+ * sensor drifts a little from its last reading, as a real one would, which is what keeps the
+ * batch's deltas short. The sensor's interrupt takes one at once, and sends what is queued
+ * without waiting for the batch to fill.
+ */
+void sampleSensor(void){
+    if (!sensorEvent && millis() - lastSample < SAMPLE_INTERVAL) {
+        return;
+    }
+    if (sensorEvent) {
+        sensorEvent = false;
+        earlyData = true;
+    }
+    lastSample = millis();
+
+    // Generate a simulated sensor reading: sensor number in the top 4 bits, 12 bit reading below
+    int sensorNumber = random(0, SENSORS);
+    int reading = constrain(sensorLevel[sensorNumber] + (int)random(-8, 9), 0, 1023);
+    sensorLevel[sensorNumber] = reading;
+
+    if (queueCount == QUEUE_SIZE) {
+        spillOldest();
+    }
+    QueuedReading* tail = &readingQueue[(queueHead + queueCount) % QUEUE_SIZE];
+    tail->packed[0] = (byte)((sensorNumber << 4) | ((reading >> 8) & 0x0f));
+    tail->packed[1] = (byte)reading;
+    tail->sequence = nextSequence++;
+    tail->time = lastSample;
+    ++queueCount;
+    if (nextSequence == spill.lease) {
+        spill.lease += SEQUENCE_LEASE;
+        saveSpill();
+    }
+}
+
+/*
+ * Returns true once BATCH_SIZE readings wait to be sent or the oldest one has waited BATCH_DEADLINE,
+ * or as soon as anything waits while the new keys wait for their first batch or after the
+ * sensor's interrupt. A backlog left by an outage goes out a full batch at a time, as fast as
+ * the window takes them.
+ */
+bool batchReady(void){
+    int unsent = queued() - sentCount;
+    if (unsent >= BATCH_SIZE || (earlyData && unsent > 0)) {
+        return true;
+    }
+    if (unsent == 0) {
+        return false;
+    }
+    QueuedReading oldest;
+    peekReading(sentCount, &oldest);
+    return millis() - oldest.time >= BATCH_DEADLINE;
+}
+
+/*
+ * Returns true when link() has something to do: a handshake, key or window trouble, a frame from
+ * the server, a new data rate or transmit power to agree or a batch to send.
+ */
+bool linkReady(void){
+    return state != 3 || iot.keyExpired() || renewDue() || iot.windowFailed() || iot.frameAvailable() || linkDue() || canSend();
+}
+
+/*
+ * Returns true once a batch is ready and, with a window, there is room in it.
+ */
+bool canSend(void){
+    return batchReady() && (WINDOW_SIZE == 0 || iot.windowOpen());
+}
+
+/*
+ * Returns true once the keys are due to be renewed and no batch sent under them waits for its ACK.
+ */
+bool renewDue(void){
+    return iot.rekeyDue() && iot.windowInFlight() == 0;
+}
+
+/*
+ * Returns true once IoTSec wants another data rate or transmit power and no batch waits for its
+ * ACK, as a change of rate would leave it behind. Key trouble is seen to first.
+ */
+bool linkDue(void){
+    byte rate;
+    byte paLevel;
+    return state == 3 && !iot.keyExpired() && !iot.windowFailed() && !renewDue() && iot.windowInFlight() == 0
+        && iot.linkProposal(&rate, &paLevel);
+}
+
+/*
+ * Packs up to BATCH_SIZE of the oldest queued readings not in a window frame yet into batch, as
+ * many as fit in a frame and follow on from the first by sequence number, leaving them queued
+ * until the server has acknowledged them. Sets batchEnd to the sequence number after the last.
+ * @param len - Set to the bytes packed.
+ * @return the number of readings packed.
+ */
+int fillBatch(byte batch[], byte* len){
+    QueuedReading reading;
+    peekReading(sentCount, &reading);
+    batchEnd = reading.sequence;
+    SensorEncoder encoder(batch, WINDOW_SIZE > 0 ? MAX_WINDOW_PAYLOAD : MAX_FRAME_PAYLOAD, millis(), batchEnd);
+    for (int i = sentCount; i < queued() && i - sentCount < BATCH_SIZE; ++i) {
+        peekReading(i, &reading);
+        if (reading.sequence != batchEnd
+            || !encoder.add(reading.packed[0] >> 4, ((reading.packed[0] & 0x0f) << 8) | reading.packed[1], reading.time)) {
+            break;
         }
-        else {
-          state = 0;
-          Serial.println("\nX H FAIL X");
-          Serial.println("\n# HP END #");
-          iot.setHandshakeComplete(false);
+        ++batchEnd;
+    }
+    *len = encoder.getLength();
+    return encoder.getCount();
+}
+
+/*
+ * Returns the number of readings queued, in EEPROM and RAM.
+ */
+int queued(void){
+    return spill.count + queueCount;
+}
+
+/*
+ * Reads the queued reading i places from the oldest: the EEPROM spill holds the oldest ones, the
+ * RAM queue the rest.
+ */
+void peekReading(int i, QueuedReading* reading){
+    if (i >= spill.count) {
+        *reading = readingQueue[(queueHead + i - spill.count) % QUEUE_SIZE];
+        return;
+    }
+    EEPROM.get(spillAddress((spill.head + i) % SPILL_SLOTS), *reading);
+    if (i < spillRestored) {
+        reading->time = 0;                        // Taken before the reset, so counted as taken at power-up
+    }
+}
+
+/*
+ * Removes the queued readings before sequence number end, which the server has.
+ */
+void dropBefore(unsigned int end){
+    QueuedReading oldest;
+    byte spilled = spill.count;
+    while (queued() > 0) {
+        peekReading(0, &oldest);
+        if ((int16_t)(oldest.sequence - end) >= 0) {
+            break;
         }
-        handshakeTime = micros() - handshakeTime;
-        Serial.print("Handshake timing: " + (String)handshakeTime);
+        dropOldest();
     }
-    /***********************[VERIFY KEY EXPIRATION] - Set state to renew key.*******************/
-    else if (iot.keyExpired()) {
-        Serial.println("\n- K EXPIRED -");
-        Serial.println("\n# DP END #");
-        state = 0;
-        iot.setHandshakeComplete(false);
+    if (spill.count != spilled) {
+        saveSpill();
     }
-    /***********************[DATA] - Starting The Data Phase.*******************/
-    else if (state == 3) {
-        // Generate a simulated sensor reading and message payload
-        int reading = analogRead(A0) * millis() % 1024;
-        int sensorNumber = random(0, 10);
-        msg = (String)sensorNumber + ":" + (String)reading;
-      
-        Serial.println("\n- P SENT -");
-        Serial.println("[I] S: " + msg);
-        iot.send(msg, iot.getMasterKey(), iot.getHashKey(), (String)state);
-        handshakeTime = micros();
-        msg = iot.receiveStr(iot.getMasterKey(), iot.getHashKey(), newState, false);
-        
-        if (iot.getIntegrityPassed() && atoi(newState) != 0) {
-            Serial.println("\n- P RECEIVED -");
-            Serial.println("[I] R: " + msg);
-            Serial.println("Time: " + (String)(micros()-handshakeTime));
+}
+
+/*
+ * Removes the oldest queued reading, from EEPROM if any are spilled. The caller saves the spill.
+ */
+void dropOldest(void){
+    if (sentCount > 0) {
+        --sentCount;
+    }
+    if (spill.count == 0) {
+        queueHead = (queueHead + 1) % QUEUE_SIZE;
+        --queueCount;
+        return;
+    }
+    spill.head = (spill.head + 1) % SPILL_SLOTS;
+    --spill.count;
+    if (spillRestored > 0) {
+        --spillRestored;
+    }
+}
+
+/*
+ * Makes room in the full RAM queue by moving its oldest reading to the end of the EEPROM spill,
+ * so an outage costs no readings until the spill is full too; then the oldest of all is dropped.
+ * The header is saved for the first one and then once every BATCH_SIZE; restoreSpill finds
+ * those spilled since by their sequence numbers.
+ */
+void spillOldest(void){
+    if (spill.count == SPILL_SLOTS) {
+        dropOldest();
+    }
+    unsigned int spilled = readingQueue[queueHead].sequence;
+    EEPROM.put(spillAddress((spill.head + spill.count) % SPILL_SLOTS), readingQueue[queueHead]);
+    ++spill.count;
+    queueHead = (queueHead + 1) % QUEUE_SIZE;
+    --queueCount;
+    if (spill.count == 1 || (unsigned int)(spilled + 1 - spill.next) >= BATCH_SIZE) {
+        saveSpill();
+    }
+}
+
+/*
+ * Picks up the readings spilled to EEPROM before a reset, or starts an empty spill on an EEPROM
+ * without one, and takes the next lease of sequence numbers so none is handed out twice.
+ */
+void restoreSpill(void){
+    // The newest copy of the header is the one the copy after it was not saved after
+    SpillHeader after;
+    bool found = false;
+    for (byte i = 0; i < SPILL_HEADERS && !found; ++i) {
+        spillCopy = i;
+        EEPROM.get(spillHeaderAddress(i), spill);
+        EEPROM.get(spillHeaderAddress((i + 1) % SPILL_HEADERS), after);
+        found = spillValid(&spill) && (!spillValid(&after) || after.stamp != (byte)(spill.stamp + 1));
+    }
+    if (!found) {
+        spillCopy = SPILL_HEADERS - 1;
+        spill.magic = SPILL_MAGIC;
+        spill.slots = SPILL_SLOTS;
+        spill.head = 0;
+        spill.count = 0;
+        spill.lease = 0;
+        spill.stamp = 0;
+    }
+
+    // The fewer than BATCH_SIZE readings spilled since it was saved follow on from its next
+    // sequence number; once the spill was full, each took the slot of the oldest
+    QueuedReading reading;
+    for (int i = 0; found && i < BATCH_SIZE - 1; ++i) {
+        EEPROM.get(spillAddress((spill.head + spill.count) % SPILL_SLOTS), reading);
+        if (reading.sequence != spill.next) {
+            break;
+        }
+        if (spill.count == SPILL_SLOTS) {
+            spill.head = (spill.head + 1) % SPILL_SLOTS;
         }
         else {
-            Serial.println("\nX INT FAIL X");
-            Serial.println("\n# DP END #");
-            state = 0;
-            iot.setHandshakeComplete(false);
+            ++spill.count;
         }
+        ++spill.next;
+    }
+    spillRestored = spill.count;
+    nextSequence = spill.lease;
+    spill.lease += SEQUENCE_LEASE;
+    saveSpill();
+}
+
+/*
+ * Writes the spill's header to the next of its SPILL_HEADERS copies, so each copy is written
+ * that many times less often. It is saved at most once a batch: when the spill starts and every
+ * BATCH_SIZE readings spilled after, when acknowledged readings leave it, and with each lease
+ * of sequence numbers.
+ */
+void saveSpill(void){
+    spill.next = queueCount > 0 ? readingQueue[queueHead].sequence : nextSequence;
+    ++spill.stamp;
+    spillCopy = (spillCopy + 1) % SPILL_HEADERS;
+    EEPROM.put(spillHeaderAddress(spillCopy), spill);
+}
+
+/*
+ * Returns true if a copy of the spill's header was written by this layout and these settings.
+ */
+bool spillValid(SpillHeader* header){
+    return header->magic == SPILL_MAGIC && header->slots == SPILL_SLOTS && header->head < SPILL_SLOTS
+        && header->count <= SPILL_SLOTS;
+}
+
+/*
+ * Returns the EEPROM address of a copy of the spill's header.
+ */
+int spillHeaderAddress(byte copy){
+    return SPILL_ADDRESS + copy * sizeof(SpillHeader);
+}
+
+/*
+ * Returns the EEPROM address of a spill slot.
+ */
+int spillAddress(int slot){
+    return SPILL_ADDRESS + SPILL_HEADERS * sizeof(SpillHeader) + slot * sizeof(QueuedReading);
+}
+
+/*
+ * Lets go of the readings of every window frame before the window's base, which the server has
+ * acknowledged. A failed window confirms nothing: what it carried goes again under new keys.
+ */
+void confirmWindow(void){
+    if (WINDOW_SIZE == 0 || iot.windowFailed()) {
+        return;
+    }
+    while (windowConfirmed < iot.getWindowBase()) {
+        dropBefore(windowEnd[windowConfirmed % MAX_WINDOW]);
+        ++windowConfirmed;
     }
+}
 
-    delete[] newState;
-    newState = NULL;
+/*
+ * Puts every queued reading back in line for the next batch once new keys are made. Whatever the
+ * last window carried and was not confirmed may never have arrived; the server drops any that did.
+ */
+void resendUnconfirmed(void){
+    sentCount = 0;
+    windowConfirmed = 0;
+}
 
-    radio.stopListening();                        // Setup to tranmit
-    if (state == 3) {
-        delay(5000);
+/*
+ * With LOW_POWER, powers the radio down and sleeps once link() waits for nothing but the next
+ * batch: IoTSec has finished with the radio, see sleepRadio, and no reply is awaited. The next
+ * reading due or the sensor's interrupt wakes it.
+ */
+void rest(void){
+#if LOW_POWER
+    if (waitingReply || sensorEvent || linkReady() || !iot.sleepRadio()) {
+        return;
     }
-    
+    Serial.flush();                               // Power-down stops the UART mid-byte
+    unsigned long elapsed = millis() - lastSample;
+    sleepFor(elapsed < SAMPLE_INTERVAL ? SAMPLE_INTERVAL - elapsed : 0);
+#endif
 }
 
-// HELPER FUNCTIONS ###########################################################################################################
-bool getResponse(void){
-    radio.startListening();                                    // SETUP for receiving data
-    memset(receiveBuffer, 0, sizeof(receiveBuffer));           // Clear the reveiveBuffer
-                                       
-    unsigned long started_waiting = micros();                  // Set up a timeout period, get the current microseconds
-    boolean timeout = false;                                   // Set up a variable to indicate if a response was received or not
- 
-    while (!radio.available()){                                // While nothing is received
-        if (micros() - started_waiting > 50000000 ){           // If waited longer than 10ms, indicate timeout and exit while loop
-            timeout = true;
-            break;
-        }     
+/*
+ * Sleeps the MCU in power-down for up to ms milliseconds, in one of the watchdog's steps of 16 ms
+ * doubling up to 1 s; loop() sleeps again for whatever is left. The time asleep is added to
+ * millis(), whose timer stops with the CPU. A sleep the sensor's interrupt cuts short is not,
+ * leaving millis() up to one step behind. Power-down stops the clock that edge detection needs,
+ * so the sensor's pin wakes the MCU on its low level while asleep and goes back to FALLING after.
+ * Off the board it does nothing.
+ */
+void sleepFor(unsigned long ms){
+#if LOW_POWER && defined(__AVR__)
+    byte step = 0;                                // WDTO_15MS
+    while (step < WDTO_1S && (32UL << step) <= ms) {
+        ++step;
     }
-    if (timeout){                                             
-        Serial.println("\nFailed, response timed out.");
-        return false;                                           // Nothing received from server
+    if ((16UL << step) > ms) {
+        return;                                   // Shorter than the shortest step, loop() spins it out
     }
-    else{
-        radio.read(&receiveBuffer, sizeof(receiveBuffer));
-        return true;
+    watchdogFired = false;
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+        wdt_reset();
+        MCUSR &= ~_BV(WDRF);
+        WDTCSR = _BV(WDCE) | _BV(WDE);
+        WDTCSR = _BV(WDIE) | step;                // Interrupt only, no reset
+    }
+#if SENSOR_PIN >= 0
+    bool sensorWake = digitalRead(SENSOR_PIN) == HIGH;  // A pin still held low would wake it straight away
+    if (sensorWake) {
+        attachInterrupt(digitalPinToInterrupt(SENSOR_PIN), sensorWakeISR, LOW);
+    }
+#endif
+    set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+    cli();
+    if (!sensorEvent) {                           // Unless the sensor got in first
+        sleep_enable();
+#ifdef sleep_bod_disable
+        sleep_bod_disable();
+#endif
+        sei();                                    // The instruction after sei() runs first, so no interrupt slips in before the sleep
+        sleep_cpu();
+        sleep_disable();
     }
+    sei();
+    wdt_disable();
+#if SENSOR_PIN >= 0
+    if (sensorWake) {
+        attachInterrupt(digitalPinToInterrupt(SENSOR_PIN), sensorISR, FALLING);
+    }
+#endif
+    if (watchdogFired) {
+        ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+            timer0_millis += 16UL << step;
+        }
+    }
+#else
+    (void)ms;
+#endif
+}
+
+#if LOW_POWER && defined(__AVR__)
+/*
+ * Interrupt of the watchdog, which ends a sleep.
+ */
+ISR(WDT_vect){
+    watchdogFired = true;
+}
+
+#if SENSOR_PIN >= 0
+/*
+ * Interrupt on the sensor's pin while asleep, on its low level: the sensor has something to
+ * report. The level keeps firing while the sensor holds the pin low, so it only fires once.
+ */
+void sensorWakeISR(void){
+    sensorEvent = true;
+    detachInterrupt(digitalPinToInterrupt(SENSOR_PIN));
+}
+#endif
+#endif
+
+/*
+ * Interrupt on the sensor's pin: it has something to report.
+ */
+void sensorISR(void){
+    sensorEvent = true;
+}
+
+/*
+ * Interrupt on the radio's IRQ pin: a send finished or a frame arrived.
+ */
+void radioISR(void){
+    iot.radioInterrupt();
 }
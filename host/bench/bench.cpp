@@ -0,0 +1,726 @@
+/*
+ * Latency/throughput benchmarks for IoTSec over the RF24 loopback shim.
+ *
+ * Built against libraries/IoTSec, the library both sketches use; both
+ * ends of every exchange run it. Each benchmark reports ns/op and messages/s, where
+ * an op is one call (send/receive/sendFrame/receiveFrame/...), one full
+ * three-state handshake (handshake.1rtt: the one round trip handshake), one data-phase round trip (data.reading: one reading
+ * of its batch; data.window: one batch through the sliding window), or one whole fragmented message. messages/s counts radio frames, so a fragmented message counts
+ * once per fragment. Both ends use dynamic frames, as the sketches do.
+ *
+ * Usage: benchmark [-n iterations] [-o results.txt] [-b baseline.txt] [-t tolerance]
+ *   -o writes "name ns_per_op" lines that can later be passed back with -b.
+ *   -b compares against a saved run and exits 1 if any benchmark is slower
+ *      than baseline * (1 + tolerance); tolerance defaults to 0.10.
+ */
+#include <SPI.h>
+#include <RF24.h>
+#include <Crypto.h>
+#include <AES.h>
+#include <SHA256.h>
+#include "IoTSec.h"
+#include "IoTSecMessages.h"
+
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+struct Result {
+    std::string name;
+    unsigned long iterations;
+    double nsPerOp;
+    double msgsPerOp;
+};
+
+//One end of the link: the same objects each sketch declares globally.
+struct Node {
+    RF24 radio;
+    IoTSecCipher cipher;
+    IoTSecHash hash256;
+    IoTSec iot;
+
+    Node() : radio(9, 10), iot(&radio, &cipher, &hash256) {}
+};
+
+static byte addresses[][6] = {"NODE1", "NODE2"};
+static std::vector<Result> results;
+
+static double elapsedNs(Clock::time_point start) {
+    return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+}
+
+static void record(const std::string& name, unsigned long iterations, double totalNs, double msgsPerOp) {
+    Result r = {name, iterations, totalNs / iterations, msgsPerOp};
+    results.push_back(r);
+    printf("%-28s %10lu %12.1f %14.1f\n", r.name.c_str(), r.iterations, r.nsPerOp,
+           r.msgsPerOp * 1e9 / r.nsPerOp);
+}
+
+/*
+ * The IRQ pin's interrupt: radioISR() in both sketches. Nothing runs loop() between the
+ * bench's calls, so it also polls at once, as loop() would before the other node's next send.
+ */
+static void radioInterrupt(RF24* radio, void* context) {
+    (void)radio;
+    ((IoTSec*)context)->radioInterrupt();
+    ((IoTSec*)context)->poll();
+}
+
+static void setupRadios(Node& client, Node& server) {
+    client.radio.begin();
+    client.radio.setPALevel(RF24_PA_MAX);
+    client.radio.setDataRate(RF24_250KBPS);
+    client.radio.setChannel(10);
+    client.radio.openWritingPipe(addresses[0]);
+    client.radio.openReadingPipe(1, addresses[1]);
+    client.radio.stopListening();
+
+    server.radio.begin();
+    server.radio.setPALevel(RF24_PA_MAX);
+    server.radio.setDataRate(RF24_250KBPS);
+    server.radio.setChannel(10);
+    server.radio.openWritingPipe(addresses[1]);
+    server.radio.openReadingPipe(1, addresses[0]);
+    server.radio.startListening();
+
+    client.iot.setDynamicFrames(true);
+    server.iot.setDynamicFrames(true);
+    client.iot.setInitiator(true);
+    client.radio.setHostInterrupt(&radioInterrupt, &client.iot);
+    server.radio.setHostInterrupt(&radioInterrupt, &server.iot);
+}
+
+//ATmega328P @ 16 MHz time of the crypto counted since start, at the rates netsim charges.
+static double avrMicros(const HostCryptoOps& start) {
+    return (hostCryptoOps.aesSetKey - start.aesSetKey) * 160.0
+           + (hostCryptoOps.aesEncrypt - start.aesEncrypt) * 540.0
+           + (hostCryptoOps.aesDecrypt - start.aesDecrypt) * 1370.0
+           + (hostCryptoOps.shaBlocks - start.shaBlocks) * 2810.0;
+}
+
+//Throws away whatever is waiting in a radio's RX FIFO.
+static void drain(RF24& radio) {
+    byte packet[MAX_FRAME_SIZE];
+    while (radio.available()) {
+        radio.read(packet, MAX_FRAME_SIZE);
+    }
+}
+
+enum Mode { PLAIN, ENCRYPTED, AUTHENTICATED };
+static const char* modeNames[] = {"plain", "enc", "enc+hmac"};
+
+static void sendOnce(IoTSec& iot, Mode mode, bool asString) {
+    static char arr[MAX_PAYLOAD_SIZE] = {'9', ':', '1', '0', '2', '3', 0, 0};
+    static const String str = "9:1023";
+    byte* key = iot.getSecretKey();
+    byte* intKey = iot.getSecretHashKey();
+
+    switch (mode) {
+        case PLAIN:
+            asString ? iot.send(str, "3") : iot.send(arr, "3");
+            break;
+        case ENCRYPTED:
+            asString ? iot.send(str, key, "3") : iot.send(arr, key, "3");
+            break;
+        case AUTHENTICATED:
+            asString ? iot.send(str, key, intKey, "3") : iot.send(arr, key, intKey, "3");
+            break;
+    }
+}
+
+static void receiveOnce(IoTSec& iot, Mode mode, bool asString) {
+    byte payload[MAX_PAYLOAD_SIZE];
+    char state[MAX_HEADER_SIZE];
+    byte* key = iot.getSecretKey();
+    byte* intKey = iot.getSecretHashKey();
+
+    switch (mode) {
+        case PLAIN:
+            asString ? (void)iot.receiveStr(state, false) : iot.receive(payload, state, false);
+            break;
+        case ENCRYPTED:
+            asString ? (void)iot.receiveStr(key, state, false) : iot.receive(payload, key, state, false);
+            break;
+        case AUTHENTICATED:
+            asString ? (void)iot.receiveStr(key, intKey, state, false)
+                     : iot.receive(payload, key, intKey, state, false);
+            break;
+    }
+}
+
+static void benchSend(Node& client, Node& server, Mode mode, bool asString, unsigned long iterations) {
+    double total = 0;
+    for (unsigned long i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        sendOnce(client.iot, mode, asString);
+        total += elapsedNs(start);
+        drain(server.radio);
+    }
+    record(std::string("send.") + modeNames[mode] + (asString ? ".str" : ".arr"), iterations, total, 1);
+}
+
+/*
+ * Queues frames between the two radios without the 3-deep FIFO limit, so a
+ * fragmented message can be sent in full before the receiver starts pulling it.
+ */
+struct Queue {
+    RF24* receiver;
+    std::deque<std::string> frames;
+
+    static bool transmit(RF24* radio, const uint8_t* data, uint8_t len, void* context) {
+        (void)radio;
+        ((Queue*)context)->frames.push_back(std::string((const char*)data, len));
+        return true;
+    }
+
+    static void refill(RF24* radio, void* context) {
+        Queue* q = (Queue*)context;
+        if (radio == q->receiver && !q->frames.empty()) {
+            radio->hostDeliver(1, (const uint8_t*)q->frames.front().data(), q->frames.front().size());
+            q->frames.pop_front();
+        }
+    }
+};
+
+static void benchMessage(Node& client, Node& server, unsigned int len, unsigned long iterations) {
+    static byte message[MAX_MESSAGE_SIZE];
+    static byte buffer[MAX_MESSAGE_SIZE];
+    char state[MAX_HEADER_SIZE];
+    for (unsigned int i = 0; i < len; ++i) {
+        message[i] = (byte)(i * 7);
+    }
+    unsigned int perFragment = client.iot.getDynamicFrames() ? MAX_FRAME_BODY - FRAGMENT_SEQ_LEN : FRAGMENT_DATA_LEN;
+    unsigned int fragments = (MESSAGE_LEN_LEN + len + HASH_LEN + perFragment - 1) / perFragment;
+
+    Queue queue;
+    queue.receiver = &server.radio;
+    RF24::setHostTransmitHook(&Queue::transmit, &queue);
+    RF24::setHostReceiveHook(&Queue::refill, &queue);
+
+    double sendTotal = 0;
+    double receiveTotal = 0;
+    unsigned long failures = 0;
+    for (unsigned long i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        bool sent = client.iot.sendMessage(message, len, client.iot.getSecretKey(), client.iot.getSecretHashKey(), "3");
+        sendTotal += elapsedNs(start);
+
+        start = Clock::now();
+        unsigned int got = server.iot.receiveMessage(buffer, sizeof(buffer), server.iot.getSecretKey(),
+                                                     server.iot.getSecretHashKey(), state, false);
+        receiveTotal += elapsedNs(start);
+        if (!sent || got != len || !server.iot.getIntegrityPassed() || memcmp(buffer, message, len) != 0) {
+            failures++;
+        }
+        queue.frames.clear();
+    }
+
+    RF24::setHostTransmitHook(NULL, NULL);
+    RF24::setHostReceiveHook(NULL, NULL);
+    char name[64];
+    snprintf(name, sizeof(name), "send.message.%uB", len);
+    record(name, iterations, sendTotal, fragments);
+    snprintf(name, sizeof(name), "receive.message.%uB", len);
+    record(name, iterations, receiveTotal, fragments);
+    if (failures > 0) {
+        printf("  (%lu of %lu messages failed to reassemble)\n", failures, iterations);
+    }
+}
+
+//sendFrame/receiveFrame with HMAC under the secret keys, checking every payload comes back intact.
+static void benchFrame(Node& client, Node& server, byte len, unsigned long iterations) {
+    byte data[MAX_FRAME_PAYLOAD];
+    byte payload[MAX_FRAME_PAYLOAD];
+    char state[MAX_HEADER_SIZE];
+    for (byte i = 0; i < len; ++i) {
+        data[i] = (byte)(i * 13 + 1);
+    }
+
+    double sendTotal = 0;
+    double receiveTotal = 0;
+    unsigned long failures = 0;
+    for (unsigned long i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        client.iot.sendFrame(data, len, client.iot.getSecretKey(), client.iot.getSecretHashKey(), "3");
+        sendTotal += elapsedNs(start);
+
+        start = Clock::now();
+        byte got = server.iot.receiveFrame(payload, server.iot.getSecretKey(), server.iot.getSecretHashKey(),
+                                           state, false);
+        receiveTotal += elapsedNs(start);
+        if (got != len || !server.iot.getIntegrityPassed() || memcmp(payload, data, len) != 0) {
+            failures++;
+        }
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "send.frame.%uB", len);
+    record(name, iterations, sendTotal, 1);
+    snprintf(name, sizeof(name), "receive.frame.%uB", len);
+    record(name, iterations, receiveTotal, 1);
+    if (failures > 0) {
+        printf("  (%lu of %lu frames failed to verify)\n", failures, iterations);
+    }
+}
+
+//beginFrame/sendInPlace/receiveInPlace: the same frames with no copy in or out of the caller's buffer.
+static void benchInPlace(Node& client, Node& server, byte len, unsigned long iterations) {
+    byte frame[MAX_FRAME_SIZE];
+    byte data[MAX_FRAME_PAYLOAD];
+    for (byte i = 0; i < len; ++i) {
+        data[i] = (byte)(i * 13 + 1);
+    }
+
+    double sendTotal = 0;
+    double receiveTotal = 0;
+    double sendAvr = 0;
+    double receiveAvr = 0;
+    unsigned long failures = 0;
+    for (unsigned long i = 0; i < iterations; ++i) {
+        HostCryptoOps ops = hostCryptoOps;
+        Clock::time_point start = Clock::now();
+        memcpy(client.iot.beginFrame(frame, MSG_BATCH), data, len);
+        client.iot.sendInPlace(frame, len, client.iot.getSecretKey(), client.iot.getSecretHashKey());
+        sendTotal += elapsedNs(start);
+        sendAvr += avrMicros(ops);
+
+        ops = hostCryptoOps;
+        start = Clock::now();
+        byte got;
+        byte* payload = server.iot.receiveInPlace(frame, &got, server.iot.getSecretKey(),
+                                                  server.iot.getSecretHashKey(), false);
+        receiveTotal += elapsedNs(start);
+        receiveAvr += avrMicros(ops);
+        if (payload == NULL || got != len || !server.iot.getIntegrityPassed() || memcmp(payload, data, len) != 0) {
+            failures++;
+        }
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "send.inplace.%uB", len);
+    record(name, iterations, sendTotal, 1);
+    snprintf(name, sizeof(name), "receive.inplace.%uB", len);
+    record(name, iterations, receiveTotal, 1);
+    printf("  (AVR crypto: %.0f us send, %.0f us receive)\n", sendAvr / iterations, receiveAvr / iterations);
+    if (failures > 0) {
+        printf("  (%lu of %lu frames failed to verify)\n", failures, iterations);
+    }
+}
+
+//sendSealedInPlace/receiveSealedInPlace: AES-CCM in place of HMAC-then-encrypt, under the secret key.
+static void benchSealed(Node& client, Node& server, byte len, unsigned long iterations) {
+    byte frame[MAX_FRAME_SIZE];
+    byte data[MAX_FRAME_PAYLOAD];
+    for (byte i = 0; i < len; ++i) {
+        data[i] = (byte)(i * 13 + 1);
+    }
+
+    double sendTotal = 0;
+    double receiveTotal = 0;
+    double sendAvr = 0;
+    double receiveAvr = 0;
+    unsigned long failures = 0;
+    for (unsigned long i = 0; i < iterations; ++i) {
+        HostCryptoOps ops = hostCryptoOps;
+        Clock::time_point start = Clock::now();
+        memcpy(client.iot.beginFrame(frame, MSG_BATCH), data, len);
+        client.iot.sendSealedInPlace(frame, len, client.iot.getSecretKey());
+        sendTotal += elapsedNs(start);
+        sendAvr += avrMicros(ops);
+
+        ops = hostCryptoOps;
+        start = Clock::now();
+        byte got;
+        byte* payload = server.iot.receiveSealedInPlace(frame, &got, server.iot.getSecretKey(), false);
+        receiveTotal += elapsedNs(start);
+        receiveAvr += avrMicros(ops);
+        if (payload == NULL || got != len || !server.iot.getIntegrityPassed() || memcmp(payload, data, len) != 0) {
+            failures++;
+        }
+    }
+
+    char name[64];
+    snprintf(name, sizeof(name), "send.sealed.%uB", len);
+    record(name, iterations, sendTotal, 1);
+    snprintf(name, sizeof(name), "receive.sealed.%uB", len);
+    record(name, iterations, receiveTotal, 1);
+    printf("  (AVR crypto: %.0f us send, %.0f us receive)\n", sendAvr / iterations, receiveAvr / iterations);
+    if (failures > 0) {
+        printf("  (%lu of %lu frames failed to verify)\n", failures, iterations);
+    }
+}
+
+static void benchReceive(Node& client, Node& server, Mode mode, bool asString, unsigned long iterations) {
+    double total = 0;
+    for (unsigned long i = 0; i < iterations; ++i) {
+        sendOnce(client.iot, mode, false);
+        Clock::time_point start = Clock::now();
+        receiveOnce(server.iot, mode, asString);
+        total += elapsedNs(start);
+    }
+    record(std::string("receive.") + modeNames[mode] + (asString ? ".str" : ".arr"), iterations, total, 1);
+}
+
+/*
+ * Runs states 0-2 of client.ino against the matching server.ino handlers, one call at a time
+ * in a single thread, with the IoTSecMessages.h messages. Returns true if both sides ended
+ * with keys.
+ */
+static bool handshake(Node& client, Node& server) {
+    IoTSec& c = client.iot;
+    IoTSec& s = server.iot;
+    byte frame[MAX_FRAME_SIZE];
+    byte len;
+    byte* payload;
+
+    //State 0: server authentication.
+    c.setHandshakeComplete(false);
+    ChallengeMsg challenge;
+    challenge.number = c.createRandom();
+    sendMessage(c, frame, encodeChallenge(challenge, c.beginFrame(frame, MSG_CHALLENGE)));
+
+    payload = readMessage(s, frame, MSG_CHALLENGE, &len);
+    ChallengeMsg received;
+    if (!s.getIntegrityPassed() || !decodeChallenge(payload, len, &received)) {
+        return false;
+    }
+    s.setHandshakeComplete(false);
+    ChallengeReplyMsg reply;
+    reply.number = received.number - 1;
+    s.setChallenge(s.createRandom());
+    reply.challenge = s.getChallenge();
+    sendMessage(s, frame, encodeChallengeReply(reply, s.beginFrame(frame, MSG_CHALLENGE_REPLY)));
+
+    payload = readMessage(c, frame, MSG_CHALLENGE_REPLY, &len);
+    if (!c.getIntegrityPassed() || !decodeChallengeReply(payload, len, &reply) || reply.number != challenge.number - 1) {
+        return false;
+    }
+
+    //State 1: client authentication.
+    ResponseMsg response;
+    response.number = reply.challenge - 1;
+    sendMessage(c, frame, encodeResponse(response, c.beginFrame(frame, MSG_RESPONSE)));
+
+    payload = readMessage(s, frame, MSG_RESPONSE, &len);
+    if (!s.getIntegrityPassed() || !decodeResponse(payload, len, &response) || (int)response.number != s.getChallenge() - 1) {
+        return false;
+    }
+    AuthOkMsg ok;
+    sendMessage(s, frame, encodeAuthOk(ok, s.beginFrame(frame, MSG_AUTH_OK)));
+
+    payload = readMessage(c, frame, MSG_AUTH_OK, &len);
+    if (!c.getIntegrityPassed() || !decodeAuthOk(payload, len, &ok)) {
+        return false;
+    }
+
+    //State 2: share nonces.
+    NonceMsg nonce1;
+    NonceMsg nonce2;
+    c.createNonce(nonce1.nonce);
+    sendMessage(c, frame, encodeNonce(nonce1, c.beginFrame(frame, MSG_NONCE)));
+
+    payload = readMessage(s, frame, MSG_NONCE, &len);
+    NonceMsg serverNonce1;
+    if (!s.getIntegrityPassed() || !decodeNonce(payload, len, &serverNonce1)) {
+        return false;
+    }
+    s.createNonce(nonce2.nonce);
+    sendMessage(s, frame, encodeNonce(nonce2, s.beginFrame(frame, MSG_NONCE)));
+    s.generateKeys(serverNonce1.nonce, nonce2.nonce);
+    s.setHandshakeComplete(true);
+
+    payload = readMessage(c, frame, MSG_NONCE, &len);
+    if (!c.getIntegrityPassed() || !decodeNonce(payload, len, &nonce2)) {
+        return false;
+    }
+    c.generateKeys(nonce1.nonce, nonce2.nonce);
+    c.setHandshakeComplete(true);
+    return true;
+}
+
+/*
+ * Runs the one round trip handshake (state 4 in client.ino and server.ino): the random
+ * number and nonce go out in one MSG_HELLO, the decremented number and the other nonce come
+ * back in one, and both sides make the keys. Returns true if both sides ended with keys.
+ */
+static bool handshake1Rtt(Node& client, Node& server) {
+    IoTSec& c = client.iot;
+    IoTSec& s = server.iot;
+    byte frame[MAX_FRAME_SIZE];
+    byte len;
+    byte* payload;
+
+    HelloMsg hello;
+    hello.number = c.createRandom();
+    c.createNonce(hello.nonce);
+    sendMessage(c, frame, encodeHello(hello, c.beginFrame(frame, MSG_HELLO)));
+
+    payload = readMessage(s, frame, MSG_HELLO, &len);
+    HelloMsg received;
+    if (!s.getIntegrityPassed() || !decodeHello(payload, len, &received)) {
+        return false;
+    }
+    HelloMsg reply;
+    reply.number = received.number - 1;
+    s.createNonce(reply.nonce);
+    sendMessage(s, frame, encodeHello(reply, s.beginFrame(frame, MSG_HELLO)));
+    s.generateKeys(received.nonce, reply.nonce);
+    s.setHandshakeComplete(true);
+
+    payload = readMessage(c, frame, MSG_HELLO, &len);
+    if (!c.getIntegrityPassed() || !decodeHello(payload, len, &reply) || reply.number != hello.number - 1) {
+        return false;
+    }
+    c.generateKeys(hello.nonce, reply.nonce);
+    c.setHandshakeComplete(true);
+    return true;
+}
+
+static void benchHandshake(Node& client, Node& server, bool oneRoundTrip, unsigned long iterations) {
+    double total = 0;
+    unsigned long failures = 0;
+    for (unsigned long i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        if (!(oneRoundTrip ? handshake1Rtt(client, server) : handshake(client, server))) {
+            failures++;
+        }
+        total += elapsedNs(start);
+        drain(client.radio);
+        drain(server.radio);
+    }
+    record(oneRoundTrip ? "handshake.1rtt" : "handshake", iterations, total, oneRoundTrip ? 2 : 6);
+    if (failures > 0) {
+        printf("  (%lu of %lu handshakes failed)\n", failures, iterations);
+    }
+}
+
+/*
+ * One state-3 exchange: a full batch of readings out, its count back in a MSG_ACK, both encrypted
+ * with HMAC under the session keys. Returns false once the exchange used up the keys.
+ */
+static bool dataRoundTrip(Node& client, Node& server) {
+    IoTSec& c = client.iot;
+    IoTSec& s = server.iot;
+    byte frame[MAX_FRAME_SIZE];
+    byte* batch = c.beginFrame(frame, MSG_BATCH);
+    for (int i = 0; i < MAX_BATCH_SIZE; ++i) {
+        batch[i * READING_LEN] = (byte)((i << 4) | 0x02);
+        batch[i * READING_LEN + 1] = (byte)(i * 31);
+    }
+    c.sendSealedInPlace(frame, MAX_BATCH_SIZE * READING_LEN, c.getMasterKey());
+
+    byte received = 0;
+    s.receiveSealedInPlace(frame, &received, s.getMasterKey(), false);
+    AckMsg ack;
+    ack.count = received / READING_LEN;
+    s.sendSealedInPlace(frame, encodeAck(ack, s.beginFrame(frame, MSG_ACK)), s.getMasterKey());
+
+    //The client's send that hits MAX_MESSAGE_COUNT frees the keys it would verify with.
+    if (c.keyExpired()) {
+        drain(client.radio);
+        return false;
+    }
+    byte len;
+    byte* payload = c.receiveSealedInPlace(frame, &len, c.getMasterKey(), false);
+    return c.getIntegrityPassed() && payload != NULL && decodeAck(payload, len, &ack) && ack.count == MAX_BATCH_SIZE
+        && !s.keyExpired();
+}
+
+/*
+ * The data phase end to end, rekeying whenever the keys run out. With eventDriven the
+ * nodes queue frames through IoTSec's IRQ path, as the sketches do, instead of write()
+ * and available() directly.
+ */
+static void benchDataPhase(Node& client, Node& server, bool eventDriven, unsigned long iterations) {
+    double rttTotal = 0;
+    double rekeyTotal = 0;
+    client.iot.setEventDriven(eventDriven);
+    server.iot.setEventDriven(eventDriven);
+    handshake(client, server);
+
+    for (unsigned long i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        bool live = dataRoundTrip(client, server);
+        rttTotal += elapsedNs(start);
+
+        if (!live || client.iot.keyExpired() || server.iot.keyExpired()) {
+            if (eventDriven) {
+                //Drops the ACK drain() could not reach in the client's RX queue.
+                client.iot.setEventDriven(true);
+            }
+            start = Clock::now();
+            handshake(client, server);
+            rekeyTotal += elapsedNs(start);
+        }
+    }
+    client.iot.setEventDriven(false);
+    server.iot.setEventDriven(false);
+    if (eventDriven) {
+        record("data.rtt.event", iterations, rttTotal, 2);
+        return;
+    }
+    record("data.rtt", iterations, rttTotal, 2);
+    record("data.rtt+rekey", iterations, rttTotal + rekeyTotal, 2);
+    record("data.reading", iterations * MAX_BATCH_SIZE, rttTotal + rekeyTotal, 2.0 / MAX_BATCH_SIZE);
+}
+
+/*
+ * The data phase through a MAX_WINDOW frame sliding window: each batch goes out without a
+ * reply of its own and is acknowledged on the auto-ACK of a later one, rekeying whenever the
+ * keys run out. One op is one batch, and the only frame it puts on air.
+ */
+static void benchWindow(Node& client, Node& server, unsigned long iterations) {
+    IoTSec& c = client.iot;
+    IoTSec& s = server.iot;
+    byte batch[MAX_WINDOW_PAYLOAD];
+    byte frame[MAX_FRAME_SIZE];
+    double total = 0;
+    unsigned long stalls = 0;
+    unsigned long lost = 0;
+    for (int i = 0; i < MAX_BATCH_SIZE; ++i) {
+        batch[i * READING_LEN] = (byte)((i << 4) | 0x02);
+        batch[i * READING_LEN + 1] = (byte)(i * 31);
+    }
+    c.setWindow(MAX_WINDOW);
+    s.setWindow(MAX_WINDOW);
+    handshake(client, server);
+
+    for (unsigned long i = 0; i < iterations; ++i) {
+        Clock::time_point start = Clock::now();
+        if (!c.windowOpen()) {
+            stalls++;
+        }
+        c.sendWindowed(batch, MAX_BATCH_SIZE * READING_LEN, c.getMasterKey());
+        byte len = 0;
+        s.receiveWindowedInPlace(frame, &len, s.getMasterKey(), false);
+        total += elapsedNs(start);
+        if (len != MAX_BATCH_SIZE * READING_LEN) {
+            lost++;
+        }
+
+        if (c.keyExpired() || c.windowFailed()) {
+            handshake(client, server);
+        }
+    }
+    c.setWindow(0);
+    s.setWindow(0);
+    drain(client.radio);
+    drain(server.radio);
+    record("data.window", iterations, total, 1);
+    if (stalls > 0 || lost > 0) {
+        printf("  (%lu sends found the window full, %lu batches lost)\n", stalls, lost);
+    }
+}
+
+static bool compareBaseline(const char* path, double tolerance) {
+    FILE* f = fopen(path, "r");
+    if (f == NULL) {
+        fprintf(stderr, "cannot open baseline %s\n", path);
+        return false;
+    }
+    std::map<std::string, double> baseline;
+    char name[128];
+    double ns;
+    while (fscanf(f, "%127s %lf", name, &ns) == 2) {
+        baseline[name] = ns;
+    }
+    fclose(f);
+
+    bool ok = true;
+    for (size_t i = 0; i < results.size(); ++i) {
+        std::map<std::string, double>::iterator it = baseline.find(results[i].name);
+        if (it == baseline.end()) {
+            continue;
+        }
+        double ratio = results[i].nsPerOp / it->second;
+        if (ratio > 1.0 + tolerance) {
+            printf("REGRESSION %-28s %.1f ns/op vs %.1f baseline (%+.1f%%)\n", results[i].name.c_str(),
+                   results[i].nsPerOp, it->second, (ratio - 1.0) * 100.0);
+            ok = false;
+        }
+    }
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    unsigned long iterations = 20000;
+    const char* outPath = NULL;
+    const char* baselinePath = NULL;
+    double tolerance = 0.10;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+            iterations = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            outPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baselinePath = argv[++i];
+        }
+        else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            tolerance = atof(argv[++i]);
+        }
+        else {
+            fprintf(stderr, "usage: %s [-n iterations] [-o results] [-b baseline] [-t tolerance]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations == 0) {
+        iterations = 1;
+    }
+
+    //IoTSec logs to Serial on the hot path; keep the terminal out of the measurement.
+    Serial.setOutput(NULL);
+
+    Node client;
+    Node server;
+    setupRadios(client, server);
+
+    printf("%-28s %10s %12s %14s\n", "benchmark", "iters", "ns/op", "msgs/s");
+    for (int mode = PLAIN; mode <= AUTHENTICATED; ++mode) {
+        benchSend(client, server, (Mode)mode, true, iterations);
+        benchSend(client, server, (Mode)mode, false, iterations);
+    }
+    for (int mode = PLAIN; mode <= AUTHENTICATED; ++mode) {
+        benchReceive(client, server, (Mode)mode, true, iterations);
+        benchReceive(client, server, (Mode)mode, false, iterations);
+    }
+    benchFrame(client, server, MAX_PAYLOAD_SIZE, iterations);
+    benchFrame(client, server, MAX_FRAME_PAYLOAD, iterations);
+    benchInPlace(client, server, MAX_PAYLOAD_SIZE, iterations);
+    benchInPlace(client, server, MAX_FRAME_PAYLOAD, iterations);
+    benchSealed(client, server, MAX_PAYLOAD_SIZE, iterations);
+    benchSealed(client, server, MAX_FRAME_PAYLOAD, iterations);
+    benchMessage(client, server, 64, iterations / 10 + 1);
+    benchMessage(client, server, 1024, iterations / 100 + 1);
+    benchHandshake(client, server, false, iterations / 10 + 1);
+    benchHandshake(client, server, true, iterations / 10 + 1);
+    benchDataPhase(client, server, false, iterations);
+    benchDataPhase(client, server, true, iterations);
+    benchWindow(client, server, iterations);
+#if IOTSEC_METRICS
+    Serial.setOutput(stdout);                   //Both ends of the link share the one metrics block.
+    IoTSec::dumpMetrics();
+#endif
+
+    if (outPath != NULL) {
+        FILE* f = fopen(outPath, "w");
+        if (f == NULL) {
+            fprintf(stderr, "cannot write %s\n", outPath);
+            return 2;
+        }
+        for (size_t i = 0; i < results.size(); ++i) {
+            fprintf(f, "%s %.1f\n", results[i].name.c_str(), results[i].nsPerOp);
+        }
+        fclose(f);
+    }
+    if (baselinePath != NULL && !compareBaseline(baselinePath, tolerance)) {
+        return 1;
+    }
+    return 0;
+}
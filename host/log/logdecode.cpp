@@ -0,0 +1,46 @@
+/*
+ * Turns the binary log a sketch writes to Serial (see IoTSecLog.h) back into the lines it
+ * stands for, with the same formats the board would render with IOTSEC_LOG_TEXT.
+ *
+ * Built against the library's IoTSecLog.cpp, the token table both sketches log with. Start it
+ * before the board resets, so it sees the stream from the first record. A byte that cannot
+ * start a record is skipped, which finds the next record again after noise on the line.
+ *
+ * Usage: logdecode [file]      (reads standard input without a file, e.g. the serial port:
+ *                               stty -F /dev/ttyACM0 9600 raw && logdecode < /dev/ttyACM0)
+ */
+#include "IoTSec.h"
+
+int main(int argc, char** argv) {
+    FILE* in = stdin;
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-')) {
+        fprintf(stderr, "usage: %s [file]\n", argv[0]);
+        return 2;
+    }
+    if (argc == 2) {
+        in = fopen(argv[1], "rb");
+        if (in == NULL) {
+            fprintf(stderr, "cannot open %s\n", argv[1]);
+            return 2;
+        }
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0);
+
+    byte rec[LOG_RECORD_MAX];
+    int c;
+    while ((c = fgetc(in)) != EOF) {
+        if (c < 2 || c > LOG_RECORD_MAX) {
+            continue;
+        }
+        rec[0] = (byte)c;
+        size_t got = fread(rec + 1, 1, rec[0] - 1, in);
+        if (got < (size_t)(rec[0] - 1)) {
+            break;
+        }
+        IoTSecLog::render(rec);
+    }
+    if (in != stdin) {
+        fclose(in);
+    }
+    return 0;
+}
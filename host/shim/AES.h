@@ -0,0 +1,40 @@
+/*
+ * Host stand-in for AES.h from the Arduino Cryptography Library. Same API and
+ * key-length rules: setKey() refuses anything but a 16 byte key and leaves the
+ * previous schedule in place.
+ */
+#ifndef HOST_AES_H
+#define HOST_AES_H
+
+#include "Crypto.h"
+
+class BlockCipher {
+    public:
+        BlockCipher() {}
+        virtual ~BlockCipher() {}
+
+        virtual size_t blockSize() const = 0;
+        virtual size_t keySize() const = 0;
+        virtual bool setKey(const uint8_t* key, size_t len) = 0;
+        virtual void encryptBlock(uint8_t* output, const uint8_t* input) = 0;
+        virtual void decryptBlock(uint8_t* output, const uint8_t* input) = 0;
+        virtual void clear() = 0;
+};
+
+class AES128 : public BlockCipher {
+    public:
+        AES128();
+        virtual ~AES128();
+
+        size_t blockSize() const { return 16; }
+        size_t keySize() const { return 16; }
+        bool setKey(const uint8_t* key, size_t len);
+        void encryptBlock(uint8_t* output, const uint8_t* input);
+        void decryptBlock(uint8_t* output, const uint8_t* input);
+        void clear();
+
+    private:
+        uint8_t schedule[176];
+};
+
+#endif
@@ -0,0 +1,157 @@
+#include "Arduino.h"
+
+#include <chrono>
+#include <thread>
+
+HardwareSerial Serial;
+
+void String::fromUnsigned(unsigned long value, unsigned char base) {
+    char buf[8 * sizeof(unsigned long) + 1];
+    char* p = buf + sizeof(buf) - 1;
+    *p = 0;
+    if (base < 2) {
+        base = DEC;
+    }
+    do {
+        int digit = value % base;
+        *--p = digit < 10 ? '0' + digit : 'A' + digit - 10;
+        value /= base;
+    } while (value);
+    this->s = p;
+}
+
+void String::fromSigned(long value, unsigned char base) {
+    if (value < 0 && base == DEC) {
+        fromUnsigned((unsigned long)(-value), base);
+        this->s.insert(this->s.begin(), '-');
+    }
+    else {
+        fromUnsigned((unsigned long)value, base);
+    }
+}
+
+size_t HardwareSerial::print(const String& str) {
+    return this->print(str.c_str());
+}
+
+size_t HardwareSerial::print(const char* str) {
+    this->written += strlen(str);
+    if (this->out == NULL) {
+        return strlen(str);
+    }
+    return fputs(str, this->out) < 0 ? 0 : strlen(str);
+}
+
+size_t HardwareSerial::print(char c) {
+    char str[2] = {c, 0};
+    return this->print(str);
+}
+
+size_t HardwareSerial::print(int value) {
+    return this->print(String(value));
+}
+
+size_t HardwareSerial::print(unsigned long value) {
+    return this->print(String(value));
+}
+
+size_t HardwareSerial::write(uint8_t c) {
+    this->written++;
+    if (this->out == NULL) {
+        return 1;
+    }
+    return fputc(c, this->out) == EOF ? 0 : 1;
+}
+
+size_t HardwareSerial::println(const String& str) {
+    return this->print(str) + this->println();
+}
+
+size_t HardwareSerial::println(const char* str) {
+    return this->print(str) + this->println();
+}
+
+size_t HardwareSerial::println(int value) {
+    return this->print(value) + this->println();
+}
+
+size_t HardwareSerial::println(unsigned long value) {
+    return this->print(value) + this->println();
+}
+
+size_t HardwareSerial::println() {
+    return this->print("\r\n");
+}
+
+static std::chrono::steady_clock::time_point bootTime() {
+    static const std::chrono::steady_clock::time_point boot = std::chrono::steady_clock::now();
+    return boot;
+}
+
+static unsigned long (*hostClock)() = NULL;
+
+void setHostClock(unsigned long (*clock)()) {
+    hostClock = clock;
+}
+
+unsigned long micros() {
+    if (hostClock != NULL) {
+        return hostClock();
+    }
+    return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - bootTime()).count();
+}
+
+unsigned long millis() {
+    return micros() / 1000;
+}
+
+void delay(unsigned long ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+}
+
+void delayMicroseconds(unsigned int us) {
+    std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+//Same 31-bit Park-Miller generator avr-libc uses, so seeds reproduce across builds.
+static unsigned long randomState = 1;
+
+static long nextRandom() {
+    long hi = randomState / 127773L;
+    long lo = randomState % 127773L;
+    long x = 16807L * lo - 2836L * hi;
+    if (x < 0) {
+        x += 0x7fffffffL;
+    }
+    randomState = x;
+    return x % (0x7fffffffL + 1UL);
+}
+
+long random(long howbig) {
+    if (howbig == 0) {
+        return 0;
+    }
+    return nextRandom() % howbig;
+}
+
+long random(long howsmall, long howbig) {
+    if (howsmall >= howbig) {
+        return howsmall;
+    }
+    return random(howbig - howsmall) + howsmall;
+}
+
+void randomSeed(unsigned long seed) {
+    if (seed != 0) {
+        randomState = seed % 0x7fffffffL;
+        if (randomState == 0) {
+            randomState = 1;
+        }
+    }
+}
+
+int analogRead(uint8_t pin) {
+    //Floating analog pins are what the sketches seed from; any noisy value will do.
+    return (int)((micros() * 2654435761UL + pin) >> 7) & 0x3ff;
+}
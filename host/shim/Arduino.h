@@ -0,0 +1,114 @@
+/*
+ * Host stand-in for the subset of the Arduino core used by the sketches and IoTSec.
+ * Only what the project touches is provided; behaviour follows the AVR core closely
+ * enough that IoTSec.cpp compiles and runs unmodified on Linux.
+ */
+#ifndef HOST_ARDUINO_H
+#define HOST_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <string>
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+#define A0 14
+#define A1 15
+
+#define DEC 10
+#define HEX 16
+
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const unsigned char*)(addr))
+#define pgm_read_ptr(addr) (*(void* const*)(addr))
+
+class String {
+    public:
+        String() {}
+        String(const char* str) : s(str ? str : "") {}
+        String(const std::string& str) : s(str) {}
+        explicit String(char c) : s(1, c) {}
+        explicit String(unsigned char value, unsigned char base = DEC) { fromUnsigned(value, base); }
+        explicit String(int value, unsigned char base = DEC) { fromSigned(value, base); }
+        explicit String(unsigned int value, unsigned char base = DEC) { fromUnsigned(value, base); }
+        explicit String(long value, unsigned char base = DEC) { fromSigned(value, base); }
+        explicit String(unsigned long value, unsigned char base = DEC) { fromUnsigned(value, base); }
+
+        unsigned int length() const { return (unsigned int)s.size(); }
+        const char* c_str() const { return s.c_str(); }
+        char operator[](unsigned int index) const { return index < s.size() ? s[index] : 0; }
+        char& operator[](unsigned int index) { return s[index]; }
+
+        String& operator+=(const String& rhs) { s += rhs.s; return *this; }
+        String& operator+=(const char* rhs) { s += rhs; return *this; }
+        String& operator+=(char rhs) { s += rhs; return *this; }
+
+        bool operator==(const String& rhs) const { return s == rhs.s; }
+        bool operator==(const char* rhs) const { return s == rhs; }
+        bool operator!=(const String& rhs) const { return s != rhs.s; }
+        bool operator!=(const char* rhs) const { return s != rhs; }
+
+        int toInt() const { return atoi(s.c_str()); }
+
+        friend String operator+(const String& lhs, const String& rhs) { return String(lhs.s + rhs.s); }
+        friend String operator+(const String& lhs, const char* rhs) { return String(lhs.s + rhs); }
+        friend String operator+(const char* lhs, const String& rhs) { return String(lhs + rhs.s); }
+        friend String operator+(const String& lhs, char rhs) { return String(lhs.s + rhs); }
+
+    private:
+        std::string s;
+
+        void fromUnsigned(unsigned long value, unsigned char base);
+        void fromSigned(long value, unsigned char base);
+};
+
+class HardwareSerial {
+    public:
+        HardwareSerial() : out(stdout), written(0) {}
+        void begin(unsigned long baud) { (void)baud; }
+        size_t print(const String& str);
+        size_t print(const char* str);
+        size_t print(char c);
+        size_t print(int value);
+        size_t print(unsigned long value);
+        size_t println(const String& str);
+        size_t println(const char* str);
+        size_t println(int value);
+        size_t println(unsigned long value);
+        size_t println();
+        size_t write(uint8_t c);
+        int availableForWrite() { return 63; }        //Output never backs up on a host.
+        void flush() {}
+        int available() { return 0; }                 //Nothing is ever typed into a host build.
+        int read() { return -1; }
+
+        //Host only: redirect (or silence with NULL) everything printed to Serial.
+        void setOutput(FILE* out) { this->out = out; }
+        //Host only: characters printed so far, whether or not they went anywhere.
+        unsigned long bytesWritten() const { return this->written; }
+
+    private:
+        FILE* out;
+        unsigned long written;
+};
+
+extern HardwareSerial Serial;
+
+unsigned long micros();
+unsigned long millis();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+//Host only: have micros() and millis() read a simulated clock in microseconds, NULL for the real one.
+void setHostClock(unsigned long (*clock)());
+
+long random(long howbig);
+long random(long howsmall, long howbig);
+void randomSeed(unsigned long seed);
+
+int analogRead(uint8_t pin);
+
+#endif
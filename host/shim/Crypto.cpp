@@ -0,0 +1,20 @@
+#include "Crypto.h"
+
+HostCryptoOps hostCryptoOps;
+
+void clean(void* dest, size_t size) {
+    volatile uint8_t* d = (volatile uint8_t*)dest;
+    while (size-- > 0) {
+        *d++ = 0;
+    }
+}
+
+bool secure_compare(const void* data1, const void* data2, size_t len) {
+    const uint8_t* d1 = (const uint8_t*)data1;
+    const uint8_t* d2 = (const uint8_t*)data2;
+    uint8_t result = 0;
+    while (len-- > 0) {
+        result |= (*d1++ ^ *d2++);
+    }
+    return result == 0;
+}
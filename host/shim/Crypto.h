@@ -0,0 +1,30 @@
+/*
+ * Host stand-in for the common header of the Arduino Cryptography Library
+ * (rweather/Crypto). Only the pieces IoTSec uses are provided.
+ */
+#ifndef HOST_CRYPTO_H
+#define HOST_CRYPTO_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+void clean(void* dest, size_t size);
+
+template <typename T>
+inline void clean(T& var) {
+    clean(&var, sizeof(T));
+}
+
+bool secure_compare(const void* data1, const void* data2, size_t len);
+
+//Host only: primitive operation counts, so a simulator can charge AVR-equivalent CPU time.
+struct HostCryptoOps {
+    unsigned long aesSetKey;
+    unsigned long aesEncrypt;
+    unsigned long aesDecrypt;
+    unsigned long shaBlocks;
+};
+
+extern HostCryptoOps hostCryptoOps;
+
+#endif
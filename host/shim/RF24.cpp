@@ -0,0 +1,295 @@
+#include "RF24.h"
+
+//Every radio in the process, so write() can find the receiver.
+static RF24* ether = NULL;
+
+static HostTransmitHook transmitHook = NULL;
+static void* transmitContext = NULL;
+static HostReceiveHook receiveHook = NULL;
+static void* receiveContext = NULL;
+
+void RF24::setHostTransmitHook(HostTransmitHook hook, void* context) {
+    transmitHook = hook;
+    transmitContext = context;
+}
+
+void RF24::setHostReceiveHook(HostReceiveHook hook, void* context) {
+    receiveHook = hook;
+    receiveContext = context;
+}
+
+RF24::RF24(uint16_t cePin, uint16_t csPin) {
+    (void)cePin;
+    (void)csPin;
+    this->paLevel = RF24_PA_MAX;
+    this->dataRate = RF24_1MBPS;
+    this->channel = 76;
+    this->payloadSize = RF24_MAX_PAYLOAD;
+    this->dynamicPayloads = false;
+    this->retryDelay = 5;
+    this->retryCount = 15;
+    this->autoAck = true;
+    this->listening = false;
+    this->powered = false;
+    this->arc = 0;
+    this->rpd = false;
+    memset(this->writeAddress, 0, sizeof(this->writeAddress));
+    memset(this->readAddress, 0, sizeof(this->readAddress));
+    memset(this->readEnabled, 0, sizeof(this->readEnabled));
+    this->rxHead = 0;
+    this->rxCount = 0;
+    this->ackPayloads = false;
+    this->ackCount = 0;
+    memset(this->irqStatus, 0, sizeof(this->irqStatus));
+    memset(this->irqMask, 0, sizeof(this->irqMask));
+    this->interruptHook = NULL;
+    this->interruptContext = NULL;
+
+    this->nextRadio = ether;
+    ether = this;
+}
+
+RF24::~RF24() {
+    for (RF24** it = &ether; *it != NULL; it = &(*it)->nextRadio) {
+        if (*it == this) {
+            *it = this->nextRadio;
+            break;
+        }
+    }
+}
+
+bool RF24::begin() {
+    this->powered = true;
+    this->listening = false;
+    this->rxCount = 0;
+    return true;
+}
+
+void RF24::setPayloadSize(uint8_t size) {
+    this->payloadSize = size > RF24_MAX_PAYLOAD ? RF24_MAX_PAYLOAD : (size == 0 ? 1 : size);
+}
+
+void RF24::openWritingPipe(const uint8_t* address) {
+    memcpy(this->writeAddress, address, RF24_ADDR_WIDTH);
+}
+
+void RF24::openReadingPipe(uint8_t number, const uint8_t* address) {
+    if (number >= RF24_PIPES) {
+        return;
+    }
+    memcpy(this->readAddress[number], address, RF24_ADDR_WIDTH);
+    this->readEnabled[number] = true;
+}
+
+void RF24::closeReadingPipe(uint8_t number) {
+    if (number < RF24_PIPES) {
+        this->readEnabled[number] = false;
+    }
+}
+
+void RF24::startListening() {
+    this->powered = true;
+    this->listening = true;
+}
+
+void RF24::stopListening() {
+    this->listening = false;
+    if (this->ackPayloads) {
+        this->ackCount = 0;
+    }
+}
+
+bool RF24::writeAckPayload(uint8_t pipe, const void* buf, uint8_t len) {
+    if (!this->ackPayloads || !this->dynamicPayloads || this->ackCount == RF24_FIFO_DEPTH) {
+        return false;
+    }
+    Frame* frame = &this->ack[this->ackCount++];
+    frame->pipe = pipe;
+    frame->len = len > RF24_MAX_PAYLOAD ? RF24_MAX_PAYLOAD : len;
+    memcpy(frame->data, buf, frame->len);
+    return true;
+}
+
+//Removes the oldest ACK payload queued for pipe, if any.
+bool RF24::hostTakeAckPayload(uint8_t pipe, uint8_t* data, uint8_t* len) {
+    for (uint8_t i = 0; i < this->ackCount; ++i) {
+        if (this->ack[i].pipe != pipe) {
+            continue;
+        }
+        memcpy(data, this->ack[i].data, this->ack[i].len);
+        *len = this->ack[i].len;
+        for (uint8_t j = i + 1; j < this->ackCount; ++j) {
+            this->ack[j - 1] = this->ack[j];
+        }
+        this->ackCount--;
+        return true;
+    }
+    return false;
+}
+
+bool RF24::available() {
+    return this->available(NULL);
+}
+
+bool RF24::available(uint8_t* pipeNum) {
+    if (this->rxCount == 0 && receiveHook != NULL) {
+        receiveHook(this, receiveContext);
+    }
+    if (this->rxCount == 0) {
+        return false;
+    }
+    if (pipeNum != NULL) {
+        *pipeNum = this->rx[this->rxHead].pipe;
+    }
+    return true;
+}
+
+uint8_t RF24::getDynamicPayloadSize() {
+    if (this->rxCount == 0) {
+        return 0;
+    }
+    return this->rx[this->rxHead].len;
+}
+
+void RF24::read(void* buf, uint8_t len) {
+    if (this->rxCount == 0) {
+        memset(buf, 0, len);
+        return;
+    }
+    Frame* frame = &this->rx[this->rxHead];
+    uint8_t n = len < frame->len ? len : frame->len;
+    memcpy(buf, frame->data, n);
+    if (len > n) {
+        memset((uint8_t*)buf + n, 0, len - n);
+    }
+    this->rxHead = (this->rxHead + 1) % RF24_FIFO_DEPTH;
+    this->rxCount--;
+}
+
+bool RF24::write(const void* buf, uint8_t len) {
+    if (!this->powered || this->listening) {
+        return false;
+    }
+    return this->transmit((const uint8_t*)buf, len);
+}
+
+void RF24::startWrite(const void* buf, uint8_t len, const bool multicast) {
+    (void)multicast;
+    if (!this->powered || this->listening) {
+        return;
+    }
+    bool acked = this->transmit((const uint8_t*)buf, len);
+    if (transmitHook == NULL) {
+        this->hostTransmitDone(acked);
+    }
+}
+
+void RF24::maskIRQ(bool tx_ok, bool tx_fail, bool rx_ready) {
+    this->irqMask[0] = tx_ok;
+    this->irqMask[1] = tx_fail;
+    this->irqMask[2] = rx_ready;
+}
+
+void RF24::whatHappened(bool& tx_ok, bool& tx_fail, bool& rx_ready) {
+    tx_ok = this->irqStatus[0];
+    tx_fail = this->irqStatus[1];
+    rx_ready = this->irqStatus[2];
+    memset(this->irqStatus, 0, sizeof(this->irqStatus));
+}
+
+void RF24::setHostInterrupt(HostInterruptHook hook, void* context) {
+    this->interruptHook = hook;
+    this->interruptContext = context;
+}
+
+void RF24::hostTransmitDone(bool acked) {
+    this->setStatus(acked ? 0 : 1);
+}
+
+bool RF24::irqLow() const {
+    for (int i = 0; i < 3; ++i) {
+        if (this->irqStatus[i] && !this->irqMask[i]) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//Sets a STATUS bit; the IRQ pin only has a falling edge if no other unmasked bit held it low already.
+void RF24::setStatus(int bit) {
+    bool wasLow = this->irqLow();
+    this->irqStatus[bit] = true;
+    if (!wasLow && this->irqLow() && this->interruptHook != NULL) {
+        this->interruptHook(this, this->interruptContext);
+    }
+}
+
+bool RF24::transmit(const uint8_t* buf, uint8_t len) {
+    //With static payloads the radio always clocks out payloadSize bytes.
+    uint8_t size = this->payloadSize;
+    if (this->dynamicPayloads) {
+        size = len > RF24_MAX_PAYLOAD ? RF24_MAX_PAYLOAD : (len == 0 ? 1 : len);
+    }
+    uint8_t data[RF24_MAX_PAYLOAD];
+    memset(data, 0, sizeof(data));
+    memcpy(data, buf, len < size ? len : size);
+
+    if (transmitHook != NULL) {
+        return transmitHook(this, data, size, transmitContext);
+    }
+    this->arc = this->autoAck ? this->retryCount : 0;
+    for (RF24* radio = ether; radio != NULL; radio = radio->nextRadio) {
+        if (radio->deliver(this->writeAddress, data, size, this)) {
+            this->arc = 0;
+            radio->rpd = true;
+            uint8_t pipe = 0;
+            uint8_t ackData[RF24_MAX_PAYLOAD];
+            uint8_t ackLen;
+            if (radio->hasReadingAddress(this->writeAddress, &pipe) && radio->hostTakeAckPayload(pipe, ackData, &ackLen)) {
+                this->hostDeliver(0, ackData, ackLen);
+                this->rpd = true;
+            }
+            return true;
+        }
+    }
+    return !this->autoAck;
+}
+
+bool RF24::hasReadingAddress(const uint8_t* address, uint8_t* pipe) const {
+    for (uint8_t i = 0; i < RF24_PIPES; ++i) {
+        if (this->readEnabled[i] && memcmp(this->readAddress[i], address, RF24_ADDR_WIDTH) == 0) {
+            if (pipe != NULL) {
+                *pipe = i;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+bool RF24::hostDeliver(uint8_t pipe, const uint8_t* data, uint8_t len) {
+    if (this->rxCount == RF24_FIFO_DEPTH) {
+        return false;
+    }
+    Frame* frame = &this->rx[(this->rxHead + this->rxCount) % RF24_FIFO_DEPTH];
+    frame->pipe = pipe;
+    frame->len = len > RF24_MAX_PAYLOAD ? RF24_MAX_PAYLOAD : len;
+    memcpy(frame->data, data, frame->len);
+    this->rxCount++;
+    this->setStatus(2);
+    return true;
+}
+
+bool RF24::deliver(const uint8_t* address, const uint8_t* data, uint8_t len, const RF24* from) {
+    if (this == from || !this->powered || !this->listening
+        || this->channel != from->channel || this->dataRate != from->dataRate
+        || this->dynamicPayloads != from->dynamicPayloads) {
+        return false;
+    }
+    uint8_t pipe;
+    if (!this->hasReadingAddress(address, &pipe)) {
+        return false;
+    }
+    //A full RX FIFO drops the frame and withholds the ACK.
+    return this->hostDeliver(pipe, data, len);
+}
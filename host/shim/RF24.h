@@ -0,0 +1,159 @@
+/*
+ * Host stand-in for the TMRh20 RF24 driver. Every RF24 object created in the
+ * process joins one in-memory ether: write() delivers straight into the 3-deep
+ * RX FIFO of whichever listening radio has the writing address open on one of
+ * its reading pipes, on the same channel, data rate and payload mode, and
+ * reports the auto-ACK the way the hardware would. Static payloads always clock
+ * out payloadSize bytes; dynamic payloads clock out exactly what write() got.
+ * With enableAckPayload() a receiver's writeAckPayload() rides back on the next
+ * auto-ACK of that pipe and lands in the writer's RX FIFO on pipe 0; like the
+ * chip, stopListening() and flush_tx() throw away ACK payloads not yet sent.
+ *
+ * A simulator can take the ether over with setHostTransmitHook(): write() then
+ * hands each frame to the hook, and frames come back in through hostDeliver().
+ * setHostReceiveHook() is asked for more whenever available() finds the FIFO empty.
+ * Under a transmit hook the harness collects ACK payloads with hostTakeAckPayload().
+ *
+ * The IRQ pin is modelled by the TX_DS/MAX_RT/RX_DR status bits and maskIRQ():
+ * setHostInterrupt() is called on each falling edge, where a sketch would have
+ * attachInterrupt(). startWrite() on the ether completes at once; under a
+ * transmit hook the harness ends it with hostTransmitDone().
+ *
+ * getARC() and testRPD() report the last write's retransmissions and whether the last frame
+ * in was heard above the chip's -64 dBm detector. On the ether a write is delivered first time
+ * or not at all and every frame in is strong; under a transmit hook the harness sets both with
+ * hostSetARC() and hostSetRPD().
+ */
+#ifndef HOST_RF24_H
+#define HOST_RF24_H
+
+#include "Arduino.h"
+
+typedef enum { RF24_PA_MIN = 0, RF24_PA_LOW, RF24_PA_HIGH, RF24_PA_MAX, RF24_PA_ERROR } rf24_pa_dbm_e;
+typedef enum { RF24_1MBPS = 0, RF24_2MBPS, RF24_250KBPS } rf24_datarate_e;
+typedef enum { RF24_CRC_DISABLED = 0, RF24_CRC_8, RF24_CRC_16 } rf24_crclength_e;
+
+#define RF24_MAX_PAYLOAD 32
+#define RF24_FIFO_DEPTH 3
+#define RF24_PIPES 6
+#define RF24_ADDR_WIDTH 5
+
+class RF24;
+
+//Host only: receives every frame a radio clocks out; the return value is write()'s ACK result.
+typedef bool (*HostTransmitHook)(RF24* radio, const uint8_t* data, uint8_t len, void* context);
+//Host only: called by available() on an empty RX FIFO, so a harness can feed frames on demand.
+typedef void (*HostReceiveHook)(RF24* radio, void* context);
+//Host only: the radio pulled its IRQ pin low.
+typedef void (*HostInterruptHook)(RF24* radio, void* context);
+
+class RF24 {
+    public:
+        RF24(uint16_t cePin, uint16_t csPin);
+        ~RF24();
+
+        bool begin();
+        bool isChipConnected() { return true; }
+        void setPALevel(uint8_t level) { this->paLevel = level; }
+        uint8_t getPALevel() { return this->paLevel; }
+        bool setDataRate(rf24_datarate_e speed) { this->dataRate = speed; return true; }
+        rf24_datarate_e getDataRate() { return this->dataRate; }
+        void setChannel(uint8_t channel) { this->channel = channel; }
+        uint8_t getChannel() { return this->channel; }
+        void setPayloadSize(uint8_t size);
+        uint8_t getPayloadSize() { return this->payloadSize; }
+        void enableDynamicPayloads() { this->dynamicPayloads = true; }
+        void disableDynamicPayloads() { this->dynamicPayloads = false; }
+        uint8_t getDynamicPayloadSize();
+        void setRetries(uint8_t delay, uint8_t count) { this->retryDelay = delay; this->retryCount = count; }
+        void setAutoAck(bool enable) { this->autoAck = enable; }
+        void setCRCLength(rf24_crclength_e length) { (void)length; }
+        void enableAckPayload() { this->ackPayloads = true; }
+        void disableAckPayload() { this->ackPayloads = false; this->ackCount = 0; }
+        bool writeAckPayload(uint8_t pipe, const void* buf, uint8_t len);
+        bool isAckPayloadAvailable() { return this->available(); }
+
+        void openWritingPipe(const uint8_t* address);
+        void openReadingPipe(uint8_t number, const uint8_t* address);
+        void closeReadingPipe(uint8_t number);
+        void startListening();
+        void stopListening();
+
+        bool available();
+        bool available(uint8_t* pipeNum);
+        void read(void* buf, uint8_t len);
+        bool write(const void* buf, uint8_t len);
+        void startWrite(const void* buf, uint8_t len, const bool multicast);
+        void maskIRQ(bool tx_ok, bool tx_fail, bool rx_ready);
+        void whatHappened(bool& tx_ok, bool& tx_fail, bool& rx_ready);
+
+        void powerDown() { this->powered = false; }
+        void powerUp() { this->powered = true; }
+        void flush_rx() { this->rxCount = 0; }
+        void flush_tx() { this->ackCount = 0; }
+        uint8_t getARC() { return this->arc; }
+        bool testRPD() { return this->rpd; }
+
+        //Host only: simulator plumbing.
+        static void setHostTransmitHook(HostTransmitHook hook, void* context);
+        static void setHostReceiveHook(HostReceiveHook hook, void* context);
+        bool hostDeliver(uint8_t pipe, const uint8_t* data, uint8_t len);
+        void setHostInterrupt(HostInterruptHook hook, void* context);
+        void hostTransmitDone(bool acked);
+        bool isListening() const { return this->powered && this->listening; }
+        bool isDynamicPayloads() const { return this->dynamicPayloads; }
+        const uint8_t* getWritingAddress() const { return this->writeAddress; }
+        bool hasReadingAddress(const uint8_t* address, uint8_t* pipe) const;
+        bool hostTakeAckPayload(uint8_t pipe, uint8_t* data, uint8_t* len);
+        void hostSetARC(uint8_t count) { this->arc = count; }
+        uint8_t hostRetryDelay() const { return this->retryDelay; }
+        void hostSetRPD(bool strong) { this->rpd = strong; }
+
+    private:
+        struct Frame {
+            uint8_t pipe;
+            uint8_t len;
+            uint8_t data[RF24_MAX_PAYLOAD];
+        };
+
+        uint8_t paLevel;
+        rf24_datarate_e dataRate;
+        uint8_t channel;
+        uint8_t payloadSize;
+        bool dynamicPayloads;
+        uint8_t retryDelay;
+        uint8_t retryCount;
+        bool autoAck;
+        bool listening;
+        bool powered;
+        uint8_t arc; //Retransmissions the last write took, OBSERVE_TX's ARC_CNT.
+        bool rpd; //Flag for whether the last frame in was above the RPD level.
+
+        //STATUS bits behind the IRQ pin and the CONFIG bits that mask them, in TX_DS, MAX_RT, RX_DR order.
+        bool irqStatus[3];
+        bool irqMask[3];
+        HostInterruptHook interruptHook;
+        void* interruptContext;
+
+        uint8_t writeAddress[RF24_ADDR_WIDTH];
+        uint8_t readAddress[RF24_PIPES][RF24_ADDR_WIDTH];
+        bool readEnabled[RF24_PIPES];
+
+        Frame rx[RF24_FIFO_DEPTH];
+        uint8_t rxHead;
+        uint8_t rxCount;
+
+        //ACK payloads wait in the TX FIFO, oldest first.
+        bool ackPayloads;
+        Frame ack[RF24_FIFO_DEPTH];
+        uint8_t ackCount;
+
+        RF24* nextRadio;
+
+        bool deliver(const uint8_t* address, const uint8_t* data, uint8_t len, const RF24* from);
+        bool transmit(const uint8_t* data, uint8_t len);
+        bool irqLow() const;
+        void setStatus(int bit);
+};
+
+#endif
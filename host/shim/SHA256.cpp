@@ -0,0 +1,166 @@
+#include "SHA256.h"
+
+#include <string.h>
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t ror(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void Hash::formatHMACKey(void* block, const void* key, size_t len, uint8_t pad) {
+    size_t size = blockSize();
+    reset();
+    if (len <= size) {
+        memcpy(block, key, len);
+    }
+    else {
+        update(key, len);
+        len = hashSize();
+        finalize(block, len);
+        reset();
+    }
+    uint8_t* b = (uint8_t*)block;
+    memset(b + len, pad, size - len);
+    for (size_t i = 0; i < len; ++i) {
+        b[i] ^= pad;
+    }
+}
+
+SHA256::SHA256() {
+    reset();
+}
+
+SHA256::~SHA256() {
+    clean(this->state);
+}
+
+void SHA256::reset() {
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(this->state.h, init, sizeof(init));
+    memset(this->state.w, 0, sizeof(this->state.w));
+    this->state.length = 0;
+    this->state.chunkSize = 0;
+}
+
+void SHA256::update(const void* data, size_t len) {
+    const uint8_t* d = (const uint8_t*)data;
+    this->state.length += ((uint64_t)len) << 3;
+    while (len > 0) {
+        uint8_t size = 64 - this->state.chunkSize;
+        if (size > len) {
+            size = (uint8_t)len;
+        }
+        memcpy(((uint8_t*)this->state.w) + this->state.chunkSize, d, size);
+        this->state.chunkSize += size;
+        len -= size;
+        d += size;
+        if (this->state.chunkSize == 64) {
+            processChunk();
+            this->state.chunkSize = 0;
+        }
+    }
+}
+
+void SHA256::finalize(void* hash, size_t len) {
+    uint8_t* w = (uint8_t*)this->state.w;
+    uint8_t pos = this->state.chunkSize;
+    w[pos++] = 0x80;
+    if (pos > 56) {
+        memset(w + pos, 0, 64 - pos);
+        processChunk();
+        pos = 0;
+    }
+    memset(w + pos, 0, 56 - pos);
+    for (int i = 0; i < 8; ++i) {
+        w[56 + i] = (uint8_t)(this->state.length >> (56 - 8 * i));
+    }
+    processChunk();
+
+    uint8_t digest[32];
+    for (int i = 0; i < 8; ++i) {
+        digest[4 * i] = (uint8_t)(this->state.h[i] >> 24);
+        digest[4 * i + 1] = (uint8_t)(this->state.h[i] >> 16);
+        digest[4 * i + 2] = (uint8_t)(this->state.h[i] >> 8);
+        digest[4 * i + 3] = (uint8_t)(this->state.h[i]);
+    }
+    memcpy(hash, digest, len < 32 ? len : 32);
+    clean(digest, sizeof(digest));
+}
+
+void SHA256::clear() {
+    clean(this->state);
+    reset();
+}
+
+void SHA256::resetHMAC(const void* key, size_t keyLen) {
+    formatHMACKey(this->state.w, key, keyLen, 0x36);
+    this->state.length += 64 * 8;
+    processChunk();
+}
+
+void SHA256::finalizeHMAC(const void* key, size_t keyLen, void* hash, size_t hashLen) {
+    uint8_t temp[32];
+    finalize(temp, sizeof(temp));
+    formatHMACKey(this->state.w, key, keyLen, 0x5c);
+    this->state.length += 64 * 8;
+    processChunk();
+    update(temp, sizeof(temp));
+    finalize(hash, hashLen);
+    clean(temp, sizeof(temp));
+}
+
+void SHA256::processChunk() {
+    hostCryptoOps.shaBlocks++;
+    uint32_t w[64];
+    const uint8_t* bytes = (const uint8_t*)this->state.w;
+    for (int i = 0; i < 16; ++i) {
+        w[i] = ((uint32_t)bytes[4 * i] << 24) | ((uint32_t)bytes[4 * i + 1] << 16)
+             | ((uint32_t)bytes[4 * i + 2] << 8) | (uint32_t)bytes[4 * i + 3];
+    }
+    for (int i = 16; i < 64; ++i) {
+        uint32_t s0 = ror(w[i - 15], 7) ^ ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ror(w[i - 2], 17) ^ ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = this->state.h[0], b = this->state.h[1], c = this->state.h[2], d = this->state.h[3];
+    uint32_t e = this->state.h[4], f = this->state.h[5], g = this->state.h[6], h = this->state.h[7];
+    for (int i = 0; i < 64; ++i) {
+        uint32_t s1 = ror(e, 6) ^ ror(e, 11) ^ ror(e, 25);
+        uint32_t ch = (e & f) ^ (~e & g);
+        uint32_t t1 = h + s1 + ch + k[i] + w[i];
+        uint32_t s0 = ror(a, 2) ^ ror(a, 13) ^ ror(a, 22);
+        uint32_t maj = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t t2 = s0 + maj;
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    this->state.h[0] += a;
+    this->state.h[1] += b;
+    this->state.h[2] += c;
+    this->state.h[3] += d;
+    this->state.h[4] += e;
+    this->state.h[5] += f;
+    this->state.h[6] += g;
+    this->state.h[7] += h;
+    clean(w, sizeof(w));
+}
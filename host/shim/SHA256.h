@@ -0,0 +1,53 @@
+/*
+ * Host stand-in for SHA256.h from the Arduino Cryptography Library, including
+ * its resetHMAC()/finalizeHMAC() helpers.
+ */
+#ifndef HOST_SHA256_H
+#define HOST_SHA256_H
+
+#include "Crypto.h"
+
+class Hash {
+    public:
+        Hash() {}
+        virtual ~Hash() {}
+
+        virtual size_t hashSize() const = 0;
+        virtual size_t blockSize() const = 0;
+        virtual void reset() = 0;
+        virtual void update(const void* data, size_t len) = 0;
+        virtual void finalize(void* hash, size_t len) = 0;
+        virtual void clear() = 0;
+        virtual void resetHMAC(const void* key, size_t keyLen) = 0;
+        virtual void finalizeHMAC(const void* key, size_t keyLen, void* hash, size_t hashLen) = 0;
+
+    protected:
+        void formatHMACKey(void* block, const void* key, size_t len, uint8_t pad);
+};
+
+class SHA256 : public Hash {
+    public:
+        SHA256();
+        virtual ~SHA256();
+
+        size_t hashSize() const { return 32; }
+        size_t blockSize() const { return 64; }
+        void reset();
+        void update(const void* data, size_t len);
+        void finalize(void* hash, size_t len);
+        void clear();
+        void resetHMAC(const void* key, size_t keyLen);
+        void finalizeHMAC(const void* key, size_t keyLen, void* hash, size_t hashLen);
+
+    private:
+        struct {
+            uint32_t h[8];
+            uint32_t w[16];
+            uint64_t length;
+            uint8_t chunkSize;
+        } state;
+
+        void processChunk();
+};
+
+#endif
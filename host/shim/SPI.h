@@ -0,0 +1,9 @@
+/*
+ * Host stand-in for SPI.h. The RF24 shim never touches a bus, so there is nothing to declare.
+ */
+#ifndef HOST_SPI_H
+#define HOST_SPI_H
+
+#include "Arduino.h"
+
+#endif
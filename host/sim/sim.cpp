@@ -0,0 +1,1925 @@
+/*
+ * Deterministic discrete-event simulation of one server.ino gateway and N
+ * client.ino nodes sharing a single nRF24 channel.
+ *
+ * Every node runs the real IoTSec code (host build) for framing and crypto.
+ * The client state machine (states 0-3) and the server loop() are ported
+ * branch for branch from the sketches, split at the points where they block
+ * on the radio, so the simulator can advance virtual time instead of spinning.
+ *
+ * The channel is one collision domain with dynamic payloads, as the sketches
+ * configure it (--static-payloads puts every packet on air as 32 bytes instead):
+ * any two transmissions that overlap in time are both lost, each receiver
+ * independently loses a frame with probability --loss, and write() follows the
+ * nRF24 auto-ACK/auto-retransmit rules (ARC 15, ARD as each radio's setRetries: 1500 us
+ * on the server, staggered by node ID on the clients as client.ino does) with PID duplicate
+ * suppression. Each client is a path loss from the server drawn from --path-loss
+ * (default 50 to 80 dB). A packet, or its ACK, arrives at the sender's power
+ * less that loss; the margin over the receiver's sensitivity at the data rate
+ * gives its chance of being lost, 1 / (1 + e^(margin / 1 dB)), and packets are
+ * only heard at the receiver's own data rate. Above -64 dBm the radio's RPD is
+ * set. Both sketches call setLinkAdaptation(true), so the data rate and power
+ * move with what the clients see; --fixed-rate keeps 250 kbps and full power.
+ * CPU time is charged from the number of AES blocks, key schedules and SHA-256 compressions each step actually performed
+ * (at ATmega328P rates), and the radio listens through it: a reply goes on air once it is over. Log records go out over Serial at 9600 baud from IoTSecLog's
+ * ring while the node is idle, so they only cost CPU time by being dropped when it is full.
+ *
+ * Clients sample a reading every SAMPLE_INTERVAL and send them in batches of up to
+ * -b readings (default 12), or fewer once the oldest has waited --deadline ms; a
+ * batch is delta packed by SensorEncoder and holds as many as fit in a frame. Readings
+ * stay queued, in RAM and then the EEPROM spill, until the server has acknowledged
+ * them, and go again under new keys if it never did; the server drops the ones it has
+ * had before by their sequence numbers. --gateway-down at,len switches the gateway off
+ * at `at` seconds for `len`, and it boots again with no sessions.
+ * They make keys with the three exchange handshake (states 0-2), as client.ino's
+ * HANDSHAKE_STATE does by default, or with the one round trip one (state 4) given --one-rtt.
+ *
+ * Nodes use IoTSec's event-driven I/O as the sketches do: sends are queued and
+ * finished from the IRQ, and the client keeps sampling while its link thread
+ * waits for a reply. --low-power runs client.ino with LOW_POWER: once its link thread
+ * waits for the next batch a client powers its radio down and sleeps between readings,
+ * and the server keeps anything for it until it is next heard from. --blocking runs the earlier sketches instead, where write()
+ * and the receive spin hold up loop() and sampling only happens between exchanges.
+ *
+ * Each batch waits for a sealed ACK, as with client.ino's default WINDOW_SIZE of 0.
+ * -w n sends batches through a sliding window of n frames instead, ACKed in the
+ * radio's ACK payloads, which take their airtime on the ACK, or in frames of their
+ * own once a pipe has been heard from more than one client; --blocking has no window.
+ * IoTSec's window timer runs on the simulated clock.
+ *
+ * The server is a gateway, as in server.ino: client i sends node ID i in front of
+ * every frame, and the server keeps an IoTSec session per node ID and serves them in
+ * turn. Clients are spread over its CLIENT_PIPES (5) reading pipes, and each listens
+ * on an address of its own. --blocking keeps one session that every client shares,
+ * all of them with node ID 0.
+ *
+ * Usage: netsim [-N 1,2,5,...] [-d seconds] [-l loss] [-s seed] [-b batch] [--deadline ms] [-w window]
+ *               [--path-loss lo,hi] [--fixed-rate] [--low-power] [--gateway-down at,len] [--no-serial]
+ *               [--static-payloads] [--blocking] [--one-rtt] [-v]
+ *
+ * One row per client count:
+ *   hs_done     handshakes that reached state 3, hs_p50ms/hs_p95ms their duration
+ *               from the first state-0 send of the attempt
+ *   rd/s        sensor readings the server verified and ACKed, each counted once; goodB/s their packed bytes
+ *   srvIF%      frames the server received that failed integrity
+ *   cliIF%      responses the client received that failed integrity (timeouts excluded)
+ *   rtx/s       requests sent again after IoTSec's retransmission timeout, across all clients
+ *   tmo/s       exchanges given up after MAX_RETRIES retransmissions (one timeout without event-driven I/O)
+ *   hsFrm%      client frames spent on handshake states rather than state 3
+ *   exp:fail    returns to state 0 from the data phase caused by MAX_MESSAGE_COUNT
+ *               expiry versus by integrity failures
+ *   renew       handshakes started in the background by rekeyDue(), data still flowing
+ *   air%        fraction of time at least one packet or ACK was on air
+ *   lat_ms      mean time from a reading being sampled to the client verifying its ACK (with a
+ *               window, to the window moving past its frame),
+ *               lat_max the longest any reading waited
+ *   cliBusy%    fraction of client time loop() was held up in IoTSec: CPU work, plus
+ *               blocking write() and receive waits without event-driven I/O
+ *   txuJ/rd     energy the clients' radios spent transmitting, packets and ACKs with their
+ *               settling, per reading the server accepted (TX current at each power, 3.3 V)
+ *   kbps        mean data rate of the clients' packets on air
+ *   uJ/rd       all the energy the clients spent, per reading the server accepted: TX as above, the
+ *               radio listening and the MCU running whenever they are not asleep, and with
+ *               --low-power the sleep currents, each reading's wake-up and the radio's power-ups
+ *   avg_mA      mean current a client draws over the run
+ *   lost        readings the clients dropped from a full queue, never to reach the server
+ *   dup%        readings the server had already had, sent again after an ACK or window was lost,
+ *               against those it accepted
+ *
+ * Without event-driven I/O write() does not report its ACK to IoTSec here, so --blocking keeps
+ * the fixed rate.
+ */
+#include <SPI.h>
+#include <RF24.h>
+#include <Crypto.h>
+#include <AES.h>
+#include <SHA256.h>
+#include "IoTSec.h"
+#include "IoTSecMessages.h"
+#include "SensorCodec.h"
+
+#include <algorithm>
+#include <deque>
+#include <new>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
+
+typedef unsigned long long SimTime;     //Microseconds of virtual time.
+
+//The running simulation's clock, read by micros() and millis().
+static const SimTime* simulatedTime = NULL;
+//While set, every read of the clock moves it this far on, so a blocking receive spins through its timeout at once.
+static SimTime spinStep = 0;
+static SimTime spinOffset = 0;
+
+static unsigned long simulatedMicros() {
+    spinOffset += spinStep;
+    return (unsigned long)(*simulatedTime + spinOffset);
+}
+
+static const SimTime SAMPLE_INTERVAL_US = 500000;    //client.ino's SAMPLE_INTERVAL.
+static const int QUEUE_SIZE = 12;                     //client.ino's QUEUE_SIZE.
+static const int SPILL_SLOTS = 120;                   //client.ino's SPILL_SLOTS; the EEPROM spill and the RAM queue are one queue here.
+static const int QUEUE_LIMIT = QUEUE_SIZE + SPILL_SLOTS;
+static const int SENSORS = 10;                        //client.ino's SENSORS.
+static const SimTime POLL_INTERVAL_US = 10000;        //How often an idle client's loop() polls IoTSec.
+
+static int batchSize = 12;                            //client.ino's BATCH_SIZE.
+static SimTime batchDeadlineUs = 5000000;             //client.ino's BATCH_DEADLINE.
+static bool eventDriven = true;                        //The sketches call iot.setEventDriven(true).
+static int handshakeState = 0;                        //client.ino's HANDSHAKE_STATE.
+static int windowSize = 0;                            //client.ino's WINDOW_SIZE; the server takes any window.
+static bool lowPower = false;                         //client.ino's LOW_POWER.
+static SimTime gatewayDownAt = 0;                     //When the gateway loses power, with --gateway-down.
+static SimTime gatewayDownUs = 0;                     //How long it stays off, 0 for never.
+
+/*
+ * Radio and CPU timing. Defaults are nRF24L01+ datasheet figures and the
+ * Arduino Cryptography Library's published ATmega328P @ 16 MHz rates.
+ */
+struct Model {
+    bool dynamicPayloads = true;     //The sketches call iot.setDynamicFrames(true).
+    SimTime settleUs = 130;          //TX/RX PLL settling before each transmission.
+    SimTime ardStepUs = 250;         //Auto-retransmit delay step, a radio's setRetries delay d waits (d + 1) steps.
+    int arc = 15;                    //Auto-retransmit count.
+    double loss = 0.0;               //Independent per-frame, per-receiver loss probability.
+    double pathLossLo = 50;          //Range each client's path loss to the server is drawn from, in dB.
+    double pathLossHi = 80;
+    bool fixedRate = false;          //Keeps 250 kbps and RF24_PA_MAX, as before link adaptation.
+    double paDbm[4] = {-18, -12, -6, 0};         //Output power at RF24_PA_MIN to RF24_PA_MAX.
+    double txMa[4] = {7.0, 7.5, 9.0, 11.3};      //TX current at each.
+    double volts = 3.3;
+    double fadeDb = 1.0;             //Width of the margin over which packets go from lost to heard.
+    double rpdDbm = -64;             //The RPD detector's level.
+    double rxMa = 12.6;              //RX current, drawn whenever the radio is powered and not asleep.
+    double standbyMa = 0.026;        //Standby-I current.
+    double powerDownMa = 0.0009;
+    double mcuMa = 6.0;              //ATmega328P running.
+    double mcuSleepMa = 0.006;       //In power-down with the watchdog on.
+    double readingWakeUs = 1000;     //MCU time a reading taken between sleeps costs, from waking to sleeping again.
+    double powerUpUs = 5000;         //RF24::powerUp()'s wait for the crystal, the MCU running and the radio in standby.
+
+    double aesSetKeyUs = 160;
+    double aesEncryptUs = 540;
+    double aesDecryptUs = 1370;
+    double shaBlockUs = 2810;
+    double serialCharUs = 1041.7;    //Serial.begin(9600), 10 bits per character.
+    int serialBufferChars = 64;
+    int logBufferChars = 128;        //IoTSecLog's LOG_BUFFER_LEN on a board.
+
+    SimTime airtime(int payload, rf24_datarate_e rate) const {
+        //Preamble (2 bytes at 2 Mbps) + 5 byte address + 9 bit packet control field + payload + CRC16.
+        int bits = ((rate == RF24_2MBPS ? 2 : 1) + 5 + payload + 2) * 8 + 9;
+        return (SimTime)(bits * bitUs(rate) + 0.5);
+    }
+
+    static double bitUs(rf24_datarate_e rate) {
+        return rate == RF24_250KBPS ? 4.0 : (rate == RF24_1MBPS ? 1.0 : 0.5);
+    }
+
+    static double sensitivityDbm(rf24_datarate_e rate) {
+        return rate == RF24_250KBPS ? -94 : (rate == RF24_1MBPS ? -85 : -82);
+    }
+
+    //The chance a packet sent at paLevel over pathLoss dB is not heard at rate.
+    double fade(uint8_t paLevel, double pathLoss, rf24_datarate_e rate) const {
+        double margin = paDbm[paLevel & 3] - pathLoss - sensitivityDbm(rate);
+        return 1.0 / (1.0 + exp(margin / fadeDb));
+    }
+
+    //Microjoules a radio spends sending a packet of payload bytes, settling included.
+    double txEnergyUj(int payload, uint8_t paLevel, rf24_datarate_e rate) const {
+        return (settleUs + airtime(payload, rate)) * txMa[paLevel & 3] * volts / 1000.0;
+    }
+
+    //Microjoules a client spends besides sending: awakeUs listening with the MCU running, asleepUs with both
+    //powered down, readingWakes readings taken while asleep and radioWakes power-ups of its radio.
+    double clientEnergyUj(double awakeUs, double asleepUs, unsigned long readingWakes, unsigned long radioWakes) const {
+        return (awakeUs * (rxMa + mcuMa) + asleepUs * (powerDownMa + mcuSleepMa) + readingWakes * readingWakeUs * mcuMa
+                + radioWakes * powerUpUs * (mcuMa + standbyMa)) * volts / 1000.0;
+    }
+};
+
+static Model model;
+static const int CLIENT_PIPES = 5;                    //server.ino's CLIENT_PIPES on a gateway with five sessions or more.
+static const int MAX_CLIENTS = 255;                   //Client i sends node ID i, and node IDs are a byte.
+static const int RETRY_DELAY = 5;                     //client.ino's RETRY_DELAY.
+static const int RETRY_SPREAD = 8;                    //client.ino's RETRY_SPREAD.
+static byte serverAddresses[][6] = {"1NODE", "2NODE", "3NODE", "4NODE", "5NODE"};
+static byte clientAddress[6] = "0CLNT";               //First byte replaced with the node ID.
+
+struct Node;
+
+struct Transmission {
+    Node* from;
+    SimTime start;
+    SimTime end;
+    bool corrupted;
+    bool faded;                          //An ACK too weak to be heard.
+    bool strong;                         //An ACK above the RPD level.
+    bool isAck;
+    rf24_datarate_e rate;
+    uint8_t paLevel;
+    unsigned long long frameId;
+    uint8_t data[RF24_MAX_PAYLOAD];
+    uint8_t len;
+};
+
+enum EventKind {
+    CLIENT_LOOP,        //client.ino loop() starts an iteration.
+    CLIENT_TIMEOUT,     //The retransmission timeout ran out waiting for a reply.
+    CLIENT_SAMPLE,      //sampleSensor() takes a reading; event-driven clients only.
+    CLIENT_WAKE,        //The oldest queued reading hit the batch deadline; event-driven clients only.
+    CLIENT_POLL,        //loop() polls IoTSec while window frames wait for their ACK.
+    CLIENT_REST,        //rest() tries again once IoTSec's wake window is over; --low-power only.
+    GATEWAY_DOWN,       //The gateway loses power; --gateway-down only.
+    GATEWAY_UP,         //It boots again with no sessions.
+    SERVER_POLL,        //server.ino loop() checks radio.available().
+    TX_START,           //A write() attempt goes on air.
+    TX_END,             //A data frame finishes on air.
+    ACK_END,            //The matching auto-ACK finishes on air.
+    WRITE_DONE,         //write() returned; the node continues the sketch.
+    STEP_DONE           //The CPU work charged to a handler has elapsed.
+};
+
+struct Event {
+    SimTime time;
+    unsigned long long seq;
+    EventKind kind;
+    Node* node;
+    unsigned long long token;
+    Transmission* tx;
+
+    bool operator>(const Event& rhs) const {
+        return time != rhs.time ? time > rhs.time : seq > rhs.seq;
+    }
+};
+
+//Readings sent in one window frame, until the window moves past it.
+struct WindowBatch {
+    unsigned long number;                //The frame's number, as IoTSec::getWindowBase counts.
+    unsigned int end;                    //The sequence number after its readings.
+    std::vector<SimTime> sampled;        //When each reading was taken.
+};
+
+struct Node {
+    RF24 radio;
+    IoTSecCipher cipher;
+    IoTSecHash hash256;
+    IoTSec iot;
+
+    int id;
+    bool isServer;
+    double pathLoss;                     //dB between a client and the server, 0 on the server.
+
+    //Radio.
+    bool transmitting;
+    bool pendingFrame;
+    uint8_t txData[RF24_MAX_PAYLOAD];
+    uint8_t txLen;
+    int txAttempts;
+    unsigned long long txFrameId;
+    unsigned long long lastFrameSeen;    //PID duplicate suppression per receiver.
+    uint8_t ackData[RF24_MAX_PAYLOAD];   //The ACK payload sent for lastFrameSeen, sent again for its duplicates.
+    uint8_t ackLen;
+    SimTime serialFreeAt;
+
+    //Sketch globals.
+    int state;
+    int exchange;                        //client.ino's exchange: the request waiting for a reply.
+    int tempVariable;
+    int myRandNum;
+    unsigned int linkNumber;
+    byte nonce1[NONCE_LEN];
+    byte frame[MAX_FRAME_SIZE];
+    byte readingQueue[QUEUE_LIMIT][READING_LEN];
+    unsigned int queueSequence[QUEUE_LIMIT];
+    SimTime queueTime[QUEUE_LIMIT];
+    int queueHead;
+    int queueCount;
+    unsigned int nextSequence;
+    int sentCount;                       //client.ino's sentCount: the oldest readings already in a window frame.
+    SimTime lastSample;
+    int sensorLevel[SENSORS];
+    int batchCount;
+    unsigned int batchEnd;
+
+    //Client blocking receive.
+    bool waiting;
+    unsigned long long waitToken;
+    int retries;                         //client.ino's retries: times the request waiting for a reply went again.
+    bool idle;                           //Event-driven link thread waiting for batchReady().
+    bool earlyData;                      //client.ino's earlyData: new keys wait for their first batch.
+    SimTime busySince;                   //Start of the blocking exchange in progress.
+    std::deque<WindowBatch> inFlight;    //Window frames sent and not known to be ACKed, oldest first.
+    bool polling;                        //A CLIENT_POLL is scheduled.
+    bool resting;                        //A CLIENT_REST is scheduled.
+    bool asleep;                         //rest() powered the radio down and the MCU sleeps between readings.
+    SimTime asleepSince;
+    SimTime asleepUs;                    //Time asleep before asleepSince.
+    SimTime startedAt;                   //When the node powered up.
+
+    //Server loop.
+    bool busy;
+    bool down;                           //Powered off by --gateway-down.
+    IoTSec* session;                     //The session iot.nextSession() returned, NULL until frameWaiting() asks.
+
+    //Metrics.
+    SimTime handshakeStart;
+    bool inHandshake;
+
+    Node(int id, bool isServer) : radio(9, 10), iot(&radio, &cipher, &hash256), id(id), isServer(isServer), pathLoss(0),
+        transmitting(false), pendingFrame(false), txLen(0), txAttempts(0), txFrameId(0), lastFrameSeen(0), ackLen(0),
+        serialFreeAt(0), state(0), tempVariable(0), myRandNum(0), linkNumber(0), queueHead(0), queueCount(0), nextSequence(0), sentCount(0),
+        lastSample(0), batchCount(0), batchEnd(0), waiting(false), waitToken(0), retries(0), idle(false), earlyData(false), busySince(0),
+        polling(false), resting(false), asleep(false), asleepSince(0), asleepUs(0), startedAt(0), busy(false), down(false), session(NULL),
+        handshakeStart(0), inHandshake(false) {
+        memset(this->nonce1, 0, sizeof(this->nonce1));
+    }
+};
+
+struct Stats {
+    unsigned long handshakesCompleted = 0;
+    std::vector<double> handshakeMs;
+    unsigned long expiryRekeys = 0;
+    unsigned long failureRekeys = 0;
+    unsigned long renewals = 0;
+    unsigned long readingsAccepted = 0;     //Readings in state 3 frames the server verified and ACKed, each once.
+    unsigned long readingsRepeated = 0;     //Readings the server had had before, sent again after a lost ACK or window.
+    unsigned long readingsLost = 0;         //Readings a client dropped from its full queue.
+    unsigned long readingsConfirmed = 0;    //Readings in batches whose ACK the client verified.
+    unsigned long handshakeFrames = 0;
+    unsigned long dataFrames = 0;
+    unsigned long serverFrames = 0;
+    unsigned long serverIntegrityFailures = 0;
+    unsigned long clientFrames = 0;
+    unsigned long clientIntegrityFailures = 0;
+    unsigned long clientTimeouts = 0;
+    unsigned long retransmissions = 0;
+    unsigned long airAttempts = 0;
+    unsigned long collisions = 0;
+    unsigned long writeFailures = 0;
+    SimTime airBusyUs = 0;
+    std::vector<double> readingLatencyMs;   //One per confirmed reading.
+    double clientBusyUs = 0;
+    double clientTxUj = 0;                  //Clients' TX energy, packets and ACKs.
+    double clientKbps = 0;                  //Sum of the data rate of each client packet on air.
+    unsigned long clientPackets = 0;
+    double clientAwakeUs = 0;               //Client time with the radio powered and the MCU running.
+    double clientAsleepUs = 0;
+    unsigned long readingWakes = 0;         //Readings taken while asleep.
+    unsigned long radioWakes = 0;           //Radios powered up again after rest().
+};
+
+class Simulation {
+    public:
+        Simulation(int clients, SimTime duration, unsigned long seed, bool verbose);
+        ~Simulation();
+        void run();
+        const Stats& getStats() const { return this->stats; }
+        SimTime getDuration() const { return this->duration; }
+
+    private:
+        std::priority_queue<Event, std::vector<Event>, std::greater<Event> > events;
+        std::vector<Node*> nodes;
+        Node* server;
+        std::vector<Transmission*> onAir;
+        std::mt19937_64 rng;
+        SimTime now;
+        SimTime duration;
+        SimTime airBusySince;
+        unsigned long long nextSeq;
+        unsigned long long nextFrameId;
+        bool verbose;
+        Stats stats;
+
+        //Set by the transmit hook while a handler runs.
+        Node* sendingNode;
+        int framesSent;
+
+        struct Cost {
+            HostCryptoOps ops;
+            unsigned long chars;
+        };
+
+        void schedule(SimTime at, EventKind kind, Node* node, unsigned long long token = 0, Transmission* tx = NULL);
+        double uniform() { return std::uniform_real_distribution<double>(0.0, 1.0)(this->rng); }
+
+        Cost beginStep();
+        SimTime endStep(Node* node, const Cost& start);
+
+        void clientLoop(Node* n);
+        void clientSample(Node* n);
+        void abandonHandshake(Node* n);
+        void clientWake(Node* n);
+        void clientPoll(Node* n);
+        void clientRest(Node* n);
+        void clientAwake(Node* n);
+        void setUpNode(Node* n);
+        void gatewayDown(Node* n);
+        void gatewayUp(Node* n);
+        void dropBefore(Node* n, unsigned int end);
+        void dropOldest(Node* n);
+        bool frameWaiting(Node* n);
+        void sampleSensor(Node* n);
+        bool batchReady(Node* n);
+        bool canSend(Node* n);
+        bool renewDue(Node* n);
+        bool linkDue(Node* n);
+        bool linkReady(Node* n);
+        void serverNotice(Node* n);
+        void confirmWindow(Node* n);
+        SimTime clientSleep(Node* n, SimTime at);
+        bool clientSend(Node* n);
+        void clientTimeout(Node* n);
+        void clientFinish(Node* n, bool timedOut);
+        void serverPoll(Node* n);
+        bool serverHandle(Node* n);
+
+        void startTransmission(Node* n);
+        void endTransmission(Transmission* tx);
+        void endAck(Transmission* ack);
+        void writeDone(Node* n, bool acked);
+        void frameArrived(Node* n);
+        void accountAir(bool busy, SimTime at);
+        void chargeTx(Node* n, int payload, rf24_datarate_e rate);
+        double pathLoss(Node* from, Node* to);
+
+        Node* nodeOf(RF24* radio);
+
+        static bool transmitHook(RF24* radio, const uint8_t* data, uint8_t len, void* context);
+        static void interruptHook(RF24* radio, void* context);
+};
+
+Simulation::Simulation(int clients, SimTime duration, unsigned long seed, bool verbose)
+    : rng(seed), now(0), duration(duration), airBusySince(0), nextSeq(0), nextFrameId(1), verbose(verbose),
+      sendingNode(NULL), framesSent(0) {
+    this->server = new Node(0, true);
+    this->server->radio.begin();
+    this->server->radio.setPALevel(RF24_PA_MAX);
+    this->server->radio.setDataRate(RF24_250KBPS);
+    this->server->radio.setChannel(10);
+    //Without event-driven I/O the server keeps one session, which every client shares on pipe 1.
+    clientAddress[0] = 0;
+    this->server->radio.openWritingPipe(clientAddress);
+    for (int i = 0; i < (eventDriven ? CLIENT_PIPES : 1); ++i) {
+        this->server->radio.openReadingPipe(i + 1, serverAddresses[i]);
+    }
+    this->server->radio.startListening();
+    this->nodes.push_back(this->server);
+
+    //Path losses come from their own generator, so the rest of a run draws as it did before them.
+    std::mt19937_64 placement(seed * 0x9e3779b97f4a7c15ULL + 7);
+    for (int i = 1; i <= clients; ++i) {
+        Node* n = new Node(i, false);
+        n->pathLoss = model.pathLossLo + std::uniform_real_distribution<double>(0.0, 1.0)(placement) * (model.pathLossHi - model.pathLossLo);
+        n->radio.begin();
+        n->radio.setPALevel(RF24_PA_MAX);
+        n->radio.setDataRate(RF24_250KBPS);
+        n->radio.setChannel(10);
+        byte nodeId = eventDriven ? (byte)i : 0;
+        n->radio.setRetries(RETRY_DELAY + nodeId % RETRY_SPREAD, 15);
+        byte address[6];
+        memcpy(address, clientAddress, sizeof(address));
+        address[0] = nodeId;
+        n->radio.openWritingPipe(serverAddresses[eventDriven ? (i - 1) % CLIENT_PIPES : 0]);
+        n->radio.openReadingPipe(1, address);
+        n->radio.stopListening();
+        n->iot.setInitiator(true);
+        n->iot.setNodeId(nodeId);
+        n->iot.setWakeInterval(lowPower ? (batchDeadlineUs + SAMPLE_INTERVAL_US) / 1000 : 0);
+        n->state = handshakeState;
+        this->nodes.push_back(n);
+    }
+    for (size_t i = 0; i < this->nodes.size(); ++i) {
+        setUpNode(this->nodes[i]);
+    }
+
+    //The sketches seed random() from a floating pin in setup(); pin the sequence down instead.
+    randomSeed(seed * 2654435761UL + 1);
+    RF24::setHostTransmitHook(&Simulation::transmitHook, this);
+    simulatedTime = &this->now;
+    setHostClock(&simulatedMicros);
+
+    //Nodes power up at random points within the first second.
+    for (size_t i = 1; i < this->nodes.size(); ++i) {
+        this->nodes[i]->inHandshake = true;
+        this->nodes[i]->handshakeStart = (SimTime)(uniform() * 1000000.0);
+        this->nodes[i]->startedAt = this->nodes[i]->handshakeStart;
+        this->nodes[i]->lastSample = this->nodes[i]->handshakeStart;
+        for (int s = 0; s < SENSORS; ++s) {
+            this->nodes[i]->sensorLevel[s] = random(0, 1024);
+        }
+        schedule(this->nodes[i]->handshakeStart, CLIENT_LOOP, this->nodes[i]);
+        if (eventDriven) {
+            schedule(this->nodes[i]->handshakeStart + SAMPLE_INTERVAL_US, CLIENT_SAMPLE, this->nodes[i]);
+        }
+    }
+    if (gatewayDownUs > 0) {
+        schedule(gatewayDownAt, GATEWAY_DOWN, this->server);
+    }
+}
+
+//The IoTSec set-up both sketches do in setup() after their radio's.
+void Simulation::setUpNode(Node* n) {
+    n->iot.setDynamicFrames(model.dynamicPayloads);
+    n->iot.setWindow(n->isServer ? MAX_WINDOW : windowSize);
+    n->iot.setLinkAdaptation(!model.fixedRate);
+    if (eventDriven) {
+        n->iot.setEventDriven(true);
+    }
+    if (n->isServer && eventDriven) {
+        n->iot.setGateway(clientAddress);
+    }
+    if (eventDriven) {
+        n->radio.setHostInterrupt(&Simulation::interruptHook, n);
+    }
+}
+
+//The gateway loses power: its radio hears and ACKs nothing until it boots again.
+void Simulation::gatewayDown(Node* n) {
+    n->down = true;
+    n->radio.powerDown();
+    n->session = NULL;
+    schedule(this->now + gatewayDownUs, GATEWAY_UP, n);
+}
+
+//The gateway boots again, its sessions and everything its radio held gone.
+void Simulation::gatewayUp(Node* n) {
+    n->iot.~IoTSec();
+    new (&n->iot) IoTSec(&n->radio, &n->cipher, &n->hash256);
+    n->radio.flush_rx();
+    n->radio.flush_tx();
+    n->radio.powerUp();
+    n->radio.startListening();
+    n->lastFrameSeen = 0;
+    n->down = false;
+    setUpNode(n);
+    serverPoll(n);
+}
+
+Simulation::~Simulation() {
+    RF24::setHostTransmitHook(NULL, NULL);
+    setHostClock(NULL);
+    //Pending TX_END/ACK_END events point at packets still on air; those are freed here.
+    for (size_t i = 0; i < this->onAir.size(); ++i) {
+        delete this->onAir[i];
+    }
+    for (size_t i = 0; i < this->nodes.size(); ++i) {
+        delete this->nodes[i];
+    }
+}
+
+void Simulation::schedule(SimTime at, EventKind kind, Node* node, unsigned long long token, Transmission* tx) {
+    Event e = {at, this->nextSeq++, kind, node, token, tx};
+    this->events.push(e);
+}
+
+bool Simulation::transmitHook(RF24* radio, const uint8_t* data, uint8_t len, void* context) {
+    Simulation* sim = (Simulation*)context;
+    Node* n = sim->sendingNode;
+    bool inStep = n != NULL && &n->radio == radio;
+    if (!inStep && (n = sim->nodeOf(radio)) == NULL) {
+        return false;
+    }
+    //A node has at most one frame on air; the transmission itself is timed by the simulator.
+    sim->clientAwake(n);
+    memcpy(n->txData, data, len);
+    n->txLen = len;
+    n->pendingFrame = true;
+    if (inStep) {
+        sim->framesSent++;
+    }
+    else {
+        //A poll outside a sketch step (a write finishing, a window frame sent again) starts it now.
+        sim->schedule(sim->now, TX_START, n);
+    }
+    return true;
+}
+
+Node* Simulation::nodeOf(RF24* radio) {
+    for (size_t i = 0; i < this->nodes.size(); ++i) {
+        if (&this->nodes[i]->radio == radio) {
+            return this->nodes[i];
+        }
+    }
+    return NULL;
+}
+
+//The IRQ pin's interrupt: radioISR() in both sketches.
+void Simulation::interruptHook(RF24* radio, void* context) {
+    (void)radio;
+    ((Node*)context)->iot.radioInterrupt();
+}
+
+//radio.available() in the blocking sketches, iot.frameAvailable() in the event-driven ones; on the
+//server iot.nextSession(), kept for serverHandle().
+bool Simulation::frameWaiting(Node* n) {
+    if (!eventDriven) {
+        return n->radio.available();
+    }
+    if (!n->isServer) {
+        return n->iot.frameAvailable();
+    }
+    if (n->session == NULL) {
+        n->session = n->iot.nextSession();
+    }
+    return n->session != NULL;
+}
+
+Simulation::Cost Simulation::beginStep() {
+    Cost c = {hostCryptoOps, Serial.bytesWritten()};
+    return c;
+}
+
+/*
+ * Converts the crypto operations of the step that just ran into AVR CPU time, and
+ * puts what it logged on the node's Serial line. Records the ring and the 64 byte TX
+ * buffer have no room for are dropped, as on a board.
+ */
+SimTime Simulation::endStep(Node* node, const Cost& start) {
+    double us = (hostCryptoOps.aesSetKey - start.ops.aesSetKey) * model.aesSetKeyUs
+              + (hostCryptoOps.aesEncrypt - start.ops.aesEncrypt) * model.aesEncryptUs
+              + (hostCryptoOps.aesDecrypt - start.ops.aesDecrypt) * model.aesDecryptUs
+              + (hostCryptoOps.shaBlocks - start.ops.shaBlocks) * model.shaBlockUs;
+
+    IoTSecLog::drain();
+    double chars = Serial.bytesWritten() - start.chars;
+    if (chars > 0 && model.serialCharUs > 0) {
+        SimTime drainStart = std::max(this->now, node->serialFreeAt);
+        double queued = (drainStart - this->now) / model.serialCharUs;
+        double room = model.serialBufferChars + model.logBufferChars - queued;
+        if (chars > room) {
+            chars = room > 0 ? room : 0;
+        }
+        node->serialFreeAt = drainStart + (SimTime)(chars * model.serialCharUs);
+    }
+    return (SimTime)us;
+}
+
+void Simulation::run() {
+    while (!this->events.empty()) {
+        Event e = this->events.top();
+        if (e.time > this->duration) {
+            break;
+        }
+        this->events.pop();
+        this->now = e.time;
+
+        switch (e.kind) {
+            case CLIENT_LOOP:
+                clientLoop(e.node);
+                break;
+            case CLIENT_TIMEOUT:
+                if (e.node->waiting && e.node->waitToken == e.token) {
+                    clientTimeout(e.node);
+                }
+                break;
+            case CLIENT_SAMPLE:
+                clientSample(e.node);
+                break;
+            case CLIENT_WAKE:
+                clientWake(e.node);
+                break;
+            case CLIENT_POLL:
+                clientPoll(e.node);
+                break;
+            case CLIENT_REST:
+                e.node->resting = false;
+                clientWake(e.node);
+                break;
+            case GATEWAY_DOWN:
+                gatewayDown(e.node);
+                break;
+            case GATEWAY_UP:
+                gatewayUp(e.node);
+                break;
+            case SERVER_POLL:
+                serverPoll(e.node);
+                break;
+            case TX_START:
+                startTransmission(e.node);
+                break;
+            case TX_END:
+                endTransmission(e.tx);
+                break;
+            case ACK_END:
+                endAck(e.tx);
+                break;
+            case WRITE_DONE:
+                writeDone(e.node, e.token != 0);
+                break;
+            case STEP_DONE:
+                if (e.node->isServer) {
+                    e.node->busy = false;
+                    serverPoll(e.node);
+                }
+                else {
+                    clientLoop(e.node);
+                }
+                break;
+        }
+    }
+    for (size_t i = 1; i < this->nodes.size(); ++i) {
+        Node* n = this->nodes[i];
+        SimTime end = std::max(this->duration, n->startedAt);
+        double asleepUs = n->asleepUs + (n->asleep ? end - n->asleepSince : 0);
+        this->stats.clientAsleepUs += asleepUs;
+        this->stats.clientAwakeUs += end - n->startedAt - asleepUs;
+    }
+}
+
+// CLIENT ###########################################################################################################
+
+void Simulation::clientLoop(Node* n) {
+    Cost cost = beginStep();
+    this->sendingNode = n;
+    this->framesSent = 0;
+    if (!eventDriven) {
+        sampleSensor(n);
+    }
+    if (eventDriven && n->state == 3 && n->iot.frameAvailable()) {
+        serverNotice(n);
+    }
+    bool sent = clientSend(n);
+    int queued = this->framesSent;
+    this->sendingNode = NULL;
+    SimTime cpu = endStep(n, cost);
+
+    if (!sent) {
+        this->stats.clientBusyUs += cpu;
+        if (queued > 0) {
+            //A window frame: it goes on air, and the link thread goes straight back to waiting.
+            schedule(this->now + cpu, TX_START, n);
+        }
+        if (eventDriven && n->state == 3) {
+            //The link thread waits in PT_WAIT_UNTIL; samples, the deadline and the window's ACKs wake it.
+            n->idle = true;
+            if (cpu == 0) {
+                clientWake(n);
+            }
+            else {
+                schedule(this->now + cpu, CLIENT_WAKE, n);
+            }
+            return;
+        }
+        //The key-expired branch falls straight through to the next loop(); state 3 sleeps until a reading is due.
+        schedule(clientSleep(n, this->now + cpu), STEP_DONE, n);
+        return;
+    }
+    if (n->exchange == 3) {
+        this->stats.dataFrames++;
+    }
+    else if (n->exchange != 5) {
+        this->stats.handshakeFrames++;
+    }
+    if (eventDriven) {
+        //The send only queued the frame; the link thread's retransmission timeout starts now.
+        this->stats.clientBusyUs += cpu;
+        n->waiting = true;
+        n->waitToken++;
+        n->retries = 0;
+        schedule(this->now + cpu + n->iot.getResponseTimeout(), CLIENT_TIMEOUT, n, n->waitToken);
+    }
+    else {
+        n->busySince = this->now;
+    }
+    if (queued > 0) {
+        schedule(this->now + cpu, TX_START, n);
+    }
+}
+
+//Event-driven client.ino: loop() calls sampleSensor() whatever the link thread is waiting on.
+void Simulation::clientSample(Node* n) {
+    if (n->asleep) {
+        this->stats.readingWakes++;
+    }
+    sampleSensor(n);
+    schedule(this->now + SAMPLE_INTERVAL_US, CLIENT_SAMPLE, n);
+    clientWake(n);
+}
+
+//Resumes an idle event-driven link thread once it has work, or sets a wake-up for the batch deadline.
+void Simulation::clientWake(Node* n) {
+    if (!n->idle) {
+        return;
+    }
+    if (linkReady(n)) {
+        n->idle = false;
+        clientLoop(n);
+        return;
+    }
+    clientRest(n);
+    SimTime oldest = n->queueTime[(n->queueHead + n->sentCount) % QUEUE_LIMIT];
+    if (n->queueCount > n->sentCount && oldest + batchDeadlineUs > this->now) {
+        schedule(oldest + batchDeadlineUs, CLIENT_WAKE, n);
+    }
+}
+
+//client.ino rest(): with --low-power an idle link thread lets the radio power down and the MCU sleep
+//between readings. IoTSec holds off until WAKE_WINDOW after the last frame, so it is tried again then.
+void Simulation::clientRest(Node* n) {
+    if (!lowPower || n->asleep || n->waiting) {
+        return;
+    }
+    if (n->iot.sleepRadio()) {
+        n->asleep = true;
+        n->asleepSince = this->now;
+    }
+    else if (!n->resting && !n->polling) {
+        n->resting = true;
+        schedule(this->now + WAKE_WINDOW * 1000ULL, CLIENT_REST, n);
+    }
+}
+
+//IoTSec powers the radio up for a send, and the MCU stays up until the client rests again.
+void Simulation::clientAwake(Node* n) {
+    if (!n->asleep) {
+        return;
+    }
+    n->asleep = false;
+    n->asleepUs += this->now - n->asleepSince;
+    this->stats.radioWakes++;
+}
+
+//loop() keeps polling while window frames are unacknowledged; IoTSec sends them again from the poll.
+void Simulation::clientPoll(Node* n) {
+    n->polling = false;
+    n->iot.poll();
+    confirmWindow(n);
+    if (n->iot.windowInFlight() > 0) {
+        n->polling = true;
+        schedule(this->now + POLL_INTERVAL_US, CLIENT_POLL, n);
+    }
+    clientWake(n);
+}
+
+//Readings are confirmed once the window has moved past the frame that carried them, and leave the queue.
+void Simulation::confirmWindow(Node* n) {
+    while (!n->inFlight.empty() && n->inFlight.front().number < n->iot.getWindowBase()) {
+        const std::vector<SimTime>& sampled = n->inFlight.front().sampled;
+        for (size_t i = 0; i < sampled.size(); ++i) {
+            this->stats.readingLatencyMs.push_back((this->now - sampled[i]) / 1000.0);
+        }
+        this->stats.readingsConfirmed += sampled.size();
+        dropBefore(n, n->inFlight.front().end);
+        n->inFlight.pop_front();
+    }
+}
+
+//client.ino dropBefore(): the queued readings before sequence number end go.
+void Simulation::dropBefore(Node* n, unsigned int end) {
+    while (n->queueCount > 0 && (int16_t)(n->queueSequence[n->queueHead] - end) < 0) {
+        dropOldest(n);
+    }
+}
+
+//client.ino dropOldest().
+void Simulation::dropOldest(Node* n) {
+    if (n->sentCount > 0) {
+        n->sentCount--;
+    }
+    n->queueHead = (n->queueHead + 1) % QUEUE_LIMIT;
+    n->queueCount--;
+}
+
+//client.ino sampleSensor(): one reading per SAMPLE_INTERVAL into the bounded queue, its RAM and
+//EEPROM spill as one, each sensor drifting from its last reading.
+void Simulation::sampleSensor(Node* n) {
+    if (this->now - n->lastSample < SAMPLE_INTERVAL_US) {
+        return;
+    }
+    n->lastSample = this->now;
+    int sensorNumber = random(0, SENSORS);
+    int reading = std::max(0, std::min(n->sensorLevel[sensorNumber] + (int)(this->rng() % 17) - 8, 1023));
+    n->sensorLevel[sensorNumber] = reading;
+
+    if (n->queueCount == QUEUE_LIMIT) {
+        dropOldest(n);
+        this->stats.readingsLost++;
+    }
+    int tail = (n->queueHead + n->queueCount) % QUEUE_LIMIT;
+    n->readingQueue[tail][0] = (byte)((sensorNumber << 4) | ((reading >> 8) & 0x0f));
+    n->readingQueue[tail][1] = (byte)reading;
+    n->queueSequence[tail] = (unsigned int)(n->nextSequence++ & 0xffff);
+    n->queueTime[tail] = this->now;
+    n->queueCount++;
+}
+
+//client.ino batchReady().
+bool Simulation::batchReady(Node* n) {
+    int unsent = n->queueCount - n->sentCount;
+    if (unsent >= batchSize || (n->earlyData && unsent > 0)) {
+        return true;
+    }
+    return unsent > 0 && this->now - n->queueTime[(n->queueHead + n->sentCount) % QUEUE_LIMIT] >= batchDeadlineUs;
+}
+
+//client.ino canSend().
+bool Simulation::canSend(Node* n) {
+    return batchReady(n) && (windowSize == 0 || n->iot.windowOpen());
+}
+
+//client.ino renewDue().
+bool Simulation::renewDue(Node* n) {
+    return n->iot.rekeyDue() && n->iot.windowInFlight() == 0;
+}
+
+//client.ino linkDue().
+bool Simulation::linkDue(Node* n) {
+    byte rate;
+    byte paLevel;
+    return n->state == 3 && !n->iot.keyExpired() && !n->iot.windowFailed() && !renewDue(n) && n->iot.windowInFlight() == 0
+        && n->iot.linkProposal(&rate, &paLevel);
+}
+
+//What the link thread's PT_WAIT_UNTIL waits for.
+bool Simulation::linkReady(Node* n) {
+    return n->state != 3 || n->iot.keyExpired() || renewDue(n) || n->iot.windowFailed() || frameWaiting(n) || linkDue(n)
+        || canSend(n);
+}
+
+//client.ino serverNotice(): the server giving up on the session keys restarts the handshake.
+void Simulation::serverNotice(Node* n) {
+    IoTSec& iot = n->iot;
+    byte len;
+    byte* payload = readMessage(iot, n->frame, MSG_RESTART, &len);
+    this->stats.clientFrames++;
+
+    if (iot.getIntegrityPassed() && n->frame[0] == MSG_RESTART) {
+        LOG_DEBUG(LOG_RECEIVED_MESSAGE, n->frame[0], LogBytes(payload, len));
+        LOG_INFO(LOG_DP_END);
+        n->state = handshakeState;
+        iot.setHandshakeComplete(false);
+        n->inFlight.clear();
+        this->stats.failureRekeys++;
+        n->inHandshake = true;
+        n->handshakeStart = this->now;
+    }
+}
+
+//The delay at the end of client.ino loop(): in state 3, sleep until the next reading is due.
+SimTime Simulation::clientSleep(Node* n, SimTime at) {
+    if (n->state == 3 && !batchReady(n) && at - n->lastSample < SAMPLE_INTERVAL_US) {
+        return n->lastSample + SAMPLE_INTERVAL_US;
+    }
+    return at;
+}
+
+/*
+ * The first half of client.ino loop(): everything up to and including iot.send().
+ * Returns false if this iteration sends nothing.
+ */
+bool Simulation::clientSend(Node* n) {
+    IoTSec& iot = n->iot;
+    confirmWindow(n);
+    n->exchange = (n->state != 3 && !iot.keyExpired() && windowSize == 0 && batchReady(n)) ? 3 : n->state;
+    if (n->exchange == 3 && linkDue(n)) {
+        n->exchange = 5;
+    }
+
+    if (n->exchange == 0) {
+        LOG_INFO(LOG_HP_BEGIN);
+        LOG_INFO(LOG_H_INIT);
+        LOG_INFO(LOG_MA_INIT);
+
+        ChallengeMsg challenge;
+        n->myRandNum = iot.createRandom();
+        challenge.number = n->myRandNum;
+        sendMessage(iot, n->frame, encodeChallenge(challenge, iot.beginFrame(n->frame, MSG_CHALLENGE)));
+        return true;
+    }
+    else if (n->exchange == 4) {
+        LOG_INFO(LOG_HP_BEGIN);
+        LOG_INFO(LOG_H_INIT);
+        HelloMsg hello;
+        n->myRandNum = iot.createRandom();
+        iot.createNonce(n->nonce1);
+        hello.number = n->myRandNum;
+        memmove(hello.nonce, n->nonce1, NONCE_LEN);
+        hello.wake = (iot.getWakeInterval() + 999) / 1000;
+        sendMessage(iot, n->frame, encodeHello(hello, iot.beginFrame(n->frame, MSG_HELLO)));
+        return true;
+    }
+    else if (n->exchange == 1) {
+        ResponseMsg response;
+        response.number = n->tempVariable - 1;
+        sendMessage(iot, n->frame, encodeResponse(response, iot.beginFrame(n->frame, MSG_RESPONSE)));
+        return true;
+    }
+    else if (n->exchange == 2) {
+        LOG_INFO(LOG_KEYS_GEN_INIT);
+        NonceMsg nonce;
+        iot.createNonce(n->nonce1);
+        memmove(nonce.nonce, n->nonce1, NONCE_LEN);
+        nonce.wake = (iot.getWakeInterval() + 999) / 1000;
+        sendMessage(iot, n->frame, encodeNonce(nonce, iot.beginFrame(n->frame, MSG_NONCE)));
+        return true;
+    }
+    else if (n->exchange == 5) {
+        LinkMsg link;
+        link.number = ++n->linkNumber;
+        iot.linkProposal(&link.rate, &link.paLevel);
+        sendMessage(iot, n->frame, encodeLink(link, iot.beginFrame(n->frame, MSG_LINK)));
+        return true;
+    }
+    else if (iot.keyExpired()) {
+        LOG_INFO(LOG_K_EXPIRED);
+        LOG_INFO(LOG_DP_END);
+        n->state = handshakeState;
+        iot.setHandshakeComplete(false);
+        n->inFlight.clear();
+        this->stats.expiryRekeys++;
+        n->inHandshake = true;
+        n->handshakeStart = this->now;
+        if (!eventDriven) {
+            n->radio.stopListening();
+        }
+        return false;
+    }
+    else if (iot.windowFailed()) {
+        LOG_WARN(LOG_ACK_FAIL);
+        LOG_INFO(LOG_DP_END);
+        n->state = handshakeState;
+        iot.setHandshakeComplete(false);
+        n->inFlight.clear();
+        this->stats.failureRekeys++;
+        n->inHandshake = true;
+        n->handshakeStart = this->now;
+        return false;
+    }
+    else if (n->state == 3 && renewDue(n)) {
+        LOG_INFO(LOG_K_RENEW);
+        n->state = handshakeState;
+        this->stats.renewals++;
+        n->inHandshake = true;
+        n->handshakeStart = this->now;
+        return false;
+    }
+    else if (canSend(n)) {
+        byte* batch = iot.beginFrame(n->frame, MSG_BATCH);
+        //client.ino fillBatch(): as many of the oldest not in a window frame as fit and follow on, in millis().
+        n->batchEnd = n->queueSequence[(n->queueHead + n->sentCount) % QUEUE_LIMIT];
+        SensorEncoder encoder(batch, windowSize > 0 ? MAX_WINDOW_PAYLOAD : MAX_FRAME_PAYLOAD, this->now / 1000, n->batchEnd);
+        for (int i = n->sentCount; i < n->queueCount && i - n->sentCount < batchSize; ++i) {
+            int at = (n->queueHead + i) % QUEUE_LIMIT;
+            byte* reading = n->readingQueue[at];
+            if (n->queueSequence[at] != n->batchEnd
+                || !encoder.add(reading[0] >> 4, ((reading[0] & 0x0f) << 8) | reading[1], n->queueTime[at] / 1000)) {
+                break;
+            }
+            n->batchEnd = (n->batchEnd + 1) & 0xffff;
+        }
+        n->batchCount = encoder.getCount();
+        byte batchLen = encoder.getLength();
+
+        n->earlyData = false;
+        LOG_INFO(LOG_P_SENT);
+        LOG_DEBUG(LOG_SENT_READINGS, n->batchCount);
+        if (windowSize > 0) {
+            WindowBatch sent;
+            sent.number = iot.getWindowBase() + iot.windowInFlight();
+            sent.end = n->batchEnd;
+            for (int i = 0; i < n->batchCount; ++i) {
+                sent.sampled.push_back(n->queueTime[(n->queueHead + n->sentCount + i) % QUEUE_LIMIT]);
+            }
+            if (iot.sendWindowed(batch, batchLen, iot.getMasterKey())) {
+                //The readings stay queued until the window confirms them, and go again under new keys if it fails.
+                n->inFlight.push_back(sent);
+                n->sentCount += n->batchCount;
+                this->stats.dataFrames++;
+                if (!n->polling) {
+                    n->polling = true;
+                    schedule(this->now + POLL_INTERVAL_US, CLIENT_POLL, n);
+                }
+            }
+            return false;
+        }
+        iot.sendSealedInPlace(n->frame, batchLen, iot.getMasterKey());
+        return true;
+    }
+    return false;
+}
+
+/*
+ * The link thread's wait for a reply ran out: send the request again, or after MAX_RETRIES give up
+ * on the exchange. The blocking sketches never retried.
+ */
+void Simulation::clientTimeout(Node* n) {
+    if (!eventDriven || n->retries == MAX_RETRIES) {
+        n->waiting = false;
+        clientFinish(n, true);
+        return;
+    }
+    Cost cost = beginStep();
+    this->sendingNode = n;
+    this->framesSent = 0;
+    n->retries++;
+    LOG_WARN(LOG_RETRY);
+    n->iot.retransmit();
+    int queued = this->framesSent;
+    this->sendingNode = NULL;
+    SimTime cpu = endStep(n, cost);
+
+    this->stats.retransmissions++;
+    this->stats.clientBusyUs += cpu;
+    n->waitToken++;
+    schedule(this->now + cpu + n->iot.getResponseTimeout(), CLIENT_TIMEOUT, n, n->waitToken);
+    if (queued > 0) {
+        schedule(this->now + cpu, TX_START, n);
+    }
+}
+
+/*
+ * The second half of client.ino loop(): the blocking receive returned (or timed out),
+ * check the response and pick the next state.
+ */
+void Simulation::clientFinish(Node* n, bool timedOut) {
+    //On AVR a NULL key reads the register file; on the host it would fault, so use zeros.
+    static byte expiredKey[KEY_DATA_LEN];
+
+    Cost cost = beginStep();
+    IoTSec& iot = n->iot;
+    int previous = n->state;
+    bool expiredOnSend = false;
+    bool keysMade = false;
+    bool dataFailed = false;
+
+    if (timedOut) {
+        //receiveHelper hands back zeroed bytes; decrypting them fails the HMAC, as on hardware.
+        //Event-driven receives find nothing queued; blocking ones spin until the timeout, which backs off.
+        if (eventDriven) {
+            LOG_WARN(LOG_TIMED_OUT);
+        }
+        else {
+            spinStep = MAX_RTO;
+        }
+        this->stats.clientTimeouts++;
+    }
+    else {
+        this->stats.clientFrames++;
+    }
+
+    //client.ino handleResponse(): the reply's type must belong to the exchange, and its handler accept it.
+    byte type = timedOut ? MSG_NONE : (byte)iot.peekState();
+    byte len;
+    byte* payload;
+    if (n->exchange == 3 && iot.keyExpired() && messageRoute(type) == ROUTE_SEALED) {
+        //The send that reaches MAX_MESSAGE_COUNT frees the keys this receive verifies with.
+        expiredOnSend = true;
+        payload = iot.receiveSealedInPlace(n->frame, &len, expiredKey, false);
+    }
+    else {
+        expiredOnSend = n->exchange == 3 && iot.keyExpired();
+        payload = readMessage(iot, n->frame, type, &len);
+    }
+    bool valid = iot.getIntegrityPassed() && messageState(type) == n->exchange;
+    if (valid) {
+        LOG_DEBUG(LOG_RECEIVED_MESSAGE, type, LogBytes(payload, len));
+    }
+
+    if (n->exchange == 0) {
+        ChallengeReplyMsg reply;
+        if (valid && type == MSG_CHALLENGE_REPLY && decodeChallengeReply(payload, len, &reply)
+            && (int)reply.number == n->myRandNum - 1) {
+            LOG_INFO(LOG_S_AUTH_SUCCESS);
+            n->tempVariable = reply.challenge;
+            n->state = 1;
+        }
+        else {
+            LOG_WARN(LOG_S_AUTH_FAIL);
+            LOG_WARN(LOG_MA_FAIL);
+            LOG_INFO(LOG_HP_END);
+            abandonHandshake(n);
+        }
+    }
+    else if (n->exchange == 4) {
+        HelloMsg reply;
+        if (valid && decodeHello(payload, len, &reply) && (int)reply.number == n->myRandNum - 1) {
+            LOG_INFO(LOG_S_AUTH_SUCCESS);
+            iot.generateKeys(n->nonce1, reply.nonce);
+            LOG_DEBUG(LOG_MASTER_KEY, LogBytes(iot.getMasterKey(), KEY_DATA_LEN));
+            LOG_DEBUG(LOG_HASH_KEY, LogBytes(iot.getHashKey(), KEY_DATA_LEN));
+            iot.setHandshakeComplete(true);
+            n->state = 3;
+            n->earlyData = true;
+            keysMade = true;
+            LOG_INFO(LOG_KEYS_GEN_SUCCESS);
+            LOG_INFO(LOG_H_SUCCESS);
+            LOG_INFO(LOG_HP_END);
+            LOG_INFO(LOG_DP_BEGIN);
+        }
+        else {
+            LOG_WARN(LOG_S_AUTH_FAIL);
+            LOG_WARN(LOG_H_FAIL);
+            LOG_INFO(LOG_HP_END);
+            abandonHandshake(n);
+        }
+    }
+    else if (n->exchange == 1) {
+        AuthOkMsg ok;
+        if (valid && type == MSG_AUTH_OK && decodeAuthOk(payload, len, &ok)) {
+            LOG_INFO(LOG_MA_SUCCESS);
+            n->state = 2;
+        }
+        else {
+            LOG_WARN(LOG_MA_FAIL);
+            LOG_INFO(LOG_HP_END);
+            abandonHandshake(n);
+        }
+    }
+    else if (n->exchange == 2) {
+        NonceMsg nonce2;
+        if (valid && decodeNonce(payload, len, &nonce2)) {
+            iot.generateKeys(n->nonce1, nonce2.nonce);
+            LOG_DEBUG(LOG_MASTER_KEY, LogBytes(iot.getMasterKey(), KEY_DATA_LEN));
+            LOG_DEBUG(LOG_HASH_KEY, LogBytes(iot.getHashKey(), KEY_DATA_LEN));
+            iot.setHandshakeComplete(true);
+            n->state = 3;
+            keysMade = true;
+            LOG_INFO(LOG_KEYS_GEN_SUCCESS);
+            LOG_INFO(LOG_H_SUCCESS);
+            LOG_INFO(LOG_HP_END);
+            LOG_INFO(LOG_DP_BEGIN);
+        }
+        else {
+            LOG_WARN(LOG_H_FAIL);
+            LOG_INFO(LOG_HP_END);
+            abandonHandshake(n);
+        }
+    }
+    else if (n->exchange == 5) {
+        LinkMsg link;
+        if (valid && decodeLink(payload, len, &link) && link.number == n->linkNumber - 1) {
+            iot.setLinkMode(link.rate, link.paLevel);
+            LOG_INFO(LOG_LINK_MODE, link.rate, link.paLevel);
+        }
+        else {
+            iot.setLinkMode(iot.getLinkRate(), iot.getLinkPaLevel());
+        }
+    }
+    else {
+        AckMsg ack;
+        if (valid && type == MSG_ACK && decodeAck(payload, len, &ack) && ack.count == n->batchCount) {
+            LOG_INFO(LOG_P_RECEIVED);
+            LOG_DEBUG(LOG_RECEIVED_ACK, ack.count);
+            for (int i = 0; i < n->batchCount; ++i) {
+                this->stats.readingLatencyMs.push_back((this->now - n->queueTime[(n->queueHead + i) % QUEUE_LIMIT]) / 1000.0);
+            }
+            dropBefore(n, n->batchEnd);
+            this->stats.readingsConfirmed += n->batchCount;
+        }
+        else {
+            LOG_WARN(timedOut ? LOG_TIMEOUT : LOG_INT_FAIL);
+            LOG_INFO(LOG_DP_END);
+            n->state = handshakeState;
+            iot.setHandshakeComplete(false);
+            dataFailed = true;
+        }
+    }
+
+    spinStep = 0;
+    spinOffset = 0;
+
+    if (!timedOut && !iot.getIntegrityPassed()) {
+        this->stats.clientIntegrityFailures++;
+    }
+
+    //Handshake bookkeeping. New keys start a new window, and client.ino resendUnconfirmed() sends again what the last one carried.
+    if (keysMade || dataFailed) {
+        n->inFlight.clear();
+    }
+    if (keysMade) {
+        n->sentCount = 0;
+        this->stats.handshakesCompleted++;
+        this->stats.handshakeMs.push_back((this->now - n->handshakeStart) / 1000.0);
+        n->inHandshake = false;
+    }
+    else if (dataFailed) {
+        if (expiredOnSend) {
+            this->stats.expiryRekeys++;
+        }
+        else {
+            this->stats.failureRekeys++;
+        }
+        n->inHandshake = true;
+        n->handshakeStart = this->now;
+    }
+
+    SimTime cpu = endStep(n, cost);
+    if (this->verbose) {
+        printf("%12llu client %d state %d -> %d%s%s\n", this->now, n->id, previous, n->state,
+               n->exchange == 5 ? " (link)" : (n->exchange != previous ? " (batch)" : ""), timedOut ? " (timeout)" : "");
+        if (n->exchange == 5) {
+            printf("%12llu client %d rate %u PA %u\n", this->now, n->id, n->iot.getLinkRate(), n->iot.getLinkPaLevel());
+        }
+    }
+    if (eventDriven) {
+        this->stats.clientBusyUs += cpu;
+        schedule(this->now + cpu, CLIENT_LOOP, n);
+        return;
+    }
+    n->radio.stopListening();
+    this->stats.clientBusyUs += this->now + cpu - n->busySince;
+    schedule(clientSleep(n, this->now + cpu), CLIENT_LOOP, n);
+}
+
+//client.ino's abandonHandshake(): a renewal that fails leaves the working keys carrying data.
+void Simulation::abandonHandshake(Node* n) {
+    n->state = n->iot.keyExpired() ? handshakeState : 3;
+    if (n->state == 3) {
+        n->inHandshake = false;
+    }
+}
+
+// SERVER ###########################################################################################################
+
+void Simulation::serverPoll(Node* n) {
+    if (n->down || n->busy || n->transmitting || !frameWaiting(n)) {
+        return;
+    }
+    Cost cost = beginStep();
+    this->sendingNode = n;
+    this->framesSent = 0;
+    serverHandle(n);
+    bool sent = this->framesSent > 0;
+    this->sendingNode = NULL;
+    SimTime cpu = endStep(n, cost);
+
+    n->busy = true;
+    if (sent) {
+        schedule(this->now + cpu, TX_START, n);
+    }
+    else {
+        schedule(this->now + cpu, STEP_DONE, n);
+    }
+}
+
+//server.ino printReadings(): unpacks and logs the readings of a batch the session has not had
+//before, returning how many it held and setting fresh to how many were new.
+static byte printReadings(IoTSec& iot, byte* payload, byte len, byte* fresh) {
+    SensorDecoder decoder(payload, len);
+    byte sensor;
+    unsigned int value;
+    unsigned long age;
+    byte count = 0;
+    *fresh = 0;
+    while (decoder.next(&sensor, &value, &age)) {
+        count++;
+        if (!iot.freshSequence(decoder.getSequence())) {
+            LOG_DEBUG(LOG_READING_REPEATED, decoder.getSequence());
+            continue;
+        }
+        (*fresh)++;
+#if SENSOR_TIMESTAMPS
+        LOG_INFO(LOG_READING_AGE, sensor, value, age);
+#else
+        LOG_INFO(LOG_READING, (int)sensor, (int)value);
+#endif
+    }
+    return count;
+}
+
+//server.ino sendRestart().
+static void sendRestart(IoTSec& iot, byte frame[], byte reason) {
+    RestartMsg restart;
+    restart.reason = reason;
+    sendMessage(iot, frame, encodeRestart(restart, iot.beginFrame(frame, MSG_RESTART)));
+}
+
+/*
+ * One pass through server.ino loop() with a frame available: handleFrame() on the session
+ * iot.nextSession() returned, then the serverHandlers entry for the frame's type. Returns true
+ * if it answered.
+ */
+bool Simulation::serverHandle(Node* n) {
+    IoTSec& iot = eventDriven ? *n->session : n->iot;
+    n->session = NULL;
+    byte* frame = n->frame;
+
+    byte type = (byte)iot.peekState();
+    if (type >= MSG_TYPE_LIMIT || (iot.keyExpired() && messageRoute(type) != ROUTE_SECRET)) {
+        type = MSG_NONE;
+    }
+    byte len;
+    byte* payload = readMessage(iot, frame, type, &len);
+    n->state = messageState(type);
+    this->stats.serverFrames++;
+
+    if (!iot.getIntegrityPassed()) {
+        this->stats.serverIntegrityFailures++;
+        LOG_WARN(LOG_INT_FAIL);
+        sendRestart(iot, frame, RESTART_INT_FAIL);
+        LOG_INFO(LOG_HDP_END);
+        iot.setHandshakeComplete(false);
+        return true;
+    }
+    LOG_DEBUG(LOG_RECEIVED_MESSAGE, type, LogBytes(payload, len));
+
+    if (type == MSG_CHALLENGE) {
+        LOG_INFO(LOG_HP_BEGIN);
+        LOG_INFO(LOG_H_INIT);
+        LOG_INFO(LOG_MA_INIT);
+        ChallengeMsg challenge;
+        if (!decodeChallenge(payload, len, &challenge)) {
+            LOG_WARN(LOG_H_FAIL);
+            LOG_INFO(LOG_HP_END);
+            return false;
+        }
+        ChallengeReplyMsg reply;
+        reply.number = challenge.number - 1;
+        iot.setChallenge(iot.createRandom());
+        reply.challenge = iot.getChallenge();
+        sendMessage(iot, frame, encodeChallengeReply(reply, iot.beginFrame(frame, MSG_CHALLENGE_REPLY)));
+        return true;
+    }
+    else if (type == MSG_RESPONSE) {
+        ResponseMsg response;
+        if (decodeResponse(payload, len, &response) && (int)response.number == iot.getChallenge() - 1) {
+            LOG_INFO(LOG_C_AUTH_SUCCESS);
+            LOG_INFO(LOG_MA_SUCCESS);
+            AuthOkMsg ok;
+            sendMessage(iot, frame, encodeAuthOk(ok, iot.beginFrame(frame, MSG_AUTH_OK)));
+        }
+        else {
+            LOG_WARN(LOG_C_AUTH_FAIL);
+            LOG_WARN(LOG_MA_FAIL);
+            sendRestart(iot, frame, RESTART_AUTH_FAIL);
+            LOG_INFO(LOG_HP_END);
+        }
+        return true;
+    }
+    else if (type == MSG_NONCE) {
+        LOG_INFO(LOG_KEYS_GEN_INIT);
+        NonceMsg nonce1;
+        if (!decodeNonce(payload, len, &nonce1)) {
+            LOG_WARN(LOG_H_FAIL);
+            LOG_INFO(LOG_HP_END);
+            return false;
+        }
+        iot.setWakeInterval(nonce1.wake * 1000UL);
+        NonceMsg nonce2;
+        iot.createNonce(nonce2.nonce);
+        nonce2.wake = 0;
+        sendMessage(iot, frame, encodeNonce(nonce2, iot.beginFrame(frame, MSG_NONCE)));
+        iot.generateKeys(nonce1.nonce, nonce2.nonce);
+        LOG_DEBUG(LOG_MASTER_KEY, LogBytes(iot.getMasterKey(), KEY_DATA_LEN));
+        LOG_DEBUG(LOG_HASH_KEY, LogBytes(iot.getHashKey(), KEY_DATA_LEN));
+        iot.setHandshakeComplete(true);
+        LOG_INFO(LOG_KEYS_GEN_SUCCESS);
+        LOG_INFO(LOG_H_SUCCESS);
+        LOG_INFO(LOG_HP_END);
+        LOG_INFO(LOG_DP_BEGIN);
+        return true;
+    }
+    else if (type == MSG_HELLO) {
+        LOG_INFO(LOG_HP_BEGIN);
+        LOG_INFO(LOG_H_INIT);
+        HelloMsg hello;
+        if (!decodeHello(payload, len, &hello)) {
+            LOG_WARN(LOG_H_FAIL);
+            LOG_INFO(LOG_HP_END);
+            return false;
+        }
+        iot.setWakeInterval(hello.wake * 1000UL);
+        HelloMsg reply;
+        reply.number = hello.number - 1;
+        iot.createNonce(reply.nonce);
+        reply.wake = 0;
+        sendMessage(iot, frame, encodeHello(reply, iot.beginFrame(frame, MSG_HELLO)));
+        iot.generateKeys(hello.nonce, reply.nonce);
+        LOG_DEBUG(LOG_MASTER_KEY, LogBytes(iot.getMasterKey(), KEY_DATA_LEN));
+        LOG_DEBUG(LOG_HASH_KEY, LogBytes(iot.getHashKey(), KEY_DATA_LEN));
+        iot.setHandshakeComplete(true);
+        LOG_INFO(LOG_KEYS_GEN_SUCCESS);
+        LOG_INFO(LOG_H_SUCCESS);
+        LOG_INFO(LOG_HP_END);
+        LOG_INFO(LOG_DP_BEGIN);
+        return true;
+    }
+    else if (type == MSG_BATCH) {
+        LOG_INFO(LOG_P_RECEIVED);
+        AckMsg ack;
+        byte fresh;
+        ack.count = printReadings(iot, payload, len, &fresh);
+        LOG_INFO(LOG_P_SENT);
+        LOG_DEBUG(LOG_SENT_ACK, (int)ack.count);
+        iot.sendSealedInPlace(frame, encodeAck(ack, iot.beginFrame(frame, MSG_ACK)), iot.getMasterKey());
+        this->stats.readingsAccepted += fresh;
+        this->stats.readingsRepeated += ack.count - fresh;
+        return true;
+    }
+    else if (type == MSG_LINK) {
+        LinkMsg link;
+        if (!decodeLink(payload, len, &link) || !iot.agreeLink(link.number, &link.rate, &link.paLevel)) {
+            return false;
+        }
+        LOG_INFO(LOG_LINK_MODE, link.rate, link.paLevel);
+        link.number--;
+        sendMessage(iot, frame, encodeLink(link, iot.beginFrame(frame, MSG_LINK)));
+        return true;
+    }
+    else if (type == MSG_WINDOW_BATCH) {
+        //Already ACKed on the radio's ACK; a batch sent again after its ACK was lost carries nothing new.
+        if (len > 0) {
+            LOG_INFO(LOG_P_RECEIVED);
+            byte fresh;
+            byte count = printReadings(iot, payload, len, &fresh);
+            this->stats.readingsAccepted += fresh;
+            this->stats.readingsRepeated += count - fresh;
+        }
+        return false;
+    }
+    else if (iot.keyExpired()) {
+        LOG_INFO(LOG_EXPIRED);
+        sendRestart(iot, frame, RESTART_EXPIRED);
+        LOG_INFO(LOG_DP_END);
+        iot.setHandshakeComplete(false);
+        return true;
+    }
+    return false;
+}
+
+// CHANNEL ##########################################################################################################
+
+//Tracks how long at least one packet is on air. Call before adding and after removing a packet.
+void Simulation::accountAir(bool busy, SimTime at) {
+    if (busy && this->onAir.empty()) {
+        this->airBusySince = at;
+    }
+    else if (!busy && this->onAir.empty() && at > this->airBusySince) {
+        this->stats.airBusyUs += std::min(at, this->duration) - std::min(this->airBusySince, this->duration);
+        this->airBusySince = at;
+    }
+}
+
+//Adds a client's packet or ACK to its TX energy.
+void Simulation::chargeTx(Node* n, int payload, rf24_datarate_e rate) {
+    if (!n->isServer) {
+        this->stats.clientTxUj += model.txEnergyUj(payload, n->radio.getPALevel(), rate);
+    }
+}
+
+//The path loss between a client and the server, either way.
+double Simulation::pathLoss(Node* from, Node* to) {
+    return from->isServer ? to->pathLoss : from->pathLoss;
+}
+
+void Simulation::startTransmission(Node* n) {
+    if (!n->transmitting) {
+        n->transmitting = true;
+        n->txAttempts = 0;
+        n->txFrameId = this->nextFrameId++;
+        n->pendingFrame = false;
+    }
+    n->txAttempts++;
+    this->stats.airAttempts++;
+
+    Transmission* tx = new Transmission();
+    tx->from = n;
+    tx->rate = n->radio.getDataRate();
+    tx->paLevel = n->radio.getPALevel();
+    tx->start = this->now + model.settleUs;
+    tx->end = tx->start + model.airtime(n->txLen, tx->rate);
+    tx->corrupted = false;
+    tx->faded = false;
+    tx->isAck = false;
+    tx->frameId = n->txFrameId;
+    memcpy(tx->data, n->txData, n->txLen);
+    tx->len = n->txLen;
+
+    //Settling time is dead air for the sender; collisions are judged over the packet itself.
+    accountAir(true, tx->start);
+    for (size_t i = 0; i < this->onAir.size(); ++i) {
+        if (this->onAir[i]->end > tx->start) {
+            this->onAir[i]->corrupted = true;
+            tx->corrupted = true;
+        }
+    }
+    if (tx->corrupted) {
+        this->stats.collisions++;
+    }
+    chargeTx(n, n->txLen, tx->rate);
+    if (!n->isServer) {
+        this->stats.clientKbps += 1000.0 / Model::bitUs(tx->rate);
+        this->stats.clientPackets++;
+    }
+    this->onAir.push_back(tx);
+    schedule(tx->end, TX_END, n, 0, tx);
+}
+
+void Simulation::endTransmission(Transmission* tx) {
+    this->onAir.erase(std::find(this->onAir.begin(), this->onAir.end(), tx));
+    accountAir(false, this->now);
+    Node* from = tx->from;
+
+    bool acked = false;
+    Node* ackFrom = NULL;
+    if (!tx->corrupted) {
+        for (size_t i = 0; i < this->nodes.size(); ++i) {
+            Node* r = this->nodes[i];
+            uint8_t pipe;
+            //A write made in a step goes on air once the step's CPU time is over, and the radio listens until then.
+            bool listening = r->radio.isListening() || r->pendingFrame;
+            if (r == from || r->transmitting || !listening || r->radio.getDataRate() != tx->rate
+                || !r->radio.hasReadingAddress(from->radio.getWritingAddress(), &pipe)) {
+                continue;
+            }
+            if (model.loss > 0 && uniform() < model.loss) {
+                continue;
+            }
+            //Only margins within a few dB of the sensitivity draw, so strong links take the draws they always did.
+            double faded = model.fade(tx->paLevel, pathLoss(from, r), tx->rate);
+            if (faded > 1e-6 && uniform() < faded) {
+                continue;
+            }
+            r->radio.hostSetRPD(model.paDbm[tx->paLevel & 3] - pathLoss(from, r) > model.rpdDbm);
+            if (r->lastFrameSeen == tx->frameId) {
+                //Retransmission of a frame already in the FIFO: ACKed with the same payload, not stored twice.
+                acked = true;
+                ackFrom = r;
+                continue;
+            }
+            if (r->radio.hostDeliver(pipe, tx->data, tx->len)) {
+                r->lastFrameSeen = tx->frameId;
+                if (!r->radio.hostTakeAckPayload(pipe, r->ackData, &r->ackLen)) {
+                    r->ackLen = 0;
+                }
+                acked = true;
+                ackFrom = r;
+                frameArrived(r);
+            }
+        }
+    }
+
+    if (acked) {
+        //The ACK carries the receiver's ACK payload for the pipe, if it loaded one.
+        Transmission* ack = new Transmission();
+        ack->from = from;
+        ack->start = this->now + model.settleUs;
+        ack->len = ackFrom->ackLen;
+        memcpy(ack->data, ackFrom->ackData, ack->len);
+        ack->rate = tx->rate;
+        ack->paLevel = ackFrom->radio.getPALevel();
+        ack->end = ack->start + model.airtime(ack->len, ack->rate);
+        ack->corrupted = false;
+        double faded = model.fade(ack->paLevel, pathLoss(ackFrom, from), ack->rate);
+        ack->faded = faded > 1e-6 && uniform() < faded;
+        ack->strong = model.paDbm[ack->paLevel & 3] - pathLoss(ackFrom, from) > model.rpdDbm;
+        ack->isAck = true;
+        chargeTx(ackFrom, ack->len, ack->rate);
+        ack->frameId = tx->frameId;
+        accountAir(true, ack->start);
+        for (size_t i = 0; i < this->onAir.size(); ++i) {
+            if (this->onAir[i]->end > ack->start) {
+                this->onAir[i]->corrupted = true;
+                ack->corrupted = true;
+            }
+        }
+        this->onAir.push_back(ack);
+        schedule(ack->end, ACK_END, from, 0, ack);
+    }
+    else if (from->txAttempts <= model.arc) {
+        schedule(this->now + model.ardStepUs * (from->radio.hostRetryDelay() + 1), TX_START, from);
+    }
+    else {
+        this->stats.writeFailures++;
+        schedule(this->now, WRITE_DONE, from, 0);
+    }
+    delete tx;
+}
+
+void Simulation::endAck(Transmission* ack) {
+    this->onAir.erase(std::find(this->onAir.begin(), this->onAir.end(), ack));
+    accountAir(false, this->now);
+    Node* from = ack->from;
+    bool corrupted = ack->corrupted || ack->faded;
+    if (!corrupted && ack->len > 0) {
+        from->radio.hostSetRPD(ack->strong);
+        from->radio.hostDeliver(0, ack->data, ack->len);
+    }
+    delete ack;
+
+    if (!corrupted) {
+        schedule(this->now, WRITE_DONE, from, 1);
+    }
+    else if (from->txAttempts <= model.arc) {
+        schedule(this->now + model.ardStepUs * (from->radio.hostRetryDelay() + 1), TX_START, from);
+    }
+    else {
+        this->stats.writeFailures++;
+        schedule(this->now, WRITE_DONE, from, 0);
+    }
+}
+
+void Simulation::writeDone(Node* n, bool acked) {
+    //The hook's write() always returns true, so only event-driven I/O gets the result, as TX_DS or MAX_RT.
+    n->transmitting = false;
+    if (eventDriven) {
+        n->radio.hostSetARC(acked ? n->txAttempts - 1 : model.arc);
+        n->radio.hostTransmitDone(acked);
+        n->iot.poll();
+    }
+
+    if (n->isServer) {
+        n->busy = false;
+        serverPoll(n);
+        return;
+    }
+    if (eventDriven) {
+        //The link thread already started its timeout when it queued the frame.
+        if (n->waiting && frameWaiting(n)) {
+            n->waiting = false;
+            n->waitToken++;
+            clientFinish(n, false);
+        }
+        //An ACK payload may have moved the window on.
+        confirmWindow(n);
+        clientWake(n);
+        return;
+    }
+    //send() ended with startListening(); receiveHelper now spins for up to a second.
+    n->waiting = true;
+    n->waitToken++;
+    if (n->radio.available()) {
+        n->waiting = false;
+        clientFinish(n, false);
+    }
+    else {
+        schedule(this->now + n->iot.getResponseTimeout(), CLIENT_TIMEOUT, n, n->waitToken);
+    }
+}
+
+void Simulation::frameArrived(Node* n) {
+    if (n->isServer) {
+        schedule(this->now, SERVER_POLL, n);
+    }
+    else if (n->waiting) {
+        //The spinning receiveHelper sees available() straight away; cancel its timeout.
+        n->waiting = false;
+        n->waitToken++;
+        clientFinish(n, false);
+    }
+    else if (eventDriven) {
+        clientWake(n);
+    }
+}
+
+// REPORT ###########################################################################################################
+
+static double percentile(std::vector<double> v, double p) {
+    if (v.empty()) {
+        return 0;
+    }
+    std::sort(v.begin(), v.end());
+    size_t idx = (size_t)(p * (v.size() - 1) + 0.5);
+    return v[idx];
+}
+
+static std::vector<int> parseList(const char* arg) {
+    std::vector<int> out;
+    std::string s(arg);
+    size_t pos = 0;
+    while (pos < s.size()) {
+        size_t comma = s.find(',', pos);
+        if (comma == std::string::npos) {
+            comma = s.size();
+        }
+        int v = atoi(s.substr(pos, comma - pos).c_str());
+        if (v > 0) {
+            out.push_back(v);
+        }
+        pos = comma + 1;
+    }
+    return out;
+}
+
+int main(int argc, char** argv) {
+    std::vector<int> sizes = parseList("1,2,5,10,20,50,100,200,255");
+    double seconds = 300;
+    unsigned long seed = 1;
+    bool verbose = false;
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "-N") == 0 && i + 1 < argc) {
+            sizes = parseList(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            seconds = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            model.loss = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            seed = strtoul(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            batchSize = std::max(1, std::min(atoi(argv[++i]), QUEUE_SIZE));
+        }
+        else if (strcmp(argv[i], "--deadline") == 0 && i + 1 < argc) {
+            batchDeadlineUs = (SimTime)(atof(argv[++i]) * 1000);
+        }
+        else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+            windowSize = std::max(0, std::min(atoi(argv[++i]), MAX_WINDOW));
+        }
+        else if (strcmp(argv[i], "--path-loss") == 0 && i + 1 < argc) {
+            const char* range = argv[++i];
+            const char* comma = strchr(range, ',');
+            model.pathLossLo = atof(range);
+            model.pathLossHi = comma != NULL ? atof(comma + 1) : model.pathLossLo;
+        }
+        else if (strcmp(argv[i], "--fixed-rate") == 0) {
+            model.fixedRate = true;
+        }
+        else if (strcmp(argv[i], "--low-power") == 0) {
+            lowPower = true;
+        }
+        else if (strcmp(argv[i], "--gateway-down") == 0 && i + 1 < argc) {
+            const char* outage = argv[++i];
+            const char* comma = strchr(outage, ',');
+            gatewayDownAt = (SimTime)(atof(outage) * 1e6);
+            gatewayDownUs = comma != NULL ? (SimTime)(atof(comma + 1) * 1e6) : 0;
+        }
+        else if (strcmp(argv[i], "--no-serial") == 0) {
+            model.serialCharUs = 0;
+        }
+        else if (strcmp(argv[i], "--static-payloads") == 0) {
+            model.dynamicPayloads = false;
+        }
+        else if (strcmp(argv[i], "--blocking") == 0) {
+            eventDriven = false;
+        }
+        else if (strcmp(argv[i], "--one-rtt") == 0) {
+            handshakeState = 4;
+        }
+        else if (strcmp(argv[i], "-v") == 0) {
+            verbose = true;
+        }
+        else {
+            fprintf(stderr, "usage: %s [-N 1,2,5,...] [-d seconds] [-l loss] [-s seed] [-b batch] [--deadline ms] [-w window]\n"
+                            "       [--path-loss lo,hi] [--fixed-rate] [--low-power] [--gateway-down at,len] [--no-serial]\n"
+                            "       [--static-payloads] [--blocking] [--one-rtt] [-v]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    for (size_t k = 0; k < sizes.size(); ++k) {
+        if (eventDriven && sizes[k] > MAX_CLIENTS) {
+            fprintf(stderr, "%s: -N takes at most %d clients, one per node ID\n", argv[0], MAX_CLIENTS);
+            return 2;
+        }
+    }
+    if (!eventDriven || !model.dynamicPayloads) {
+        //The window is simulated for the event-driven sketches only, and ACK payloads need dynamic payloads.
+        windowSize = 0;
+    }
+    if (!eventDriven) {
+        model.fixedRate = true;
+        lowPower = false;
+    }
+
+    Serial.setOutput(NULL);
+    printf("# %.0f s simulated per run, loss %.3f, seed %lu, serial %s, %s payloads, batch %d / %.0f ms, window %d, %s I/O, %s handshake\n",
+           seconds, model.loss, seed, model.serialCharUs > 0 ? "9600 baud" : "off",
+           model.dynamicPayloads ? "dynamic" : "static", batchSize, batchDeadlineUs / 1000.0, windowSize,
+           eventDriven ? "event-driven" : "blocking", handshakeState == 4 ? "1-RTT" : "three-way");
+    printf("# path loss %.0f to %.0f dB, %s, clients %s\n", model.pathLossLo, model.pathLossHi,
+           model.fixedRate ? "fixed at 250 kbps and full power" : "adaptive rate and power",
+           lowPower ? "sleeping between readings" : "always listening");
+    if (gatewayDownUs > 0) {
+        printf("# gateway off at %.1f s for %.1f s\n", gatewayDownAt / 1e6, gatewayDownUs / 1e6);
+    }
+    printf("%6s %8s %9s %9s %9s %10s %9s %8s %8s %8s %9s %9s %6s %7s %8s %8s %9s %8s %6s %8s %7s %6s %6s\n", "N", "hs_done", "hs_p50ms",
+           "hs_p95ms", "rd/s", "goodB/s", "srvIF%", "cliIF%", "rtx/s", "tmo/s", "hsFrm%", "exp:fail", "renew", "air%", "lat_ms", "lat_max",
+           "cliBusy%", "txuJ/rd", "kbps", "uJ/rd", "avg_mA", "lost", "dup%");
+
+    for (size_t k = 0; k < sizes.size(); ++k) {
+        Simulation sim(sizes[k], (SimTime)(seconds * 1e6), seed, verbose);
+        sim.run();
+        const Stats& s = sim.getStats();
+
+        double secs = sim.getDuration() / 1e6;
+        unsigned long frames = s.handshakeFrames + s.dataFrames;
+        double latencyMs = 0;
+        for (size_t i = 0; i < s.readingLatencyMs.size(); ++i) {
+            latencyMs += s.readingLatencyMs[i];
+        }
+        double energyUj = s.clientTxUj + model.clientEnergyUj(s.clientAwakeUs, s.clientAsleepUs, s.readingWakes, s.radioWakes);
+        printf("%6d %8lu %9.1f %9.1f %9.2f %10.1f %9.2f %8.2f %8.2f %8.2f %9.1f %4lu:%-4lu %6lu %7.1f %8.0f %8.0f %9.2f %8.1f %6.0f %8.0f %7.3f %6lu %6.2f\n", sizes[k],
+               s.handshakesCompleted, percentile(s.handshakeMs, 0.5), percentile(s.handshakeMs, 0.95),
+               s.readingsAccepted / secs, s.readingsAccepted * (double)READING_LEN / secs,
+               s.serverFrames ? 100.0 * s.serverIntegrityFailures / s.serverFrames : 0.0,
+               s.clientFrames ? 100.0 * s.clientIntegrityFailures / s.clientFrames : 0.0,
+               s.retransmissions / secs, s.clientTimeouts / secs, frames ? 100.0 * s.handshakeFrames / frames : 0.0,
+               s.expiryRekeys, s.failureRekeys, s.renewals, 100.0 * s.airBusyUs / sim.getDuration(),
+               s.readingLatencyMs.empty() ? 0.0 : latencyMs / s.readingLatencyMs.size(), percentile(s.readingLatencyMs, 1.0),
+               100.0 * s.clientBusyUs / ((double)sim.getDuration() * sizes[k]),
+               s.readingsAccepted ? s.clientTxUj / s.readingsAccepted : 0.0,
+               s.clientPackets ? s.clientKbps / s.clientPackets : 0.0,
+               s.readingsAccepted ? energyUj / s.readingsAccepted : 0.0, energyUj / model.volts / secs / sizes[k] / 1000.0,
+               s.readingsLost, s.readingsAccepted ? 100.0 * s.readingsRepeated / s.readingsAccepted : 0.0);
+    }
+    return 0;
+}
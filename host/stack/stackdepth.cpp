@@ -0,0 +1,226 @@
+/*
+ * Worst-case stack depth of the send and receive paths, from the call graphs GCC writes with
+ * -fstack-usage -fcallgraph-info=su (see make stack). Each entry's depth is its own frame plus
+ * the deepest of its callees'; the call chain of the deepest entry is printed after them.
+ *
+ * The frames are the host build's, so they are only a guide to the board's: AVR pointers and
+ * ints are half the size, but it has no red zone and pushes every saved register. Calls into
+ * functions without a frame size (the C library, the shim's stand-ins) count as 0 and are
+ * listed. Indirect calls count as the deepest function matching an -i name, as the virtual
+ * calls here all go to the cipher or the hash; calls those make through a pointer in turn are
+ * not followed, or every virtual would seem to call every other.
+ *
+ * Usage: stackdepth [-i name]... -e entry [-e entry]... file.ci...
+ *        (an entry is a qualified name, e.g. IoTSec::poll, and takes in all its overloads)
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+struct Function {
+    std::string name; //The demangled name, from the first line of the node's label.
+    long frame; //Bytes of its own frame, -1 when GCC did not say.
+    bool dynamic; //Flag for whether its frame grows at run time.
+    std::vector<std::string> callees;
+    long depth[2]; //Worst-case depth without and with indirect calls, -1 before it is worked out.
+    std::string deepest[2]; //The callee each depth goes through.
+    bool throughIndirect[2]; //Flag for whether that callee is called through a pointer.
+    bool visiting;
+
+    Function() : frame(-1), dynamic(false), visiting(false) {
+        depth[0] = depth[1] = -1;
+        throughIndirect[0] = throughIndirect[1] = false;
+    }
+};
+
+static std::map<std::string, Function> functions;
+static std::vector<std::string> indirectNames;
+static std::set<std::string> unknown;
+static std::set<std::string> recursive;
+
+/*
+ * Reads the quoted value after key in line.
+ * @return the value, empty if the key is missing.
+ */
+static std::string field(const std::string& line, const char* key) {
+    size_t at = line.find(key);
+    if (at == std::string::npos) {
+        return "";
+    }
+    at += strlen(key);
+    std::string value;
+    for (size_t i = at; i < line.size() && line[i] != '"'; ++i) {
+        if (line[i] == '\\' && i + 1 < line.size()) {
+            value += line[i + 1] == 'n' ? '\n' : line[i + 1];
+            ++i;
+            continue;
+        }
+        value += line[i];
+    }
+    return value;
+}
+
+static void readGraph(const char* path) {
+    FILE* in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "cannot open %s\n", path);
+        exit(2);
+    }
+    char buffer[8192];
+    while (fgets(buffer, sizeof(buffer), in) != NULL) {
+        std::string line(buffer);
+        if (line.compare(0, 5, "node:") == 0) {
+            std::string title = field(line, "title: \"");
+            std::string label = field(line, "label: \"");
+            Function& f = functions[title];
+            if (f.name.empty()) {
+                f.name = label.substr(0, label.find('\n'));
+            }
+            size_t bytes = label.rfind(" bytes (");
+            if (bytes != std::string::npos) {
+                size_t start = label.rfind('\n', bytes);
+                f.frame = atol(label.c_str() + (start == std::string::npos ? 0 : start + 1));
+                f.dynamic = label.find("dynamic", bytes) != std::string::npos;
+            }
+        }
+        else if (line.compare(0, 5, "edge:") == 0) {
+            functions[field(line, "sourcename: \"")].callees.push_back(field(line, "targetname: \""));
+        }
+    }
+    fclose(in);
+}
+
+static long depth(const std::string& title, int indirect);
+
+/*
+ * Works out the deepest an indirect call can go: the deepest function matching an -i name, not
+ * following its own indirect calls.
+ */
+static long indirectDepth(std::string* through) {
+    long best = 0;
+    for (std::map<std::string, Function>::iterator it = functions.begin(); it != functions.end(); ++it) {
+        for (size_t i = 0; i < indirectNames.size(); ++i) {
+            if (it->second.frame >= 0 && it->second.name.find(indirectNames[i]) != std::string::npos) {
+                long d = depth(it->first, 0);
+                if (d > best) {
+                    best = d;
+                    *through = it->first;
+                }
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+/*
+ * Works out the deepest the stack goes from a function down.
+ * @param title - The function's node.
+ * @param indirect - 1 to follow indirect calls, 0 to count them as 0.
+ */
+static long depth(const std::string& title, int indirect) {
+    Function& f = functions[title];
+    if (f.depth[indirect] >= 0) {
+        return f.depth[indirect];
+    }
+    if (f.visiting) {
+        recursive.insert(f.name);
+        return 0;
+    }
+    if (f.frame < 0) {
+        if (title != "__indirect_call") {
+            unknown.insert(f.name.empty() ? title : f.name);
+        }
+        return 0;
+    }
+    f.visiting = true;
+    long deepest = 0;
+    for (size_t i = 0; i < f.callees.size(); ++i) {
+        std::string through = f.callees[i];
+        bool pointer = through == "__indirect_call";
+        long d = 0;
+        if (!pointer) {
+            d = depth(through, indirect);
+        }
+        else if (indirect) {
+            d = indirectDepth(&through);
+        }
+        if (d > deepest) {
+            deepest = d;
+            f.deepest[indirect] = through;
+            f.throughIndirect[indirect] = pointer;
+        }
+    }
+    f.visiting = false;
+    f.depth[indirect] = f.frame + deepest;
+    return f.depth[indirect];
+}
+
+int main(int argc, char** argv) {
+    std::vector<std::string> entries;
+    int i = 1;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-e") == 0) {
+            entries.push_back(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "-i") == 0) {
+            indirectNames.push_back(argv[i + 1]);
+        }
+        else {
+            break;
+        }
+    }
+    if (i >= argc || entries.empty()) {
+        fprintf(stderr, "usage: %s [-i name]... -e entry [-e entry]... file.ci...\n", argv[0]);
+        return 2;
+    }
+    for (; i < argc; ++i) {
+        readGraph(argv[i]);
+    }
+
+    std::string worst;
+    for (size_t e = 0; e < entries.size(); ++e) {
+        for (std::map<std::string, Function>::iterator it = functions.begin(); it != functions.end(); ++it) {
+            const std::string& name = it->second.name;
+            size_t at = name.find(entries[e] + "(");
+            if (it->second.frame < 0 || at == std::string::npos || (at > 0 && name[at - 1] != ' ')) {
+                continue;
+            }
+            printf("%6ld B  %s\n", depth(it->first, 1), name.c_str());
+            if (worst.empty() || it->second.depth[1] > functions[worst].depth[1]) {
+                worst = it->first;
+            }
+        }
+    }
+    if (!worst.empty()) {
+        printf("\ndeepest, frame by frame (+ for frames that grow at run time):\n");
+        int indirect = 1;
+        std::string step = worst;
+        while (!step.empty()) {
+            Function& f = functions[step];
+            printf("%6ld%s  %s%s\n", f.frame, f.dynamic ? "+" : " ", f.name.c_str(),
+                   f.throughIndirect[indirect] ? "  (calls the next through a pointer)" : "");
+            step = f.deepest[indirect];
+            if (f.throughIndirect[indirect]) {
+                indirect = 0;
+            }
+        }
+    }
+    if (!recursive.empty()) {
+        printf("\nrecursive, counted once:\n");
+        for (std::set<std::string>::iterator it = recursive.begin(); it != recursive.end(); ++it) {
+            printf("  %s\n", it->c_str());
+        }
+    }
+    if (!unknown.empty()) {
+        printf("\nno frame size, counted as 0:\n");
+        for (std::set<std::string>::iterator it = unknown.begin(); it != unknown.end(); ++it) {
+            printf("  %s\n", it->c_str());
+        }
+    }
+    return 0;
+}
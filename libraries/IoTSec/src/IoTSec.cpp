@@ -0,0 +1,3570 @@
+#include "IoTSec.h"
+#include <new>
+
+//The one gateway's session table and its other sessions, see setGateway.
+static SessionTable gatewayTable;
+alignas(IoTSec) static byte gatewaySessions[MAX_SESSIONS > 1 ? MAX_SESSIONS - 1 : 1][sizeof(IoTSec)];
+static bool gatewayTableUsed = false;
+
+//Shared by every session, as they all key the one cipher, see useContext.
+byte* IoTSec::keyedKey = NULL;
+
+/*
+ * Initializes the IoTSec class with the needed keys and initial state.
+ * @param radio - A pointer to the radio object used to transfer data.
+ */
+IoTSec::IoTSec(RF24* radio, IoTSecCipher* encCipher, IoTSecHash* hash256) {
+    //Generate the secret key and initialize other keys.
+    static const byte secret[KEY_DATA_LEN] = {36, 152, 131, 242, 98, 145, 27, 252, 14, 79, 42, 22, 126, 158, 25, 156};
+    memmove(this->secretKey, secret, KEY_DATA_LEN);
+
+    //Generate secret hash key from secret key.
+    for (int i = 0; i < KEY_DATA_LEN; ++i) {
+        this->secretHashKey[i] = (this->secretKey[i] * 17) % 256;
+    }
+
+    this->masterKey = NULL;
+    this->hashKey = NULL;
+    this->previousMasterKey = NULL;
+    this->previousHashKey = NULL;
+
+    
+    this->radio = radio;                            //Save an instance of the radio for the library to be able to use.
+    this->encCipher = encCipher;                    //Save an instance of the cipher to be used for encryption/decryption
+    this->hash256 = hash256;                        //Save an instance of the SHA256 object to be used for HMAC
+
+    this->handshakeComplete = false;
+    this->numMsgs = 0;
+    this->ratchetCount = 0;
+    this->peerOnPrevious = false;
+    this->graceLeft = 0;
+    this->previousMsgs = 0;
+    this->previousRatchets = 0;
+    this->previousLinkNumber = 0;
+
+#if IOTSEC_FRAGMENTS
+    this->fragmentFill = 0;
+    this->fragmentSeq = 0;
+    this->messageRemaining = 0;
+#endif
+    this->messageLost = false;
+    this->dynamicFrames = false;
+    this->initiator = false;
+    this->eventDriven = false;
+    this->radioEvent = false;
+    this->txBusy = false;
+    this->rxHead = 0;
+    this->rxCount = 0;
+    this->txHead = 0;
+    this->txCount = 0;
+    this->rxPipe = 0;
+    this->nodeId = 0;
+    this->challenge = 0;
+    this->radioOwner = this;
+    this->sessionTable = NULL;
+    this->sessionEntry = 0;
+    this->timedOut = false;
+    this->resetTimer(&this->responseTimer, INITIAL_RTO);
+    this->resetTimer(&this->windowTimer, WINDOW_TIMEOUT);
+    this->lastSent.len = 0;
+    this->lastReceived = 0;
+    this->awaitingReply = false;
+    this->requestTimed = false;
+    this->replyCached = false;
+    this->windowSize = 0;
+    this->windowTransmissions = 0;
+    this->resetWindow();
+    this->sequenceHigh = 0;
+    this->sequenceSeen = 0;
+    this->linkAdapt = false;
+    this->linkRate = 0;
+    this->nextRate = 0;
+    this->rateDue = false;
+    this->linkNumber = 0;
+    this->txSession = NULL;
+    this->link.paLevel = RF24_PA_MAX;
+    this->resetLink();
+    this->wakeInterval = 0;
+    this->lastActive = 0;
+    this->radioAsleep = false;
+    this->replyOwed = false;
+
+    //The secret keys are expanded in the shared cipher when a handshake picks them.
+    this->keyContext = NULL;
+    this->selectedIntKey = NULL;
+    this->buildContext(&this->secretContext, this->secretKey, this->secretHashKey);
+    this->sessionContext.encKey = NULL;
+    this->sessionContext.intKey = NULL;
+    this->previousContext.encKey = NULL;
+    this->previousContext.intKey = NULL;
+}
+
+/*
+ * Wipes the keys and releases a gateway's sessions.
+ */
+IoTSec::~IoTSec() {
+    clean(this->secretKey, KEY_DATA_LEN);
+    clean(this->secretHashKey, KEY_DATA_LEN);
+    clean(this->sessionKeys, KEY_DATA_LEN + HASH_KEY_LEN);
+    this->masterKey = NULL;
+    this->hashKey = NULL;
+    this->clearPreviousKeys();
+    if (this->sessionTable != NULL) {
+        for (unsigned int i = 1; i < MAX_SESSIONS; ++i) {
+            this->sessionTable->entries[i].session->~IoTSec();
+        }
+        gatewayTableUsed = false;
+        this->sessionTable = NULL;
+    }
+}
+
+/*
+ * Returns true if the key has expired, false otherwise.
+ */
+bool IoTSec::keyExpired() {
+    return !this->handshakeComplete;
+}
+
+/*
+ * Returns true once the session keys are within REKEY_MARGIN messages of MAX_MESSAGE_COUNT.
+ * The handshake should be run again then; the keys keep carrying data until it finishes.
+ */
+bool IoTSec::rekeyDue() {
+    return this->handshakeComplete && this->numMsgs >= MAX_MESSAGE_COUNT - REKEY_MARGIN;
+}
+
+/*
+ * Sends one packet: the header, then a cipher block holding the payload, with its HMAC appended
+ * when authenticated and encrypted when asked. The mode is fixed at compile time, so each send
+ * overload only carries the steps it uses.
+ * @param arr - The MAX_PAYLOAD_SIZE bytes to send.
+ * @param encKey - The encryption key byte array, unused without Encrypt.
+ * @param intKey - The integrity key byte array, unused without Authenticate.
+ * @param state - The state to send in the header.
+ */
+template <bool Encrypt, bool Authenticate>
+void IoTSec::sendPacket(char* arr, byte* encKey, byte* intKey, String state) {
+    static_assert(Encrypt || !Authenticate, "the HMAC is only sent encrypted");
+    this->setListening(false);
+    byte bytes[MAX_PACKET_SIZE];
+    memset(bytes, 0, MAX_PACKET_SIZE);
+    createHeader(state, bytes);
+    byte* block = bytes + MAX_HEADER_SIZE;
+
+    if (Encrypt) {
+        this->selectKeys(encKey, Authenticate ? intKey : NULL);
+    }
+    if (Authenticate) {
+        this->appendHMAC(arr, block);                        //store payload (arr) in block and append HMAC
+    }
+    else {
+        memmove(block, arr, MAX_PAYLOAD_SIZE);
+    }
+    if (Encrypt) {
+        METRIC_START(cipherStart);
+        this->encCipher->encryptBlock(block, block);
+        METRIC_STOP(STAGE_CIPHER, cipherStart);
+    }
+    this->transmit(bytes, MAX_PACKET_SIZE);
+
+    this->incrMsgCount();
+    this->setListening(true);
+}
+
+/*
+ * Receives one packet into payload: the cipher block after the header is decrypted when asked
+ * and, when authenticated, its HMAC checked for getIntegrityPassed. The mode is fixed at compile
+ * time like sendPacket's.
+ * @param payload - The array to store the MAX_PAYLOAD_SIZE bytes of data in.
+ * @param encKey - The encryption key used to decrypt the data, unused without Encrypt.
+ * @param intKey - The integrity key used to verify the integrity, unused without Authenticate.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ */
+template <bool Encrypt, bool Authenticate>
+void IoTSec::receivePacket(byte payload[], byte* encKey, byte* intKey, char* state, bool block) {
+    static_assert(Encrypt || !Authenticate, "the HMAC is only sent encrypted");
+    if (Authenticate) {
+        this->integrityPassed = false;
+    }
+    byte bytes[MAX_PACKET_SIZE - MAX_HEADER_SIZE];
+    memset(bytes, 0, MAX_PACKET_SIZE - MAX_HEADER_SIZE);
+
+    this->receiveHelper(bytes, MAX_PACKET_SIZE - MAX_HEADER_SIZE, state, block);
+
+    METRIC_START(verifyStart);
+    if (Encrypt) {
+        this->selectKeys(encKey, Authenticate ? intKey : NULL);
+        METRIC_START(cipherStart);
+        this->encCipher->decryptBlock(bytes, bytes);
+        METRIC_STOP(STAGE_CIPHER, cipherStart);
+    }
+    if (Authenticate && this->verifyHMAC(bytes)) {
+        this->integrityPassed = true;
+    }
+    if (Authenticate && !this->timedOut) {
+        METRIC_COUNT(integrityFailures, !this->integrityPassed);
+        METRIC_STOP(STAGE_VERIFY, verifyStart);
+    }
+    memmove(payload, bytes, MAX_PAYLOAD_SIZE);
+}
+
+/*
+ * Copies a string into a zeroed packet payload, cut at MAX_PAYLOAD_SIZE.
+ * @param str - The string.
+ * @param bytes - The MAX_PAYLOAD_SIZE byte payload.
+ */
+void IoTSec::stringPayload(String str, byte bytes[]) {
+    memset(bytes, 0, MAX_PAYLOAD_SIZE);
+    for (unsigned int i = 0; i < str.length() && i < MAX_PAYLOAD_SIZE; ++i) {
+        bytes[i] = str[i];
+    }
+}
+
+#if IOTSEC_PLAIN_MODES
+/*
+ * Sends an un-encrypted no integrity string to the peer.
+ * @param str - The string to send.
+ * @param state - The state to send in the header.
+ */
+void IoTSec::send(String str, String state) {
+    byte bytes[MAX_PAYLOAD_SIZE];
+    this->stringPayload(str, bytes);
+    this->sendPacket<false, false>((char*)bytes, NULL, NULL, state);
+}
+
+/*
+ * Sends a non-encrypted no integrity array of bytes to the peer.
+ * @param arr - The bytes to send.
+ * @param state - The state to send in the header.
+ */
+void IoTSec::send(char* arr, String state) {
+    this->sendPacket<false, false>(arr, NULL, NULL, state);
+}
+
+/*
+ * Sends an encrypted no integrity string to the peer.
+ * @param str - The str to encrypt and send.
+ * @param encKey - The encryption key byte array to use for encryption.
+ * @param state - The state to send in the header.
+ */
+void IoTSec::send(String str, byte* encKey, String state) {
+    byte bytes[MAX_PAYLOAD_SIZE];
+    this->stringPayload(str, bytes);
+    this->sendPacket<true, false>((char*)bytes, encKey, NULL, state);
+}
+
+/*
+ * Sends an encrypted no integrity array of bytes to the peer.
+ * @param arr - The bytes to encrypt and send.
+ * @param encKey - The encryption key byte array to use for encryption.
+ * @param state - The state to send in the header.
+ */
+void IoTSec::send(char* arr, byte* encKey, String state) {
+    this->sendPacket<true, false>(arr, encKey, NULL, state);
+}
+#endif
+
+/*
+ * Sends an encrypted string with its integrity to the peer.
+ * @param str - The string to encrypt, generate integrity and send.
+ * @param encKey - The encryption key byte array to use for encryption.
+ * @param intKey - The integrity key byte array to use for integrity.
+ * @param state - The state to send in the header.
+ */
+void IoTSec::send(String str, byte* encKey, byte* intKey, String state) {
+    byte bytes[MAX_PAYLOAD_SIZE];
+    this->stringPayload(str, bytes);
+    this->sendPacket<true, true>((char*)bytes, encKey, intKey, state);
+}
+
+/*
+ * Sends an encrypted array of bytes with its integrity to the peer.
+ * @param arr - The bytes to encrypt and send.
+ * @param encKey - The encryption key byte array to use for encryption.
+ * @param intKey - The integrity key byte array to use for integrity.
+ * @param state - The state to send in the header.
+ */
+void IoTSec::send(char* arr, byte* encKey, byte* intKey, String state) {
+    this->sendPacket<true, true>(arr, encKey, intKey, state);
+}
+
+#if IOTSEC_PLAIN_MODES
+/*
+ * Receives a non-encrypted no integrity string from the peer.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ */
+String IoTSec::receiveStr(char* state, bool block) {
+    //Null terminate.
+    byte bytes[MAX_PAYLOAD_SIZE + 1];
+    memset(bytes, 0, MAX_PAYLOAD_SIZE + 1);
+
+    this->receivePacket<false, false>(bytes, NULL, NULL, state, block);
+    return (char*) bytes;
+}
+
+/*
+ * Receives non-encrypted no integrity data from the peer.
+ * @param payload - The byte array to store the data.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ */
+void IoTSec::receive(byte payload[], char* state, bool block) {
+    this->receivePacket<false, false>(payload, NULL, NULL, state, block);
+}
+
+/*
+ * Receives an encrypted string no integrity from the peer.
+ * @param encKey - The encryption key used to decrypt the data.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ */
+String IoTSec::receiveStr(byte* encKey, char* state, bool block) {
+    //Null terminate.
+    byte bytes[MAX_PAYLOAD_SIZE + 1];
+    memset(bytes, 0, MAX_PAYLOAD_SIZE + 1);
+
+    this->receivePacket<true, false>(bytes, encKey, NULL, state, block);
+    return (char*) bytes;
+}
+
+/*
+ * Receives encrypted data no integrity from the peer.
+ * @param payload - The array to store the data in.
+ * @param encKey - The Encryption key used to decrypt the data.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ */
+void IoTSec::receive(byte payload[], byte* encKey, char* state, bool block) {
+    this->receivePacket<true, false>(payload, encKey, NULL, state, block);
+}
+#endif
+
+/*
+ * Receives an encrypted string with its integrity from the peer.
+ * @param encKey - The encryption key used to decrypt.
+ * @param intKey - The integrity key used to verify the integrity.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ */
+String IoTSec::receiveStr(byte* encKey, byte* intKey, char* state, bool block) {
+    //Null terminate.
+    byte bytes[MAX_PAYLOAD_SIZE + 1];
+    memset(bytes, 0, MAX_PAYLOAD_SIZE + 1);
+
+    this->receivePacket<true, true>(bytes, encKey, intKey, state, block);
+    return (char*) bytes;
+}
+
+/*
+ * Receives encrypted data and integrity from the peer.
+ * @param payload - The bytes to store the data in.
+ * @param encKey - The encryption key used to decrypt the data
+ * @param intKey - The integrity key used to verify the integrity.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ */
+void IoTSec::receive(byte* payload, byte* encKey, byte* intKey, char* state, bool block) {
+    this->receivePacket<true, true>(payload, encKey, intKey, state, block);
+}
+
+
+#if IOTSEC_FRAGMENTS
+/*
+ * Starts sending a fragmented message of len bytes to the peer. The message is streamed
+ * out with writeMessage and finished with endMessage. Each fragment is one packet whose
+ * encrypted block holds a 2 byte sequence number and fragmentDataLen() bytes of the stream:
+ * the 2 byte message length, the message, then a single HMAC over the header and the whole
+ * message. The second header byte is set to FRAGMENT_FLAG, so states must be one character.
+ * @param len - The total length of the message, at most MAX_MESSAGE_SIZE.
+ * @param encKey - The encryption key byte array to use for encryption.
+ * @param intKey - The integrity key byte array to use for integrity.
+ * @param state - The state header.
+ * @return false if the message is too long.
+ */
+bool IoTSec::beginMessage(unsigned int len, byte* encKey, byte* intKey, String state) {
+    if (len > MAX_MESSAGE_SIZE) {
+        return false;
+    }
+    this->setListening(false);
+    memset(this->fragment, 0, MAX_FRAME_SIZE);
+    createHeader(state, this->fragment);
+    this->fragment[MAX_HEADER_SIZE - 1] = FRAGMENT_FLAG;
+    this->fragmentFill = 0;
+    this->fragmentSeq = 0;
+    this->messageRemaining = len;
+    this->messageLost = false;
+    this->selectKeys(encKey, intKey);
+
+    byte lenBytes[MESSAGE_LEN_LEN] = {(byte)(len >> 8), (byte)len};
+    this->beginHMAC();
+    this->hash256->update(this->fragment, MAX_HEADER_SIZE);
+    this->hash256->update(lenBytes, MESSAGE_LEN_LEN);
+    this->streamFragment(lenBytes, MESSAGE_LEN_LEN);
+    return true;
+}
+
+/*
+ * Appends bytes to the message started with beginMessage, sending every fragment that fills up.
+ * Anything past the length given to beginMessage is dropped, as is everything once a fragment
+ * has run out of retries.
+ * @param data - The next bytes of the message.
+ * @param len - The number of bytes.
+ */
+void IoTSec::writeMessage(byte* data, unsigned int len) {
+    if (len > this->messageRemaining) {
+        len = this->messageRemaining;
+    }
+    this->hash256->update(data, len);
+    this->streamFragment(data, len);
+    this->messageRemaining -= len;
+}
+
+/*
+ * Appends the HMAC and sends the last fragments of the message. The whole message counts
+ * as one message towards key expiry. With event-driven I/O it polls until the fragments are
+ * off the queue, so their writes are known.
+ * @return false if fewer bytes were written than beginMessage announced, or a fragment ran out
+ *         of retries and the peer cannot put the message back together; nothing more is sent.
+ */
+bool IoTSec::endMessage() {
+    if (this->messageRemaining != 0 || this->messageLost) {
+        this->messageRemaining = 0;
+        this->setListening(true);
+        return false;
+    }
+    byte hash[HASH_LEN];
+    this->endHMAC(hash);
+    this->streamFragment(hash, HASH_LEN);
+    if (this->fragmentFill > 0 && !this->messageLost) {
+        this->flushFragment();
+    }
+    while (this->eventDriven && (this->txCount > 0 || (this->radioOwner->txBusy && this->radioOwner->txSession == this))) {
+        this->poll();
+    }
+    if (this->messageLost) {
+        this->setListening(true);
+        return false;
+    }
+
+    this->incrMsgCount();
+    this->setListening(true);
+    return true;
+}
+
+/*
+ * Sends a whole fragmented message to the peer. See beginMessage.
+ * @param data - The message.
+ * @param len - The length of the message, at most MAX_MESSAGE_SIZE.
+ * @param encKey - The encryption key byte array to use for encryption.
+ * @param intKey - The integrity key byte array to use for integrity.
+ * @param state - The state header.
+ * @return false if the message is too long or could not all be sent, see endMessage.
+ */
+bool IoTSec::sendMessage(byte* data, unsigned int len, byte* encKey, byte* intKey, String state) {
+    if (!this->beginMessage(len, encKey, intKey, state)) {
+        return false;
+    }
+    this->writeMessage(data, len);
+    return this->endMessage();
+}
+
+/*
+ * Receives a fragmented message from the peer and reassembles it into buffer. Fragments must
+ * arrive in sequence; repeated fragments are skipped, a missing one or a timeout aborts.
+ * getIntegrityPassed() reports whether the HMAC over the whole message matched.
+ * @param buffer - The array to reassemble the message in.
+ * @param size - The size of buffer.
+ * @param encKey - The encryption key used to decrypt the data.
+ * @param intKey - The integrity key used to verify the integrity.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ * @return the length of the message, or 0 if it could not be reassembled.
+ */
+unsigned int IoTSec::receiveMessage(byte buffer[], unsigned int size, byte* encKey, byte* intKey, char* state, bool block) {
+    this->integrityPassed = false;
+    byte bytes[MAX_FRAME_BODY];
+    byte decBytes[MAX_FRAME_BODY];
+    char header[MAX_HEADER_SIZE];
+    byte lenBytes[MESSAGE_LEN_LEN];
+    byte receivedHash[HASH_LEN];
+    unsigned int expectedSeq = 0;
+    unsigned long pos = 0;                              // position in the length + message + HMAC stream
+    unsigned long end = MESSAGE_LEN_LEN;
+    unsigned int len = 0;
+    this->selectKeys(encKey, intKey);
+
+    while (pos < end) {
+        memset(header, 0, MAX_HEADER_SIZE);
+        byte bodyLen = this->receiveHelper(bytes, this->dynamicFrames ? MAX_FRAME_BODY : MAX_PACKET_SIZE - MAX_HEADER_SIZE, header, block);
+        if (header[MAX_HEADER_SIZE - 1] != FRAGMENT_FLAG || bodyLen < CIPHER_BLOCK_LEN) {   // timed out or not a fragment
+            return 0;
+        }
+        this->decryptFrame(decBytes, bytes, bodyLen);
+        unsigned int seq = ((unsigned int)decBytes[0] << 8) | decBytes[1];
+        if (seq < expectedSeq) {                                      // retransmitted fragment
+            continue;
+        }
+        if (seq > expectedSeq) {                                      // lost fragment
+            return 0;
+        }
+        if (seq == 0) {
+            memmove(state, header, MAX_HEADER_SIZE);
+            this->beginHMAC();
+            this->hash256->update(header, MAX_HEADER_SIZE);
+        }
+        else if (header[0] != state[0]) {
+            return 0;
+        }
+        ++expectedSeq;
+
+        byte* data = decBytes + FRAGMENT_SEQ_LEN;
+        unsigned long first = pos;
+        for (int i = 0; i < bodyLen - FRAGMENT_SEQ_LEN && pos < end; ++i, ++pos) {
+            if (pos < MESSAGE_LEN_LEN) {
+                lenBytes[pos] = data[i];
+                if (pos == MESSAGE_LEN_LEN - 1) {
+                    len = ((unsigned int)lenBytes[0] << 8) | lenBytes[1];
+                    if (len > size || len > MAX_MESSAGE_SIZE) {
+                        return 0;
+                    }
+                    end = MESSAGE_LEN_LEN + len + HASH_LEN;
+                    this->hash256->update(lenBytes, MESSAGE_LEN_LEN);
+                }
+            }
+            else if (pos < MESSAGE_LEN_LEN + len) {
+                buffer[pos - MESSAGE_LEN_LEN] = data[i];
+            }
+            else {
+                receivedHash[pos - MESSAGE_LEN_LEN - len] = data[i];
+            }
+        }
+
+        //Hash the part of the message this fragment carried.
+        unsigned long from = first < MESSAGE_LEN_LEN ? MESSAGE_LEN_LEN : first;
+        unsigned long to = pos < MESSAGE_LEN_LEN + len ? pos : MESSAGE_LEN_LEN + len;
+        if (to > from) {
+            this->hash256->update(buffer + from - MESSAGE_LEN_LEN, to - from);
+        }
+    }
+
+    byte computedHash[HASH_LEN];
+    byte diff = 0;
+    this->endHMAC(computedHash);
+    for (int i = 0; i < HASH_LEN; i++) {
+        diff |= receivedHash[i] ^ computedHash[i];
+    }
+    this->integrityPassed = (diff == 0);
+    METRIC_COUNT(integrityFailures, !this->integrityPassed);
+    return len;
+}
+#endif
+
+/*
+ * Prints a formatted array of bytes to the serial monitor.
+ * @param arr - The array of bytes to print.
+ * @param size - The size of the array.
+ */
+void IoTSec::printByteArr(byte arr[], int size) {
+    Serial.print("[ ");
+    for (int i = 0; i < size; ++i) {
+        Serial.print(arr[i]);
+        Serial.print(' ');
+    }
+    Serial.println("]");
+}
+
+/*
+ * Gets the master key used for encryption.
+ */
+byte* IoTSec::getMasterKey() {
+    return this->masterKey;
+}
+
+/*
+ * Gets the hash key used for integrity.
+ */
+byte* IoTSec::getHashKey() {
+    return this->hashKey;
+}
+
+/*
+ * Gets how many times the session keys have been ratcheted since the handshake made them.
+ * Both ends agree on it while their sealed frames keep passing.
+ */
+unsigned int IoTSec::getRatchetCount() {
+    return this->ratchetCount;
+}
+
+/*
+ * Gets the secret key used for the handshake.
+ */
+byte* IoTSec::getSecretKey() {
+    return this->secretKey;
+}
+
+/*
+ * Gets the secret hash key for the handshake.
+ */
+byte* IoTSec::getSecretHashKey() {
+    return this->secretHashKey;
+}
+
+/*
+ * Creates a random nonce that is KEY_DATA_LEN bytes long.
+ * @param nonce - the array to store the random bytes.
+ */
+void IoTSec::createNonce(byte nonce[]) {
+    for (int i = 0; i < NONCE_LEN; ++i) {
+        nonce[i] = random(255);
+    }
+}
+
+/*
+ * Creates a random number between 1 and 999.
+ */
+int IoTSec::createRandom() {
+    return random(998) + 1;
+}
+
+/*
+ * Generates the master and hash keys from the two nonces that were passed to each other.
+ * If session keys are already in use they become the previous keys, which sealed frames
+ * are still accepted under until the other end is heard on the new ones.
+ * @param nonce1 - The clients nonce
+ * @param nonce2 - The servers nonce
+ */
+void IoTSec::generateKeys(byte nonce1[], byte nonce2[]) {
+    if (this->handshakeComplete && this->masterKey != NULL) {
+        METRIC_COUNT(rekeys, 1);
+        this->retireSessionKeys();
+    }
+    METRIC_COUNT(handshakes, 1);
+    this->masterKey = this->sessionKeys;
+    this->hashKey = this->sessionKeys + KEY_DATA_LEN;
+
+    for (int i = 0; i < NONCE_LEN; ++i) {
+        masterKey[i] = ((nonce1[i] * 13) % 256) ^ ((nonce2[i] * 17) % 256);
+        masterKey[i + NONCE_LEN] = ((nonce1[i] * 29) % 256) ^ ((nonce2[i] * 31) % 256);
+        hashKey[i] = ((nonce1[i] * 19) % 256) ^ ((nonce2[i] * 23) % 256);
+        hashKey[i + NONCE_LEN] = ((nonce1[i] * 37) % 256) ^ ((nonce2[i] * 41) % 256);
+    }
+    this->buildContext(&this->sessionContext, this->masterKey, this->hashKey);
+
+    //Both ends name the keys the same way without sending anything; 0 is the secret keys.
+    byte digest[DIGEST_LEN];
+    byte keyId;
+    this->deriveKeys(&this->sessionContext, KEY_ID_LABEL, digest);
+    keyId = digest[0];
+    clean(digest, DIGEST_LEN);
+    while (keyId == 0 || (this->previousContext.encKey != NULL && keyId == this->previousContext.keyId)) {
+        keyId++;
+    }
+    this->sessionContext.keyId = keyId;
+    this->numMsgs = 0;
+    this->ratchetCount = 0;
+    this->linkNumber = 0;
+    this->peerOnPrevious = false;
+    this->resetWindow();
+}
+
+/*
+ * Sets the handshake complete to the flag passed in.
+ * @param complete - The flag to govern whether the handshake is complete or not.
+ */
+void IoTSec::setHandshakeComplete(bool complete) {
+    //Clean up memory to avoid memory leaks.
+    if (!complete) {
+        this->clearContext(&this->sessionContext);
+        this->clearPreviousKeys();
+        this->resetWindow();
+    }
+    if (!complete && this->masterKey != NULL) {
+        clean(this->sessionKeys, KEY_DATA_LEN + HASH_KEY_LEN);
+        this->masterKey = NULL;
+        this->hashKey = NULL;
+    }
+  
+    if ((!this->handshakeComplete && complete) || (!complete)) {
+        this->numMsgs = 0;
+    }
+  
+    this->handshakeComplete = complete;
+}
+
+/*
+ * Increments the msg count and checks if a key refresh is needed. The session keys are
+ * ratcheted every RATCHET_INTERVAL sealed exchanges or window frames, so a full handshake
+ * only has to renew them after MAX_MESSAGE_COUNT messages.
+ */
+void IoTSec::incrMsgCount() {
+    this->numMsgs++;
+
+    if (this->numMsgs >= MAX_MESSAGE_COUNT) {
+        this->setHandshakeComplete(false);
+        LOG_INFO(LOG_KEYS_EXPIRED);
+    }
+}
+
+/*
+ * Switches between the fixed MAX_PACKET_SIZE packets and frames sized to what they carry,
+ * using the radio's dynamic payloads. Both ends must use the same mode. With dynamic frames
+ * sendFrame only puts the bytes it needs on air and fragments carry up to MAX_FRAME_BODY
+ * bytes each; the fixed size send and receive functions keep working in either mode.
+ * @param enable - true to use dynamic frames.
+ */
+void IoTSec::setDynamicFrames(bool enable) {
+    this->dynamicFrames = enable;
+    if (enable) {
+        this->radio->enableDynamicPayloads();
+    }
+    else {
+        this->radio->disableDynamicPayloads();
+    }
+}
+
+/*
+ * Returns true if dynamic frames are in use.
+ */
+bool IoTSec::getDynamicFrames() {
+    return this->dynamicFrames;
+}
+
+/*
+ * Sends a non-encrypted no integrity frame to the peer. With dynamic frames only len bytes
+ * follow the header, otherwise the frame is padded to MAX_FRAME_SIZE.
+ * @param data - The bytes to send.
+ * @param len - The number of bytes, at most MAX_FRAME_BODY.
+ * @param state - The state header.
+ */
+void IoTSec::sendFrame(byte* data, byte len, String state) {
+    if (len > MAX_FRAME_BODY) {
+        len = MAX_FRAME_BODY;
+    }
+    this->setListening(false);
+    byte bytes[MAX_FRAME_SIZE];
+    memset(bytes, 0, MAX_FRAME_SIZE);
+    createHeader(state, bytes);
+    memmove(bytes + MAX_HEADER_SIZE, data, len);
+
+    this->transmit(bytes, MAX_HEADER_SIZE + (this->dynamicFrames ? len : MAX_FRAME_BODY));
+
+    this->incrMsgCount();
+    this->setListening(true);
+}
+
+/*
+ * Sends an encrypted frame with its integrity to the peer. The body is the 1 byte payload
+ * length, the payload, zero padding up to one cipher block and the HMAC over the header,
+ * length and payload. It is encrypted with ciphertext stealing, so it can be any length
+ * from one cipher block up to MAX_FRAME_BODY and nothing is sent past the HMAC.
+ * @param data - The bytes to encrypt and send.
+ * @param len - The number of bytes, at most MAX_FRAME_PAYLOAD.
+ * @param encKey - The encryption key byte array to use for encryption.
+ * @param intKey - The integrity key byte array to use for integrity.
+ * @param state - The state header.
+ */
+void IoTSec::sendFrame(byte* data, byte len, byte* encKey, byte* intKey, String state) {
+    if (len > MAX_FRAME_PAYLOAD) {
+        len = MAX_FRAME_PAYLOAD;
+    }
+    byte frame[MAX_FRAME_SIZE];
+    memset(frame, 0, MAX_HEADER_SIZE);
+    createHeader(state, frame);
+    memmove(frame + MAX_HEADER_SIZE + FRAME_LEN_LEN, data, len);
+
+    this->sendInPlace(frame, len, encKey, intKey);
+}
+
+/*
+ * Receives a non-encrypted no integrity frame from the peer.
+ * @param payload - The array to store the data in, at least MAX_FRAME_BODY bytes.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ * @return the number of bytes received, MAX_FRAME_BODY without dynamic frames.
+ */
+byte IoTSec::receiveFrame(byte payload[], char* state, bool block) {
+    return this->receiveHelper(payload, MAX_FRAME_BODY, state, block);
+}
+
+/*
+ * Receives an encrypted frame with its integrity from the peer. See sendFrame.
+ * getIntegrityPassed() reports whether the HMAC matched.
+ * @param payload - The array to store the data in, at least MAX_FRAME_PAYLOAD bytes.
+ * @param encKey - The encryption key used to decrypt the data.
+ * @param intKey - The integrity key used to verify the integrity.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ * @return the length of the payload, or 0 on a timeout or malformed frame.
+ */
+byte IoTSec::receiveFrame(byte payload[], byte* encKey, byte* intKey, char* state, bool block) {
+    byte frame[MAX_FRAME_SIZE];
+    byte len;
+    memset(frame, 0, MAX_HEADER_SIZE);
+
+    byte* data = this->receiveInPlace(frame, &len, encKey, intKey, block);
+    memmove(state, frame, MAX_HEADER_SIZE);
+    if (data == NULL) {
+        return 0;
+    }
+    memmove(payload, data, len);
+    return len;
+}
+
+/*
+ * Starts an encrypted frame in a caller-owned buffer of MAX_FRAME_SIZE bytes. Write up to
+ * MAX_FRAME_PAYLOAD bytes of payload at the returned pointer, then pass the same buffer to
+ * sendInPlace. Nothing is allocated or copied along the way.
+ * @param frame - The frame buffer.
+ * @param state - The state for the header.
+ * @return where the payload goes inside frame.
+ */
+byte* IoTSec::beginFrame(byte frame[], char state) {
+    METRIC_START(headerStart);
+    frame[0] = state;
+    memset(frame + 1, 0, MAX_HEADER_SIZE - 1);
+    METRIC_STOP(STAGE_HEADER, headerStart);
+    return frame + MAX_HEADER_SIZE + FRAME_LEN_LEN;
+}
+
+/*
+ * Sends the frame started with beginFrame to the peer. The length, padding and HMAC are
+ * filled in and the body is encrypted inside frame, which holds ciphertext afterwards.
+ * The frame is the same as sendFrame's.
+ * @param frame - The frame buffer.
+ * @param len - The number of payload bytes, at most MAX_FRAME_PAYLOAD.
+ * @param encKey - The encryption key byte array to use for encryption.
+ * @param intKey - The integrity key byte array to use for integrity.
+ */
+void IoTSec::sendInPlace(byte frame[], byte len, byte* encKey, byte* intKey) {
+    if (len > MAX_FRAME_PAYLOAD) {
+        len = MAX_FRAME_PAYLOAD;
+    }
+    this->setListening(false);
+    byte* body = frame + MAX_HEADER_SIZE;
+    byte bodyLen = MAX_FRAME_BODY;
+    if (this->dynamicFrames) {
+        bodyLen = FRAME_LEN_LEN + len + HASH_LEN;
+        if (bodyLen < CIPHER_BLOCK_LEN) {
+            bodyLen = CIPHER_BLOCK_LEN;
+        }
+    }
+
+    body[0] = len;
+    memset(body + FRAME_LEN_LEN + len, 0, bodyLen - FRAME_LEN_LEN - len - HASH_LEN);
+    this->selectKeys(encKey, intKey);
+    METRIC_START(macStart);
+    this->beginHMAC();
+    this->hash256->update(frame, MAX_HEADER_SIZE + FRAME_LEN_LEN + len);
+    this->endHMAC(body + bodyLen - HASH_LEN);
+    METRIC_STOP(STAGE_MAC, macStart);
+    this->encryptFrame(body, body, bodyLen);
+
+    this->transmit(frame, MAX_HEADER_SIZE + bodyLen);
+
+    this->incrMsgCount();
+    this->setListening(true);
+}
+
+/*
+ * Receives an encrypted frame from the peer straight into a caller-owned buffer of
+ * MAX_FRAME_SIZE bytes and decrypts and verifies it there. The state header is left in
+ * the first MAX_HEADER_SIZE bytes. getIntegrityPassed() reports whether the HMAC matched.
+ * @param frame - The frame buffer.
+ * @param len - Set to the number of payload bytes.
+ * @param encKey - The encryption key used to decrypt the data.
+ * @param intKey - The integrity key used to verify the integrity.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ * @return where the payload is inside frame, or NULL on a timeout, a malformed frame or
+ * session keys this end does not have.
+ */
+byte* IoTSec::receiveInPlace(byte frame[], byte* len, byte* encKey, byte* intKey, bool block) {
+    this->integrityPassed = false;
+    *len = 0;
+
+    byte packetLen = this->readFrame(frame, MAX_FRAME_SIZE, block);
+    if (packetLen < MAX_HEADER_SIZE + CIPHER_BLOCK_LEN || encKey == NULL || intKey == NULL) {
+        return NULL;
+    }
+    byte* body = frame + MAX_HEADER_SIZE;
+    byte bodyLen = packetLen - MAX_HEADER_SIZE;
+    METRIC_START(verifyStart);
+    this->selectKeys(encKey, intKey);
+    this->integrityPassed = this->openFrame(frame, bodyLen);
+    if (!this->integrityPassed && this->keyContext == &this->sessionContext && this->reinstateDue(this->previousContext.keyId)) {
+        //These frames do not name their keys: put the frame back as it came and try the previous ones.
+        this->encryptFrame(body, body, bodyLen);
+        this->swapSessionKeys();
+        this->integrityPassed = this->openFrame(frame, bodyLen);
+        if (this->integrityPassed) {
+            this->clearPreviousKeys();
+        }
+        else {
+            this->swapSessionKeys();
+        }
+    }
+    if (FRAME_LEN_LEN + body[0] + HASH_LEN > bodyLen) {
+        return NULL;
+    }
+    METRIC_COUNT(integrityFailures, !this->integrityPassed);
+    METRIC_STOP(STAGE_VERIFY, verifyStart);
+
+    *len = body[0];
+    return body + FRAME_LEN_LEN;
+}
+
+/*
+ * Decrypts the body of a frame in place with the keys selectKeys picked and checks its HMAC.
+ * @param frame - The frame, its header first.
+ * @param bodyLen - The length of its body.
+ * @return true if the length inside fits the body and the HMAC matched.
+ */
+bool IoTSec::openFrame(byte frame[], byte bodyLen) {
+    byte* body = frame + MAX_HEADER_SIZE;
+    this->decryptFrame(body, body, bodyLen);
+    if (FRAME_LEN_LEN + body[0] + HASH_LEN > bodyLen) {
+        return false;
+    }
+
+    byte computedHash[HASH_LEN];
+    byte diff = 0;
+    METRIC_START(macStart);
+    this->beginHMAC();
+    this->hash256->update(frame, MAX_HEADER_SIZE + FRAME_LEN_LEN + body[0]);
+    this->endHMAC(computedHash);
+    METRIC_STOP(STAGE_MAC, macStart);
+    for (int i = 0; i < HASH_LEN; i++) {
+        diff |= body[bodyLen - HASH_LEN + i] ^ computedHash[i];
+    }
+    return diff == 0;
+}
+
+/*
+ * Sets which end of the link this is. Each direction of sealed frames has its own half of
+ * the nonces, so the end that starts the handshake sets this and the other leaves it unset.
+ * @param initiator - true on the end that starts the handshake.
+ */
+void IoTSec::setInitiator(bool initiator) {
+    this->initiator = initiator;
+}
+
+/*
+ * Sends a sealed frame to the peer: the payload encrypted and authenticated in one AES-CCM
+ * pass under key, with the state header and payload length as associated data. The frame
+ * is the header, the 1 byte payload length, the ciphertext and a CCM_TAG_LEN byte tag, with
+ * no padding, so any payload length goes out as is. The nonce is a counter kept with the
+ * key's context, so only the secret and session keys can seal, and the session keys should.
+ * @param data - The bytes to encrypt and send.
+ * @param len - The number of bytes, at most MAX_FRAME_PAYLOAD.
+ * @param key - The key to seal with.
+ * @param state - The state header.
+ */
+void IoTSec::sendSealed(byte* data, byte len, byte* key, String state) {
+    if (len > MAX_FRAME_PAYLOAD) {
+        len = MAX_FRAME_PAYLOAD;
+    }
+    byte frame[MAX_FRAME_SIZE];
+    memset(frame, 0, MAX_HEADER_SIZE);
+    createHeader(state, frame);
+    memmove(frame + MAX_HEADER_SIZE + FRAME_LEN_LEN, data, len);
+
+    this->sendSealedInPlace(frame, len, key);
+}
+
+/*
+ * Receives a sealed frame from the peer. See sendSealed. getIntegrityPassed() reports
+ * whether the tag matched.
+ * @param payload - The array to store the data in, at least MAX_FRAME_PAYLOAD bytes.
+ * @param key - The key the frame was sealed with.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ * @return the length of the payload, or 0 on a timeout or malformed frame.
+ */
+byte IoTSec::receiveSealed(byte payload[], byte* key, char* state, bool block) {
+    byte frame[MAX_FRAME_SIZE];
+    byte len;
+    memset(frame, 0, MAX_HEADER_SIZE);
+
+    byte* data = this->receiveSealedInPlace(frame, &len, key, block);
+    memmove(state, frame, MAX_HEADER_SIZE);
+    if (data == NULL) {
+        return 0;
+    }
+    memmove(payload, data, len);
+    return len;
+}
+
+/*
+ * Seals the frame started with beginFrame and sends it to the peer. The frame is the same
+ * as sendSealed's and holds it afterwards.
+ * @param frame - The frame buffer.
+ * @param len - The number of payload bytes, at most MAX_FRAME_PAYLOAD.
+ * @param key - The key to seal with.
+ */
+void IoTSec::sendSealedInPlace(byte frame[], byte len, byte* key) {
+    if (len > MAX_FRAME_PAYLOAD) {
+        len = MAX_FRAME_PAYLOAD;
+    }
+    this->selectKeys(key, NULL);
+    if (this->keyContext == NULL) {
+        LOG_ERROR(LOG_SEAL_NO_KEY);
+        return;
+    }
+    //The initiator moves to new keys as soon as it has them; the other end answers in the keys it was spoken to in.
+    if (this->keyContext == &this->sessionContext && !this->initiator && this->peerOnPrevious
+        && this->previousContext.encKey != NULL) {
+        this->useContext(&this->previousContext);
+    }
+    this->setListening(false);
+    byte nonce[CCM_NONCE_LEN];
+    this->ccmNonce(nonce, this->initiator, this->keyContext->sendCount++);
+
+    frame[MAX_HEADER_SIZE - 1] = this->keyContext->keyId;
+    frame[MAX_HEADER_SIZE] = len;
+    byte* payload = frame + MAX_HEADER_SIZE + FRAME_LEN_LEN;
+    byte* tag = payload + len;
+    this->ccmMAC(tag, frame, MAX_HEADER_SIZE + FRAME_LEN_LEN, nonce);
+    this->ccmCrypt(payload, len, tag, nonce);
+
+    byte packetLen = MAX_HEADER_SIZE + FRAME_LEN_LEN + len + CCM_TAG_LEN;
+    if (!this->dynamicFrames) {
+        memset(frame + packetLen, 0, MAX_FRAME_SIZE - packetLen);
+        packetLen = MAX_FRAME_SIZE;
+    }
+    this->transmit(frame, packetLen);
+
+    this->incrMsgCount();
+    this->checkRatchet();
+    this->setListening(true);
+}
+
+/*
+ * Receives a sealed frame from the peer straight into a caller-owned buffer of
+ * MAX_FRAME_SIZE bytes and opens it there. The state header is left in the first
+ * MAX_HEADER_SIZE bytes. getIntegrityPassed() reports whether the tag matched.
+ * @param frame - The frame buffer.
+ * @param len - Set to the number of payload bytes.
+ * @param key - The key the frame was sealed with.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ * @return where the payload is inside frame, or NULL on a timeout, a malformed frame or a key
+ * that cannot seal.
+ */
+byte* IoTSec::receiveSealedInPlace(byte frame[], byte* len, byte* key, bool block) {
+    this->integrityPassed = false;
+    *len = 0;
+
+    byte packetLen = this->readFrame(frame, MAX_FRAME_SIZE, block);
+    if (packetLen < MAX_HEADER_SIZE + FRAME_LEN_LEN + CCM_TAG_LEN) {
+        return NULL;
+    }
+    byte payloadLen = frame[MAX_HEADER_SIZE];
+    if (payloadLen > MAX_FRAME_PAYLOAD || MAX_HEADER_SIZE + FRAME_LEN_LEN + payloadLen + CCM_TAG_LEN > packetLen) {
+        return NULL;
+    }
+    METRIC_START(verifyStart);
+    this->selectKeys(key, NULL);
+    if (this->keyContext == NULL) {
+        return NULL;
+    }
+    byte keyId = frame[MAX_HEADER_SIZE - 1];
+    bool reinstated = this->keyContext == &this->sessionContext && this->reinstateDue(keyId);
+    if (reinstated) {
+        this->swapSessionKeys();
+    }
+    if (this->keyContext == &this->sessionContext && keyId != this->sessionContext.keyId
+        && this->previousContext.encKey != NULL && keyId == this->previousContext.keyId) {
+        if (this->graceLeft == 0) {
+            this->clearPreviousKeys();
+        }
+        else {
+            this->useContext(&this->previousContext);
+        }
+    }
+
+    byte nonce[CCM_NONCE_LEN];
+    byte computedTag[CCM_TAG_LEN];
+    byte diff = 0;
+    byte* payload = frame + MAX_HEADER_SIZE + FRAME_LEN_LEN;
+    byte* tag = payload + payloadLen;
+    this->ccmNonce(nonce, !this->initiator, this->keyContext->receiveCount);
+    this->ccmCrypt(payload, payloadLen, tag, nonce);
+    this->ccmMAC(computedTag, frame, MAX_HEADER_SIZE + FRAME_LEN_LEN, nonce);
+    for (int i = 0; i < CCM_TAG_LEN; i++) {
+        diff |= tag[i] ^ computedTag[i];
+    }
+    this->integrityPassed = (diff == 0);
+    METRIC_COUNT(integrityFailures, !this->integrityPassed);
+    METRIC_STOP(STAGE_VERIFY, verifyStart);
+    if (this->integrityPassed) {
+        this->keyContext->receiveCount++;
+        this->checkRatchet();
+        if (this->keyContext == &this->previousContext) {
+            this->peerOnPrevious = true;
+            this->graceLeft--;
+        }
+        else if (this->keyContext == &this->sessionContext) {
+            this->clearPreviousKeys();                        //The other end has the new keys too.
+        }
+    }
+    else if (reinstated) {
+        this->swapSessionKeys();
+    }
+
+    *len = payloadLen;
+    return payload;
+}
+
+/*
+ * Turns the sliding window on or off. With a window, sendWindowed keeps up to size sealed
+ * frames on their way to the peer without waiting for a reply to each, and the peer
+ * acknowledges them in the radio's ACK payloads, so acknowledgements cost no transmission of
+ * their own. A gateway sends them as frames instead to nodes that share their pipe with
+ * another, see sendWindowAck. Both ends call it and need dynamic frames; the receiving end takes frames from
+ * any window up to MAX_WINDOW. Resets the window.
+ * @param size - Frames left unacknowledged at most, up to MAX_WINDOW; 0 for stop-and-wait.
+ */
+void IoTSec::setWindow(byte size) {
+    this->windowSize = size > MAX_WINDOW ? MAX_WINDOW : size;
+    this->resetWindow();
+    if (this->windowSize > 0) {
+        this->radio->enableAckPayload();
+    }
+    else {
+        this->radio->disableAckPayload();
+    }
+}
+
+/*
+ * Returns true if sendWindowed can send another frame now.
+ */
+bool IoTSec::windowOpen() {
+    return this->windowSpan < this->windowSize;
+}
+
+/*
+ * Returns the number of window frames from the oldest unacknowledged one to the last sent,
+ * 0 once everything sent has been acknowledged.
+ */
+byte IoTSec::windowInFlight() {
+    return this->windowSpan;
+}
+
+/*
+ * Returns the number of the oldest unacknowledged window frame; every frame before it has been
+ * acknowledged. Frames are numbered from 0 with each new set of session keys, and on across
+ * their ratchets.
+ */
+unsigned long IoTSec::getWindowBase() {
+    return this->windowRatcheted + this->windowBase;
+}
+
+/*
+ * Returns true once a window frame was sent WINDOW_RETRIES times over without being
+ * acknowledged. The window was emptied; the peer has most likely lost the session keys.
+ */
+bool IoTSec::windowFailed() {
+    return this->windowLost;
+}
+
+/*
+ * Sends a frame to the peer through the sliding window set with setWindow. The frame is
+ * sealed like sendSealed's, with the low byte of its number between the header and the length
+ * so it can be opened out of order, and kept until the peer acknowledges it. poll sends it
+ * again if that takes WINDOW_TIMEOUT, so call poll every loop. Only the session keys can seal.
+ * Once RATCHET_INTERVAL frames have gone under the keys and all of them are acknowledged, the
+ * keys are ratcheted before the next one, which carries the ratchet in WINDOW_RATCHET_BIT.
+ * @param data - The bytes to encrypt and send.
+ * @param len - The number of bytes, at most MAX_WINDOW_PAYLOAD.
+ * @param key - The key to seal with.
+ * @return false if the window is full or the key cannot seal, in which case nothing was sent.
+ */
+bool IoTSec::sendWindowed(byte* data, byte len, byte* key) {
+    if (!this->windowOpen()) {
+        return false;
+    }
+    if (len > MAX_WINDOW_PAYLOAD) {
+        len = MAX_WINDOW_PAYLOAD;
+    }
+    this->selectKeys(key, NULL);
+    if (this->keyContext != &this->sessionContext) {
+        LOG_ERROR(LOG_WINDOW_NO_KEY);
+        return false;
+    }
+    if (this->windowSpan == 0) {
+        if (this->sessionContext.sendCount >= RATCHET_INTERVAL && this->handshakeComplete && !this->windowLost) {
+            //Nothing sealed under the old keys is left to send again, so the peer can ratchet on this frame.
+            this->windowRatcheted += this->sessionContext.sendCount;
+            this->ratchetKeys(&this->sessionContext);
+        }
+        this->windowBase = this->sessionContext.sendCount;
+    }
+    unsigned long number = this->sessionContext.sendCount++;
+    WindowSlot* slot = &this->window[number % MAX_WINDOW];
+    byte* frame = slot->frame.data;
+    byte* payload = frame + WINDOW_HEADER_LEN;
+    byte nonce[CCM_NONCE_LEN];
+
+    frame[0] = WINDOW_STATE;
+    frame[MAX_HEADER_SIZE - 1] = this->sessionContext.keyId;
+    frame[MAX_HEADER_SIZE] = (byte)number;
+    frame[WINDOW_HEADER_LEN - 1] = len | this->ratchetBit();
+    memmove(payload, data, len);
+    this->ccmNonce(nonce, this->initiator, number);
+    this->ccmMAC(payload + len, frame, WINDOW_HEADER_LEN, nonce);
+    this->ccmCrypt(payload, len, payload + len, nonce);
+
+    slot->frame.len = WINDOW_HEADER_LEN + len + CCM_TAG_LEN;
+    if (!this->dynamicFrames) {
+        memset(frame + slot->frame.len, 0, MAX_FRAME_SIZE - slot->frame.len);
+        slot->frame.len = MAX_FRAME_SIZE;
+    }
+    slot->retries = 0;
+    this->windowSpan++;
+    this->sendWindowFrame(slot);
+    this->incrMsgCount();
+    return true;
+}
+
+/*
+ * Receives a frame of the peer's sliding window straight into a caller-owned buffer of
+ * MAX_FRAME_SIZE bytes and opens it there, then loads the acknowledgement of everything
+ * received so far into the radio, to go back on the auto-ACK of the peer's next frame.
+ * Frames may come out of order. One received before is acknowledged again but its payload is
+ * not handed back twice. The state header is left in the first MAX_HEADER_SIZE bytes and
+ * getIntegrityPassed() reports whether the tag matched. A frame whose WINDOW_RATCHET_BIT
+ * has flipped ratchets the session keys, if it checks out under the ratcheted ones.
+ * @param frame - The frame buffer.
+ * @param len - Set to the number of payload bytes, 0 for a frame received before.
+ * @param key - The key the frame was sealed with.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ * @return where the payload is inside frame, or NULL on a timeout, a repeated or malformed
+ * frame or a key that cannot seal.
+ */
+byte* IoTSec::receiveWindowedInPlace(byte frame[], byte* len, byte* key, bool block) {
+    this->integrityPassed = false;
+    *len = 0;
+
+    byte packetLen = this->readFrame(frame, MAX_FRAME_SIZE, block);
+    if (packetLen < WINDOW_HEADER_LEN + CCM_TAG_LEN) {
+        return NULL;
+    }
+    byte payloadLen = frame[WINDOW_HEADER_LEN - 1] & ~WINDOW_RATCHET_BIT;
+    if (payloadLen > MAX_WINDOW_PAYLOAD || WINDOW_HEADER_LEN + payloadLen + CCM_TAG_LEN > packetLen) {
+        return NULL;
+    }
+    METRIC_START(verifyStart);
+    this->selectKeys(key, NULL);
+    bool reinstated = this->keyContext == &this->sessionContext && this->reinstateDue(frame[MAX_HEADER_SIZE - 1]);
+    if (reinstated) {
+        this->swapSessionKeys();
+    }
+    if (this->keyContext != &this->sessionContext || frame[MAX_HEADER_SIZE - 1] != this->sessionContext.keyId) {
+        return NULL;
+    }
+
+    //The peer ratchets only once everything it sent before was acknowledged, see sendWindowed. A flipped
+    //bit before that is a frame from before the last ratchet, sent again while its acknowledgement was on the way.
+    byte kept[KEY_DATA_LEN + HASH_KEY_LEN];
+    unsigned long keptCounts[2] = {this->sessionContext.sendCount, this->sessionContext.receiveCount};
+    bool ratchet = (frame[WINDOW_HEADER_LEN - 1] & WINDOW_RATCHET_BIT) != this->ratchetBit();
+    if (ratchet) {
+        if (this->sessionContext.receiveCount < RATCHET_INTERVAL || this->windowReceived != 0) {
+            if (reinstated) {
+                this->swapSessionKeys();
+            }
+            return NULL;
+        }
+        memmove(kept, this->sessionKeys, KEY_DATA_LEN + HASH_KEY_LEN);
+        this->ratchetKeys(&this->sessionContext);
+    }
+
+    //The frame's number, rebuilt from its low byte around the next one expected in order.
+    unsigned long expected = this->sessionContext.receiveCount;
+    signed char ahead = (signed char)(frame[MAX_HEADER_SIZE] - (byte)expected);
+    if (ahead > WINDOW_RECEIVE_SPAN || (ahead < 0 && (unsigned long)(-ahead) > expected)) {
+        if (reinstated) {
+            this->swapSessionKeys();
+        }
+        return NULL;
+    }
+    unsigned long number = expected + ahead;
+
+    byte nonce[CCM_NONCE_LEN];
+    byte computedTag[CCM_TAG_LEN];
+    byte diff = 0;
+    byte* payload = frame + WINDOW_HEADER_LEN;
+    byte* tag = payload + payloadLen;
+    this->ccmNonce(nonce, !this->initiator, number);
+    this->ccmCrypt(payload, payloadLen, tag, nonce);
+    this->ccmMAC(computedTag, frame, WINDOW_HEADER_LEN, nonce);
+    for (int i = 0; i < CCM_TAG_LEN; i++) {
+        diff |= tag[i] ^ computedTag[i];
+    }
+    this->integrityPassed = (diff == 0);
+    METRIC_COUNT(integrityFailures, !this->integrityPassed);
+    METRIC_STOP(STAGE_VERIFY, verifyStart);
+    if (ratchet && !this->integrityPassed) {
+        //Not the peer's: put the keys back as they were.
+        byte keyId = this->sessionContext.keyId;
+        memmove(this->sessionKeys, kept, KEY_DATA_LEN + HASH_KEY_LEN);
+        this->buildContext(&this->sessionContext, this->masterKey, this->hashKey);
+        this->sessionContext.keyId = keyId;
+        this->sessionContext.sendCount = keptCounts[0];
+        this->sessionContext.receiveCount = keptCounts[1];
+        this->ratchetCount--;
+    }
+    if (ratchet) {
+        clean(kept, KEY_DATA_LEN + HASH_KEY_LEN);
+    }
+    if (reinstated && !this->integrityPassed) {
+        this->swapSessionKeys();
+    }
+    else if (reinstated) {
+        this->clearPreviousKeys();
+    }
+    if (!this->integrityPassed) {
+        return NULL;
+    }
+
+    bool repeat = ahead < 0 || (ahead > 0 && ((this->windowReceived >> (ahead - 1)) & 1));
+    if (ahead == 0) {
+        //Move past this frame and any received ahead of it.
+        this->sessionContext.receiveCount++;
+        while (this->windowReceived & 1) {
+            this->windowReceived >>= 1;
+            this->sessionContext.receiveCount++;
+        }
+        this->windowReceived >>= 1;
+    }
+    else if (ahead > 0) {
+        this->windowReceived |= 1 << (ahead - 1);
+    }
+    this->sendWindowAck();
+    if (repeat) {
+        return NULL;
+    }
+
+    *len = payloadLen;
+    return payload;
+}
+
+/*
+ * Sends a window frame, or sends it again, and notes when.
+ * @param slot - The frame's slot.
+ */
+void IoTSec::sendWindowFrame(WindowSlot* slot) {
+    slot->sentAt = micros();
+    slot->order = this->windowTransmissions++;
+    this->setListening(false);
+    this->transmit(slot->frame.data, slot->frame.len);
+    this->setListening(true);
+}
+
+/*
+ * Loads the acknowledgement of the window frames received so far into the radio as the ACK
+ * payload of the pipe the last frame came in on, in place of any not sent yet: the next frame
+ * expected in order, then a bit for each of the WINDOW_RECEIVE_SPAN after it already received.
+ * It is sealed under the session keys like a window frame, numbered with this end's sealed
+ * frames. Nothing is loaded while a frame of this end's own waits to go, since the radio would
+ * send the payload as an ordinary packet.
+ *
+ * A pipe's ACK payload goes back to whichever node sends on it next, so a gateway whose pipe has
+ * been heard from more than one node queues the acknowledgement as a frame of its own instead.
+ */
+void IoTSec::sendWindowAck() {
+    SessionTable* table = this->radioOwner->sessionTable;
+    bool ownFrame = table != NULL && this->eventDriven && table->pipeNode[this->rxPipe] == -2;
+    if (!ownFrame && this->sendPending()) {
+        return;
+    }
+    byte* frame = this->windowAck + NODE_ID_LEN;
+    byte* payload = frame + WINDOW_HEADER_LEN;
+    byte nonce[CCM_NONCE_LEN];
+    unsigned long number = this->sessionContext.sendCount++;
+
+    frame[0] = WINDOW_ACK_STATE;
+    frame[MAX_HEADER_SIZE - 1] = this->sessionContext.keyId;
+    frame[MAX_HEADER_SIZE] = (byte)number;
+    frame[WINDOW_HEADER_LEN - 1] = WINDOW_ACK_LEN | this->ratchetBit();
+    payload[0] = (byte)this->sessionContext.receiveCount;
+    payload[1] = this->windowReceived;
+    this->useContext(&this->sessionContext);
+    this->ccmNonce(nonce, this->initiator, number);
+    this->ccmMAC(payload + WINDOW_ACK_LEN, frame, WINDOW_HEADER_LEN, nonce);
+    this->ccmCrypt(payload, WINDOW_ACK_LEN, payload + WINDOW_ACK_LEN, nonce);
+
+    this->windowAck[0] = this->nodeId;
+    if (ownFrame) {
+        this->queueWindowAck();
+        return;
+    }
+
+    this->radio->flush_tx();
+    if (table != NULL) {
+        //The radio cannot drop a single pipe's payload, so the other pipes' go back in.
+        for (byte pipe = 0; pipe < MAX_PIPES; ++pipe) {
+            IoTSec* session = table->ackLoaded[pipe] != NO_SESSION && pipe != this->rxPipe
+                ? table->entries[table->ackLoaded[pipe]].session : NULL;
+            if (session != NULL) {
+                this->radio->writeAckPayload(pipe, session->windowAck, sizeof(session->windowAck));
+            }
+        }
+        table->ackLoaded[this->rxPipe] = this->sessionEntry;
+    }
+    this->radio->writeAckPayload(this->rxPipe, this->windowAck, sizeof(this->windowAck));
+}
+
+/*
+ * Queues the acknowledgement in windowAck to go to the node as a frame of its own. One still
+ * waiting to go is replaced, as the newer one covers everything it did; with the queue full it
+ * is left out, and the node sends its window frames again.
+ */
+void IoTSec::queueWindowAck() {
+    QueuedFrame* out = NULL;
+    for (byte i = 0; i < this->txCount && out == NULL; ++i) {
+        QueuedFrame* queued = &this->txQueue[(this->txHead + i) % FRAME_QUEUE_LEN];
+        if (queued->data[0] == WINDOW_ACK_STATE) {
+            out = queued;
+        }
+    }
+    if (out == NULL) {
+        if (this->txCount == FRAME_QUEUE_LEN) {
+            return;
+        }
+        out = &this->txQueue[(this->txHead + this->txCount) % FRAME_QUEUE_LEN];
+        this->txCount++;
+        this->queueTurn(true);                                //poll starts it.
+    }
+    out->len = sizeof(this->windowAck) - NODE_ID_LEN;
+    memmove(out->data, this->windowAck + NODE_ID_LEN, out->len);
+}
+
+/*
+ * Notes on a gateway that a frame came in on a pipe, taking the ACK payload loaded there back
+ * with its auto-ACK. Nodes share pipes, so the payload may have gone to another node than the
+ * one it was for: that acknowledgement is queued again as a frame of its own, and from then on
+ * sendWindowAck sends the pipe's acknowledgements that way.
+ * @param pipe - The pipe it came in on.
+ * @param nodeId - The node it came from.
+ */
+void IoTSec::pipeHeard(byte pipe, byte nodeId) {
+    SessionTable* table = this->sessionTable;
+    if (table->pipeNode[pipe] != nodeId) {
+        table->pipeNode[pipe] = table->pipeNode[pipe] == -1 ? nodeId : -2;
+    }
+    unsigned int loaded = table->ackLoaded[pipe];
+    table->ackLoaded[pipe] = NO_SESSION;
+    if (loaded != NO_SESSION && table->entries[loaded].session->nodeId != nodeId && this->eventDriven) {
+        table->entries[loaded].session->queueWindowAck();
+    }
+}
+
+/*
+ * Takes in an acknowledgement that came back on the radio's ACK. The frames it covers leave
+ * the window, and a frame it shows missing behind one sent after it is taken as lost and
+ * sent again by the next poll. Acknowledgements under other keys or from before the last
+ * ratchet, with a bad tag or older than the window are ignored.
+ * @param frame - The acknowledgement as it came off the radio, opened in place.
+ * @param packetLen - Its length.
+ */
+void IoTSec::processAck(byte frame[], byte packetLen) {
+    if (packetLen < WINDOW_HEADER_LEN + WINDOW_ACK_LEN + CCM_TAG_LEN || frame[WINDOW_HEADER_LEN - 1] != (WINDOW_ACK_LEN | this->ratchetBit())
+        || this->sessionContext.encKey == NULL || frame[MAX_HEADER_SIZE - 1] != this->sessionContext.keyId) {
+        return;
+    }
+    //Acknowledgements are numbered in order, but any may be lost: take the next number with that low byte.
+    unsigned long expected = this->sessionContext.receiveCount;
+    unsigned long number = expected + (byte)(frame[MAX_HEADER_SIZE] - (byte)expected);
+    METRIC_START(verifyStart);
+
+    byte nonce[CCM_NONCE_LEN];
+    byte computedTag[CCM_TAG_LEN];
+    byte diff = 0;
+    byte* payload = frame + WINDOW_HEADER_LEN;
+    byte* tag = payload + WINDOW_ACK_LEN;
+    CryptoContext* sending = this->keyContext;              //This can run inside a send, whose keys must survive it,
+    byte* keyed = IoTSec::keyedKey;                         //be it this session's or another's.
+    this->useContext(&this->sessionContext);
+    this->ccmNonce(nonce, !this->initiator, number);
+    this->ccmCrypt(payload, WINDOW_ACK_LEN, tag, nonce);
+    this->ccmMAC(computedTag, frame, WINDOW_HEADER_LEN, nonce);
+    this->keyContext = sending;
+    if (keyed != NULL && keyed != IoTSec::keyedKey) {
+        this->encCipher->setKey(keyed, KEY_DATA_LEN);
+        IoTSec::keyedKey = keyed;
+    }
+    for (int i = 0; i < CCM_TAG_LEN; i++) {
+        diff |= tag[i] ^ computedTag[i];
+    }
+    METRIC_COUNT(integrityFailures, diff != 0);
+    METRIC_STOP(STAGE_VERIFY, verifyStart);
+    if (diff != 0) {
+        return;
+    }
+    this->sessionContext.receiveCount = number + 1;
+
+    byte inOrder = (byte)(payload[0] - (byte)this->windowBase);
+    if (inOrder > this->windowSpan) {
+        return;
+    }
+    byte acked = this->windowAcked;
+    for (byte i = 0; i < this->windowSpan; ++i) {
+        if (i < inOrder || (i > inOrder && ((payload[1] >> (i - inOrder - 1)) & 1))) {
+            acked |= 1 << i;
+        }
+    }
+
+    //Of the frames acknowledged just now, find the one that went out last. Unless it went out
+    //more than once, how long its acknowledgement took is a round trip sample.
+    WindowSlot* last = NULL;
+    for (byte i = 0; i < this->windowSpan; ++i) {
+        WindowSlot* slot = &this->window[(this->windowBase + i) % MAX_WINDOW];
+        if ((((acked & ~this->windowAcked) >> i) & 1) && (last == NULL || (signed char)(slot->order - last->order) > 0)) {
+            last = slot;
+        }
+    }
+    if (last != NULL) {
+        unsigned long now = micros();
+        if (last->retries == 0) {
+            this->timerSample(&this->windowTimer, now - last->sentAt);
+        }
+        this->windowTimer.backoff = 0;
+        for (byte i = 0; i < this->windowSpan; ++i) {
+            WindowSlot* slot = &this->window[(this->windowBase + i) % MAX_WINDOW];
+            if (!((acked >> i) & 1) && (signed char)(last->order - slot->order) > 0) {
+                slot->sentAt = now - this->timerTimeout(&this->windowTimer);
+            }
+        }
+    }
+
+    this->windowAcked = acked;
+    while (this->windowSpan > 0 && (this->windowAcked & 1)) {
+        this->windowAcked >>= 1;
+        this->windowBase++;
+        this->windowSpan--;
+    }
+}
+
+/*
+ * Sends again the oldest window frame left unacknowledged for the window's retransmission
+ * timeout, one per call and only while nothing else waits to go. The timeout starts at
+ * WINDOW_TIMEOUT, follows how long acknowledgements take, and doubles with each frame sent
+ * again until one is acknowledged. A frame that has been sent WINDOW_RETRIES times over gives
+ * up on the whole window, see windowFailed.
+ */
+void IoTSec::checkWindow() {
+    if (this->windowSpan == 0 || this->sendPending()) {
+        return;
+    }
+    unsigned long now = micros();
+    unsigned long timeout = this->timerTimeout(&this->windowTimer);
+    for (byte i = 0; i < this->windowSpan; ++i) {
+        WindowSlot* slot = &this->window[(this->windowBase + i) % MAX_WINDOW];
+        if (((this->windowAcked >> i) & 1) || now - slot->sentAt < timeout) {
+            continue;
+        }
+        if (slot->retries == WINDOW_RETRIES) {
+            LOG_WARN(LOG_WINDOW_FAILED);
+            this->resetWindow();
+            this->windowLost = true;
+            return;
+        }
+        slot->retries++;
+        this->timerBackoff(&this->windowTimer);
+        this->sendWindowFrame(slot);
+        return;
+    }
+}
+
+/*
+ * Empties the sliding window. Frames not acknowledged yet are given up on, and frames received
+ * ahead of the next one expected are forgotten.
+ */
+void IoTSec::resetWindow() {
+    this->windowBase = 0;
+    this->windowRatcheted = 0;
+    this->windowSpan = 0;
+    this->windowAcked = 0;
+    this->windowLost = false;
+    this->windowReceived = 0;
+}
+
+/*
+ * Returns true the first time the peer sends a sequence number, which it counts up by one for
+ * each thing it sends, such as its readings, wrapping at 65535; false for one seen before. The
+ * numbers seen outlast handshakes, so something sent again under new keys after its
+ * acknowledgement was lost is caught, and are forgotten with the session. A number more than
+ * SEQUENCE_SPAN below the highest one seen is taken as the peer counting from somewhere new.
+ * @param sequence - The number, as the peer sent it.
+ */
+bool IoTSec::freshSequence(unsigned int sequence) {
+    int ahead = (int16_t)(sequence - this->sequenceHigh);
+    if (this->sequenceSeen == 0 || ahead <= -SEQUENCE_SPAN) {
+        ahead = SEQUENCE_SPAN;
+    }
+    if (ahead > 0) {
+        this->sequenceSeen = ahead < SEQUENCE_SPAN ? this->sequenceSeen << ahead : 0;
+        this->sequenceSeen |= 1;
+        this->sequenceHigh = sequence;
+        return true;
+    }
+    unsigned long long bit = 1ULL << -ahead;
+    if (this->sequenceSeen & bit) {
+        return false;
+    }
+    this->sequenceSeen |= bit;
+    return true;
+}
+
+/*
+ * Ratchets the session keys the last sealed frame used once RATCHET_INTERVAL sealed frames
+ * have passed each way under them. The initiator gets there when the reply to its last frame
+ * checks out and the other end when it sends that reply, so both step on the same exchange
+ * without sending anything. A lost or forged frame stops the counts agreeing, which fails
+ * the next tag and sends the ends back to the handshake. Window frames ratchet the keys in
+ * sendWindowed and receiveWindowedInPlace instead.
+ */
+void IoTSec::checkRatchet() {
+    if ((this->keyContext != &this->sessionContext && this->keyContext != &this->previousContext)
+        || !this->handshakeComplete) {
+        return;
+    }
+    if (this->keyContext->sendCount >= RATCHET_INTERVAL && this->keyContext->receiveCount >= RATCHET_INTERVAL) {
+        this->ratchetKeys(this->keyContext);
+    }
+}
+
+/*
+ * Returns WINDOW_RATCHET_BIT if the session keys have been ratcheted an odd number of times since
+ * the handshake, 0 if not. Window frames and their acknowledgements carry it in their length byte.
+ */
+byte IoTSec::ratchetBit() {
+    return (this->ratchetCount & 1) ? WINDOW_RATCHET_BIT : 0;
+}
+
+/*
+ * Replaces a context's keys with HMAC(intKey, encKey || RATCHET_LABEL), the first half
+ * becoming the encryption key and the second the integrity key. The old keys are overwritten
+ * in place, so frames sealed before the ratchet stay safe if the device is later compromised.
+ * @param context - The session or previous context.
+ */
+void IoTSec::ratchetKeys(CryptoContext* context) {
+    byte digest[DIGEST_LEN];
+    byte keyId = context->keyId;
+    this->deriveKeys(context, RATCHET_LABEL, digest);
+    memmove(context->encKey, digest, KEY_DATA_LEN);
+    memmove(context->intKey, digest + KEY_DATA_LEN, HASH_KEY_LEN);
+    clean(digest, DIGEST_LEN);
+    this->buildContext(context, context->encKey, context->intKey);
+    context->keyId = keyId;
+    if (context == &this->sessionContext) {
+        this->ratchetCount++;
+    }
+}
+
+/*
+ * Computes HMAC(intKey, encKey || label) with a context's keys.
+ * @param context - The context whose keys to derive from.
+ * @param label - Separates the things derived from the same keys.
+ * @param digest - Where to store the DIGEST_LEN byte result.
+ */
+void IoTSec::deriveKeys(CryptoContext* context, byte label, byte digest[]) {
+    this->hash256->resetHMAC(context->intKey, HASH_KEY_LEN);
+    this->hash256->update(context->encKey, KEY_DATA_LEN);
+    this->hash256->update(&label, 1);
+    this->hash256->finalizeHMAC(context->intKey, HASH_KEY_LEN, digest, DIGEST_LEN);
+}
+
+/*
+ * Keeps the session keys in use as the previous keys while a handshake replaces them, for at
+ * most KEY_GRACE_FRAMES more sealed frames, or on a responder until the peer is heard on the new
+ * ones, see reinstateDue. Keys the other end never sealed a frame with are dropped instead, so
+ * a handshake that failed halfway cannot push out the keys still carrying data.
+ */
+void IoTSec::retireSessionKeys() {
+    if (this->previousContext.encKey == NULL || this->sessionKeysHeard()) {
+        this->clearPreviousKeys();
+        memmove(this->previousKeys, this->sessionKeys, KEY_DATA_LEN + HASH_KEY_LEN);
+        this->previousMasterKey = this->previousKeys;
+        this->previousHashKey = this->previousKeys + KEY_DATA_LEN;
+        //The previous keys are expanded in the shared cipher when picked, so only their counts carry over.
+        this->buildContext(&this->previousContext, this->previousMasterKey, this->previousHashKey);
+        this->previousContext.sendCount = this->sessionContext.sendCount;
+        this->previousContext.receiveCount = this->sessionContext.receiveCount;
+        this->previousContext.keyId = this->sessionContext.keyId;
+        this->previousMsgs = this->numMsgs;
+        this->previousRatchets = this->ratchetCount;
+        this->previousLinkNumber = this->linkNumber;
+        this->graceLeft = KEY_GRACE_FRAMES;
+    }
+    clean(this->sessionKeys, KEY_DATA_LEN + HASH_KEY_LEN);
+    this->masterKey = NULL;
+    this->hashKey = NULL;
+    this->clearContext(&this->sessionContext);
+}
+
+/*
+ * Wipes the previous session keys.
+ */
+void IoTSec::clearPreviousKeys() {
+    this->clearContext(&this->previousContext);
+    if (this->previousMasterKey != NULL) {
+        clean(this->previousKeys, KEY_DATA_LEN + HASH_KEY_LEN);
+        this->previousMasterKey = NULL;
+        this->previousHashKey = NULL;
+    }
+    this->peerOnPrevious = false;
+    this->graceLeft = 0;
+}
+
+/*
+ * Returns true once the peer has been heard on the session keys, so it is known to hold them.
+ */
+bool IoTSec::sessionKeysHeard() {
+    return this->sessionContext.receiveCount != 0 || this->ratchetCount != 0 || this->windowReceived != 0;
+}
+
+/*
+ * Returns true on a responder whose peer sends a frame under the previous session keys before it
+ * has sent any under the ones the last handshake made, when the previous keys should be put back
+ * with swapSessionKeys, and swapped out again if the frame fails. A hello played again makes keys
+ * the peer never had, and they must not push out the ones it is using, while a handshake it did
+ * run has it on the new keys from its next frame.
+ * @param keyId - The keys the frame names.
+ */
+bool IoTSec::reinstateDue(byte keyId) {
+    return !this->initiator && this->previousContext.encKey != NULL && keyId != this->sessionContext.keyId
+        && keyId == this->previousContext.keyId && !this->sessionKeysHeard();
+}
+
+/*
+ * Swaps the session keys and the previous ones, with what was counted under each: frames,
+ * messages, ratchets and link proposals. Leaves the session keys picked.
+ */
+void IoTSec::swapSessionKeys() {
+    for (byte i = 0; i < KEY_DATA_LEN + HASH_KEY_LEN; ++i) {
+        byte key = this->sessionKeys[i];
+        this->sessionKeys[i] = this->previousKeys[i];
+        this->previousKeys[i] = key;
+    }
+    CryptoContext session = this->sessionContext;
+    CryptoContext previous = this->previousContext;
+    this->buildContext(&this->sessionContext, this->masterKey, this->hashKey);
+    this->buildContext(&this->previousContext, this->previousMasterKey, this->previousHashKey);
+    this->sessionContext.sendCount = previous.sendCount;
+    this->sessionContext.receiveCount = previous.receiveCount;
+    this->sessionContext.keyId = previous.keyId;
+    this->previousContext.sendCount = session.sendCount;
+    this->previousContext.receiveCount = session.receiveCount;
+    this->previousContext.keyId = session.keyId;
+
+    int msgs = this->numMsgs;
+    unsigned int ratchets = this->ratchetCount;
+    unsigned int linkNumber = this->linkNumber;
+    this->numMsgs = this->previousMsgs;
+    this->ratchetCount = this->previousRatchets;
+    this->linkNumber = this->previousLinkNumber;
+    this->previousMsgs = msgs;
+    this->previousRatchets = ratchets;
+    this->previousLinkNumber = linkNumber;
+    this->useContext(&this->sessionContext);
+}
+
+/*
+ * Switches to event-driven radio I/O, so nothing waits on the radio. Sends queue their
+ * packet and return straight away, and poll puts queued packets on air one at a time.
+ * Receives take the oldest frame poll has moved off the radio and return nothing when there
+ * is none, so check frameAvailable first and keep your own timeout. The radio's IRQ pin
+ * must call radioInterrupt, e.g. through attachInterrupt, and loop must call poll.
+ * @param enable - true for event-driven I/O, false to wait on the radio as before.
+ */
+void IoTSec::setEventDriven(bool enable) {
+    bool txOk;
+    bool txFail;
+    bool rxReady;
+    this->eventDriven = enable;
+    this->radioEvent = enable;                                //Picks up frames already in the RX FIFO.
+    this->txBusy = false;
+    this->rxHead = 0;
+    this->rxCount = 0;
+    this->txHead = 0;
+    this->txCount = 0;
+    this->radio->maskIRQ(!enable, !enable, !enable);
+    this->radio->whatHappened(txOk, txFail, rxReady);         //Stale flags would hold the IRQ pin low.
+    this->radio->startListening();
+}
+
+/*
+ * Sets the ID this node sends in front of every frame, so a gateway can tell its frames from
+ * other nodes' and keep a session for each, see setGateway. Frames that come in with another
+ * ID are dropped, as they are meant for another node listening on the same address. Both ends
+ * of a link without a gateway keep the ID they start with, 0.
+ * @param id - The node ID.
+ */
+void IoTSec::setNodeId(byte id) {
+    this->nodeId = id;
+}
+
+/*
+ * Returns the node ID sent in front of every frame: this node's, or on a gateway the ID of the
+ * node at the far end of the session.
+ */
+byte IoTSec::getNodeId() {
+    return this->nodeId;
+}
+
+/*
+ * Makes this end a gateway keeping a session, with its own keys, counters and window, for each
+ * node it hears from, up to MAX_SESSIONS. A node's session opens the first time its ID comes in
+ * and frames with the ID go to its RX queue; its sends go on air to the address the node listens
+ * on. When the table is full the session idle longest is closed for the new node, and poll closes
+ * sessions not heard from for SESSION_IDLE_TIMEOUT milliseconds; their nodes find out when their
+ * next frame fails integrity, as after a gateway restart. The node ID is not authenticated, but
+ * a frame under another node's ID only fails integrity under that session's keys. Every session
+ * is made here, in static storage that holds one gateway at a time, so none of them takes the heap
+ * and IOTSEC_GATEWAY_SRAM counts them all at build time. Needs event-driven
+ * I/O; call after the other options, which every session takes from this one, then read with
+ * nextSession.
+ * @param address - The address nodes listen on; its first byte is replaced with the node's ID.
+ */
+void IoTSec::setGateway(byte* address) {
+    if (this->sessionTable != NULL) {
+        return;
+    }
+    if (gatewayTableUsed) {
+        return;
+    }
+    gatewayTableUsed = true;
+    SessionTable* table = &gatewayTable;
+    this->sessionTable = table;
+    for (unsigned int i = 0; i < SESSION_INDEX_LEN; ++i) {
+        table->index[i] = NO_SESSION;
+    }
+    for (unsigned int i = 0; i < MAX_SESSIONS; ++i) {
+        SessionEntry* entry = &table->entries[i];
+        entry->session = i == 0 ? this : new (gatewaySessions[i - 1]) IoTSec(this->radio, this->encCipher, this->hash256);
+        entry->session->radioOwner = this;
+        entry->session->sessionEntry = i;
+        entry->session->dynamicFrames = this->dynamicFrames;
+        entry->session->eventDriven = this->eventDriven;
+        entry->session->windowSize = this->windowSize;
+        entry->session->initiator = this->initiator;
+        entry->session->linkAdapt = this->linkAdapt;
+        entry->session->link.paLevel = this->link.paLevel;
+        entry->used = false;
+        entry->rxTurn = false;
+        entry->txTurn = false;
+        entry->newer = NO_SESSION;
+        entry->older = i + 1 < MAX_SESSIONS ? i + 1 : NO_SESSION;
+    }
+    table->newest = NO_SESSION;
+    table->oldest = NO_SESSION;
+    table->free = 0;
+    table->rxHead = 0;
+    table->rxCount = 0;
+    table->txHead = 0;
+    table->txCount = 0;
+    for (byte pipe = 0; pipe < MAX_PIPES; ++pipe) {
+        table->ackLoaded[pipe] = NO_SESSION;
+        table->pipeNode[pipe] = -1;
+    }
+    memmove(table->address, address, ADDRESS_LEN);
+    table->writingNode = -1;
+}
+
+/*
+ * Polls the radio and returns the next session with a frame to read, or NULL if none has one.
+ * On a gateway sessions take turns a frame at a time in the order their frames came in, so a
+ * node sending a lot cannot hold up the others; read exactly one frame from the session
+ * returned. On a node it is this end whenever a frame is queued.
+ */
+IoTSec* IoTSec::nextSession() {
+    this->poll();
+    SessionTable* table = this->sessionTable;
+    if (table == NULL) {
+        return this->rxCount > 0 ? this : NULL;
+    }
+    while (table->rxCount > 0) {
+        SessionEntry* entry = &table->entries[table->rxTurns[table->rxHead]];
+        table->rxHead = (table->rxHead + 1) % MAX_SESSIONS;
+        table->rxCount--;
+        entry->rxTurn = false;
+        if (!entry->used || entry->session->rxCount == 0) {
+            continue;                                         //Closed or emptied since its turn was queued.
+        }
+        if (entry->session->rxCount > 1) {
+            entry->session->queueTurn(false);                 //Its next frame waits for the other sessions'.
+        }
+        return entry->session;
+    }
+    return NULL;
+}
+
+/*
+ * Returns the number of sessions a gateway has open, 1 on a node.
+ */
+unsigned int IoTSec::getSessionCount() {
+    SessionTable* table = this->sessionTable;
+    if (table == NULL) {
+        return 1;
+    }
+    unsigned int count = 0;
+    for (unsigned int entry = table->newest; entry != NO_SESSION; entry = table->entries[entry].older) {
+        count++;
+    }
+    return count;
+}
+
+/*
+ * Returns the session a frame with a node ID goes to, or NULL if it is meant for another node.
+ * A gateway opens a session for a node it has none with, and notes the node was heard from.
+ * @param nodeId - The node ID in front of the frame.
+ */
+IoTSec* IoTSec::sessionFor(byte nodeId) {
+    if (this->sessionTable == NULL) {
+        return nodeId == this->nodeId ? this : NULL;
+    }
+    unsigned int entry = this->findSession(nodeId);
+    if (entry == NO_SESSION) {
+        entry = this->openSession(nodeId);
+    }
+    this->touchSession(entry);
+    return this->sessionTable->entries[entry].session;
+}
+
+/*
+ * Returns the entry of a gateway's session with a node, NO_SESSION if it has none. The index is
+ * probed from the slot the node ID hashes to until the node or an empty slot turns up.
+ * @param nodeId - The node.
+ */
+unsigned int IoTSec::findSession(byte nodeId) {
+    SessionTable* table = this->sessionTable;
+    for (unsigned int i = 0; i < SESSION_INDEX_LEN; ++i) {
+        unsigned int entry = table->index[(nodeId + i) & (SESSION_INDEX_LEN - 1)];
+        if (entry == NO_SESSION || table->entries[entry].nodeId == nodeId) {
+            return entry;
+        }
+    }
+    return NO_SESSION;
+}
+
+/*
+ * Opens a gateway's session with a node it has none with, closing the session idle longest
+ * when the table is full, and returns its entry. touchSession puts it in the order heard from.
+ * @param nodeId - The node.
+ */
+unsigned int IoTSec::openSession(byte nodeId) {
+    SessionTable* table = this->sessionTable;
+    if (table->free == NO_SESSION) {
+        this->closeSession(table->oldest);
+    }
+    unsigned int entry = table->free;
+    SessionEntry* opened = &table->entries[entry];
+    table->free = opened->older;
+    opened->used = true;
+    opened->nodeId = nodeId;
+    opened->newer = NO_SESSION;
+    opened->older = NO_SESSION;
+    opened->session->nodeId = nodeId;
+
+    unsigned int slot = nodeId & (SESSION_INDEX_LEN - 1);
+    while (table->index[slot] != NO_SESSION) {
+        slot = (slot + 1) & (SESSION_INDEX_LEN - 1);
+    }
+    table->index[slot] = entry;
+    return entry;
+}
+
+/*
+ * Closes a gateway's session: its keys and queued frames are dropped and the entry freed. The
+ * index entries after it move back into the hole, so no probe stops short of its node.
+ * @param entry - The session's entry.
+ */
+void IoTSec::closeSession(unsigned int entry) {
+    SessionTable* table = this->sessionTable;
+    SessionEntry* closed = &table->entries[entry];
+    unsigned int mask = SESSION_INDEX_LEN - 1;
+    unsigned int hole = closed->nodeId & mask;
+    while (table->index[hole] != entry) {
+        hole = (hole + 1) & mask;
+    }
+    table->index[hole] = NO_SESSION;
+    for (unsigned int slot = (hole + 1) & mask; table->index[slot] != NO_SESSION; slot = (slot + 1) & mask) {
+        unsigned int home = table->entries[table->index[slot]].nodeId & mask;
+        if (((slot - home) & mask) >= ((slot - hole) & mask)) {    //Its probe passes the hole.
+            table->index[hole] = table->index[slot];
+            table->index[slot] = NO_SESSION;
+            hole = slot;
+        }
+    }
+
+    this->unlinkSession(entry);
+    closed->used = false;
+    closed->session->resetSession();
+    closed->older = table->free;                              //Any turns it still has are skipped.
+    table->free = entry;
+    for (byte pipe = 0; pipe < MAX_PIPES; ++pipe) {
+        if (table->ackLoaded[pipe] == entry) {
+            table->ackLoaded[pipe] = NO_SESSION;
+        }
+    }
+}
+
+/*
+ * Notes that a gateway's session's node was just heard from, making it the newest.
+ * @param entry - The session's entry.
+ */
+void IoTSec::touchSession(unsigned int entry) {
+    SessionTable* table = this->sessionTable;
+    SessionEntry* touched = &table->entries[entry];
+    touched->lastHeard = millis();
+    if (table->newest == entry) {
+        return;
+    }
+    this->unlinkSession(entry);
+    touched->older = table->newest;
+    if (table->newest != NO_SESSION) {
+        table->entries[table->newest].newer = entry;
+    }
+    else {
+        table->oldest = entry;
+    }
+    table->newest = entry;
+}
+
+/*
+ * Takes a gateway's session out of the order its nodes were heard from, if it is in it.
+ * @param entry - The session's entry.
+ */
+void IoTSec::unlinkSession(unsigned int entry) {
+    SessionTable* table = this->sessionTable;
+    SessionEntry* unlinked = &table->entries[entry];
+    if (unlinked->newer != NO_SESSION) {
+        table->entries[unlinked->newer].older = unlinked->older;
+    }
+    else if (table->newest == entry) {
+        table->newest = unlinked->older;
+    }
+    if (unlinked->older != NO_SESSION) {
+        table->entries[unlinked->older].newer = unlinked->newer;
+    }
+    else if (table->oldest == entry) {
+        table->oldest = unlinked->newer;
+    }
+    unlinked->newer = NO_SESSION;
+    unlinked->older = NO_SESSION;
+}
+
+/*
+ * Closes a gateway's sessions whose nodes have not been heard from for SESSION_IDLE_TIMEOUT
+ * milliseconds, plus the node's wake interval, oldest first.
+ */
+void IoTSec::expireSessions() {
+    SessionTable* table = this->sessionTable;
+    while (table->oldest != NO_SESSION
+           && millis() - table->entries[table->oldest].lastHeard
+              >= SESSION_IDLE_TIMEOUT + table->entries[table->oldest].session->wakeInterval) {
+        this->closeSession(table->oldest);
+    }
+}
+
+/*
+ * Puts a gateway's session in line for a turn to read or send a frame, unless it already is.
+ * Does nothing on a node.
+ * @param tx - true for a turn on air, false for a turn to be read.
+ */
+void IoTSec::queueTurn(bool tx) {
+    SessionTable* table = this->radioOwner->sessionTable;
+    if (table == NULL) {
+        return;
+    }
+    SessionEntry* entry = &table->entries[this->sessionEntry];
+    if (tx && !entry->txTurn) {
+        table->txTurns[(table->txHead + table->txCount) % MAX_SESSIONS] = this->sessionEntry;
+        table->txCount++;
+        entry->txTurn = true;
+    }
+    else if (!tx && !entry->rxTurn) {
+        table->rxTurns[(table->rxHead + table->rxCount) % MAX_SESSIONS] = this->sessionEntry;
+        table->rxCount++;
+        entry->rxTurn = true;
+    }
+}
+
+/*
+ * Drops a session's keys, queued frames, round trip estimates and link judgment, for a gateway
+ * entry going to another node.
+ */
+void IoTSec::resetSession() {
+    this->setHandshakeComplete(false);
+    this->rxHead = 0;
+    this->rxCount = 0;
+    this->txHead = 0;
+    this->txCount = 0;
+    this->lastSent.len = 0;
+    this->lastReceived = 0;
+    this->awaitingReply = false;
+    this->requestTimed = false;
+    this->replyCached = false;
+    this->timedOut = false;
+    this->challenge = 0;
+    this->resetTimer(&this->responseTimer, INITIAL_RTO);
+    this->resetTimer(&this->windowTimer, WINDOW_TIMEOUT);
+    this->link.paLevel = RF24_PA_MAX;
+    this->resetLink();
+    this->wakeInterval = 0;
+    this->replyOwed = false;
+    this->sequenceHigh = 0;
+    this->sequenceSeen = 0;
+}
+
+/*
+ * Starts a round trip estimate over, with no samples yet.
+ * @param timer - The estimate.
+ * @param rto - The timeout to use until the first sample.
+ */
+void IoTSec::resetTimer(RetransmitTimer* timer, unsigned long rto) {
+    timer->srtt = 0;
+    timer->rttvar = 0;
+    timer->rto = rto;
+    timer->backoff = 0;
+}
+
+/*
+ * Adds a round trip to an estimate: the smoothed round trip time moves an eighth of the way
+ * to it and the mean deviation a quarter, and the timeout becomes the smoothed time plus four
+ * deviations, kept between MIN_RTO and MAX_RTO. The deviation is kept at an eighth of the round
+ * trip at least, so a link that has been steady still gets half a round trip of slack. Ends
+ * any backoff.
+ * @param timer - The estimate.
+ * @param rtt - The round trip in microseconds, from a frame sent only once.
+ */
+void IoTSec::timerSample(RetransmitTimer* timer, unsigned long rtt) {
+    if (rtt == 0) {
+        rtt = 1;                                            //0 is kept for no samples yet.
+    }
+    if (timer->srtt == 0) {
+        timer->srtt = rtt;
+        timer->rttvar = rtt / 2;
+    }
+    else {
+        unsigned long delta = rtt > timer->srtt ? rtt - timer->srtt : timer->srtt - rtt;
+        timer->rttvar = timer->rttvar - timer->rttvar / 4 + delta / 4;
+        timer->srtt = timer->srtt - timer->srtt / 8 + rtt / 8;
+    }
+    if (timer->rttvar < timer->srtt / 8) {
+        timer->rttvar = timer->srtt / 8;
+    }
+    timer->rto = timer->srtt + 4 * timer->rttvar;
+    if (timer->rto < MIN_RTO) {
+        timer->rto = MIN_RTO;
+    }
+    else if (timer->rto > MAX_RTO) {
+        timer->rto = MAX_RTO;
+    }
+    timer->backoff = 0;
+}
+
+/*
+ * Doubles an estimate's timeout after it ran out, up to MAX_RTO.
+ * @param timer - The estimate.
+ */
+void IoTSec::timerBackoff(RetransmitTimer* timer) {
+    if (timer->backoff < MAX_BACKOFF) {
+        timer->backoff++;
+    }
+}
+
+/*
+ * Returns an estimate's timeout in microseconds, backoff included.
+ * @param timer - The estimate.
+ */
+unsigned long IoTSec::timerTimeout(RetransmitTimer* timer) {
+    unsigned long timeout = timer->rto << timer->backoff;
+    return (timeout >> timer->backoff) != timer->rto || timeout > MAX_RTO ? MAX_RTO : timeout;
+}
+
+//The radio's data rate at each link adaptation step, slowest first.
+static const byte linkRates[LINK_RATES] PROGMEM = {RF24_250KBPS, RF24_1MBPS, RF24_2MBPS};
+
+/*
+ * Starts a new window of writes to judge.
+ * @param link - The link.
+ */
+static void startLinkWindow(LinkStats* link) {
+    link->writes = 0;
+    link->failures = 0;
+    link->retries = 0;
+    link->received = 0;
+    link->strong = 0;
+}
+
+/*
+ * Lets the data rate and transmit power follow the link, starting from the ones the radio is set
+ * to. A node judges the link by windows of LINK_WINDOW writes: the retransmissions each took,
+ * whether it ran out of them, and whether the frames coming back were strong. A struggling
+ * window raises the power to RF24_PA_MAX, or steps the rate down once it is there. Clean
+ * windows lower the power while most frames back are strong and step the rate up otherwise,
+ * LINK_CALM_WINDOWS of them in a row, doubled for each rise undone or refused. Changes are only
+ * proposed, see linkProposal, and both ends move once they agree. After LINK_FAIL_LIMIT writes in
+ * a row run out of retries a node does not wait for that, and tries the next rate down at full
+ * power, round from the base rate to the top, until the gateway hears it again.
+ *
+ * A gateway has one radio, so one rate for every node: the slowest any node with keys agreed,
+ * see agreeLink. It goes back to the base rate when a node with keys is quiet for LINK_SILENCE
+ * milliseconds, as it may be looking for the rate, or when its writes to one run out of retries
+ * LINK_FAIL_LIMIT times in a row. The power is kept per node and used for the gateway's own
+ * writes; ACKs go out at RF24_PA_MAX, as they answer every node. Call before setGateway.
+ * @param enable - true to follow the link, false to keep the radio as it is set up.
+ */
+void IoTSec::setLinkAdaptation(bool enable) {
+    this->linkAdapt = enable;
+    this->linkRate = 0;
+    for (byte rate = 0; rate < LINK_RATES; ++rate) {
+        if (pgm_read_byte(&linkRates[rate]) == this->radio->getDataRate()) {
+            this->linkRate = rate;
+        }
+    }
+    this->nextRate = this->linkRate;
+    this->link.paLevel = this->radio->getPALevel();
+    this->resetLink();
+}
+
+/*
+ * Returns true when the node's judgment of the link wants another data rate or transmit power
+ * than the ones agreed. Send them to the gateway, which answers through agreeLink, and pass its
+ * answer to setLinkMode.
+ * @param rate - Set to the data rate step wanted, 0 for 250 kbps to LINK_RATES - 1 for 2 Mbps.
+ * @param paLevel - Set to the transmit power wanted, RF24_PA_MIN to RF24_PA_MAX.
+ */
+bool IoTSec::linkProposal(byte* rate, byte* paLevel) {
+    LinkStats* link = &this->link;
+    if (!this->linkAdapt || link->wantedRate == LINK_NO_RATE
+        || (link->wantedRate == this->radioOwner->linkRate && link->wantedPa == link->paLevel)) {
+        return false;
+    }
+    *rate = link->wantedRate;
+    *paLevel = link->wantedPa;
+    return true;
+}
+
+/*
+ * Answers a node's proposal on the gateway's session with it. The node gets the transmit power
+ * it asked for, and the slowest data rate any node with keys has asked for; one that has not
+ * asked takes the rate the radio is on. The radio moves to it once the session's next frame, the
+ * reply, is on air, so the node hears the reply at the rate it asked on. Without link adaptation
+ * the node gets what the radio is set to.
+ *
+ * Proposals go under the session keys with no frame count, so each carries a number higher than
+ * the last one agreed under them, and one that does not is a replay and is refused. The node's
+ * retransmission of the one just agreed never gets here, as the reply already sent answers it.
+ * @param number - The proposal's number.
+ * @param rate - The data rate step the node asked for, set to the one agreed.
+ * @param paLevel - The transmit power it asked for, set to the one agreed.
+ * @return false, leaving everything as it was, for a proposal numbered no higher than the last.
+ */
+bool IoTSec::agreeLink(unsigned int number, byte* rate, byte* paLevel) {
+    IoTSec* owner = this->radioOwner;
+    SessionTable* table = owner->sessionTable;
+    LinkStats* link = &this->link;
+    if (number <= this->linkNumber) {
+        return false;
+    }
+    this->linkNumber = number;
+    if (!this->linkAdapt) {
+        *rate = owner->linkRate;
+        *paLevel = this->radio->getPALevel();
+        return true;
+    }
+    link->wantedRate = *rate < LINK_RATES ? *rate : LINK_RATES - 1;
+    link->paLevel = *paLevel < RF24_PA_MAX ? *paLevel : RF24_PA_MAX;
+    byte agreed = link->wantedRate;
+    for (unsigned int entry = table != NULL ? table->newest : NO_SESSION; entry != NO_SESSION; entry = table->entries[entry].older) {
+        LinkStats* other = &table->entries[entry].session->link;
+        byte wanted = other->wantedRate == LINK_NO_RATE ? owner->linkRate : other->wantedRate;
+        if (table->entries[entry].session->handshakeComplete && wanted < agreed) {
+            agreed = wanted;
+        }
+    }
+    *rate = agreed;
+    *paLevel = link->paLevel;
+    owner->nextRate = agreed;
+    this->linkReplyDue = this->txCount + 1;
+    return true;
+}
+
+/*
+ * Moves the node to the data rate and transmit power the gateway agreed, or keeps the ones it
+ * has when given them back, as when the gateway did not answer. A rise asked for and not given
+ * waits longer before it is asked for again.
+ * @param rate - The data rate step.
+ * @param paLevel - The transmit power.
+ */
+void IoTSec::setLinkMode(byte rate, byte paLevel) {
+    LinkStats* link = &this->link;
+    rate = rate < LINK_RATES ? rate : LINK_RATES - 1;
+    paLevel = paLevel < RF24_PA_MAX ? paLevel : RF24_PA_MAX;
+    if (link->wantedRate != LINK_NO_RATE && rate < link->wantedRate && link->backoff < LINK_MAX_BACKOFF) {
+        link->backoff++;
+    }
+    link->wantedRate = rate;
+    link->wantedPa = paLevel;
+    link->paLevel = paLevel;
+    link->calm = 0;
+    link->failStreak = 0;
+    startLinkWindow(link);
+    this->radioOwner->switchRate(rate);
+    this->radio->setPALevel(paLevel);
+}
+
+/*
+ * Returns the data rate step the radio is on, 0 for 250 kbps to LINK_RATES - 1 for 2 Mbps.
+ */
+byte IoTSec::getLinkRate() {
+    return this->radioOwner->linkRate;
+}
+
+/*
+ * Returns the transmit power agreed with the peer.
+ */
+byte IoTSec::getLinkPaLevel() {
+    return this->link.paLevel;
+}
+
+/*
+ * Counts a finished write to the peer into the link's window, and judges the window once it is
+ * full or struggling. A write that was not acknowledged also ends a fragmented message.
+ * @param acked - true if the peer acknowledged it.
+ * @param retries - The retransmissions it took, the radio's ARC count.
+ */
+void IoTSec::linkSent(bool acked, byte retries) {
+    if (!acked) {
+        this->messageLost = true;                             //See endMessage.
+    }
+    if (!this->linkAdapt) {
+        return;
+    }
+    LinkStats* link = &this->link;
+    link->writes++;
+    link->retries = retries < 255 - link->retries ? link->retries + retries : 255;
+    link->failures += !acked;
+    link->failStreak = acked ? 0 : link->failStreak + 1;
+    if (link->failStreak >= LINK_FAIL_LIMIT) {
+        this->linkFallBack();
+    }
+    else if (link->failures > 0 || link->retries > LINK_RETRY_LIMIT) {
+        this->judgeLink(true);
+    }
+    else if (link->writes >= LINK_WINDOW) {
+        this->judgeLink(false);
+    }
+}
+
+/*
+ * Counts a frame heard from the peer into the link's window.
+ * @param strong - true if the radio heard it above its RPD level, -64 dBm.
+ */
+void IoTSec::linkReceived(bool strong) {
+    LinkStats* link = &this->link;
+    if (this->linkAdapt && link->received < 255) {
+        link->received++;
+        link->strong += strong;
+    }
+}
+
+/*
+ * Judges a window of writes and starts the next, see setLinkAdaptation. Only a node judges; a
+ * gateway's session keeps what its node asked for.
+ * @param struggling - true if a write ran out of retries or they took more than LINK_RETRY_LIMIT.
+ */
+void IoTSec::judgeLink(bool struggling) {
+    LinkStats* link = &this->link;
+    bool clean = !struggling && link->failures == 0 && link->retries <= LINK_CLEAN_RETRIES;
+    byte rate = link->wantedRate == LINK_NO_RATE ? this->radioOwner->linkRate : link->wantedRate;
+    link->calm = clean ? link->calm + 1 : 0;
+    if (this->initiator && struggling) {
+        if (link->wantedPa < RF24_PA_MAX) {
+            link->wantedPa = RF24_PA_MAX;
+        }
+        else if (rate > 0) {
+            rate--;
+            link->backoff += link->backoff < LINK_MAX_BACKOFF;
+        }
+    }
+    else if (this->initiator && link->calm >= (LINK_CALM_WINDOWS << link->backoff)) {
+        link->calm = 0;
+        if (link->received > 0 && link->strong >= link->received - link->strong && link->wantedPa > RF24_PA_MIN) {
+            link->wantedPa--;
+        }
+        else if (rate + 1 < LINK_RATES) {
+            rate++;
+        }
+    }
+    if (this->initiator) {
+        link->wantedRate = rate;
+    }
+    startLinkWindow(link);
+}
+
+/*
+ * Gives up on the data rate after LINK_FAIL_LIMIT writes in a row ran out of retries, or on a
+ * gateway after the node went quiet. A node tries the next rate down at full power, round from
+ * the base rate to the top, as the gateway may have moved without it. A gateway goes back to the
+ * base rate and forgets what every node asked for, so that each asks again.
+ */
+void IoTSec::linkFallBack() {
+    IoTSec* owner = this->radioOwner;
+    SessionTable* table = owner->sessionTable;
+    LinkStats* link = &this->link;
+    link->failStreak = 0;
+    link->calm = 0;
+    startLinkWindow(link);
+    if (this->initiator) {
+        byte rate = owner->linkRate > 0 ? owner->linkRate - 1 : LINK_RATES - 1;
+        link->wantedRate = rate;
+        link->wantedPa = RF24_PA_MAX;
+        link->paLevel = RF24_PA_MAX;
+        owner->switchRate(rate);
+        this->radio->setPALevel(RF24_PA_MAX);
+        LOG_WARN(LOG_LINK_LOST);
+        LOG_INFO(LOG_LINK_MODE, rate, (byte)RF24_PA_MAX);
+        return;
+    }
+    link->paLevel = RF24_PA_MAX;
+    if (owner->linkRate == 0 && !owner->rateDue) {
+        return;
+    }
+    for (unsigned int entry = table != NULL ? table->newest : NO_SESSION; entry != NO_SESSION; entry = table->entries[entry].older) {
+        table->entries[entry].session->link.wantedRate = LINK_NO_RATE;
+        table->entries[entry].session->linkReplyDue = 0;
+    }
+    link->wantedRate = LINK_NO_RATE;
+    this->linkReplyDue = 0;
+    owner->rateDue = false;
+    owner->switchRate(0);
+    LOG_WARN(LOG_LINK_LOST);
+    LOG_INFO(LOG_LINK_MODE, (byte)0, (byte)RF24_PA_MAX);
+}
+
+/*
+ * Finishes a write on the end that services the radio: it moves to the rate agreed once the
+ * reply agreeing it is done, and a gateway's power goes back up for the ACKs.
+ */
+void IoTSec::linkWritten() {
+    if (this->rateDue) {
+        this->rateDue = false;
+        this->switchRate(this->nextRate);
+        if (this->sessionTable == NULL) {
+            this->radio->setPALevel(this->link.paLevel);
+        }
+    }
+    if (this->linkAdapt && this->sessionTable != NULL) {
+        this->radio->setPALevel(RF24_PA_MAX);
+    }
+}
+
+/*
+ * Puts the radio on a data rate step.
+ * @param rate - The step, below LINK_RATES.
+ */
+void IoTSec::switchRate(byte rate) {
+    this->linkRate = rate;
+    this->nextRate = rate;
+    this->radio->setDataRate((rf24_datarate_e)pgm_read_byte(&linkRates[rate]));
+}
+
+/*
+ * Sends a gateway back to the base rate when a node with keys has been quiet for LINK_SILENCE
+ * milliseconds, plus its wake interval, as it may be trying rates to find the gateway's. Only the
+ * nodes heard from longest ago are looked at, and only while the gateway is above the base rate.
+ */
+void IoTSec::checkLinkSilence() {
+    SessionTable* table = this->sessionTable;
+    if (!this->linkAdapt || this->linkRate == 0) {
+        return;
+    }
+    for (unsigned int entry = table->oldest; entry != NO_SESSION && millis() - table->entries[entry].lastHeard >= LINK_SILENCE;
+         entry = table->entries[entry].newer) {
+        IoTSec* session = table->entries[entry].session;
+        if (session->handshakeComplete && millis() - table->entries[entry].lastHeard >= LINK_SILENCE + session->wakeInterval) {
+            session->linkFallBack();
+            return;
+        }
+    }
+}
+
+/*
+ * Forgets how the link has fared and what this end wanted of it, keeping the power agreed.
+ */
+void IoTSec::resetLink() {
+    LinkStats* link = &this->link;
+    link->wantedRate = LINK_NO_RATE;
+    link->wantedPa = link->paLevel;
+    link->failStreak = 0;
+    link->calm = 0;
+    link->backoff = 0;
+    startLinkWindow(link);
+    this->linkReplyDue = 0;
+}
+
+/*
+ * Sets the longest this end's node sleeps between frames in milliseconds, 0, the default, for one
+ * that always listens. A node sends it to its gateway in the handshake, and the gateway sets it on
+ * the node's session. The session then keeps frames for the node until it next hears from it, see
+ * sleepRadio, and gives it the interval on top of SESSION_IDLE_TIMEOUT and LINK_SILENCE.
+ * @param ms - The interval.
+ */
+void IoTSec::setWakeInterval(unsigned long ms) {
+    this->wakeInterval = ms;
+}
+
+/*
+ * Returns the interval set with setWakeInterval.
+ */
+unsigned long IoTSec::getWakeInterval() {
+    return this->wakeInterval;
+}
+
+/*
+ * Powers a node's radio down until its next send, once nothing is queued, on air or waiting to be
+ * read, no window frame waits for its acknowledgement and no frame has gone out or come in for
+ * WAKE_WINDOW milliseconds. The send powers it up again and it listens once the send is done. A
+ * radio powered down hears nothing, so only call it while no reply is awaited. Does nothing on a
+ * gateway.
+ * @return true if the radio is powered down.
+ */
+bool IoTSec::sleepRadio() {
+    if (this->sessionTable != NULL || this->radioOwner != this) {
+        return false;
+    }
+    if (this->radioAsleep) {
+        return true;
+    }
+    this->poll();
+    if (this->sendPending() || this->rxCount > 0 || this->windowSpan > 0 || this->radio->available()
+        || millis() - this->lastActive < WAKE_WINDOW) {
+        return false;
+    }
+    this->radio->powerDown();
+    this->radioAsleep = true;
+    return true;
+}
+
+/*
+ * Returns true if a gateway's session's node hears a frame sent now: it never sleeps, waits on the
+ * reply to the frame the session read last, or was heard from in the last WAKE_WINDOW milliseconds.
+ */
+bool IoTSec::nodeListening() {
+    SessionEntry* entry = &this->radioOwner->sessionTable->entries[this->sessionEntry];
+    return this->wakeInterval == 0 || this->replyOwed || millis() - entry->lastHeard < WAKE_WINDOW;
+}
+
+/*
+ * Call from the interrupt on the radio's IRQ pin. Only notes that poll has work to do.
+ */
+void IoTSec::radioInterrupt() {
+    this->radioOwner->radioEvent = true;
+}
+
+/*
+ * Services the radio for event-driven I/O: finishes the send in progress, moves received
+ * frames into the RX queue and starts the next queued send. Cheap when nothing happened,
+ * so call it every loop. When the RX queue is full the oldest frame is dropped. With a
+ * sliding window it also sends window frames again, in either mode. On a gateway every
+ * session's frames are serviced, but only this one's window, idle sessions are closed, and the
+ * data rate goes back to the base one when a node goes quiet, see setLinkAdaptation.
+ */
+void IoTSec::poll() {
+    if (!this->eventDriven) {
+        this->checkWindow();
+        return;
+    }
+    IoTSec* owner = this->radioOwner;
+    if (owner->radioEvent) {
+        bool txOk;
+        bool txFail;
+        bool rxReady;
+        owner->radioEvent = false;
+        this->radio->whatHappened(txOk, txFail, rxReady);
+        if (txFail) {
+            this->radio->flush_tx();                          //A packet out of retries stays in the TX FIFO.
+        }
+        if (owner->txBusy && (txOk || txFail)) {
+            owner->txBusy = false;
+            owner->txSession->linkSent(txOk, this->radio->getARC());
+            owner->linkWritten();
+            this->radio->startListening();
+        }
+
+        while (this->radio->available() && owner->fetchFrame()) {
+        }
+    }
+    if (owner->sessionTable != NULL) {
+        owner->expireSessions();
+        owner->checkLinkSilence();
+    }
+
+    if (!owner->txBusy) {
+        owner->startSend();
+    }
+    this->checkWindow();
+}
+
+/*
+ * Puts the oldest queued frame on air: this end's own, or on a gateway that of the next session
+ * in turn, after opening the writing pipe on its node's address. A session whose node is asleep
+ * gives up its turn, and keeps its frames until fetchFrame hears the node and queues it again.
+ * Call on the end that services the radio while it is not sending.
+ */
+void IoTSec::startSend() {
+    SessionTable* table = this->sessionTable;
+    IoTSec* session = table == NULL && this->txCount > 0 ? this : NULL;
+    while (table != NULL && table->txCount > 0 && session == NULL) {
+        SessionEntry* entry = &table->entries[table->txTurns[table->txHead]];
+        table->txHead = (table->txHead + 1) % MAX_SESSIONS;
+        table->txCount--;
+        entry->txTurn = false;
+        if (entry->used && entry->session->txCount > 0 && entry->session->nodeListening()) {
+            session = entry->session;
+        }
+    }
+    if (session == NULL) {
+        return;
+    }
+    QueuedFrame* out = &session->txQueue[session->txHead];
+    session->txHead = (session->txHead + 1) % FRAME_QUEUE_LEN;
+    session->txCount--;
+    session->replyOwed = false;
+    if (session->txCount > 0) {
+        session->queueTurn(true);                             //Its next frame waits for the other sessions'.
+    }
+    this->txBusy = true;
+    this->txSession = session;
+    this->radio->stopListening();                             //Throws the ACK payloads away.
+    if (table != NULL) {
+        if (session->linkAdapt) {
+            this->radio->setPALevel(session->link.paLevel);
+        }
+        for (byte pipe = 0; pipe < MAX_PIPES; ++pipe) {
+            table->ackLoaded[pipe] = NO_SESSION;
+        }
+        if (table->writingNode != session->nodeId) {
+            table->address[0] = session->nodeId;
+            this->radio->openWritingPipe(table->address);
+            table->writingNode = session->nodeId;
+        }
+    }
+    session->radioWrite(out->data, out->len, true);
+}
+
+/*
+ * Hands a frame to the radio with this end's node ID in front of it. A blocking write is counted
+ * into the link's window straight away; a started one once poll hears it is done.
+ * @param data - The frame.
+ * @param len - The number of bytes, at most MAX_FRAME_SIZE.
+ * @param start - true to start the send and return, false for the radio's blocking write.
+ */
+void IoTSec::radioWrite(byte* data, byte len, bool start) {
+    METRIC_START(writeStart);
+    byte packet[NODE_ID_LEN + MAX_FRAME_SIZE];
+    packet[0] = this->nodeId;
+    memmove(packet + NODE_ID_LEN, data, len);
+    if (this->radioAsleep) {                                  //Only a node's own radio sleeps, see sleepRadio.
+        this->radio->powerUp();
+        this->radioAsleep = false;
+    }
+    this->lastActive = millis();
+    if (this->linkReplyDue > 0 && --this->linkReplyDue == 0) {
+        this->radioOwner->rateDue = true;                     //The reply agreeing the rate is going out.
+    }
+    if (start) {
+        this->radio->startWrite(packet, NODE_ID_LEN + len, false);
+    }
+    else {
+        bool acked = this->radio->write(packet, NODE_ID_LEN + len);
+        this->linkSent(acked, this->radio->getARC());
+        this->radioOwner->linkWritten();
+    }
+    METRIC_STOP(STAGE_RADIO_WRITE, writeStart);
+}
+
+/*
+ * Moves the next frame from the radio's RX FIFO to the RX queue of the session its node ID
+ * picks, dropping it if it is meant for another node. When the queue is full the oldest frame
+ * is dropped, so a node sending faster than its frames are read only loses its own. With a
+ * sliding window, acknowledgements are taken in here instead.
+ * @return false if the radio reported a corrupt length and had its FIFO flushed.
+ */
+bool IoTSec::fetchFrame() {
+    byte pipe = 0;
+    byte packet[NODE_ID_LEN + MAX_FRAME_SIZE];
+    this->radio->available(&pipe);
+    byte packetLen = this->dynamicFrames ? this->radio->getDynamicPayloadSize() : this->radio->getPayloadSize();
+    if (packetLen > NODE_ID_LEN + MAX_FRAME_SIZE) {           //Corrupt length, the radio needs its FIFO flushed.
+        this->radio->flush_rx();
+        return false;
+    }
+    this->radio->read(packet, packetLen);
+    if (this->sessionTable != NULL && packetLen > NODE_ID_LEN) {
+        this->pipeHeard(pipe, packet[0]);
+    }
+    else if (this->sessionTable != NULL) {
+        this->sessionTable->ackLoaded[pipe] = NO_SESSION;    //Went back on the frame's ACK.
+    }
+    IoTSec* session = packetLen > NODE_ID_LEN ? this->sessionFor(packet[0]) : NULL;
+    if (session == NULL) {
+        return true;
+    }
+    session->linkReceived(this->radio->testRPD());
+    session->lastActive = millis();
+    if (session->txCount > 0) {
+        session->queueTurn(true);                             //Frames kept for a sleeping node go while it listens.
+    }
+    if (session->rxCount == FRAME_QUEUE_LEN) {
+        session->rxHead = (session->rxHead + 1) % FRAME_QUEUE_LEN;
+        session->rxCount--;
+    }
+    QueuedFrame* in = &session->rxQueue[(session->rxHead + session->rxCount) % FRAME_QUEUE_LEN];
+    in->len = packetLen - NODE_ID_LEN;
+    in->pipe = pipe;
+    memmove(in->data, packet + NODE_ID_LEN, in->len);
+    if (session->windowSize > 0 && in->data[0] == WINDOW_ACK_STATE) {
+        session->processAck(in->data, in->len);
+        return true;
+    }
+    if (session->repeatedFrame(in)) {
+        return true;
+    }
+    session->replyArrived();
+    session->rxCount++;
+    session->queueTurn(false);
+    return true;
+}
+
+/*
+ * Hashes a frame with 32 bit FNV-1a, so a session can tell a frame it already read without
+ * keeping a copy. Sealed and HMACed frames differ in their tags, so two different ones sharing a
+ * hash is as unlikely as a random 32 bit match.
+ * @param data - The frame.
+ * @param len - Its length.
+ */
+static unsigned long frameHash(const byte* data, byte len) {
+    unsigned long hash = 2166136261UL;
+    for (byte i = 0; i < len; ++i) {
+        hash = (hash ^ data[i]) * 16777619UL;
+    }
+    return hash;
+}
+
+/*
+ * Returns true if a frame just off the radio repeats the last one read, as the peer sends a
+ * frame again when the reply to it is lost. The end that does not start the handshake answers
+ * it with the reply it already sent, so a request sent again is not acted on twice and a
+ * handshake does not make new keys for it. Either way the frame is not read again. A frame
+ * repeating one still queued is dropped too, as that one's reply is yet to go.
+ * @param in - The frame.
+ */
+bool IoTSec::repeatedFrame(QueuedFrame* in) {
+    for (byte i = 0; i < this->rxCount; ++i) {
+        QueuedFrame* queued = &this->rxQueue[(this->rxHead + i) % FRAME_QUEUE_LEN];
+        if (queued->len == in->len && memcmp(queued->data, in->data, in->len) == 0) {
+            return true;
+        }
+    }
+    if (frameHash(in->data, in->len) != this->lastReceived) {
+        return false;
+    }
+    if (this->initiator || !this->replyCached) {
+        return true;
+    }
+    if (!this->eventDriven) {
+        this->setListening(false);
+        this->radioWrite(this->lastSent.data, this->lastSent.len, false);
+        this->setListening(true);
+    }
+    else if (this->txCount < FRAME_QUEUE_LEN) {                  //poll starts it.
+        this->txQueue[(this->txHead + this->txCount) % FRAME_QUEUE_LEN] = this->lastSent;
+        this->txCount++;
+        this->queueTurn(true);
+    }
+    return true;
+}
+
+/*
+ * Notes that a frame came from the peer since the initiator's last send, which takes it as the
+ * reply. Unless what it answers was sent more than once, the time since is a round trip sample;
+ * either way the timeout stops backing off.
+ */
+void IoTSec::replyArrived() {
+    if (!this->initiator || !this->awaitingReply) {
+        return;
+    }
+    unsigned long rtt = micros() - this->requestSentAt;
+    METRIC_RECORD(STAGE_ROUND_TRIP, rtt);
+    this->awaitingReply = false;
+    if (this->requestTimed && rtt <= this->timerTimeout(&this->responseTimer)) {
+        this->timerSample(&this->responseTimer, rtt);
+    }
+    this->responseTimer.backoff = 0;
+}
+
+/*
+ * Returns how long to wait for the peer's reply to the frame just sent before sending it again
+ * with retransmit, in microseconds. Starts at INITIAL_RTO and follows the round trips measured
+ * since.
+ */
+unsigned long IoTSec::getResponseTimeout() {
+    return this->timerTimeout(&this->responseTimer);
+}
+
+/*
+ * Sends the last frame again byte for byte, once getResponseTimeout has passed without a
+ * reply. The peer answers a repeated frame with the reply it already sent. Each retransmission
+ * doubles the timeout until a reply comes, and the reply to a frame sent more than once does
+ * not count as a round trip. Callers give up after MAX_RETRIES.
+ */
+void IoTSec::retransmit() {
+    this->timerBackoff(&this->responseTimer);
+    this->setListening(false);
+    this->transmit(this->lastSent.data, this->lastSent.len);
+    this->setListening(true);
+    this->requestTimed = false;
+}
+
+/*
+ * Returns true if the last receive got no frame: it timed out, or with event-driven I/O
+ * nothing was queued. The receive's integrity check fails too.
+ */
+bool IoTSec::getTimedOut() {
+    return this->timedOut;
+}
+
+/*
+ * Returns the state header of the frame the next receive will read, without reading it, or 0
+ * if nothing has arrived. Lets a receiver pick the keys to receive a frame with.
+ */
+char IoTSec::peekState() {
+    if (this->eventDriven) {
+        this->poll();
+    }
+    else if (this->rxCount == 0 && this->radio->available()) {
+        this->fetchFrame();
+    }
+    return this->rxCount > 0 ? (char)this->rxQueue[this->rxHead].data[0] : 0;
+}
+
+/*
+ * Returns true if a received frame is queued for the next receive. Polls the radio first.
+ */
+bool IoTSec::frameAvailable() {
+    this->poll();
+    return this->rxCount > 0;
+}
+
+/*
+ * Returns true while a send is queued or still on air, this session's or, on a gateway, any
+ * other session's.
+ */
+bool IoTSec::sendPending() {
+    IoTSec* owner = this->radioOwner;
+    return owner->txBusy || this->txCount > 0
+        || (owner->sessionTable != NULL && owner->sessionTable->txCount > 0);
+}
+
+/*
+ * Keeps the random number the other end must send back decremented in the three way
+ * handshake, with the session it was sent on.
+ * @param challenge - The random number sent.
+ */
+void IoTSec::setChallenge(int challenge) {
+    this->challenge = challenge;
+}
+
+/*
+ * Returns the random number kept with setChallenge, 0 if none was.
+ */
+int IoTSec::getChallenge() {
+    return this->challenge;
+}
+
+/*
+ * Gets the current value for if the integrity of the last message passed or not.
+ */
+bool IoTSec::getIntegrityPassed() {
+    return this->integrityPassed;
+}
+
+/*
+ * The helper function for receiving data. This function
+ * waits for a bit until the data has become available.
+ * @param bytes - The bytes to start the data.
+ * @param size - The body length read with fixed size packets, and the most kept with dynamic frames.
+ * @param state - The state from the header received.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ * @return the number of body bytes stored in bytes, 0 on a timeout.
+ */
+byte IoTSec::receiveHelper(byte* bytes, byte size, char* state, bool block) {
+    memset(bytes, 0, size);
+    byte packet[MAX_FRAME_SIZE];
+
+    byte packetLen = this->readFrame(packet, MAX_HEADER_SIZE + size, block);
+    if (packetLen < MAX_HEADER_SIZE) {
+        return 0;
+    }
+    memmove(state, packet, MAX_HEADER_SIZE);
+    memmove(bytes, packet + MAX_HEADER_SIZE, packetLen - MAX_HEADER_SIZE);
+    return packetLen - MAX_HEADER_SIZE;
+}
+
+/*
+ * Waits for the next packet and reads it into frame as it came off the radio. With
+ * event-driven I/O it takes the oldest queued frame instead and only waits when blocking.
+ * @param frame - The buffer for the packet, at least size bytes.
+ * @param size - The packet length read with fixed size packets, and the most kept with dynamic frames.
+ * @param block - flag to block receive until message has been received, (No timeout).
+ * @return the number of bytes read, 0 on a timeout.
+ */
+byte IoTSec::readFrame(byte frame[], byte size, bool block) {
+    if (this->eventDriven) {
+        METRIC_START(waitStart);
+        do {
+            this->poll();
+        } while (block && this->rxCount == 0);
+        METRIC_STOP(STAGE_RX_WAIT, waitStart);
+    }
+    this->timedOut = false;
+    if (this->eventDriven || this->rxCount > 0) {             //Without event-driven I/O only peekState queues frames.
+        if (this->rxCount == 0) {
+            this->timedOut = true;
+            METRIC_COUNT(timeouts, 1);
+            return 0;
+        }
+        QueuedFrame* in = &this->rxQueue[this->rxHead];
+        byte packetLen = in->len < size ? in->len : size;
+        memmove(frame, in->data, packetLen);
+        this->rxPipe = in->pipe;
+        this->lastReceived = frameHash(in->data, in->len);
+        this->replyCached = false;
+        this->replyOwed = this->replyOwed || in->data[0] != WINDOW_STATE;
+        this->rxHead = (this->rxHead + 1) % FRAME_QUEUE_LEN;
+        this->rxCount--;
+        METRIC_COUNT(messagesReceived, 1);
+        METRIC_COUNT(bytesReceived, packetLen);
+        return packetLen;
+    }
+    this->setListening(true);
+
+    unsigned long started_waiting = micros();
+    unsigned long timeout = this->timerTimeout(&this->responseTimer);
+    byte packet[NODE_ID_LEN + MAX_FRAME_SIZE];
+    byte packetLen = 0;
+
+    while (packetLen == 0) {
+        while (!this->radio->available(&this->rxPipe)){
+            if (!block && micros() - started_waiting > timeout){
+                this->timedOut = true;
+                METRIC_COUNT(timeouts, 1);
+                break;
+            }
+        }
+        if (this->timedOut) {
+            break;
+        }
+        packetLen = NODE_ID_LEN + size;
+        if (this->dynamicFrames) {
+            packetLen = this->radio->getDynamicPayloadSize();
+            if (packetLen > NODE_ID_LEN + MAX_FRAME_SIZE) {   //Corrupt length, the radio needs its FIFO flushed.
+                this->radio->flush_rx();
+                return 0;
+            }
+            if (packetLen > NODE_ID_LEN + size) {
+                packetLen = NODE_ID_LEN + size;
+            }
+        }
+        this->radio->read(packet, packetLen);
+        if (packetLen <= NODE_ID_LEN || packet[0] != this->nodeId) {
+            packetLen = 0;                                    //Another node's, keep waiting.
+        }
+    }
+
+    METRIC_RECORD(STAGE_RX_WAIT, micros() - started_waiting);
+    if (this->timedOut) {
+        LOG_WARN(LOG_TIMED_OUT);
+        this->timerBackoff(&this->responseTimer);
+        return 0;
+    }
+    this->replyArrived();
+    this->linkReceived(this->radio->testRPD());
+
+    packetLen -= NODE_ID_LEN;
+    memmove(frame, packet + NODE_ID_LEN, packetLen);
+    this->lastReceived = frameHash(frame, packetLen);
+    this->replyCached = false;
+    METRIC_COUNT(messagesReceived, 1);
+    METRIC_COUNT(bytesReceived, packetLen);
+    return packetLen;
+}
+
+/*
+ * Puts a packet on air. Normally this is the radio's blocking write; with event-driven I/O
+ * the packet joins the TX queue and poll starts it when the radio is free. A full queue is
+ * polled until the radio takes its oldest frame. A new packet other than a window frame is kept
+ * for retransmit and starts the wait for a reply, and the initiator drops any frames still
+ * waiting to be read, since they answer packets it already gave up on.
+ * @param data - The packet.
+ * @param len - The number of bytes, at most MAX_FRAME_SIZE.
+ */
+void IoTSec::transmit(byte* data, byte len) {
+    METRIC_COUNT(messagesSent, 1);
+    METRIC_COUNT(bytesSent, len);
+    if (data[0] != WINDOW_STATE && data != this->lastSent.data) {   //Not a window frame, nor one sent again.
+        if (this->initiator) {
+            //Anything still waiting answers a frame given up on; the reply to this one comes after it.
+            while (this->radio->available() && this->fetchFrame()) {
+            }
+            this->rxCount = 0;
+        }
+        memmove(this->lastSent.data, data, len);
+        this->lastSent.len = len;
+        this->requestSentAt = micros();
+        this->awaitingReply = true;
+        this->requestTimed = true;
+        this->replyCached = true;
+    }
+    if (!this->eventDriven) {
+        this->radioWrite(data, len, false);
+        while (this->windowSize > 0 && this->radio->available() && this->fetchFrame()) {  //Acknowledgements ride on the radio's ACK.
+        }
+        return;
+    }
+    while (this->txCount == FRAME_QUEUE_LEN) {
+        this->poll();
+    }
+    QueuedFrame* out = &this->txQueue[(this->txHead + this->txCount) % FRAME_QUEUE_LEN];
+    out->len = len;
+    memmove(out->data, data, len);
+    this->txCount++;
+    this->queueTurn(true);
+    this->poll();
+}
+
+/*
+ * Switches the radio between receiving and sending around the blocking send and receive
+ * functions. With event-driven I/O poll keeps the radio listening whenever it is not sending,
+ * so this does nothing.
+ * @param listen - true to listen, false to get ready to send.
+ */
+void IoTSec::setListening(bool listen) {
+    if (this->eventDriven) {
+        return;
+    }
+    if (listen) {
+        this->radio->startListening();
+    }
+    else {
+        this->radio->stopListening();
+    }
+}
+
+/*
+ * Creates the header fields given the state. This function will wrap
+ * The state in <> tags.
+ * @param state - The state for the header.
+ * @param bytes - The bytes to store the header in.
+ */
+void IoTSec::createHeader(String state, byte bytes[]) {
+    METRIC_START(headerStart);
+    for (unsigned int i = 0; i < state.length() && i < MAX_HEADER_SIZE; ++i) {
+        bytes[i] = state[i];
+    }
+    METRIC_STOP(STAGE_HEADER, headerStart);
+}
+
+/*
+ * Save the message (char arr) to the toEncrypt buffer, compute and append the HMAC
+ * @param arr - The message or payload.
+ * @param toEncrypt - Working buffer to store the payload and the computed HMAC.
+ */
+void IoTSec::appendHMAC(char* arr, byte* toEncrypt) {
+    byte hash[HASH_LEN];     // used to store the computed HMAC
+    // Store the payload to the working buffer toEncrypt
+    for (int i = 0; i < MAX_PAYLOAD_SIZE; i++) {
+        toEncrypt[i] = (byte)arr[i];
+    }
+    METRIC_START(macStart);
+    this->beginHMAC();
+    this->hash256->update(arr, MAX_PAYLOAD_SIZE);
+    this->endHMAC(hash);
+    METRIC_STOP(STAGE_MAC, macStart);
+    // append the HMAC 
+    for (int i = 0; i< HASH_LEN; i++) {
+        toEncrypt[MAX_PAYLOAD_SIZE + i] = hash[i];
+    }
+}
+
+/*
+ * Save the message (char arr) to the toEncrypt buffer, compute and append the HMAC
+ * @param bytes - The payload and hash of the received message
+ * @return true is integrity passes
+ */
+bool IoTSec::verifyHMAC(byte* bytes) {
+    byte msgToVerify[MAX_PAYLOAD_SIZE];
+    byte receivedHash[HASH_LEN];
+    byte computedHash[HASH_LEN];
+    for (int i = 0; i < MAX_PAYLOAD_SIZE; i++) {            // copy the payload
+        msgToVerify[i] = bytes[i];
+    }
+    for (int i = 0; i < HASH_LEN; i++) {                    // copy the HMAC
+        receivedHash[i] = bytes[i + MAX_PAYLOAD_SIZE];
+    }
+    
+    METRIC_START(macStart);
+    this->beginHMAC();
+    this->hash256->update(msgToVerify, MAX_PAYLOAD_SIZE);
+    this->endHMAC(computedHash);
+    METRIC_STOP(STAGE_MAC, macStart);
+
+    for (int i = 0; i < HASH_LEN; i++) {
+        if (!(receivedHash[i] == computedHash[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+    
+
+#if IOTSEC_FRAGMENTS
+/*
+ * Copies bytes of the outgoing message stream into fragments, sending each one as it fills.
+ * @param data - The bytes to add to the stream.
+ * @param len - The number of bytes.
+ */
+void IoTSec::streamFragment(byte* data, unsigned int len) {
+    byte* fragmentData = this->fragment + MAX_HEADER_SIZE + FRAGMENT_SEQ_LEN;
+    byte dataLen = this->fragmentDataLen();
+    while (len > 0 && !this->messageLost) {
+        unsigned int n = dataLen - this->fragmentFill;
+        if (n > len) {
+            n = len;
+        }
+        memmove(fragmentData + this->fragmentFill, data, n);
+        this->fragmentFill += n;
+        data += n;
+        len -= n;
+        if (this->fragmentFill == dataLen) {
+            this->flushFragment();
+        }
+    }
+}
+
+/*
+ * Stamps the sequence number on the fragment being filled, encrypts and sends it.
+ */
+void IoTSec::flushFragment() {
+    byte* block = this->fragment + MAX_HEADER_SIZE;
+    block[0] = (byte)(this->fragmentSeq >> 8);
+    block[1] = (byte)this->fragmentSeq;
+
+    //A short last fragment is still padded out to one cipher block.
+    byte bodyLen = FRAGMENT_SEQ_LEN + this->fragmentFill;
+    if (bodyLen < CIPHER_BLOCK_LEN) {
+        bodyLen = CIPHER_BLOCK_LEN;
+    }
+
+    byte bytes[MAX_FRAME_SIZE];
+    memmove(bytes, this->fragment, MAX_HEADER_SIZE);
+    this->encryptFrame(bytes + MAX_HEADER_SIZE, block, bodyLen);
+    this->transmit(bytes, MAX_HEADER_SIZE + bodyLen);
+
+    this->fragmentSeq++;
+    this->fragmentFill = 0;
+    memset(block, 0, MAX_FRAME_SIZE - MAX_HEADER_SIZE);
+}
+
+/*
+ * Returns the number of message stream bytes each fragment carries.
+ */
+byte IoTSec::fragmentDataLen() {
+    return this->dynamicFrames ? MAX_FRAME_BODY - FRAGMENT_SEQ_LEN : FRAGMENT_DATA_LEN;
+}
+#endif
+
+/*
+ * Encrypts len bytes block by block. When len is not a multiple of the block size the last
+ * partial block steals the tail of the ciphertext before it, so the output is exactly len
+ * bytes. Input and output may be the same buffer.
+ * @param output - The buffer for the ciphertext.
+ * @param input - The plaintext, at least one cipher block long.
+ * @param len - The number of bytes.
+ */
+void IoTSec::encryptFrame(byte* output, byte* input, byte len) {
+    byte full = len / CIPHER_BLOCK_LEN;
+    byte partial = len % CIPHER_BLOCK_LEN;
+    METRIC_START(cipherStart);
+    for (byte i = 0; i < full; ++i) {
+        this->encCipher->encryptBlock(output + i * CIPHER_BLOCK_LEN, input + i * CIPHER_BLOCK_LEN);
+    }
+    if (partial > 0) {
+        byte* last = output + (full - 1) * CIPHER_BLOCK_LEN;
+        byte stolen[CIPHER_BLOCK_LEN];
+        memmove(stolen, input + full * CIPHER_BLOCK_LEN, partial);
+        memmove(stolen + partial, last + partial, CIPHER_BLOCK_LEN - partial);
+        memmove(output + full * CIPHER_BLOCK_LEN, last, partial);
+        this->encCipher->encryptBlock(last, stolen);
+    }
+    METRIC_STOP(STAGE_CIPHER, cipherStart);
+}
+
+/*
+ * Reverses encryptFrame. Input and output may be the same buffer.
+ * @param output - The buffer for the plaintext.
+ * @param input - The ciphertext, at least one cipher block long.
+ * @param len - The number of bytes.
+ */
+void IoTSec::decryptFrame(byte* output, byte* input, byte len) {
+    byte full = len / CIPHER_BLOCK_LEN;
+    byte partial = len % CIPHER_BLOCK_LEN;
+    METRIC_START(cipherStart);
+    for (byte i = 0; i < (partial > 0 ? full - 1 : full); ++i) {
+        this->encCipher->decryptBlock(output + i * CIPHER_BLOCK_LEN, input + i * CIPHER_BLOCK_LEN);
+    }
+    if (partial > 0) {
+        byte stolen[CIPHER_BLOCK_LEN];
+        byte last[CIPHER_BLOCK_LEN];
+        this->encCipher->decryptBlock(stolen, input + (full - 1) * CIPHER_BLOCK_LEN);
+        memmove(last, input + full * CIPHER_BLOCK_LEN, partial);
+        memmove(last + partial, stolen + partial, CIPHER_BLOCK_LEN - partial);
+        memmove(output + full * CIPHER_BLOCK_LEN, stolen, partial);
+        this->encCipher->decryptBlock(output + (full - 1) * CIPHER_BLOCK_LEN, last);
+    }
+    METRIC_STOP(STAGE_CIPHER, cipherStart);
+}
+
+/*
+ * Sets up a context for a key pair. Its key is expanded in the cipher when useContext first picks it,
+ * or here when the context is already picked, as when a ratchet changes the keys in the middle of a frame.
+ * @param context - The context to fill.
+ * @param encKey - The encryption key.
+ * @param intKey - The integrity key.
+ */
+void IoTSec::buildContext(CryptoContext* context, byte* encKey, byte* intKey) {
+    if (IoTSec::keyedKey == encKey) {
+        IoTSec::keyedKey = NULL;                            //The cipher holds what the key was before.
+    }
+    context->encKey = encKey;
+    context->intKey = intKey;
+    context->sendCount = 0;
+    context->receiveCount = 0;
+    context->keyId = 0;
+    if (this->keyContext == context) {
+        this->useContext(context);
+    }
+}
+
+/*
+ * Wipes a context so it no longer matches any keys.
+ * @param context - The context to clear.
+ */
+void IoTSec::clearContext(CryptoContext* context) {
+    if (context->encKey != NULL && IoTSec::keyedKey == context->encKey) {
+        this->encCipher->clear();                           //Wipe the schedule of the keys going away.
+        IoTSec::keyedKey = NULL;
+    }
+    context->encKey = NULL;
+    context->intKey = NULL;
+}
+
+/*
+ * Makes a context's keys the ones picked. The encryption key is only expanded in the cipher when
+ * another key was put in it since this context last had it, so a node sending and receiving under
+ * its session keys expands them once per key change, and a gateway once per change of session.
+ * @param context - The context to use.
+ */
+void IoTSec::useContext(CryptoContext* context) {
+    this->keyContext = context;
+    if (IoTSec::keyedKey != context->encKey) {
+        this->encCipher->setKey(context->encKey, KEY_DATA_LEN);
+        IoTSec::keyedKey = context->encKey;
+    }
+}
+
+/*
+ * Picks the keys for the next encryption and HMAC. Keys with a context are matched by
+ * pointer and keep its frame counts; any other key gets a fresh key schedule.
+ * @param encKey - The encryption key.
+ * @param intKey - The integrity key, or NULL when only encrypting.
+ */
+void IoTSec::selectKeys(byte* encKey, byte* intKey) {
+    this->selectedIntKey = intKey;
+    this->keyContext = NULL;
+    if (encKey != NULL && encKey == this->secretContext.encKey
+        && (intKey == NULL || intKey == this->secretContext.intKey)) {
+        this->useContext(&this->secretContext);
+        return;
+    }
+    if (encKey != NULL && encKey == this->sessionContext.encKey
+        && (intKey == NULL || intKey == this->sessionContext.intKey)) {
+        this->useContext(&this->sessionContext);
+        return;
+    }
+    if (encKey != NULL) {
+        this->encCipher->setKey(encKey, KEY_DATA_LEN);
+        IoTSec::keyedKey = encKey;
+    }
+}
+
+/*
+ * Starts an HMAC with the integrity key picked by selectKeys; follow with hash256->update.
+ */
+void IoTSec::beginHMAC() {
+    this->hash256->resetHMAC(this->selectedIntKey, HASH_KEY_LEN);
+}
+
+/*
+ * Finishes the HMAC started with beginHMAC.
+ * @param tag - Where to store the HASH_LEN byte truncated HMAC.
+ */
+void IoTSec::endHMAC(byte* tag) {
+    this->hash256->finalizeHMAC(this->selectedIntKey, HASH_KEY_LEN, tag, HASH_LEN);
+}
+
+/*
+ * Builds the CCM nonce of a sealed frame: which end sent it, then the frame count.
+ * @param nonce - Where to store the CCM_NONCE_LEN byte nonce.
+ * @param fromInitiator - true for frames sent by the end that starts the handshake.
+ * @param count - The number of frames sent before this one in that direction.
+ */
+void IoTSec::ccmNonce(byte nonce[], bool fromInitiator, unsigned long count) {
+    memset(nonce, 0, CCM_NONCE_LEN);
+    nonce[0] = fromInitiator ? 0 : 1;
+    for (int i = 0; i < 4; ++i) {
+        nonce[CCM_NONCE_LEN - 1 - i] = (byte)(count >> (8 * i));
+    }
+}
+
+/*
+ * Fills one CCM block: the flags byte, the nonce and a 2 byte big endian counter or length.
+ * @param block - The CIPHER_BLOCK_LEN byte block.
+ * @param flags - CCM_MAC_FLAGS for the first CBC-MAC block, CCM_CTR_FLAGS for counter blocks.
+ * @param nonce - The CCM_NONCE_LEN byte nonce.
+ * @param counter - The payload length in the first CBC-MAC block, the block index otherwise.
+ */
+void IoTSec::ccmBlock(byte block[], byte flags, byte* nonce, unsigned int counter) {
+    block[0] = flags;
+    memmove(block + 1, nonce, CCM_NONCE_LEN);
+    block[CIPHER_BLOCK_LEN - 2] = (byte)(counter >> 8);
+    block[CIPHER_BLOCK_LEN - 1] = (byte)counter;
+}
+
+/*
+ * Computes the CCM CBC-MAC of a sealed frame with the cipher picked by selectKeys. The
+ * associated data is everything in front of the payload, ending with the payload length;
+ * CCM_MAC_FLAGS marks that it is there, the CCM_TAG_LEN byte tag and the 2 byte length field.
+ * @param tag - Where to store the CCM_TAG_LEN byte tag, before it is encrypted.
+ * @param frame - The frame, with its payload in plaintext.
+ * @param aadLen - The bytes in front of the payload, at most CIPHER_BLOCK_LEN - 2.
+ * @param nonce - The CCM_NONCE_LEN byte nonce.
+ */
+void IoTSec::ccmMAC(byte* tag, byte frame[], byte aadLen, byte* nonce) {
+    byte len = frame[aadLen - 1] & ~WINDOW_RATCHET_BIT;     //Window frames carry the ratchet bit beside their length.
+    byte* payload = frame + aadLen;
+    byte x[CIPHER_BLOCK_LEN];
+    METRIC_START(macStart);
+
+    this->ccmBlock(x, CCM_MAC_FLAGS, nonce, len);
+    this->encCipher->encryptBlock(x, x);
+
+    //The associated data with its 2 byte length in front, padded out to one block.
+    x[1] ^= aadLen;
+    for (int i = 0; i < aadLen; ++i) {
+        x[2 + i] ^= frame[i];
+    }
+    this->encCipher->encryptBlock(x, x);
+
+    for (byte i = 0; i < len; i += CIPHER_BLOCK_LEN) {
+        for (byte j = 0; j < CIPHER_BLOCK_LEN && i + j < len; ++j) {
+            x[j] ^= payload[i + j];
+        }
+        this->encCipher->encryptBlock(x, x);
+    }
+    memmove(tag, x, CCM_TAG_LEN);
+    METRIC_STOP(STAGE_MAC, macStart);
+}
+
+/*
+ * Runs CCM counter mode over a sealed frame's payload and tag with the cipher picked by
+ * selectKeys. It is its own inverse, so it both seals and opens.
+ * @param data - The payload, encrypted or decrypted in place.
+ * @param len - The number of payload bytes.
+ * @param tag - The CCM_TAG_LEN byte tag, encrypted or decrypted in place.
+ * @param nonce - The CCM_NONCE_LEN byte nonce.
+ */
+void IoTSec::ccmCrypt(byte* data, byte len, byte* tag, byte* nonce) {
+    byte stream[CIPHER_BLOCK_LEN];
+    METRIC_START(cipherStart);
+    this->ccmBlock(stream, CCM_CTR_FLAGS, nonce, 0);
+    this->encCipher->encryptBlock(stream, stream);
+    for (int i = 0; i < CCM_TAG_LEN; ++i) {
+        tag[i] ^= stream[i];
+    }
+
+    for (byte i = 0; i < len; i += CIPHER_BLOCK_LEN) {
+        this->ccmBlock(stream, CCM_CTR_FLAGS, nonce, i / CIPHER_BLOCK_LEN + 1);
+        this->encCipher->encryptBlock(stream, stream);
+        for (byte j = 0; j < CIPHER_BLOCK_LEN && i + j < len; ++j) {
+            data[i + j] ^= stream[j];
+        }
+    }
+    clean(stream, CIPHER_BLOCK_LEN);
+    METRIC_STOP(STAGE_CIPHER, cipherStart);
+}
+
+#if IOTSEC_METRICS
+Metrics IoTSec::metrics;
+
+/*
+ * Adds a time to a stage's timer.
+ * @param stage - The STAGE_ the time is for.
+ * @param us - The time in microseconds.
+ */
+void IoTSec::recordStage(byte stage, unsigned long us) {
+    StageTimer* timer = &IoTSec::metrics.stages[stage];
+    if (timer->count == 0 || us < timer->min) {
+        timer->min = us;
+    }
+    if (us > timer->max) {
+        timer->max = us;
+    }
+    timer->count++;
+    timer->total += us;
+
+    byte bucket = 0;
+    for (unsigned long rest = us >> (METRIC_MIN_SHIFT + 1); rest > 0 && bucket < METRIC_BUCKETS - 1; rest >>= 1) {
+        bucket++;
+    }
+    if (timer->buckets[bucket] != (unsigned int)-1) {
+        timer->buckets[bucket]++;
+    }
+}
+
+/*
+ * Prints the counters and, for each stage timed so far, its number of samples and their min,
+ * average, 99th percentile and max in microseconds. The percentile is the top of the bucket it
+ * falls in, so it is within a factor of two.
+ */
+void IoTSec::dumpMetrics() {
+    static const char* const names[STAGE_COUNT] = {
+        "header", "mac", "cipher", "radio write", "rx wait", "verify", "round trip", "handshake"
+    };
+    Metrics* m = &IoTSec::metrics;
+    //Printed piece by piece, as IoTSecLog::render does, so nothing is built on the heap.
+    Serial.println("\n# METRICS #");
+    Serial.print("[M] sent: ");
+    Serial.print(m->messagesSent);
+    Serial.print(" msgs, ");
+    Serial.print(m->bytesSent);
+    Serial.println(" B");
+    Serial.print("[M] received: ");
+    Serial.print(m->messagesReceived);
+    Serial.print(" msgs, ");
+    Serial.print(m->bytesReceived);
+    Serial.println(" B");
+    Serial.print("[M] int fails: ");
+    Serial.print(m->integrityFailures);
+    Serial.print(", timeouts: ");
+    Serial.println(m->timeouts);
+    Serial.print("[M] handshakes: ");
+    Serial.print(m->handshakes);
+    Serial.print(", rekeys: ");
+    Serial.println(m->rekeys);
+#ifdef __AVR__
+    Serial.print("[M] stack: ");
+    Serial.print((unsigned long)IoTSec::stackPeak());
+    Serial.print(" B peak, ");
+    Serial.print((unsigned long)IOTSEC_STACK_RESERVE);
+    Serial.println(" B reserved");
+#endif
+    for (byte i = 0; i < STAGE_COUNT; ++i) {
+        StageTimer* timer = &m->stages[i];
+        if (timer->count == 0) {
+            continue;
+        }
+        unsigned long target = timer->count - timer->count / 100;
+        unsigned long seen = 0;
+        unsigned long p99 = timer->max;
+        for (byte b = 0; b < METRIC_BUCKETS - 1; ++b) {
+            seen += timer->buckets[b];
+            if (seen >= target) {
+                unsigned long top = 1UL << (METRIC_MIN_SHIFT + 1 + b);
+                p99 = top < timer->max ? top : timer->max;
+                break;
+            }
+        }
+        Serial.print("[M] ");
+        Serial.print(names[i]);
+        Serial.print(": n ");
+        Serial.print((unsigned long)timer->count);
+        Serial.print(", min ");
+        Serial.print((unsigned long)timer->min);
+        Serial.print(", avg ");
+        Serial.print((unsigned long)(timer->total / timer->count));
+        Serial.print(", p99 ");
+        Serial.print(p99);
+        Serial.print(", max ");
+        Serial.println((unsigned long)timer->max);
+    }
+    Serial.println("\n# METRICS END #");
+}
+
+/*
+ * Zeroes the counters and stage timers.
+ */
+void IoTSec::resetMetrics() {
+    memset(&IoTSec::metrics, 0, sizeof(Metrics));
+}
+
+/*
+ * Gets the counters and stage timers.
+ * @return the device's metrics block.
+ */
+Metrics* IoTSec::getMetrics() {
+    return &IoTSec::metrics;
+}
+
+#ifdef __AVR__
+extern char __heap_start;
+extern char* __brkval;
+#endif
+
+/*
+ * Fills the free SRAM between the heap and the stack with STACK_PAINT, so stackPeak can tell how
+ * deep the stack has been since. Call it first thing in setup(). Does nothing off the board.
+ */
+void IoTSec::paintStack() {
+#ifdef __AVR__
+    char top;
+    char* p = __brkval != NULL ? __brkval : &__heap_start;
+    while (p < &top - 16) {
+        *p++ = STACK_PAINT;
+    }
+#endif
+}
+
+/*
+ * Gets the deepest the stack has been since paintStack, interrupts included. The count starts
+ * at the current end of the heap, so the heap never counts as stack.
+ * @return the bytes from the top of SRAM down to the lowest one written, 0 off the board.
+ */
+unsigned int IoTSec::stackPeak() {
+#ifdef __AVR__
+    char* p = __brkval != NULL ? __brkval : &__heap_start;
+    while (p <= (char*)RAMEND && *p == (char)STACK_PAINT) {
+        p++;
+    }
+    return (char*)RAMEND + 1 - p;
+#else
+    return 0;
+#endif
+}
+#endif
@@ -0,0 +1,642 @@
+#include"Arduino.h"
+#include <RF24.h>
+#include <Crypto.h>
+#include <AES.h>
+#include <SHA256.h>
+
+//A product tunes the defines of the next two blocks in an IoTSecConfig.h beside this header rather
+//than editing it. The library's own files and the sketches using it all find it there, so a sketch
+//and IoTSec.cpp always agree on the layout; both sketches are built with the same one.
+#if defined(__has_include)
+#if __has_include("IoTSecConfig.h")
+#include "IoTSecConfig.h"
+#endif
+#endif
+#include "IoTSecLog.h"
+
+//Cipher and MAC policy (tunable): a block cipher with CIPHER_BLOCK_LEN byte blocks taking a
+//KEY_DATA_LEN byte key, and a hash with a DIGEST_LEN byte digest,
+//e.g. SpeckTiny and BLAKE2s; IoTSecConfig.h includes their headers.
+#ifndef IOTSEC_CIPHER
+#define IOTSEC_CIPHER AES128
+#endif
+#ifndef IOTSEC_HASH
+#define IOTSEC_HASH SHA256
+#endif
+typedef IOTSEC_CIPHER IoTSecCipher;
+typedef IOTSEC_HASH IoTSecHash;
+
+//Tunable sizes and modes. Everything below them is worked out from them.
+#ifndef RADIO_PAYLOAD_LEN
+#define RADIO_PAYLOAD_LEN 32                   //Bytes the radio carries in one packet.
+#endif
+#ifndef TAG_LEN
+#define TAG_LEN 8                              //Bytes of the truncated HMAC and of the CCM tag.
+#endif
+#ifndef MAX_MESSAGE_COUNT
+#define MAX_MESSAGE_COUNT 1000
+#endif
+#ifndef MAX_WINDOW
+#ifdef __AVR__
+#define MAX_WINDOW 1                           //Each slot is a frame of SRAM; set more in IoTSecConfig.h on a bigger board.
+#else
+#define MAX_WINDOW 4
+#endif
+#endif
+#ifndef FRAME_QUEUE_LEN
+#ifdef __AVR__
+#define FRAME_QUEUE_LEN 2                      //Frames each event-driven queue holds, the reply and one more.
+#else
+#define FRAME_QUEUE_LEN 3
+#endif
+#endif
+#ifndef IOTSEC_PLAIN_MODES
+#define IOTSEC_PLAIN_MODES 0                   //1 to build the send and receive without integrity.
+#endif
+#ifndef IOTSEC_METRICS
+#define IOTSEC_METRICS 0                       //1 to build the counters and stage timers, see dumpMetrics.
+#endif
+#ifndef IOTSEC_FRAGMENTS
+#define IOTSEC_FRAGMENTS 0                     //1 to build the fragmented messages, see beginMessage.
+#endif
+
+#define MAX_PACKET_SIZE (MAX_HEADER_SIZE + CIPHER_BLOCK_LEN)
+#define MAX_HEADER_SIZE 2
+#define MAX_PAYLOAD_SIZE (CIPHER_BLOCK_LEN - HASH_LEN)
+#define KEY_DATA_LEN 16
+#define HASH_KEY_LEN 16
+#define HASH_LEN TAG_LEN
+#define NONCE_LEN 8
+#define FRAGMENT_FLAG '+'
+#define FRAGMENT_SEQ_LEN 2
+#define FRAGMENT_DATA_LEN (CIPHER_BLOCK_LEN - FRAGMENT_SEQ_LEN)
+#define MESSAGE_LEN_LEN 2
+#define MAX_MESSAGE_SIZE 4096
+#define MAX_FRAME_SIZE (RADIO_PAYLOAD_LEN - NODE_ID_LEN)
+#define MAX_FRAME_BODY (MAX_FRAME_SIZE - MAX_HEADER_SIZE)
+#define CIPHER_BLOCK_LEN 16
+#define FRAME_LEN_LEN 1
+#define MAX_FRAME_PAYLOAD (MAX_FRAME_BODY - FRAME_LEN_LEN - HASH_LEN)
+#define READING_LEN 2
+#define MAX_BATCH_SIZE (MAX_WINDOW_PAYLOAD / READING_LEN)
+#define DIGEST_LEN 32
+#define CCM_NONCE_LEN 13
+#define CCM_TAG_LEN TAG_LEN
+#define CCM_MAC_FLAGS (0x40 | ((CCM_TAG_LEN - 2) / 2) << 3 | (14 - CCM_NONCE_LEN))
+#define CCM_CTR_FLAGS 0x01
+#define RATCHET_INTERVAL 10
+#define RATCHET_LABEL 0x01
+#define KEY_ID_LABEL 0x02
+#define REKEY_MARGIN 50
+#define KEY_GRACE_FRAMES 20
+#define WINDOW_STATE 10
+#define WINDOW_ACK_STATE 11
+#define WINDOW_SEQ_LEN 1
+#define WINDOW_HEADER_LEN 4
+#define MAX_WINDOW_PAYLOAD (MAX_FRAME_SIZE - WINDOW_HEADER_LEN - CCM_TAG_LEN)
+#define WINDOW_RECEIVE_SPAN 8
+#define WINDOW_ACK_LEN 2
+#define WINDOW_RATCHET_BIT 0x80
+#define WINDOW_TIMEOUT 200000
+#define WINDOW_RETRIES 5
+#define INITIAL_RTO 1000000
+#define MIN_RTO 20000
+#define MAX_RTO 4000000
+#define MAX_BACKOFF 8
+#define MAX_RETRIES 3
+#define MAX_PIPES 6
+#define NODE_ID_LEN 1
+#define ADDRESS_LEN 5
+#define NO_SESSION 0xffff
+#define SESSION_IDLE_TIMEOUT 600000
+
+//Link adaptation, see setLinkAdaptation. The data rate moves between LINK_RATES steps, 250 kbps,
+//1 Mbps and 2 Mbps, and the transmit power between RF24_PA_MIN and RF24_PA_MAX. A window of
+//LINK_WINDOW writes with no failure and at most LINK_CLEAN_RETRIES retransmissions is clean, one
+//with a failure or more than LINK_RETRY_LIMIT is struggling and judged straight away.
+#ifndef LINK_WINDOW
+#define LINK_WINDOW 8
+#endif
+#ifndef LINK_SILENCE
+#define LINK_SILENCE 30000                     //Milliseconds a gateway waits on a quiet node before going back to the base rate.
+#endif
+#define LINK_RATES 3
+#define LINK_NO_RATE 0xff
+#define LINK_CLEAN_RETRIES 1
+#define LINK_RETRY_LIMIT 8
+#define LINK_FAIL_LIMIT 3
+#define LINK_CALM_WINDOWS 2
+#define LINK_MAX_BACKOFF 4
+
+//Duty cycling, see sleepRadio and setWakeInterval. A node that sleeps between reports listens for
+//WAKE_WINDOW milliseconds after each frame it sends or hears, and its gateway keeps anything else
+//for it until then.
+#ifndef WAKE_WINDOW
+#define WAKE_WINDOW 20
+#endif
+
+//Duplicate filtering, see freshSequence. A session remembers which of the SEQUENCE_SPAN sequence
+//numbers up to the highest its peer has sent came in, more than a full window of readings.
+#define SEQUENCE_SPAN 64
+
+//Sessions a gateway keeps, see setGateway, and so the nodes it serves without one evicting another.
+//A 2 KB board has room for one next to its own Serial and radio, a bigger one for a node on each of
+//the five reading pipes left beside the ACK pipe; a host build has one for every node ID.
+//SESSION_INDEX_LEN is a power of two of at least MAX_SESSIONS.
+#ifndef MAX_SESSIONS
+#if defined(__AVR__) && defined(RAMEND) && RAMEND - RAMSTART + 1 > 2048
+#define MAX_SESSIONS 5
+#define SESSION_INDEX_LEN 8
+#elif defined(__AVR__)
+#define MAX_SESSIONS 1
+#define SESSION_INDEX_LEN 1
+#else
+#define MAX_SESSIONS 256
+#define SESSION_INDEX_LEN 256
+#endif
+#endif
+#if (SESSION_INDEX_LEN & (SESSION_INDEX_LEN - 1)) != 0 || SESSION_INDEX_LEN < MAX_SESSIONS
+#error "SESSION_INDEX_LEN must be a power of two of at least MAX_SESSIONS"
+#endif
+
+//SRAM budget every board build is checked against, see IOTSEC_NODE_SRAM: the board's SRAM, and the part
+//of it kept free for the stack. The reserve covers the deepest send or receive path, a blocking
+//receive that polls and resends a window frame on the way, with interrupts on top. make -C host
+//stack works the paths out in host frames, which are wider than the board's, and a metrics build
+//reports the deepest the stack has been on the board.
+#ifndef IOTSEC_SRAM_BUDGET
+#ifdef RAMEND
+#define IOTSEC_SRAM_BUDGET (RAMEND - RAMSTART + 1)
+#else
+#define IOTSEC_SRAM_BUDGET 0                   //Unknown off the board, and not checked.
+#endif
+#endif
+#ifndef IOTSEC_STACK_RESERVE
+#define IOTSEC_STACK_RESERVE 768
+#endif
+#define STACK_PAINT 0xa5
+
+//Stages of the hot path timed with IOTSEC_METRICS. Their times fall in METRIC_BUCKETS buckets
+//doubling from 2^METRIC_MIN_SHIFT us, the last one open-ended.
+#define STAGE_HEADER 0
+#define STAGE_MAC 1
+#define STAGE_CIPHER 2
+#define STAGE_RADIO_WRITE 3
+#define STAGE_RX_WAIT 4
+#define STAGE_VERIFY 5
+#define STAGE_ROUND_TRIP 6
+#define STAGE_HANDSHAKE 7
+#define STAGE_COUNT 8
+#define METRIC_BUCKETS 16
+#define METRIC_MIN_SHIFT 4
+
+//Layouts the tunables must keep.
+static_assert(RADIO_PAYLOAD_LEN <= 32, "RADIO_PAYLOAD_LEN is at most the nRF24's 32 bytes");
+static_assert(TAG_LEN >= 4 && TAG_LEN <= 8 && TAG_LEN % 2 == 0,
+              "TAG_LEN must be 4, 6 or 8: CCM tags are even and a packet keeps 8 payload bytes");
+static_assert(MAX_PACKET_SIZE <= MAX_FRAME_SIZE && MAX_FRAME_BODY >= CIPHER_BLOCK_LEN,
+              "a packet, and a cipher block after a header, must fit in a frame");
+static_assert(MAX_HEADER_SIZE + FRAME_LEN_LEN + MAX_FRAME_PAYLOAD + CCM_TAG_LEN <= MAX_FRAME_SIZE,
+              "a sealed frame must fit in a frame");
+static_assert(MAX_WINDOW >= 1 && MAX_WINDOW <= WINDOW_RECEIVE_SPAN, "MAX_WINDOW must be 1 to WINDOW_RECEIVE_SPAN");
+static_assert(MAX_BATCH_SIZE >= 1, "a window frame must hold a reading");
+static_assert(MAX_MESSAGE_COUNT > REKEY_MARGIN, "MAX_MESSAGE_COUNT must leave room to renew the keys");
+
+/*
+ * One encryption/integrity key pair and the frames sealed under it. Its key schedule lives in the
+ * shared cipher, which is only expanded again when another context's keys were put in it since.
+ * HMACs are worked out from intKey each time: the SHA256 of the Crypto library keeps its state
+ * private, so the ipad and opad blocks cannot be hashed once and resumed.
+ */
+struct CryptoContext {
+    byte* encKey; //The encryption key the context was built from, NULL when unused.
+    byte* intKey; //The integrity key the context was built from.
+    unsigned long sendCount; //Sealed frames sent under encKey, the nonce of the next one.
+    unsigned long receiveCount; //Sealed frames accepted under encKey, the nonce expected next.
+    byte keyId; //Names the keys in the header of each sealed frame, 0 for the secret keys.
+};
+
+/*
+ * A frame waiting in one of the event-driven queues.
+ */
+struct QueuedFrame {
+    byte len; //Bytes used in data.
+    byte pipe; //The pipe a received frame came in on.
+    byte data[MAX_FRAME_SIZE]; //The frame as it goes on or came off air.
+};
+
+/*
+ * A frame of the sliding window, kept until the other end acknowledges it.
+ */
+struct WindowSlot {
+    QueuedFrame frame; //The sealed frame, sent again as is.
+    unsigned long sentAt; //micros() when it last went out.
+    byte retries; //Times it has been sent again.
+    byte order; //Transmission it last went out in, to tell which of two frames went out last.
+};
+
+/*
+ * Round trip estimate for one kind of exchange with the peer, after RFC 6298, and the
+ * retransmission timeout it gives. Times are in microseconds.
+ */
+struct RetransmitTimer {
+    unsigned long srtt; //Smoothed round trip time, 0 before the first sample.
+    unsigned long rttvar; //Smoothed mean deviation of the round trip time.
+    unsigned long rto; //Timeout given by the estimate, before backoff.
+    byte backoff; //Timeouts since the last sample or acknowledgement, each doubling the timeout.
+};
+
+/*
+ * How the link with one peer has fared over the writes judged so far, and the data rate and
+ * transmit power this end would move it to.
+ */
+struct LinkStats {
+    byte paLevel; //The transmit power agreed for the peer.
+    byte wantedRate; //The data rate step this end would move to, LINK_NO_RATE before it has judged any.
+    byte wantedPa; //The transmit power it would move to.
+    byte writes; //Writes to the peer finished in this window.
+    byte failures; //Of those, writes out of retries.
+    byte retries; //Retransmissions the radio took for them, stuck at 255.
+    byte received; //Frames heard from the peer in this window, stuck at 255.
+    byte strong; //Of those, frames the radio heard above its RPD level.
+    byte failStreak; //Writes out of retries in a row.
+    byte calm; //Clean windows in a row.
+    byte backoff; //Rises undone or refused so far, each doubling the clean windows before the next.
+};
+
+/*
+ * The times taken by one stage of the hot path, in microseconds.
+ */
+struct StageTimer {
+    unsigned long count;
+    unsigned long long total;
+    unsigned long min;
+    unsigned long max;
+    unsigned int buckets[METRIC_BUCKETS]; //Samples under 2^(METRIC_MIN_SHIFT + 1 + i) us, stuck at their maximum.
+};
+
+/*
+ * What one device has done since it started or resetMetrics, kept in one fixed block.
+ */
+struct Metrics {
+    unsigned long messagesSent; //Frames put on air, retransmissions included.
+    unsigned long bytesSent;
+    unsigned long messagesReceived; //Frames read by the sketch.
+    unsigned long bytesReceived;
+    unsigned long integrityFailures; //Frames whose HMAC or tag did not match.
+    unsigned long timeouts;
+    unsigned long handshakes; //Session keys generated, rekeys included.
+    unsigned long rekeys; //Session keys generated over live ones.
+    StageTimer stages[STAGE_COUNT];
+};
+
+//Hot path probes. Without IOTSEC_METRICS they compile to nothing.
+#if IOTSEC_METRICS
+#define METRIC_COUNT(counter, n) (IoTSec::metrics.counter += (n))
+#define METRIC_START(timer) unsigned long timer = micros()
+#define METRIC_RECORD(stage, us) IoTSec::recordStage(stage, us)
+#define METRIC_STOP(stage, timer) IoTSec::recordStage(stage, micros() - (timer))
+#else
+#define METRIC_COUNT(counter, n) ((void)0)
+#define METRIC_START(timer) ((void)0)
+#define METRIC_RECORD(stage, us) ((void)0)
+#define METRIC_STOP(stage, timer) ((void)0)
+#endif
+
+class IoTSec;
+
+/*
+ * A gateway's session with one node.
+ */
+struct SessionEntry {
+    IoTSec* session; //The session, reset whenever the entry goes to another node.
+    byte nodeId; //The node the session is with.
+    bool used; //Flag for whether the entry holds a node's session.
+    bool rxTurn; //Flag for whether the entry waits in the RX turns.
+    bool txTurn; //Flag for whether the entry waits in the TX turns.
+    unsigned long lastHeard; //millis() when the node's last frame came in.
+    unsigned int newer; //The entry heard from next after this one, NO_SESSION for the newest.
+    unsigned int older; //The entry heard from last before this one, NO_SESSION for the oldest; links free entries.
+};
+
+/*
+ * A gateway's sessions, see setGateway. Node IDs are found through an open addressing index,
+ * and the entries in use are kept in the order their nodes were last heard from, so the one
+ * idle longest is at hand for expiry or eviction. Sessions with frames to read or send wait
+ * for their turn in first come, first served queues of entries.
+ */
+struct SessionTable {
+    SessionEntry entries[MAX_SESSIONS];
+    unsigned int index[SESSION_INDEX_LEN]; //The entry of the node ID hashed to each slot, NO_SESSION for none.
+    unsigned int newest; //The entry heard from last, NO_SESSION when none is in use.
+    unsigned int oldest; //The entry heard from longest ago.
+    unsigned int free; //The first entry not in use, NO_SESSION when the table is full.
+    unsigned int rxTurns[MAX_SESSIONS]; //Entries with frames to read, oldest turn at rxHead.
+    unsigned int rxHead;
+    unsigned int rxCount;
+    unsigned int txTurns[MAX_SESSIONS]; //Entries with frames to send, oldest turn at txHead.
+    unsigned int txHead;
+    unsigned int txCount;
+    unsigned int ackLoaded[MAX_PIPES]; //The entry whose acknowledgement is loaded as each pipe's ACK payload.
+    int pipeNode[MAX_PIPES]; //The node heard on each pipe, -1 for none yet and -2 once a second one is.
+    byte address[ADDRESS_LEN]; //The address nodes listen on, with the first byte replaced by the node ID.
+    int writingNode; //The node the writing pipe was last opened on, -1 for none yet.
+};
+
+class IoTSec {
+	public:
+	    //Constructors
+		IoTSec(RF24* radio, IoTSecCipher* encCipher, IoTSecHash* hash256);
+		~IoTSec();
+
+		//Functions
+		bool keyExpired();
+        bool rekeyDue();
+#if IOTSEC_PLAIN_MODES
+		void send(String str, String state);
+		void send(char* arr, String state);
+        void send(String str, byte* encKey, String state);
+		void send(char* arr, byte* encKey, String state);
+#endif
+        void send(String str, byte* encKey, byte* intKey, String state);
+		void send(char* arr, byte* encKey, byte* intKey, String state);
+#if IOTSEC_PLAIN_MODES
+		String receiveStr(char* state, bool block);
+        void receive(byte payload[], char* state, bool block);
+        String receiveStr(byte* encKey, char* state, bool block);
+        void receive(byte payload[], byte* encKey, char* state, bool block);
+#endif
+        String receiveStr(byte* encKey, byte* intKey, char* state, bool block);
+        void receive(byte payload[], byte* encKey, byte* intKey, char* state, bool block);
+#if IOTSEC_FRAGMENTS
+        bool beginMessage(unsigned int len, byte* encKey, byte* intKey, String state);
+        void writeMessage(byte* data, unsigned int len);
+        bool endMessage();
+        bool sendMessage(byte* data, unsigned int len, byte* encKey, byte* intKey, String state);
+        unsigned int receiveMessage(byte buffer[], unsigned int size, byte* encKey, byte* intKey, char* state, bool block);
+#endif
+        void setDynamicFrames(bool enable);
+        bool getDynamicFrames();
+        void sendFrame(byte* data, byte len, String state);
+        void sendFrame(byte* data, byte len, byte* encKey, byte* intKey, String state);
+        byte receiveFrame(byte payload[], char* state, bool block);
+        byte receiveFrame(byte payload[], byte* encKey, byte* intKey, char* state, bool block);
+        byte* beginFrame(byte frame[], char state);
+        void sendInPlace(byte frame[], byte len, byte* encKey, byte* intKey);
+        byte* receiveInPlace(byte frame[], byte* len, byte* encKey, byte* intKey, bool block);
+        void setInitiator(bool initiator);
+        void sendSealed(byte* data, byte len, byte* key, String state);
+        byte receiveSealed(byte payload[], byte* key, char* state, bool block);
+        void sendSealedInPlace(byte frame[], byte len, byte* key);
+        byte* receiveSealedInPlace(byte frame[], byte* len, byte* key, bool block);
+        void setWindow(byte size);
+        bool windowOpen();
+        byte windowInFlight();
+        unsigned long getWindowBase();
+        bool windowFailed();
+        bool sendWindowed(byte* data, byte len, byte* key);
+        byte* receiveWindowedInPlace(byte frame[], byte* len, byte* key, bool block);
+        bool freshSequence(unsigned int sequence);
+        void setEventDriven(bool enable);
+        void setNodeId(byte id);
+        byte getNodeId();
+        void setGateway(byte* address);
+        IoTSec* nextSession();
+        unsigned int getSessionCount();
+        void setLinkAdaptation(bool enable);
+        bool linkProposal(byte* rate, byte* paLevel);
+        bool agreeLink(unsigned int number, byte* rate, byte* paLevel);
+        void setLinkMode(byte rate, byte paLevel);
+        byte getLinkRate();
+        byte getLinkPaLevel();
+        void setWakeInterval(unsigned long ms);
+        unsigned long getWakeInterval();
+        bool sleepRadio();
+        void radioInterrupt();
+        void poll();
+        bool frameAvailable();
+        bool sendPending();
+        char peekState();
+        unsigned long getResponseTimeout();
+        void retransmit();
+        bool getTimedOut();
+        void hash(byte message[], int len, byte hash[]);
+        void printByteArr(byte arr[], int size);
+        byte* getMasterKey();
+        byte* getHashKey();
+        byte* getSecretKey();
+        byte* getSecretHashKey();
+        unsigned int getRatchetCount();
+        void createNonce(byte nonce[]);
+        int createRandom();
+        void generateKeys(byte nonce1[], byte nonce2[]);
+        void setHandshakeComplete(bool complete);
+        void incrMsgCount();
+        bool getIntegrityPassed();
+        void setChallenge(int challenge);
+        int getChallenge();
+#if IOTSEC_METRICS
+        static void recordStage(byte stage, unsigned long us);
+        static void dumpMetrics();
+        static void resetMetrics();
+        static Metrics* getMetrics();
+        static void paintStack();
+        static unsigned int stackPeak();
+
+        static Metrics metrics; //Shared by every session on the device.
+#endif
+
+	private:
+	    //Keys
+		byte secretKey[KEY_DATA_LEN]; //The secret key known to both the client and the server.
+		byte secretHashKey[KEY_DATA_LEN]; //The secret hash key computed from secret key.
+        byte* masterKey; //The master key generated through the handshake.
+        byte* hashKey; //The hash key generated from the master key.
+        byte* previousMasterKey; //The master key the last handshake replaced, NULL once its grace window is over.
+        byte* previousHashKey; //The hash key the last handshake replaced.
+        byte sessionKeys[KEY_DATA_LEN + HASH_KEY_LEN]; //Holds masterKey and hashKey, so handshakes never allocate.
+        byte previousKeys[KEY_DATA_LEN + HASH_KEY_LEN]; //Holds previousMasterKey and previousHashKey.
+
+        //State
+        bool handshakeComplete; //Flag for whether the handshake has been completed.
+        int numMsgs; //The number of messages sent.
+        unsigned int ratchetCount; //Times the session keys have been ratcheted since the handshake.
+        bool peerOnPrevious; //Flag for whether the last sealed frame received used the previous session keys.
+        byte graceLeft; //Sealed frames still accepted under the previous session keys.
+        int previousMsgs; //numMsgs under the previous session keys, for swapSessionKeys.
+        unsigned int previousRatchets; //ratchetCount of the previous session keys.
+        unsigned int previousLinkNumber; //linkNumber under the previous session keys.
+        bool integrityPassed;  //Flag set in the receive function validating message integrity
+        bool timedOut; //Flag set in the receive functions when no frame came.
+        bool dynamicFrames; //Flag for whether packets go out with only as many bytes as they carry.
+        bool initiator; //Flag for whether this end starts the handshake, which picks its half of the nonces.
+
+        //Fragmented message being streamed out.
+#if IOTSEC_FRAGMENTS
+        byte fragment[MAX_FRAME_SIZE]; //Header and plaintext body of the fragment being filled.
+        byte fragmentFill; //Data bytes already in the fragment.
+        unsigned int fragmentSeq; //Sequence number of the fragment being filled.
+        unsigned int messageRemaining; //Message bytes still expected by writeMessage.
+#endif
+        bool messageLost; //A fragment of the message ran out of retries; nothing more of it is sent.
+
+        //Event-driven radio I/O.
+        bool eventDriven; //Flag for whether sends queue and receives take queued frames instead of waiting on the radio.
+        volatile bool radioEvent; //Set from the IRQ pin's interrupt, cleared once poll has looked at the radio.
+        bool txBusy; //Flag for whether the radio is still sending the last frame poll started.
+        QueuedFrame rxQueue[FRAME_QUEUE_LEN]; //Frames off the radio not read yet, oldest at rxHead.
+        QueuedFrame txQueue[FRAME_QUEUE_LEN]; //Frames waiting for the radio, oldest at txHead.
+        byte rxHead;
+        byte rxCount;
+        byte txHead;
+        byte txCount;
+        byte rxPipe; //The pipe the last frame read came in on.
+
+        //Sessions, see setNodeId and setGateway.
+        byte nodeId; //The node at the far end of a gateway's session, or this node; sent in front of each frame.
+        int challenge; //The random number the other end must send back decremented in the handshake.
+        IoTSec* radioOwner; //The gateway that services the radio, this one unless it is one of its sessions.
+        SessionTable* sessionTable; //A gateway's sessions, NULL on a node.
+        unsigned int sessionEntry; //The entry of a gateway's session in its table.
+
+        //Link adaptation, see setLinkAdaptation. The data rate is the radio's, kept by the end that services it.
+        bool linkAdapt; //Flag for whether the data rate and transmit power follow the link.
+        byte linkRate; //The data rate step the radio is on.
+        byte nextRate; //The step the radio moves to once the reply agreeing it is on air.
+        bool rateDue; //Flag for whether the radio moves to nextRate when the frame on air is done.
+        byte linkReplyDue; //Frames this session sends before its reply to agreeLink, 0 for none.
+        unsigned int linkNumber; //The number of the last proposal agreed under the session keys.
+        IoTSec* txSession; //The session whose frame is on air.
+        LinkStats link; //How the link with the peer is doing.
+
+        //Duty cycling, see sleepRadio and setWakeInterval.
+        unsigned long wakeInterval; //The longest the node sleeps between frames in ms, 0 if it always listens.
+        unsigned long lastActive; //millis() when this node last sent or heard a frame.
+        bool radioAsleep; //Flag for whether sleepRadio powered the radio down.
+        bool replyOwed; //Flag for whether a gateway's session read a frame other than a window frame and has not sent since.
+
+        //Retransmission, see retransmit.
+        RetransmitTimer responseTimer; //Round trips from a frame sent to the peer's reply.
+        RetransmitTimer windowTimer; //Round trips from a window frame sent to its acknowledgement.
+        QueuedFrame lastSent; //The last frame sent, other than window frames.
+        unsigned long lastReceived; //frameHash of the last frame read, 0 before the first.
+        unsigned long requestSentAt; //micros() when lastSent went out.
+        bool awaitingReply; //Flag for whether the initiator has sent a frame and not had a reply since.
+        bool requestTimed; //Flag for whether lastSent went out only once, so its reply times a round trip.
+        bool replyCached; //Flag for whether lastSent answers lastReceived.
+
+        //Sliding window, see setWindow.
+        byte windowSize; //Frames sendWindowed may leave unacknowledged at once, 0 for stop-and-wait.
+        WindowSlot window[MAX_WINDOW]; //Frames sent and not acknowledged yet, frame n in slot n % MAX_WINDOW.
+        unsigned long windowBase; //The oldest frame not acknowledged yet.
+        unsigned long windowRatcheted; //Frame numbers used under the session keys before their last ratchet in the window.
+        byte windowSpan; //Frames sent from windowBase on.
+        byte windowAcked; //Frames acknowledged out of order, bit i for frame windowBase + i.
+        byte windowTransmissions; //Transmissions of window frames so far.
+        bool windowLost; //Flag for whether a frame ran out of retries.
+        byte windowReceived; //Frames received ahead of the next one expected, bit i for receiveCount + 1 + i.
+        byte windowAck[NODE_ID_LEN + WINDOW_HEADER_LEN + WINDOW_ACK_LEN + CCM_TAG_LEN]; //The acknowledgement loaded as the ACK payload, node ID first.
+
+        //Duplicate filtering, see freshSequence.
+        unsigned int sequenceHigh; //The highest sequence number the peer has sent.
+        unsigned long long sequenceSeen; //Sequence numbers seen, bit i for sequenceHigh - i; 0 before the first.
+
+        //Crypto contexts
+        CryptoContext secretContext; //Context of the secret key pair.
+        CryptoContext sessionContext; //Context of the master and hash keys.
+        CryptoContext previousContext; //Context of the previous master and hash keys.
+        CryptoContext* keyContext; //Context of the keys picked by selectKeys, NULL if they have none.
+        byte* selectedIntKey; //The integrity key picked by selectKeys.
+        static byte* keyedKey; //The key the cipher has expanded, NULL when unknown.
+
+        //Utilities
+        RF24* radio;
+        IoTSecCipher* encCipher;
+        IoTSecHash* hash256;
+
+        //Functions
+        byte receiveHelper(byte* bytes, byte size, char* state, bool block);
+        byte readFrame(byte frame[], byte size, bool block);
+        bool fetchFrame();
+        void startSend();
+        void radioWrite(byte* data, byte len, bool start);
+        IoTSec* sessionFor(byte nodeId);
+        unsigned int findSession(byte nodeId);
+        unsigned int openSession(byte nodeId);
+        void closeSession(unsigned int entry);
+        void touchSession(unsigned int entry);
+        void unlinkSession(unsigned int entry);
+        void expireSessions();
+        void queueTurn(bool tx);
+        void resetSession();
+        bool repeatedFrame(QueuedFrame* in);
+        void replyArrived();
+        void transmit(byte* data, byte len);
+        void setListening(bool listen);
+        void createHeader(String state, byte bytes[]);
+        template <bool Encrypt, bool Authenticate>
+        void sendPacket(char* arr, byte* encKey, byte* intKey, String state);
+        template <bool Encrypt, bool Authenticate>
+        void receivePacket(byte payload[], byte* encKey, byte* intKey, char* state, bool block);
+        void stringPayload(String str, byte bytes[]);
+        void appendHMAC(char* arr, byte* toEncrypt);
+        bool verifyHMAC(byte* bytes);
+#if IOTSEC_FRAGMENTS
+        void streamFragment(byte* data, unsigned int len);
+        void flushFragment();
+        byte fragmentDataLen();
+#endif
+        void encryptFrame(byte* output, byte* input, byte len);
+        void decryptFrame(byte* output, byte* input, byte len);
+        void buildContext(CryptoContext* context, byte* encKey, byte* intKey);
+        void clearContext(CryptoContext* context);
+        void useContext(CryptoContext* context);
+        void selectKeys(byte* encKey, byte* intKey);
+        void beginHMAC();
+        void endHMAC(byte* tag);
+        void ccmNonce(byte nonce[], bool fromInitiator, unsigned long count);
+        void ccmBlock(byte block[], byte flags, byte* nonce, unsigned int counter);
+        void ccmMAC(byte* tag, byte frame[], byte aadLen, byte* nonce);
+        void ccmCrypt(byte* data, byte len, byte* tag, byte* nonce);
+        void checkRatchet();
+        byte ratchetBit();
+        void ratchetKeys(CryptoContext* context);
+        void deriveKeys(CryptoContext* context, byte label, byte digest[]);
+        void retireSessionKeys();
+        void clearPreviousKeys();
+        bool sessionKeysHeard();
+        bool reinstateDue(byte keyId);
+        void swapSessionKeys();
+        bool openFrame(byte frame[], byte bodyLen);
+        void sendWindowFrame(WindowSlot* slot);
+        void sendWindowAck();
+        void queueWindowAck();
+        void pipeHeard(byte pipe, byte nodeId);
+        void processAck(byte frame[], byte packetLen);
+        void checkWindow();
+        void resetWindow();
+        void resetTimer(RetransmitTimer* timer, unsigned long rto);
+        void linkSent(bool acked, byte retries);
+        void linkReceived(bool strong);
+        void judgeLink(bool struggling);
+        void linkFallBack();
+        void linkWritten();
+        void switchRate(byte rate);
+        void checkLinkSilence();
+        void resetLink();
+        bool nodeListening();
+        void timerSample(RetransmitTimer* timer, unsigned long rtt);
+        void timerBackoff(RetransmitTimer* timer);
+        unsigned long timerTimeout(RetransmitTimer* timer);
+};
+
+//SRAM the library takes, for a sketch to add its own globals to and check against IOTSEC_SRAM_BUDGET:
+//a node's session with its cipher, hash and log ring, and a gateway's session table and other
+//sessions on top, all in static storage. Only the calls taking a String use the heap, for the String.
+#if IOTSEC_METRICS
+#define METRICS_SRAM sizeof(Metrics)
+#else
+#define METRICS_SRAM 0
+#endif
+#define IOTSEC_NODE_SRAM (sizeof(IoTSec) + sizeof(IoTSecCipher) + sizeof(IoTSecHash) + LOG_BUFFER_LEN + METRICS_SRAM)
+#define IOTSEC_GATEWAY_SRAM (IOTSEC_NODE_SRAM + sizeof(SessionTable) + (MAX_SESSIONS - 1) * sizeof(IoTSec))
@@ -0,0 +1,282 @@
+#include "IoTSec.h"
+
+byte IoTSecLog::ring[LOG_BUFFER_LEN];
+unsigned int IoTSecLog::head = 0;
+unsigned int IoTSecLog::count = 0;
+unsigned long IoTSecLog::dropped = 0;
+unsigned long IoTSecLog::droppedReported = 0;
+
+//The formats, only read to render text. Without IOTSEC_LOG_TEXT on a board nothing does, and
+//the linker leaves them out.
+#define LOG_FORMAT_STRING(token, format) static const char token##_FORMAT[] PROGMEM = format;
+#define LOG_FORMAT_ENTRY(token, format) token##_FORMAT,
+LOG_TOKENS(LOG_FORMAT_STRING)
+static const char* const logFormats[LOG_TOKEN_COUNT] PROGMEM = {
+    LOG_TOKENS(LOG_FORMAT_ENTRY)
+};
+
+/*
+ * Moves what the Serial TX buffer has room for out of the ring, so it never blocks. Call it
+ * from loop() when nothing else is waiting. With IOTSEC_LOG_TEXT whole lines are rendered
+ * instead, each once LOG_TEXT_ROOM bytes are free; a line longer than that can block for
+ * the rest.
+ */
+void IoTSecLog::drain() {
+#if IOTSEC_LOG_TEXT
+    byte rec[LOG_RECORD_MAX];
+    while (IoTSecLog::count > 0 && Serial.availableForWrite() >= LOG_TEXT_ROOM) {
+        IoTSecLog::pop(rec);
+        IoTSecLog::render(rec);
+    }
+#else
+    while (IoTSecLog::count > 0 && Serial.availableForWrite() > 0) {
+        Serial.write(IoTSecLog::ring[IoTSecLog::head]);
+        IoTSecLog::head = (IoTSecLog::head + 1) % LOG_BUFFER_LEN;
+        IoTSecLog::count--;
+    }
+#endif
+}
+
+/*
+ * Returns true once everything logged has gone out to Serial.
+ */
+bool IoTSecLog::empty() {
+    return IoTSecLog::count == 0;
+}
+
+/*
+ * Gets the number of lines dropped because the ring was full.
+ * @return the lines dropped since startup.
+ */
+unsigned long IoTSecLog::getDropped() {
+    return IoTSecLog::dropped;
+}
+
+/*
+ * Prints a record as the line it stands for.
+ * @param rec - The record, its length byte first.
+ */
+void IoTSecLog::render(byte rec[]) {
+    if (rec[1] >= LOG_TOKEN_COUNT) {
+        Serial.print("(unknown log token ");
+        Serial.print((unsigned long)rec[1]);
+        Serial.println(")");
+        return;
+    }
+    const byte* arg = rec + 2;
+    const byte* end = rec + rec[0];
+    const char* format = (const char*)pgm_read_ptr(&logFormats[rec[1]]);
+    char c;
+    while ((c = pgm_read_byte(format++)) != 0) {
+        if (c != '%') {
+            Serial.print(c);
+            continue;
+        }
+        c = pgm_read_byte(format++);
+        if (c == 0) {
+            break;
+        }
+        if (arg >= end) {
+            Serial.print('?');
+            continue;
+        }
+        unsigned long value;
+        if (c == 'u') {
+            arg = IoTSecLog::readVarint(arg, &value);
+            Serial.print(value);
+        }
+        else if (c == 'd') {
+            arg = IoTSecLog::readVarint(arg, &value);
+            if (value & 1) {
+                Serial.print('-');
+            }
+            Serial.print((value >> 1) + (value & 1));
+        }
+        else if (c == 's' || c == 'b') {
+            byte n = *arg++;
+            if (n > end - arg) {
+                n = end - arg;
+            }
+            if (c == 'b') {
+                Serial.print("[ ");
+            }
+            for (byte i = 0; i < n; ++i) {
+                if (c == 's') {
+                    Serial.print((char)arg[i]);
+                }
+                else {
+                    Serial.print((unsigned long)arg[i]);
+                    Serial.print(' ');
+                }
+            }
+            if (c == 'b') {
+                Serial.print("]");
+            }
+            arg += n;
+        }
+    }
+    Serial.println();
+}
+
+/*
+ * Appends an unsigned number as a base 128 varint, low 7 bits first.
+ * @param rec - The record being built.
+ * @param len - Its length so far, updated; 0 once an argument did not fit.
+ * @param value - The number.
+ */
+void IoTSecLog::putArg(byte rec[], byte* len, unsigned long value) {
+    byte out[(sizeof(unsigned long) * 8 + 6) / 7];
+    byte n = 0;
+    do {
+        out[n] = value & 0x7f;
+        value >>= 7;
+        if (value != 0) {
+            out[n] |= 0x80;
+        }
+        n++;
+    } while (value != 0);
+    IoTSecLog::putBytes(rec, len, out, n);
+}
+
+/*
+ * Appends a signed number zigzagged, so small negative numbers stay short.
+ * @param rec - The record being built.
+ * @param len - Its length so far, updated; 0 once an argument did not fit.
+ * @param value - The number.
+ */
+void IoTSecLog::putArg(byte rec[], byte* len, long value) {
+    IoTSecLog::putArg(rec, len, ((unsigned long)value << 1) ^ (unsigned long)(value >> (sizeof(long) * 8 - 1)));
+}
+
+/*
+ * Appends a C string, cut to what is left of the record.
+ * @param rec - The record being built.
+ * @param len - Its length so far, updated; 0 once an argument did not fit.
+ * @param str - The string.
+ */
+void IoTSecLog::putArg(byte rec[], byte* len, const char* str) {
+    if (*len == 0 || *len >= LOG_RECORD_MAX) {
+        *len = 0;
+        return;
+    }
+    unsigned int n = strlen(str);
+    if (n > (unsigned int)(LOG_RECORD_MAX - *len - 1)) {
+        n = LOG_RECORD_MAX - *len - 1;
+    }
+    rec[(*len)++] = n;
+    IoTSecLog::putBytes(rec, len, (const byte*)str, n);
+}
+
+/*
+ * Appends a String, cut to what is left of the record.
+ * @param rec - The record being built.
+ * @param len - Its length so far, updated; 0 once an argument did not fit.
+ * @param str - The string.
+ */
+void IoTSecLog::putArg(byte rec[], byte* len, const String& str) {
+    IoTSecLog::putArg(rec, len, str.c_str());
+}
+
+/*
+ * Appends a byte array whole; a record it does not fit in is dropped.
+ * @param rec - The record being built.
+ * @param len - Its length so far, updated; 0 once an argument did not fit.
+ * @param bytes - The array.
+ */
+void IoTSecLog::putArg(byte rec[], byte* len, const LogBytes& bytes) {
+    if (*len == 0 || *len >= LOG_RECORD_MAX) {
+        *len = 0;
+        return;
+    }
+    rec[(*len)++] = bytes.len;
+    IoTSecLog::putBytes(rec, len, bytes.data, bytes.len);
+}
+
+/*
+ * Appends raw bytes to a record, or marks it as not fitting.
+ * @param rec - The record being built.
+ * @param len - Its length so far, updated; 0 once an argument did not fit.
+ * @param data - The bytes.
+ * @param n - The number of bytes.
+ */
+void IoTSecLog::putBytes(byte rec[], byte* len, const byte* data, unsigned int n) {
+    if (*len == 0 || *len + n > LOG_RECORD_MAX) {
+        *len = 0;
+        return;
+    }
+    memmove(rec + *len, data, n);
+    *len += n;
+}
+
+/*
+ * Puts a finished record in the ring, behind a LOG_DROPPED record if lines were lost since
+ * the last one that went in.
+ * @param rec - The record, its length byte left to fill.
+ * @param len - Its length, 0 if an argument did not fit.
+ */
+void IoTSecLog::commit(byte rec[], byte len) {
+    if (len == 0) {
+        IoTSecLog::dropped++;
+        return;
+    }
+    rec[0] = len;
+    if (IoTSecLog::dropped != IoTSecLog::droppedReported) {
+        byte note[8];
+        byte noteLen = 2;
+        note[1] = LOG_DROPPED;
+        IoTSecLog::putArg(note, &noteLen, IoTSecLog::dropped - IoTSecLog::droppedReported);
+        note[0] = noteLen;
+        if (IoTSecLog::count + noteLen + len > LOG_BUFFER_LEN) {
+            IoTSecLog::dropped++;
+            return;
+        }
+        IoTSecLog::push(note, noteLen);
+        IoTSecLog::droppedReported = IoTSecLog::dropped;
+    }
+    if (IoTSecLog::count + len > LOG_BUFFER_LEN) {
+        IoTSecLog::dropped++;
+        return;
+    }
+    IoTSecLog::push(rec, len);
+}
+
+/*
+ * Copies bytes into the ring behind what is there. The caller checks they fit.
+ * @param rec - The bytes.
+ * @param len - The number of bytes.
+ */
+void IoTSecLog::push(byte rec[], byte len) {
+    for (byte i = 0; i < len; ++i) {
+        IoTSecLog::ring[(IoTSecLog::head + IoTSecLog::count) % LOG_BUFFER_LEN] = rec[i];
+        IoTSecLog::count++;
+    }
+}
+
+/*
+ * Takes the oldest record out of the ring.
+ * @param rec - The LOG_RECORD_MAX byte buffer to copy it to.
+ */
+void IoTSecLog::pop(byte rec[]) {
+    byte len = IoTSecLog::ring[IoTSecLog::head];
+    for (byte i = 0; i < len; ++i) {
+        rec[i] = IoTSecLog::ring[IoTSecLog::head];
+        IoTSecLog::head = (IoTSecLog::head + 1) % LOG_BUFFER_LEN;
+    }
+    IoTSecLog::count -= len;
+}
+
+/*
+ * Reads a varint written by putArg.
+ * @param in - Where it starts.
+ * @param value - Set to the number.
+ * @return where the next argument starts.
+ */
+const byte* IoTSecLog::readVarint(const byte* in, unsigned long* value) {
+    *value = 0;
+    byte shift = 0;
+    do {
+        *value |= (unsigned long)(*in & 0x7f) << shift;
+        shift += 7;
+    } while ((*in++ & 0x80) && shift < 35);
+    return in;
+}
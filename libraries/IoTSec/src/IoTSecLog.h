@@ -0,0 +1,193 @@
+/*
+ * Deferred, tokenized logging. A log call writes a few bytes into a RAM ring instead of
+ * printing: the line's token and its arguments, packed. The ring goes out over Serial a
+ * little at a time from loop() when there is nothing else to do, as binary records
+ * for host/logdecode to turn back into text, or rendered as text for the serial monitor
+ * with IOTSEC_LOG_TEXT. The lines themselves are only stored as PROGMEM format strings.
+ *
+ * Each call site picks a level, and calls above IOTSEC_LOG_LEVEL compile to nothing.
+ * Set the tunables in IoTSecConfig.h, which IoTSec.h includes first.
+ */
+#ifndef IOTSECLOG_H
+#define IOTSECLOG_H
+
+#include "Arduino.h"
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef IOTSEC_LOG_LEVEL
+#define IOTSEC_LOG_LEVEL LOG_LEVEL_INFO        //The most detailed level built in.
+#endif
+#ifndef IOTSEC_LOG_TEXT
+#define IOTSEC_LOG_TEXT 0                      //1 to drain the log as text rather than records.
+#endif
+#ifndef LOG_BUFFER_LEN
+#ifdef __AVR__
+#define LOG_BUFFER_LEN 64
+#else
+#define LOG_BUFFER_LEN 1024
+#endif
+#endif
+
+#define LOG_RECORD_MAX 32                      //The longest record, its length byte included.
+#define LOG_TEXT_ROOM 32                       //Serial TX buffer space to wait for before rendering a line.
+
+/*
+ * Every line logged: its token and its format. A format takes %u for an unsigned number, %d
+ * for a signed one, %s for a String or C string and %b for a LogBytes array, printed as
+ * printByteArr does. Numbers are packed by their C type, so a %u must be passed an unsigned
+ * type and a %d a signed one; an enum or a literal is an int, so cast it for a %u. A record
+ * is its length byte, the token and then the arguments in order: numbers as base 128 varints,
+ * signed ones zigzagged, strings and arrays as a length byte and their bytes. Tokens are only
+ * ever added at the end, so older logs still decode.
+ */
+#define LOG_TOKENS(X) \
+    X(LOG_DROPPED, "(%u log records dropped)") \
+    X(LOG_HP_BEGIN, "\n# HP BEGIN #") \
+    X(LOG_HP_END, "\n# HP END #") \
+    X(LOG_DP_BEGIN, "\n# DP BEGIN #") \
+    X(LOG_DP_END, "\n# DP END #") \
+    X(LOG_HDP_END, "\n# [H/D]P END #") \
+    X(LOG_H_INIT, "\n- H INIT -") \
+    X(LOG_H_SUCCESS, "\n- H SUCCESS -") \
+    X(LOG_H_FAIL, "\nX H FAIL X") \
+    X(LOG_MA_INIT, "\n- MA INIT -") \
+    X(LOG_MA_SUCCESS, "\n- MA SUCCESS -") \
+    X(LOG_MA_FAIL, "\nX MA FAIL X") \
+    X(LOG_S_AUTH_SUCCESS, "\n- S AUTH SUCCESS -") \
+    X(LOG_S_AUTH_FAIL, "\nX S AUTH FAIL X") \
+    X(LOG_C_AUTH_SUCCESS, "\n- C AUTH SUCCESS -") \
+    X(LOG_C_AUTH_FAIL, "\nX C AUTH FAIL X") \
+    X(LOG_KEYS_GEN_INIT, "\n- KEYS GEN INIT -") \
+    X(LOG_KEYS_GEN_SUCCESS, "\n- KEYS GEN SUCCESS -") \
+    X(LOG_K_EXPIRED, "\n- K EXPIRED -") \
+    X(LOG_K_RENEW, "\n- K RENEW -") \
+    X(LOG_EXPIRED, "\n- EXPIRED -") \
+    X(LOG_KEYS_EXPIRED, "KEYS EXPIRED") \
+    X(LOG_P_SENT, "\n- P SENT -") \
+    X(LOG_P_RECEIVED, "\n- P RECEIVED -") \
+    X(LOG_RETRY, "\n- RETRY -") \
+    X(LOG_ACK_FAIL, "\nX ACK FAIL X") \
+    X(LOG_INT_FAIL, "\nX INT FAIL X") \
+    X(LOG_TIMEOUT, "\nX TIMEOUT X") \
+    X(LOG_TIMED_OUT, "\nFailed, response timed out.") \
+    X(LOG_SEAL_NO_KEY, "\nFailed, sealing needs the secret or session key.") \
+    X(LOG_WINDOW_NO_KEY, "\nFailed, the window needs the session key.") \
+    X(LOG_WINDOW_FAILED, "\nFailed, window frame never acknowledged.") \
+    X(LOG_SENT, "[I] S: %s") \
+    X(LOG_SENT_BYTES, "[I] S: %b") \
+    X(LOG_SENT_NONCE, "[I] S: %d %b") \
+    X(LOG_SENT_READINGS, "[I] S: %d readings") \
+    X(LOG_SENT_ACK, "[I] S: %d:ACK") \
+    X(LOG_RECEIVED, "[I] R: %s") \
+    X(LOG_RECEIVED_BYTES, "[I] R: %b") \
+    X(LOG_RECEIVED_NONCE, "[I] R: %d %b") \
+    X(LOG_RECEIVED_ACK, "[I] R: %u:ACK") \
+    X(LOG_READING, "[I] R: %d:%d") \
+    X(LOG_MASTER_KEY, "[I] MK: %b") \
+    X(LOG_HASH_KEY, "[I] HK: %b") \
+    X(LOG_READING_AGE, "[I] R: %u:%u %u ms ago") \
+    X(LOG_SENT_MESSAGE, "[I] S: type %u %b") \
+    X(LOG_RECEIVED_MESSAGE, "[I] R: type %u %b") \
+    X(LOG_LINK_LOST, "\nX LINK LOST X") \
+    X(LOG_LINK_MODE, "[I] Link: rate %u PA %u") \
+    X(LOG_READING_REPEATED, "[I] R: reading %u again")
+
+#define LOG_TOKEN_ID(token, format) token,
+enum LogToken {
+    LOG_TOKENS(LOG_TOKEN_ID)
+    LOG_TOKEN_COUNT
+};
+
+//Log calls by level. Arguments of a call compiled out are not evaluated, only type checked, so a
+//value kept just for a debug line still counts as used.
+#define LOG_NOTHING(...) ((void)sizeof(IoTSecLog::record(__VA_ARGS__), 0))
+#if IOTSEC_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) IoTSecLog::record(__VA_ARGS__)
+#else
+#define LOG_ERROR(...) LOG_NOTHING(__VA_ARGS__)
+#endif
+#if IOTSEC_LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) IoTSecLog::record(__VA_ARGS__)
+#else
+#define LOG_WARN(...) LOG_NOTHING(__VA_ARGS__)
+#endif
+#if IOTSEC_LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) IoTSecLog::record(__VA_ARGS__)
+#else
+#define LOG_INFO(...) LOG_NOTHING(__VA_ARGS__)
+#endif
+#if IOTSEC_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) IoTSecLog::record(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) LOG_NOTHING(__VA_ARGS__)
+#endif
+
+/*
+ * A byte array argument, for a %b.
+ */
+struct LogBytes {
+    const byte* data;
+    byte len;
+    LogBytes(const byte* data, byte len) : data(data), len(len) {}
+};
+
+class IoTSecLog {
+    public:
+        /*
+         * Packs a line into the ring. A line that does not fit is dropped and counted, and a
+         * LOG_DROPPED record goes in ahead of the next one that does.
+         * @param token - The line's LogToken.
+         * @param args - Its arguments, as its format lists them.
+         */
+        template <typename... Args>
+        static void record(byte token, const Args&... args) {
+            byte rec[LOG_RECORD_MAX];
+            byte len = 2;
+            rec[1] = token;
+            IoTSecLog::put(rec, &len, args...);
+            IoTSecLog::commit(rec, len);
+        }
+
+        static void drain();
+        static bool empty();
+        static unsigned long getDropped();
+        static void render(byte rec[]);
+
+    private:
+        static byte ring[LOG_BUFFER_LEN];
+        static unsigned int head;
+        static unsigned int count;
+        static unsigned long dropped;
+        static unsigned long droppedReported;
+
+        static void put(byte rec[], byte* len) {
+            (void)rec;
+            (void)len;
+        }
+        template <typename T, typename... Rest>
+        static void put(byte rec[], byte* len, const T& first, const Rest&... rest) {
+            IoTSecLog::putArg(rec, len, first);
+            IoTSecLog::put(rec, len, rest...);
+        }
+
+        static void putArg(byte rec[], byte* len, unsigned long value);
+        static void putArg(byte rec[], byte* len, long value);
+        static void putArg(byte rec[], byte* len, unsigned int value) { putArg(rec, len, (unsigned long)value); }
+        static void putArg(byte rec[], byte* len, int value) { putArg(rec, len, (long)value); }
+        static void putArg(byte rec[], byte* len, byte value) { putArg(rec, len, (unsigned long)value); }
+        static void putArg(byte rec[], byte* len, const char* str);
+        static void putArg(byte rec[], byte* len, const String& str);
+        static void putArg(byte rec[], byte* len, const LogBytes& bytes);
+        static void putBytes(byte rec[], byte* len, const byte* data, unsigned int n);
+        static void commit(byte rec[], byte len);
+        static void push(byte rec[], byte len);
+        static void pop(byte rec[]);
+        static const byte* readVarint(const byte* in, unsigned long* value);
+};
+
+#endif
@@ -0,0 +1,196 @@
+/*
+ * The messages the sketches send each other. Each has a type, the first header byte of its
+ * frame, and a fixed binary payload listed once below as its fields. The struct holding a
+ * payload and its encode and decode functions are generated from that list, so both ends
+ * always agree on the layout. Numbers go most significant byte first.
+ *
+ * A decode reads every field at its fixed offset whatever the length received, then checks
+ * the length once: nothing is allocated or parsed, and a bad payload costs the same as a good
+ * one. The buffer it reads must have room for the whole layout, as a frame's payload does.
+ *
+ * Include it after IoTSec.h.
+ */
+#ifndef IOTSECMESSAGES_H
+#define IOTSECMESSAGES_H
+
+//How a message is read: under the secret keys, sealed under the session keys, from a window, or
+//under the session keys the way the secret ones are, which leaves the sealed frames' counts alone.
+#define ROUTE_SECRET 0
+#define ROUTE_SEALED 1
+#define ROUTE_WINDOW 2
+#define ROUTE_SESSION 3
+
+#define NO_STATE 0xff                          //The state of a message that answers none.
+#define RESTART_INT_FAIL 1
+#define RESTART_EXPIRED 2
+#define RESTART_AUTH_FAIL 3
+
+/*
+ * Every message type: X(type, state, route), the state being the exchange it belongs to. They
+ * are numbered from 1 in this order, as peekState() returns 0 for nothing received, and are
+ * only ever added at the end. The window's two are sent and read by the library itself.
+ */
+#define MESSAGE_TYPES(X) \
+    X(MSG_CHALLENGE, 0, ROUTE_SECRET)          /* client: its random number, opening the three exchange handshake */ \
+    X(MSG_CHALLENGE_REPLY, 0, ROUTE_SECRET)    /* server: that number less 1, and its own random number */ \
+    X(MSG_RESPONSE, 1, ROUTE_SECRET)           /* client: the server's number less 1 */ \
+    X(MSG_AUTH_OK, 1, ROUTE_SECRET)            /* server: the client is authenticated */ \
+    X(MSG_NONCE, 2, ROUTE_SECRET)              /* both: the nonces the session keys are made from, and the wake interval */ \
+    X(MSG_HELLO, 4, ROUTE_SECRET)              /* both: the one round trip handshake's number, nonce and wake interval */ \
+    X(MSG_BATCH, 3, ROUTE_SEALED)              /* client: SensorEncoder readings */ \
+    X(MSG_ACK, 3, ROUTE_SEALED)                /* server: the readings in the batch it answers */ \
+    X(MSG_RESTART, NO_STATE, ROUTE_SECRET)     /* server: gave up on the session, with why */ \
+    X(MSG_WINDOW_BATCH, 3, ROUTE_WINDOW)       /* client: SensorEncoder readings through the window */ \
+    X(MSG_WINDOW_ACK, NO_STATE, ROUTE_WINDOW)  /* server: the window frames received so far, taken in by the library before any dispatch */ \
+    X(MSG_LINK, 5, ROUTE_SESSION)              /* both: the proposal's number, higher each time, and the data rate and power proposed, then it less 1 and what was agreed */
+
+#define MESSAGE_TYPE_ID(type, state, route) type,
+enum MessageType {
+    MSG_NONE,
+    MESSAGE_TYPES(MESSAGE_TYPE_ID)
+    MSG_TYPE_LIMIT
+};
+static_assert(MSG_WINDOW_BATCH == WINDOW_STATE && MSG_WINDOW_ACK == WINDOW_ACK_STATE,
+              "the window's message types must be the ones IoTSec sends");
+
+/*
+ * The payload layouts, as F(kind, field, length): U8 a byte, U16 a number up to 65535 in two,
+ * BYTES an array of length bytes. X(Name, FIELDS) makes a NameMsg struct with a LEN, and
+ * encodeName and decodeName. A wake interval is the seconds the sender may sleep between
+ * frames, see setWakeInterval, 0 if it always listens.
+ */
+#define CHALLENGE_FIELDS(F) F(U16, number, 1)
+#define CHALLENGE_REPLY_FIELDS(F) F(U16, number, 1) F(U16, challenge, 1)
+#define RESPONSE_FIELDS(F) F(U16, number, 1)
+#define AUTH_OK_FIELDS(F)
+#define NONCE_FIELDS(F) F(BYTES, nonce, NONCE_LEN) F(U16, wake, 1)
+#define HELLO_FIELDS(F) F(U16, number, 1) F(BYTES, nonce, NONCE_LEN) F(U16, wake, 1)
+#define ACK_FIELDS(F) F(U8, count, 1)
+#define RESTART_FIELDS(F) F(U8, reason, 1)
+#define LINK_FIELDS(F) F(U16, number, 1) F(U8, rate, 1) F(U8, paLevel, 1)
+
+#define MESSAGE_LAYOUTS(X) \
+    X(Challenge, CHALLENGE_FIELDS) \
+    X(ChallengeReply, CHALLENGE_REPLY_FIELDS) \
+    X(Response, RESPONSE_FIELDS) \
+    X(AuthOk, AUTH_OK_FIELDS) \
+    X(Nonce, NONCE_FIELDS) \
+    X(Hello, HELLO_FIELDS) \
+    X(Ack, ACK_FIELDS) \
+    X(Restart, RESTART_FIELDS) \
+    X(Link, LINK_FIELDS)
+
+#define MSG_DECLARE_U8(name, n) byte name;
+#define MSG_DECLARE_U16(name, n) unsigned int name;
+#define MSG_DECLARE_BYTES(name, n) byte name[n];
+#define MSG_SIZE_U8(n) 1
+#define MSG_SIZE_U16(n) 2
+#define MSG_SIZE_BYTES(n) (n)
+#define MSG_PUT_U8(p, v, n) *p++ = v;
+#define MSG_PUT_U16(p, v, n) *p++ = (byte)((v) >> 8); *p++ = (byte)(v);
+#define MSG_PUT_BYTES(p, v, n) memmove(p, v, n); p += n;
+#define MSG_GET_U8(p, v, n) v = *p++;
+#define MSG_GET_U16(p, v, n) v = ((unsigned int)p[0] << 8) | p[1]; p += 2;
+#define MSG_GET_BYTES(p, v, n) memmove(v, p, n); p += n;
+
+#define MSG_DECLARE(kind, name, n) MSG_DECLARE_##kind(name, n)
+#define MSG_SIZE(kind, name, n) + MSG_SIZE_##kind(n)
+#define MSG_PUT(kind, name, n) MSG_PUT_##kind(out, msg.name, n)
+#define MSG_GET(kind, name, n) MSG_GET_##kind(in, msg->name, n)
+
+#define MESSAGE_CODEC(Name, FIELDS) \
+    struct Name##Msg { \
+        FIELDS(MSG_DECLARE) \
+        static const byte LEN = 0 FIELDS(MSG_SIZE); \
+    }; \
+    static_assert(Name##Msg::LEN <= MAX_FRAME_PAYLOAD, #Name " must fit in a frame"); \
+    inline byte encode##Name(const Name##Msg& msg, byte out[]) { \
+        (void)msg; \
+        FIELDS(MSG_PUT) \
+        return Name##Msg::LEN; \
+    } \
+    inline bool decode##Name(const byte in[], byte len, Name##Msg* msg) { \
+        (void)msg; \
+        FIELDS(MSG_GET) \
+        return len == Name##Msg::LEN; \
+    }
+MESSAGE_LAYOUTS(MESSAGE_CODEC)
+
+/*
+ * What a sketch does with a message once it is read and its integrity checked.
+ * @param iot - The session it came on.
+ * @param payload - Its payload.
+ * @param len - The payload's length.
+ * @return false if the payload was not what the exchange expected.
+ */
+typedef bool (*MessageHandler)(IoTSec& iot, byte payload[], byte len);
+
+struct MessageInfo {
+    byte state;
+    byte route;
+};
+#define MESSAGE_INFO(type, state, route) {state, route},
+static const MessageInfo messageInfo[MSG_TYPE_LIMIT] PROGMEM = {
+    {NO_STATE, ROUTE_SECRET},
+    MESSAGE_TYPES(MESSAGE_INFO)
+};
+
+/*
+ * Looks up the exchange a message type belongs to, NO_STATE for one out of range.
+ */
+inline byte messageState(byte type) {
+    return type < MSG_TYPE_LIMIT ? pgm_read_byte(&messageInfo[type].state) : NO_STATE;
+}
+
+/*
+ * Looks up how a message type is read, ROUTE_SECRET for one out of range.
+ */
+inline byte messageRoute(byte type) {
+    return type < MSG_TYPE_LIMIT ? pgm_read_byte(&messageInfo[type].route) : ROUTE_SECRET;
+}
+
+/*
+ * Reads the next message the way its type says it was sent, leaving its type in frame[0].
+ * @param iot - The session to read from.
+ * @param frame - A MAX_FRAME_SIZE byte buffer to read it into.
+ * @param type - Its type, from peekState().
+ * @param len - Set to the payload's length, 0 when nothing was read.
+ * @return where the payload is inside frame; getIntegrityPassed() says whether to trust it.
+ */
+inline byte* readMessage(IoTSec& iot, byte frame[], byte type, byte* len) {
+    byte route = messageRoute(type);
+    byte* payload;
+    if (route == ROUTE_WINDOW) {
+        payload = iot.receiveWindowedInPlace(frame, len, iot.getMasterKey(), false);
+    }
+    else if (route == ROUTE_SEALED) {
+        payload = iot.receiveSealedInPlace(frame, len, iot.getMasterKey(), false);
+    }
+    else if (route == ROUTE_SESSION) {
+        payload = iot.receiveInPlace(frame, len, iot.getMasterKey(), iot.getHashKey(), false);
+    }
+    else {
+        payload = iot.receiveInPlace(frame, len, iot.getSecretKey(), iot.getSecretHashKey(), false);
+    }
+    return payload != NULL ? payload : frame + MAX_HEADER_SIZE + FRAME_LEN_LEN;
+}
+
+/*
+ * Sends a message started with beginFrame under the keys its type's route names: the secret
+ * keys, as every handshake message and restart goes, or the session keys for ROUTE_SESSION.
+ * Sealed and window messages go through their own calls.
+ * @param iot - The session to send on.
+ * @param frame - The frame its payload was encoded into.
+ * @param len - The payload's length.
+ */
+inline void sendMessage(IoTSec& iot, byte frame[], byte len) {
+    LOG_DEBUG(LOG_SENT_MESSAGE, frame[0], LogBytes(frame + MAX_HEADER_SIZE + FRAME_LEN_LEN, len));
+    if (messageRoute(frame[0]) == ROUTE_SESSION) {
+        iot.sendInPlace(frame, len, iot.getMasterKey(), iot.getHashKey());
+    }
+    else {
+        iot.sendInPlace(frame, len, iot.getSecretKey(), iot.getSecretHashKey());
+    }
+}
+
+#endif
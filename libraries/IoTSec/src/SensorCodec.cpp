@@ -0,0 +1,206 @@
+#include "SensorCodec.h"
+
+/*
+ * Zigzags a signed number, so small negative numbers stay short.
+ */
+static unsigned long zigzag(long value) {
+    return ((unsigned long)value << 1) ^ (unsigned long)(value >> (sizeof(long) * 8 - 1));
+}
+
+static long unzigzag(unsigned long value) {
+    return (long)(value >> 1) ^ -(long)(value & 1);
+}
+
+/*
+ * Starts a batch.
+ * @param out - The payload to pack it into.
+ * @param size - The payload's room in bytes.
+ * @param now - millis() as the batch is built, what the ages are measured from.
+ * @param sequence - The sequence number of the first reading; each one added must be the next.
+ */
+SensorEncoder::SensorEncoder(byte out[], byte size, unsigned long now, unsigned int sequence) {
+    this->out = out;
+    this->size = size;
+    out[0] = (byte)(sequence >> 8);
+    out[1] = (byte)sequence;
+    this->len = SENSOR_HEADER_LEN;
+    this->count = 0;
+    this->now = now;
+    this->lastAge = 0;
+    this->seen = 0;
+}
+
+/*
+ * Packs a reading behind the ones already in the batch.
+ * @param sensor - The sensor number, 0 to SENSOR_COUNT - 1.
+ * @param value - The reading, 0 to SENSOR_VALUE_MAX.
+ * @param time - millis() when it was taken, only sent with SENSOR_TIMESTAMPS.
+ * @return false if it does not fit in what is left of the payload; the batch is unchanged.
+ */
+bool SensorEncoder::add(byte sensor, unsigned int value, unsigned long time) {
+    byte rec[SENSOR_RECORD_MAX];
+    byte n = 0;
+    sensor &= SENSOR_COUNT - 1;
+    value &= SENSOR_VALUE_MAX;
+    if (!(this->seen & (1u << sensor))) {
+        rec[n++] = (sensor << 4) | (value >> 8);
+        rec[n++] = value & 0xff;
+    }
+    else {
+        unsigned long delta = zigzag((long)value - (long)this->last[sensor]);
+        if (delta < SENSOR_ESCAPE) {
+            rec[n++] = (sensor << 4) | delta;
+        }
+        else {
+            rec[n++] = (sensor << 4) | SENSOR_ESCAPE;
+            SensorEncoder::putVarint(rec, &n, delta - SENSOR_ESCAPE);
+        }
+    }
+#if SENSOR_TIMESTAMPS
+    unsigned long age = (this->now - time) / SENSOR_TIME_UNIT;
+    SensorEncoder::putVarint(rec, &n, this->count == 0 ? age : zigzag((long)(age - this->lastAge)));
+#else
+    (void)time;
+#endif
+    if (this->len + n > this->size) {
+        return false;
+    }
+    memmove(this->out + this->len, rec, n);
+    this->len += n;
+    this->count++;
+    this->seen |= 1u << sensor;
+    this->last[sensor] = value;
+#if SENSOR_TIMESTAMPS
+    this->lastAge = age;
+#endif
+    return true;
+}
+
+/*
+ * Gets the bytes packed so far, the sequence number included.
+ */
+byte SensorEncoder::getLength() {
+    return this->len;
+}
+
+/*
+ * Gets the readings packed so far.
+ */
+byte SensorEncoder::getCount() {
+    return this->count;
+}
+
+/*
+ * Appends an unsigned number as a base 128 varint, low 7 bits first.
+ * @param rec - The record being built.
+ * @param len - Its length so far, updated.
+ * @param value - The number.
+ */
+void SensorEncoder::putVarint(byte rec[], byte* len, unsigned long value) {
+    do {
+        rec[*len] = value & 0x7f;
+        value >>= 7;
+        if (value != 0) {
+            rec[*len] |= 0x80;
+        }
+        (*len)++;
+    } while (value != 0);
+}
+
+/*
+ * Starts reading a batch. One too short for its sequence number holds no readings.
+ * @param in - The payload.
+ * @param len - Its length.
+ */
+SensorDecoder::SensorDecoder(const byte in[], byte len) {
+    this->in = in;
+    this->len = len < SENSOR_HEADER_LEN ? 0 : len;
+    this->pos = SENSOR_HEADER_LEN;
+    this->sequence = this->len == 0 ? 0 : ((unsigned int)in[0] << 8) | in[1];
+    this->sequence--;
+    this->lastAge = 0;
+    this->seen = 0;
+}
+
+/*
+ * Unpacks the next reading.
+ * @param sensor - Set to its sensor number.
+ * @param value - Set to the reading.
+ * @param age - Set to how many ms before the batch was built it was taken, 0 without SENSOR_TIMESTAMPS.
+ * @return false at the end of the batch, or at a reading cut short or out of range; nothing
+ *         after it is read.
+ */
+bool SensorDecoder::next(byte* sensor, unsigned int* value, unsigned long* age) {
+    if (this->pos >= this->len) {
+        return false;
+    }
+    byte head = this->in[this->pos++];
+    byte s = head >> 4;
+    long v;
+    if (!(this->seen & (1u << s))) {
+        if (this->pos >= this->len) {
+            this->len = 0;
+            return false;
+        }
+        v = ((head & 0x0f) << 8) | this->in[this->pos++];
+    }
+    else {
+        unsigned long delta = head & 0x0f;
+        if (delta == SENSOR_ESCAPE) {
+            if (!this->readVarint(&delta)) {
+                return false;
+            }
+            delta += SENSOR_ESCAPE;
+        }
+        v = (long)this->last[s] + unzigzag(delta);
+        if (v < 0 || v > SENSOR_VALUE_MAX) {
+            this->len = 0;
+            return false;
+        }
+    }
+    *age = 0;
+#if SENSOR_TIMESTAMPS
+    unsigned long units;
+    if (!this->readVarint(&units)) {
+        return false;
+    }
+    if (this->seen != 0) {
+        units = this->lastAge + unzigzag(units);
+    }
+    this->lastAge = units;
+    *age = units * SENSOR_TIME_UNIT;
+#endif
+    this->seen |= 1u << s;
+    this->last[s] = v;
+    this->sequence++;
+    *sensor = s;
+    *value = v;
+    return true;
+}
+
+/*
+ * Gets the sequence number of the reading next() returned last.
+ */
+unsigned int SensorDecoder::getSequence() {
+    return this->sequence;
+}
+
+/*
+ * Reads a varint written by SensorEncoder::putVarint, stopping the batch if it is cut short.
+ * @param value - Set to the number.
+ */
+bool SensorDecoder::readVarint(unsigned long* value) {
+    *value = 0;
+    for (byte shift = 0; shift < SENSOR_VARINT_MAX * 7; shift += 7) {
+        if (this->pos >= this->len) {
+            break;
+        }
+        byte b = this->in[this->pos++];
+        *value |= (unsigned long)(b & 0x7f) << shift;
+        if (!(b & 0x80)) {
+            return true;
+        }
+    }
+    this->len = 0;
+    return false;
+}
@@ -0,0 +1,74 @@
+/*
+ * Packs a batch of sensor readings into a frame's payload, and unpacks it. Every frame stands
+ * alone, so a lost or resent one never throws the next off. A batch opens with the sequence
+ * number of its first reading, in two bytes most significant first; the readings after it
+ * follow on one apart, so the receiver can tell one it has had before.
+ *
+ * The first reading of a sensor in a frame is sent whole, in two bytes: the sensor number in
+ * the top 4 bits and the 12 bit value below. A later reading of the same sensor is the change
+ * from the last one, zigzagged so small falls stay small: a change of -7 to +7 fits in the
+ * bottom 4 bits of its one byte, anything bigger sets them to SENSOR_ESCAPE and follows as a
+ * base 128 varint.
+ *
+ * With SENSOR_TIMESTAMPS each reading carries how long before the frame was built it was
+ * taken, in SENSOR_TIME_UNIT ms: the first as a varint, the rest as the zigzagged change
+ * from the one before.
+ */
+#ifndef SENSORCODEC_H
+#define SENSORCODEC_H
+
+#include "Arduino.h"
+
+#ifndef SENSOR_TIMESTAMPS
+#define SENSOR_TIMESTAMPS 0                    //1 to send each reading's age along with it.
+#endif
+#ifndef SENSOR_TIME_UNIT
+#define SENSOR_TIME_UNIT 10                    //Milliseconds per unit of a reading's age.
+#endif
+
+#define SENSOR_COUNT 16
+#define SENSOR_VALUE_MAX 4095
+#define SENSOR_ESCAPE 15
+#define SENSOR_VARINT_MAX 5
+#define SENSOR_RECORD_MAX (3 + SENSOR_TIMESTAMPS * SENSOR_VARINT_MAX)
+#define SENSOR_HEADER_LEN 2
+
+class SensorEncoder {
+    public:
+        SensorEncoder(byte out[], byte size, unsigned long now, unsigned int sequence);
+        bool add(byte sensor, unsigned int value, unsigned long time);
+        byte getLength();
+        byte getCount();
+
+    private:
+        byte* out;
+        byte size;
+        byte len;
+        byte count;
+        unsigned long now;
+        unsigned long lastAge;
+        unsigned int seen; //Bit per sensor already in the frame.
+        unsigned int last[SENSOR_COUNT];
+
+        static void putVarint(byte rec[], byte* len, unsigned long value);
+};
+
+class SensorDecoder {
+    public:
+        SensorDecoder(const byte in[], byte len);
+        bool next(byte* sensor, unsigned int* value, unsigned long* age);
+        unsigned int getSequence();
+
+    private:
+        const byte* in;
+        byte len;
+        byte pos;
+        unsigned int sequence; //The sequence number of the reading next() returned last.
+        unsigned long lastAge;
+        unsigned int seen; //Bit per sensor already read from the frame.
+        unsigned int last[SENSOR_COUNT];
+
+        bool readVarint(unsigned long* value);
+};
+
+#endif
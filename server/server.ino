@@ -3,188 +3,337 @@
 #include <Crypto.h>
 #include <AES.h>
 #include <SHA256.h>
-#include "IoTSec.h"
+#include <IoTSec.h>
+#include <IoTSecMessages.h>
+#include <SensorCodec.h>
 
+// EVENT SETUP ########################################################################################################
+#define IRQ_PIN 2                             // nRF24 IRQ pin, must be an external interrupt pin
+
+// MULTI-CLIENT SETUP #################################################################################################
+#define CLIENT_PIPES (MAX_SESSIONS < 5 ? MAX_SESSIONS : 5)  // Reading pipes 1 to CLIENT_PIPES, clients spread over them by node ID; 1 on a 2 KB board
 
 // GLOBAL VARIABLES SECTION ############################################################################################
 RF24 radio(9, 10);                            // CE, CSN - PINOUT FOR SPI and NRF24L01      
-AES128 cipher;                                // object used to encrypt data  
-SHA256 hash256;   
-byte addresses[][6] = {"NODE1", "NODE2"};     // Addresses used to SEND and RECEIVE data - ENSURE they are opposite on the sender/receiver               
-byte receiveBuffer[MAX_PAYLOAD_SIZE + 1];     // Null terminate.
-byte sendBuffer[32];
-int state;
-int tempVariable; 
+IoTSecCipher cipher;                          // object used to encrypt data  
+IoTSecHash hash256;   
+// Node n sends to serverAddresses[(n - 1) % CLIENT_PIPES] and listens on clientAddress with its first byte n - ENSURE they match client.ino's.
+// Pipes 2-5 only have a first byte of their own, the other four are pipe 1's.
+byte serverAddresses[][6] = {"1NODE", "2NODE", "3NODE", "4NODE", "5NODE"};
+byte clientAddress[6] = "0CLNT";
+byte frame[MAX_FRAME_SIZE];                   // Frame buffer every message is received, decrypted and answered in
+
+// Create IoTSec Object, the gateway with a session per node heard from
+IoTSec iot(&radio,&cipher,&hash256);
 
-// Create IoTSec Object
-IoTSec iot(&radio, &cipher, &hash256);
+// SRAM BUDGET ########################################################################################################
+// The library's share and the globals above must leave IOTSEC_STACK_RESERVE for the stack.
+#if IOTSEC_SRAM_BUDGET > 0
+#define SKETCH_SRAM (sizeof(radio) + sizeof(Serial) + sizeof(serverAddresses) + sizeof(clientAddress) \
+    + sizeof(frame))
+static_assert(IOTSEC_GATEWAY_SRAM + SKETCH_SRAM <= IOTSEC_SRAM_BUDGET - IOTSEC_STACK_RESERVE,
+              "the server does not fit the board's SRAM with IOTSEC_STACK_RESERVE left for the stack");
+#endif
+// A client past MAX_SESSIONS closes the session idle longest, so every pipe needs a session of its own.
+static_assert(CLIENT_PIPES >= 1 && CLIENT_PIPES <= MAX_SESSIONS && CLIENT_PIPES < MAX_PIPES,
+              "CLIENT_PIPES must be 1 to MAX_SESSIONS, and leave pipe 0");
 
 // ####################################################################################################################
 void setup() {
+#if IOTSEC_METRICS
+    IoTSec::paintStack();                    // Lets the metrics report how deep the stack has been
+#endif
     // RADIO SETUP
     radio.begin();                           // Starting the radio communication
     radio.setPALevel(RF24_PA_MAX);           // Transmit power
     radio.setDataRate(RF24_250KBPS);         // Transmit data rate
     radio.setChannel(10);                    // Channel = frequency
-    radio.openWritingPipe(addresses[1]);     // Setting the address RECEIVING
-    radio.openReadingPipe(1, addresses[0]);  // Setting the address SENDING
+    for (byte i = 0; i < CLIENT_PIPES; ++i) {
+        radio.openReadingPipe(i + 1, serverAddresses[i]);
+    }
+    iot.setDynamicFrames(true);              // Only put the bytes each packet carries on air
+    iot.setEventDriven(true);                // Queue replies and let the IRQ pin say when the radio is done
+    iot.setWindow(MAX_WINDOW);               // Take batches from a client's window, ACKed on the radio's ACK
+    iot.setLinkAdaptation(true);             // Agree each client's data rate and transmit power, starting from the above
+    iot.setGateway(clientAddress);           // A session per node ID; replies open each node's address as they go out
     radio.startListening();                  // Setting for server
+    attachInterrupt(digitalPinToInterrupt(IRQ_PIN), radioISR, FALLING);
     Serial.begin(9600);
-    //Null terminate.
-    memset(receiveBuffer, 0, MAX_PAYLOAD_SIZE + 1);
     randomSeed(analogRead(A1));
 }
 
+// ####################################################################################################################
+// Every state is answered as soon as its frame is read, so nothing here waits: replies are queued and
+// go out while loop() carries on with the next frame. One frame is served per loop, from the next
+// session in turn with a frame, so a chatty client only gets its turn.
 void loop(){
-    radio.startListening();
-    if (radio.available())                     //Looking for incoming data
-    {
-        char* newState = new char[MAX_HEADER_SIZE];
-        String msg;
-
-        //If the key has expired the only thing we care about is the header.
-        if (iot.keyExpired()) {
-          iot.receive(receiveBuffer, iot.getSecretKey(), iot.getSecretHashKey(), newState, false);
-        }
-        else {
-          iot.receive(receiveBuffer, iot.getMasterKey(), iot.getHashKey(), newState, false);
-        }
+    IoTSec* session = iot.nextSession();       //Move frames between the radio and every session's queues
+    if (session != NULL) {
+        handleFrame(*session);
+    }
+    else {
+        IoTSecLog::drain();                    //Log output only goes out while no client is waiting
+    }
+#if IOTSEC_METRICS
+    if (Serial.available() > 0 && Serial.read() == 'm') {
+        IoTSec::dumpMetrics();                 //'m' on the serial monitor prints the counters and timers
+    }
+#endif
+}
 
-        state = atoi(newState);
+/*
+ * What the server does with each message, by type. Types only the server sends are dropped.
+ */
+const MessageHandler serverHandlers[MSG_TYPE_LIMIT] PROGMEM = {
+    unexpected,                               // MSG_NONE
+    onChallenge,                              // MSG_CHALLENGE
+    unexpected,                               // MSG_CHALLENGE_REPLY
+    onResponse,                               // MSG_RESPONSE
+    unexpected,                               // MSG_AUTH_OK
+    onNonce,                                  // MSG_NONCE
+    onHello,                                  // MSG_HELLO
+    onBatch,                                  // MSG_BATCH
+    unexpected,                               // MSG_ACK
+    unexpected,                               // MSG_RESTART
+    onWindowBatch,                            // MSG_WINDOW_BATCH
+    unexpected,                               // MSG_WINDOW_ACK
+    onLink                                    // MSG_LINK
+};
 
-        if (!iot.getIntegrityPassed()) {
-            Serial.println("\nX INT FAIL X");
-            msg = "Int Fail";
-            Serial.println("[I] S: " + msg);
-            iot.send(msg, iot.getSecretKey(), iot.getSecretHashKey(), "0");
-            Serial.println("\n# [H/D]P END #");
-            iot.setHandshakeComplete(false);
-        }
-        /***********************[HANDSHAKE] - Server Authentication.*******************/
-        else if (state == 0) {
-            Serial.println("\n# HP BEGIN #");
-            Serial.println("\n- H INIT -");
-            Serial.println("\n- MA INIT -");
-
-            //Receive the random number from the client.
-            Serial.print("[I] R: ");
-            Serial.println((char*)receiveBuffer);
-            iot.setHandshakeComplete(false);
-
-            char* randStr = new char[3];
-            memset(randStr, 0, 3);
-
-            int i = 0;
-            while (i < 3 && receiveBuffer[i] != '-') {
-                randStr[i] = receiveBuffer[i];
-                ++i;
-            }
-            int randNum = atoi(randStr);
-            delete[] randStr;
-
-            //Send the client's random number decremented along with the server's random number.
-            tempVariable = iot.createRandom();
-            msg = ((String) (randNum - 1)) + "-" + ((String) tempVariable);
-            Serial.println("[I] S: " + msg);
-            iot.send(msg, iot.getSecretKey(), iot.getSecretHashKey(), (String)state);
-        }
-        /***********************[HANDSHAKE] - Client Authentication.*******************/
-        else if (state == 1) {
-            //Receives the server's decremented random number from the client.
-            Serial.print("[I] R: ");
-            Serial.println((char*)receiveBuffer);
-
-            char* randStr = new char[3];
-            memset(randStr, 0, 3);
-
-            int i = 0;
-            while (i < 3 && receiveBuffer[i] != '-') {
-                randStr[i] = receiveBuffer[i];
-                ++i;
-            }
-            int randNum = atoi(randStr);
-            delete[] randStr;
-
-            if (randNum == (tempVariable - 1)) {
-                Serial.println("\n- C AUTH SUCCESS -");
-                Serial.println("\n- MA SUCCESS -");
-
-                //Send a successful message back to client.
-                msg = "suc-auth";
-                Serial.println("[I] S: " + msg);
-                iot.send(msg, iot.getSecretKey(), iot.getSecretHashKey(), (String)state);
-            }
-            else {
-                Serial.println("\nX C AUTH FAIL X");
-                Serial.println("\nX MA FAIL X");
-                msg = "fail-aut";
-                Serial.println("[I] S: " + msg);
-                iot.send(msg, iot.getSecretKey(), iot.getSecretHashKey(), "0");
-                Serial.println("\n# HP END #");
-                iot.setHandshakeComplete(false);
-            }
-        }
-        /***********************[HANDSHAKE] - Share Nonces.*******************/
-        else if (state == 2) {
-            Serial.println("\n- KEYS GEN INIT -");
-            byte nonce1[MAX_PAYLOAD_SIZE];
-            byte nonce2[MAX_PAYLOAD_SIZE];
-    
-            //Retrieve the clients nonce.
-            memmove(nonce1, receiveBuffer, MAX_PAYLOAD_SIZE);
-            Serial.print("[I] R: ");
-            iot.printByteArr(nonce1, MAX_PAYLOAD_SIZE);
-
-            if (atoi(newState) != 0) {
-                //Generate and Send the nonce.
-                iot.createNonce(nonce2);
-                Serial.print("[I] S: ");
-                iot.printByteArr(nonce2, MAX_PAYLOAD_SIZE);
-                iot.send(nonce2, iot.getSecretKey(), iot.getSecretHashKey(), (String)state);
-    
-            
-                //Generate keys;
-                iot.generateKeys(nonce1, nonce2);
-                Serial.print("[I] MK: ");
-                iot.printByteArr(iot.getMasterKey(), KEY_DATA_LEN);
-                Serial.print("[I]  HK: ");
-                iot.printByteArr(iot.getHashKey(), KEY_DATA_LEN);
-    
-                iot.setHandshakeComplete(true);
-                Serial.println("\n- KEYS GEN SUCCESS -");
-                Serial.println("\n- H SUCCESS -");
-                Serial.println("\n# HP END #");
-    
-                Serial.println("\n# DP BEGIN #");
-            }
-            else {
-                state = 0;
-                Serial.println("\nX H FAIL X");
-                Serial.println("\n# HP END #");
-                iot.setHandshakeComplete(false);
-            }
-        }
-        /***********************[VERIFY KEY EXPIRATION] - Send request to renew key.*******************/
-        else if (iot.keyExpired()) {
-            msg = "Expired";
-            Serial.println("\n- EXPIRED -");
-            Serial.println("[I] S: " + msg);
-            iot.send(msg, iot.getSecretKey(), iot.getSecretHashKey(), "0");
-            Serial.println("\n# DP END #");
-            iot.setHandshakeComplete(false);
-        }
-        /***********************[DATA] - Starting The Data Phase.*******************/
-        else if (state == 3) {
-            Serial.println("\n- P RECEIVED-");
-            Serial.print("[I] R: ");
-            Serial.println((char*)receiveBuffer);
-            msg = (String)((char)receiveBuffer[0]) + ":ACK";           // 0 index is the sensor number
-            Serial.println("\n- P SENT -");
-            Serial.println("[I] S: " + msg);
-            iot.send(msg, iot.getMasterKey(), iot.getHashKey(), (String)state);
-        }
+/*
+ * Reads one frame from a client's session and answers it through serverHandlers.
+ * @param iot - The client's session.
+ */
+void handleFrame(IoTSec& iot){
+    //The frame's type says which keys it was sent under. Expired session keys can only be
+    //renewed, so anything sealed under them is read as the secret keys' and fails.
+    byte type = (byte)iot.peekState();
+    if (type >= MSG_TYPE_LIMIT || (iot.keyExpired() && messageRoute(type) != ROUTE_SECRET)) {
+        type = MSG_NONE;
+    }
+    byte len;
+    byte* payload = readMessage(iot, frame, type, &len);
+
+    if (!iot.getIntegrityPassed()) {
+        LOG_WARN(LOG_INT_FAIL);
+        sendRestart(iot, RESTART_INT_FAIL);
+        LOG_INFO(LOG_HDP_END);
+        iot.setHandshakeComplete(false);
+        return;
+    }
+    LOG_DEBUG(LOG_RECEIVED_MESSAGE, type, LogBytes(payload, len));
+    MessageHandler handle = (MessageHandler)pgm_read_ptr(&serverHandlers[type]);
+    handle(iot, payload, len);
+}
+
+/***********************[HANDSHAKE] - Server Authentication.*******************/
+bool onChallenge(IoTSec& iot, byte payload[], byte len){
+    LOG_INFO(LOG_HP_BEGIN);
+    LOG_INFO(LOG_H_INIT);
+    LOG_INFO(LOG_MA_INIT);
+
+    ChallengeMsg challenge;
+    if (!decodeChallenge(payload, len, &challenge)) {
+        LOG_WARN(LOG_H_FAIL);
+        LOG_INFO(LOG_HP_END);
+        return false;
+    }
+
+    //Send the client's random number decremented along with the server's random number.
+    ChallengeReplyMsg reply;
+    reply.number = challenge.number - 1;
+    iot.setChallenge(iot.createRandom());
+    reply.challenge = iot.getChallenge();
+    sendMessage(iot, frame, encodeChallengeReply(reply, iot.beginFrame(frame, MSG_CHALLENGE_REPLY)));
+    return true;
+}
+
+/***********************[HANDSHAKE] - Client Authentication.*******************/
+bool onResponse(IoTSec& iot, byte payload[], byte len){
+    //Receives the server's decremented random number from the client.
+    ResponseMsg response;
+    if (decodeResponse(payload, len, &response) && (int)response.number == iot.getChallenge() - 1) {
+        LOG_INFO(LOG_C_AUTH_SUCCESS);
+        LOG_INFO(LOG_MA_SUCCESS);
+
+        //Send a successful message back to client.
+        AuthOkMsg ok;
+        sendMessage(iot, frame, encodeAuthOk(ok, iot.beginFrame(frame, MSG_AUTH_OK)));
+        return true;
+    }
+    LOG_WARN(LOG_C_AUTH_FAIL);
+    LOG_WARN(LOG_MA_FAIL);
+    sendRestart(iot, RESTART_AUTH_FAIL);
+    LOG_INFO(LOG_HP_END);
+    return false;
+}
+
+/***********************[HANDSHAKE] - Share Nonces.*******************/
+bool onNonce(IoTSec& iot, byte payload[], byte len){
+    LOG_INFO(LOG_KEYS_GEN_INIT);
+
+    //Retrieve the clients nonce.
+    NonceMsg nonce1;
+    if (!decodeNonce(payload, len, &nonce1)) {
+        LOG_WARN(LOG_H_FAIL);
+        LOG_INFO(LOG_HP_END);
+        return false;
+    }
 
-        delete[] newState;
-        newState = NULL;
+    //Generate and Send the nonce.
+    iot.setWakeInterval(nonce1.wake * 1000UL);   //Frames for a client that sleeps wait until it is next heard from.
+    NonceMsg nonce2;
+    iot.createNonce(nonce2.nonce);
+    nonce2.wake = 0;
+    sendMessage(iot, frame, encodeNonce(nonce2, iot.beginFrame(frame, MSG_NONCE)));
+
+    //Generate keys;
+    iot.generateKeys(nonce1.nonce, nonce2.nonce);
+    LOG_DEBUG(LOG_MASTER_KEY, LogBytes(iot.getMasterKey(), KEY_DATA_LEN));
+    LOG_DEBUG(LOG_HASH_KEY, LogBytes(iot.getHashKey(), KEY_DATA_LEN));
+
+    iot.setHandshakeComplete(true);
+    LOG_INFO(LOG_KEYS_GEN_SUCCESS);
+    LOG_INFO(LOG_H_SUCCESS);
+    LOG_INFO(LOG_HP_END);
+
+    LOG_INFO(LOG_DP_BEGIN);
+    return true;
+}
+
+/***********************[HANDSHAKE] - One Round Trip.*******************/
+bool onHello(IoTSec& iot, byte payload[], byte len){
+    LOG_INFO(LOG_HP_BEGIN);
+    LOG_INFO(LOG_H_INIT);
+
+    //Receive the client's random number and nonce.
+    HelloMsg hello;
+    if (!decodeHello(payload, len, &hello)) {
+        LOG_WARN(LOG_H_FAIL);
+        LOG_INFO(LOG_HP_END);
+        return false;
+    }
+
+    //Prove the server holds the secret key with the decremented random number, and send the nonce with it.
+    iot.setWakeInterval(hello.wake * 1000UL);    //Frames for a client that sleeps wait until it is next heard from.
+    HelloMsg reply;
+    reply.number = hello.number - 1;
+    iot.createNonce(reply.nonce);
+    reply.wake = 0;
+    sendMessage(iot, frame, encodeHello(reply, iot.beginFrame(frame, MSG_HELLO)));
+
+    //A hello played again only makes keys the client never had: the ones it is on stay in use until it is heard on these.
+    iot.generateKeys(hello.nonce, reply.nonce);
+    LOG_DEBUG(LOG_MASTER_KEY, LogBytes(iot.getMasterKey(), KEY_DATA_LEN));
+    LOG_DEBUG(LOG_HASH_KEY, LogBytes(iot.getHashKey(), KEY_DATA_LEN));
+
+    iot.setHandshakeComplete(true);
+    LOG_INFO(LOG_KEYS_GEN_SUCCESS);
+    LOG_INFO(LOG_H_SUCCESS);
+    LOG_INFO(LOG_HP_END);
+
+    LOG_INFO(LOG_DP_BEGIN);
+    return true;
+}
+
+/***********************[DATA] - Starting The Data Phase.*******************/
+bool onBatch(IoTSec& iot, byte payload[], byte len){
+    LOG_INFO(LOG_P_RECEIVED);
+    AckMsg ack;
+    ack.count = printReadings(iot, payload, len);
+
+    //ACK the whole batch once with its reading count, reusing the frame buffer. Readings the
+    //client sent again because an ACK was lost are counted too, so it lets them go.
+    LOG_INFO(LOG_P_SENT);
+    LOG_DEBUG(LOG_SENT_ACK, (int)ack.count);
+    iot.sendSealedInPlace(frame, encodeAck(ack, iot.beginFrame(frame, MSG_ACK)), iot.getMasterKey());
+    return true;
+}
+
+/***********************[DATA] - A Batch From The Client's Window.*******************/
+bool onWindowBatch(IoTSec& iot, byte payload[], byte len){
+    //Already ACKed on the radio's ACK; a batch sent again after its ACK was lost carries nothing new.
+    if (len > 0) {
+        LOG_INFO(LOG_P_RECEIVED);
+        printReadings(iot, payload, len);
     }
+    return true;
+}
+
+/***********************[LINK] - Agree The Data Rate And Transmit Power.*******************/
+bool onLink(IoTSec& iot, byte payload[], byte len){
+    LinkMsg link;
+    if (!decodeLink(payload, len, &link)) {
+        return false;
+    }
+
+    //The client gets its power; the rate is the slowest any client wants, as the radio has one for all.
+    //A proposal numbered no higher than the last one agreed is a replay, and is left unanswered.
+    if (!iot.agreeLink(link.number, &link.rate, &link.paLevel)) {
+        return false;
+    }
+    LOG_INFO(LOG_LINK_MODE, link.rate, link.paLevel);
+    link.number--;
+    sendMessage(iot, frame, encodeLink(link, iot.beginFrame(frame, MSG_LINK)));
+    return true;
+}
+
+/***********************[VERIFY KEY EXPIRATION] - Send request to renew key.*******************/
+bool unexpected(IoTSec& iot, byte payload[], byte len){
+    if (iot.keyExpired()) {
+        LOG_INFO(LOG_EXPIRED);
+        sendRestart(iot, RESTART_EXPIRED);
+        LOG_INFO(LOG_DP_END);
+        iot.setHandshakeComplete(false);
+    }
+    return false;
+}
+
+/*
+ * Tells the client the server gave up on it, under the secret keys as the session's may be the trouble.
+ * @param iot - The client's session.
+ * @param reason - Why, a RESTART_ code.
+ */
+void sendRestart(IoTSec& iot, byte reason){
+    RestartMsg restart;
+    restart.reason = reason;
+    sendMessage(iot, frame, encodeRestart(restart, iot.beginFrame(frame, MSG_RESTART)));
+}
+
+/*
+ * Unpacks a batch of readings packed by the client's SensorEncoder and prints the ones not
+ * printed before: after a lost ACK, a failed window or a new handshake the client sends again
+ * what it was not sure of, and the session's sequence numbers weed out what already came. A
+ * batch cut short or out of range stops at the last good reading, and the ACK's count tells
+ * the client it did not all arrive.
+ * @param iot - The client's session.
+ * @param len - The batch's length in bytes.
+ * @return the number of readings in the batch, printed or not.
+ */
+byte printReadings(IoTSec& iot, byte* payload, byte len){
+    SensorDecoder decoder(payload, len);
+    byte sensor;
+    unsigned int value;
+    unsigned long age;
+    byte count = 0;
+    while (decoder.next(&sensor, &value, &age)) {
+        count++;
+        if (!iot.freshSequence(decoder.getSequence())) {
+            LOG_DEBUG(LOG_READING_REPEATED, decoder.getSequence());
+            continue;
+        }
+#if SENSOR_TIMESTAMPS
+        LOG_INFO(LOG_READING_AGE, sensor, value, age);
+#else
+        LOG_INFO(LOG_READING, (int)sensor, (int)value);
+#endif
+    }
+    return count;
+}
+
+/*
+ * Interrupt on the radio's IRQ pin: a send finished or a frame arrived.
+ */
+void radioISR(void){
+    iot.radioInterrupt();
 }